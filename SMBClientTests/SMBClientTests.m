@@ -94,6 +94,7 @@ int list_tests_with_mdata = 0;
 #include <unistd.h>
 #include <copyfile.h>
 #include <time.h>
+#include <pthread.h>
 
 char default_test_filename[] = "testfile";
 
@@ -18274,5 +18275,210 @@ done:
 }
 
 
+/*
+ * Many threads reading the same file at once, like a media server or an ML
+ * data loader would do. Reads are uncached so each one holds the smbnode lock
+ * across a round trip to the server and the fstat() calls refresh the
+ * attributes in between, which shows how much the readers serialize.
+ */
+#define kParallelReadThreads 16
+#define kParallelReadFileSize (64 * 1024 * 1024)
+#define kParallelReadIOSize (1024 * 1024)
+
+struct parallel_read_args {
+    const char *file_path;
+    int thread_nbr;
+    int error;
+};
+
+static void *
+parallel_read_thread(void *arg)
+{
+    struct parallel_read_args *args = arg;
+    struct stat sb;
+    char *buffer = NULL;
+    int nbr_ios = kParallelReadFileSize / kParallelReadIOSize;
+    off_t offset;
+    ssize_t len;
+    int fd = -1;
+    int i;
+
+    buffer = malloc(kParallelReadIOSize);
+    if (buffer == NULL) {
+        args->error = ENOMEM;
+        goto done;
+    }
+
+    fd = open(args->file_path, O_RDONLY);
+    if (fd == -1) {
+        args->error = errno;
+        goto done;
+    }
+
+    /* Go to the server for every read */
+    if (fcntl(fd, F_NOCACHE, 1) == -1) {
+        args->error = errno;
+        goto done;
+    }
+
+    for (i = 0; i < nbr_ios; i++) {
+        /* Each thread starts at a different offset */
+        offset = (off_t) ((i + args->thread_nbr) % nbr_ios) * kParallelReadIOSize;
+
+        if (fstat(fd, &sb) == -1) {
+            args->error = errno;
+            goto done;
+        }
+
+        len = pread(fd, buffer, kParallelReadIOSize, offset);
+        if (len != kParallelReadIOSize) {
+            args->error = (len == -1) ? errno : EIO;
+            goto done;
+        }
+    }
+
+done:
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    return NULL;
+}
+
+-(void)testParallelReadPerf
+{
+    int error = 0;
+    char file_path[PATH_MAX];
+    char *file_path_ptr = file_path;
+    char mp1[PATH_MAX];
+    char *buffer = NULL;
+    int fd = -1;
+    off_t offset;
+    ssize_t len;
+
+    if (list_tests_with_mdata == 1) {
+        do_list_test_meta_data("Test performance of many threads reading the same file",
+                               "performance,read",
+                               "1,2,3",
+                               NULL,
+                               NULL);
+        return;
+    }
+
+    do_create_mount_path(mp1, sizeof(mp1), "testParallelReadPerfMp1");
+
+    error = mount_two_sessions(mp1, NULL, 0);
+    if (error) {
+        XCTFail("mount_two_sessions failed %d \n", error);
+        goto done;
+    }
+
+    /* Set up file path and create test file */
+    error = setup_file_paths(mp1, NULL, default_test_filename,
+                             file_path, sizeof(file_path),
+                             NULL, 0);
+    if (error) {
+        XCTFail("setup_file_paths failed %d \n", error);
+        goto done;
+    }
+
+    /* Fill in the test file */
+    buffer = malloc(kParallelReadIOSize);
+    if (buffer == NULL) {
+        XCTFail("malloc failed \n");
+        goto done;
+    }
+    memset(buffer, 0x5a, kParallelReadIOSize);
+
+    fd = open(file_path, O_WRONLY);
+    if (fd == -1) {
+        XCTFail("open on <%s> failed %d:%s \n", file_path,
+                errno, strerror(errno));
+        goto done;
+    }
+
+    for (offset = 0; offset < kParallelReadFileSize; offset += kParallelReadIOSize) {
+        len = pwrite(fd, buffer, kParallelReadIOSize, offset);
+        if (len != kParallelReadIOSize) {
+            XCTFail("pwrite on <%s> at %lld failed %d:%s \n", file_path,
+                    offset, errno, strerror(errno));
+            goto done;
+        }
+    }
+
+    error = close(fd);
+    fd = -1;
+    if (error) {
+        XCTFail("close on <%s> failed %d:%s \n", file_path,
+                errno, strerror(errno));
+        goto done;
+    }
+
+    printf("Starting performance part of test with %d threads \n",
+           kParallelReadThreads);
+
+    [self measureBlock:^{
+        pthread_t threads[kParallelReadThreads];
+        struct parallel_read_args args[kParallelReadThreads];
+        int i, created = 0;
+        int ret;
+
+        for (i = 0; i < kParallelReadThreads; i++) {
+            args[i].file_path = file_path_ptr;
+            args[i].thread_nbr = i;
+            args[i].error = 0;
+
+            ret = pthread_create(&threads[i], NULL, parallel_read_thread, &args[i]);
+            if (ret != 0) {
+                XCTFail("pthread_create failed %d:%s \n", ret, strerror(ret));
+                break;
+            }
+            created++;
+        }
+
+        for (i = 0; i < created; i++) {
+            pthread_join(threads[i], NULL);
+
+            if (args[i].error) {
+                XCTFail("reader %d failed %d:%s \n", i,
+                        args[i].error, strerror(args[i].error));
+            }
+        }
+    }];
+
+    /* Do the Delete on test file */
+    error = remove(file_path);
+    if (error) {
+        fprintf(stderr, "do_delete on <%s> failed <%s (%d)> \n",
+                file_path, strerror(errno), errno);
+    }
+
+    /*
+     * If no errors, attempt to delete test dirs. This could fail if a
+     * previous test failed and thats fine.
+     */
+    do_delete_test_dirs(mp1);
+
+done:
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    if (unmount(mp1, MNT_FORCE) == -1) {
+        XCTFail("unmount failed for first url %d \n", errno);
+    }
+
+    rmdir(mp1);
+}
+
+
 @end
 
@@ -490,11 +490,15 @@ static void smb_session_free(struct smb_connobj *cp)
     
     smb_co_done(SESSION_TO_CP(sessionp));
 
+    /* Free any pooled compression scratch buffers */
+    smb2_compress_scratch_reclaim(sessionp, 1);
+
     lck_mtx_destroy(&sessionp->session_stlock, session_st_lck_group);
     lck_mtx_destroy(&sessionp->session_model_info_lock, session_st_lck_group);
     lck_mtx_destroy(&sessionp->iod_tailq_lock, session_st_lck_group);
     lck_mtx_destroy(&sessionp->failover_lock, session_st_lck_group);
     lck_mtx_destroy(&sessionp->iod_quantum_lock, session_st_lck_group);
+    lck_mtx_destroy(&sessionp->compress_scratch_lock, session_st_lck_group);
     lck_mtx_destroy(&sessionp->session_lease_lock, session_st_lck_group);
 
     smb2_mc_destroy(&sessionp->session_interface_table);
@@ -628,6 +632,7 @@ static int smb_session_create(struct smbioc_negotiate *session_spec,
     
     lck_mtx_init(&sessionp->session_model_info_lock, session_st_lck_group, session_st_lck_attr);
     lck_mtx_init(&sessionp->iod_quantum_lock, session_st_lck_group, session_st_lck_attr);
+    lck_mtx_init(&sessionp->compress_scratch_lock, session_st_lck_group, session_st_lck_attr);
 #if 0
     /* Message ID and credit checking debugging code */
     lck_mtx_init(&sessionp->session_mid_lock, session_st_lck_group, session_st_lck_attr);
@@ -814,11 +819,6 @@ static int smb_session_create(struct smbioc_negotiate *session_spec,
     sessionp->iod_writeCounts[1] = kQuantumMedNumber;
     sessionp->iod_writeCounts[2] = kQuantumMinNumber;
 
-    sessionp->iod_readQuantumSize = sessionp->iod_readSizes[1];
-    sessionp->iod_readQuantumNumber = kQuantumMedNumber;
-    sessionp->iod_writeQuantumSize = sessionp->iod_writeSizes[1];
-    sessionp->iod_writeQuantumNumber = kQuantumMedNumber;
-
     sessionp->rw_max_check_time = 150000; /* default of 0.15 secs */
     
     sessionp->active_channel_speed = 0;
@@ -1448,7 +1448,7 @@ static void smb_share_free(struct smb_connobj *cp)
     SMB_FREE_DATA(share->ss_name, share->ss_name_allocsize);
 	lck_mtx_destroy(&share->ss_stlock, ssst_lck_group);
 	lck_mtx_destroy(&share->ss_shlock, ssst_lck_group);
-	lck_mtx_destroy(&share->ss_fid_lock, fid_lck_grp);
+	smb_fid_table_destroy(share);
 	smb_co_done(SSTOCP(share));
     SMB_FREE_TYPE(struct smb_share, share);
 }
@@ -1483,7 +1483,6 @@ smb_share_create(struct smb_session *sessionp, struct smbioc_share *shspec,
 				 struct smb_share **outShare, vfs_context_t context)
 {
 	struct smb_share *share;
-    int i;
 	
 	/* Should never happen, but just to be safe */
 	if (context == NULL)
@@ -1504,13 +1503,7 @@ smb_share_create(struct smb_session *sessionp, struct smbioc_share *shspec,
 	share->obj.co_gone = smb_share_gone;
 
     /* alloc FID mapping stuff */
-    lck_mtx_init(&share->ss_fid_lock, fid_lck_grp, fid_lck_attr);
-    for (i = 0; i < SMB_FID_TABLE_SIZE; i++) {
-        LIST_INIT(&share->ss_fid_table[i].fid_list);
-    }
-    share->ss_fid_collisions = 0;
-    share->ss_fid_inserted = 0;
-    share->ss_fid_max_iter = 0;
+    smb_fid_table_init(share);
     
     lck_mtx_init(&share->ss_shlock, ssst_lck_group, ssst_lck_attr);
 	lck_mtx_init(&share->ss_stlock, ssst_lck_group, ssst_lck_attr);
@@ -200,13 +200,35 @@
 #define SMBS_GOING_AWAY		0x0008
 #define	SMBS_GONE			SMBO_GONE		/* 0x80000000 - Reserved see above for more details */
 
+/*
+ * smb_share ss_fsctl_refused flags, SMB 2/3 FSCTLs the server has failed with
+ * STATUS_NOT_SUPPORTED or STATUS_INVALID_DEVICE_REQUEST on this tree.
+ */
+#define SMBS_FSCTL_NO_ZERO_DATA	0x0001
+#define SMBS_FSCTL_NO_ALLOC_RANGES	0x0002
+
 /* Multichannel interfaces ignore list */
 #define kClientIfIgnorelistMaxLen 32 /* max len of client interface ignorelist */
 
 /* Compression */
 #define kClientCompressMaxEntries 64 /* max exclude/include for compression extensions */
+
+/*
+ * Compression scratch buffer pools, one per algorithm and direction so every
+ * buffer in a pool is the same size. Idle buffers are freed once compression
+ * has not been used on the session for kSmbCompressScratchIdleSecs.
+ */
+#define kSmbCompressScratchAlgs 3   /* LZNT1, LZ77, LZ77+Huffman */
+#define kSmbCompressScratchMax 4    /* max idle buffers kept per pool */
+#define kSmbCompressScratchIdleSecs 30
+
 #define kClientCompressMaxExtLen 16  /* max extension string length */
 
+struct smb_compress_scratch_pool {
+    char        *csp_bufs[kSmbCompressScratchMax];
+    uint32_t    csp_count;
+};
+
 /*
  * Negotiated protocol parameters
  */
@@ -283,6 +305,7 @@ struct smbioc_setup;
 struct smbioc_share;
 
 TAILQ_HEAD(smb_rqhead, smb_rq);
+LIST_HEAD(smb_rq_hashhead, smb_rq);
 TAILQ_HEAD(smb_lease_head, lease_rq);
 
 #define SMB_NBTIMO	15
@@ -476,33 +499,23 @@ struct smb_session {
     uint8_t             *full_session_mackey;    /* Session.FullSessionKey */
     uint32_t            full_session_mackeylen;  /* length of Session.FullSessionKey */
 
-    /* Adaptive Read/Write values */
+    /*
+     * Adaptive Read/Write limits. The sizes and counts actually used are
+     * picked per iod, see struct smb_rw_ctl.
+     */
     lck_mtx_t           iod_quantum_lock;
     
-    uint32_t            iod_readSizes[3];           /* [0] = min, [1] = med, [2] = max */
-    uint32_t            iod_readCounts[3];          /* [0] = max, [1] = med, [2] = min */
-    uint32_t            iod_readTotalTime[3];       /* [0] = min, [1] = med, [2] = max */
-    uint64_t            iod_readTotalBytes[3];      /* [0] = min, [1] = med, [2] = max */
-
-    uint32_t            iod_writeSizes[3];          /* [0] = min, [1] = med, [2] = max */
-    uint32_t            iod_writeCounts[3];         /* [0] = max, [1] = med, [2] = min */
-    uint64_t            iod_readBytePerSec[3];      /* [0] = min, [1] = med, [2] = max */
-    uint64_t            iod_writeBytePerSec[3];     /* [0] = min, [1] = med, [2] = max */
-    uint32_t            iod_writeTotalTime[3];      /* [0] = min, [1] = med, [2] = max */
-    uint64_t            iod_writeTotalBytes[3];     /* [0] = min, [1] = med, [2] = max */
-
-    struct timeval      iod_last_recheck_time;      /* Last time we checked speeds */
+    uint32_t            iod_readSizes[3];           /* [0] = min, [1] = initial, [2] = max */
+    uint32_t            iod_readCounts[3];          /* [1] = initial, smallest is min */
 
-    uint32_t            iod_readQuantumSize;        /* current read quantum size */
-    uint32_t            iod_readQuantumNumber;      /* current read quantum number */
-    uint32_t            iod_writeQuantumSize;       /* current write quantum size */
-    uint32_t            iod_writeQuantumNumber;     /* current write quantum number */
+    uint32_t            iod_writeSizes[3];          /* [0] = min, [1] = initial, [2] = max */
+    uint32_t            iod_writeCounts[3];         /* [1] = initial, smallest is min */
 
     uint64_t            active_channel_speed;
     uint32_t            active_channel_count;
     uint32_t            rw_gb_threshold;
 
-    uint32_t            rw_max_check_time;
+    uint32_t            rw_max_check_time;          /* usecs, delivery rate filter window */
 
     /* SMB 3 signing key (Session.SessionKey) */
     uint8_t             session_smb3_signing_key[SMB3_KEY_LEN];
@@ -550,10 +563,6 @@ struct smb_session {
 	uint32_t			session_dur_hndl_v2_desired_timeout;
 	u_int32_t			session_TCP_QoS;
     
-    /* For SMB 3 sealing */
-    char                *decrypt_bufferp;
-    u_int32_t           decrypt_buf_len;
-
     /* For SMB MultiChannel */
     lck_mtx_t           iod_tailq_lock;
     uint32_t            iod_tailq_flags;
@@ -617,6 +626,13 @@ struct smb_session {
     uint64_t            read_cnt_LZNT1;
     uint64_t            read_cnt_fwd_pattern;
     uint64_t            read_cnt_bwd_pattern;
+
+    /* Compression scratch buffers, [algorithm][0 = encode, 1 = decode] */
+    lck_mtx_t           compress_scratch_lock;
+    struct smb_compress_scratch_pool compress_scratch[kSmbCompressScratchAlgs][2];
+    struct timespec     compress_scratch_last_used;
+    uint64_t            compress_scratch_hits;
+    uint64_t            compress_scratch_misses;
 };
 
 #define session_maxmux	session_sopt.sv_maxmux
@@ -671,16 +687,15 @@ struct smb_share {
 	uint32_t		maxGuestAccessRights;
 	
 	/* SMB 2/3 FID mapping support */
-	lck_mtx_t		ss_fid_lock;
-	uint64_t		ss_fid_collisions;
-	uint64_t		ss_fid_inserted;
-	uint64_t		ss_fid_max_iter;
-	FID_HASH_TABLE_SLOT	ss_fid_table[SMB_FID_TABLE_SIZE];
+	SMB_FID_SHARD	ss_fid_shards[SMB_FID_SHARDS];
 	
 	/* SMB 2/3 Count of currently deferred closes */
 	int32_t         ss_max_def_close_cnt;	/* max allowed deferred closes */
 	int32_t         ss_curr_def_close_cnt;	/* current count */
 	int64_t         ss_total_def_close_cnt;	/* cumulative count */
+
+	/* SMB 2/3 FSCTLs refused by this tree, cleared on each tree connect */
+	uint32_t        ss_fsctl_refused;
 };
 
 #define	ss_flags	obj.co_flags
@@ -788,6 +803,17 @@ int  smb_checkdir(struct smb_share *share, struct smbnode *dnp,
 #define SMB_IOD_RQLOCK(iod)     lck_mtx_lock(&((iod)->iod_rqlock))
 #define SMB_IOD_RQUNLOCK(iod)   lck_mtx_unlock(&((iod)->iod_rqlock))
 
+/*
+ * Outstanding SMB 2/3 requests are also hashed by message id so that the
+ * read thread can match a reply without walking all of iod_rqlist. Message
+ * ids advance by the credit charge, so mix the bits and keep the top
+ * SMB_IOD_RQHASH_SHIFT of them.
+ */
+#define SMB_IOD_RQHASH_SHIFT    7
+#define SMB_IOD_RQHASH_SIZE     (1 << SMB_IOD_RQHASH_SHIFT)
+#define SMB_IOD_RQHASH(iod, mid) \
+    (&(iod)->iod_rqhash[((uint64_t)(mid) * 0x9E3779B97F4A7C15ULL) >> (64 - SMB_IOD_RQHASH_SHIFT)])
+
 #define SMB_IOD_FLAGSLOCKPTR(iod)       (&((iod)->iod_flagslock))
 #define SMB_IOD_FLAGSLOCK(iod)          lck_mtx_lock(&((iod)->iod_flagslock))
 #define SMB_IOD_FLAGSUNLOCK(iod)        lck_mtx_unlock(&((iod)->iod_flagslock))
@@ -864,6 +890,45 @@ struct conn_params {
 #define SMBC_CREDIT_LOCK(iod)     lck_mtx_lock(&(iod)->iod_credits_lock)
 #define SMBC_CREDIT_UNLOCK(iod)   lck_mtx_unlock(&(iod)->iod_credits_lock)
 
+/*
+ * Per iod, per direction read/write sizing controller.
+ *
+ * Each read/write reply gives a round trip time and a delivery rate sample
+ * (bytes this iod delivered while the request was outstanding divided by its
+ * round trip time). From the max delivery rate and the min round trip time we
+ * get the bandwidth delay product of the channel and then pick a request size
+ * and number of outstanding requests that keeps about twice that in flight,
+ * limited by the credits the server has granted on this iod.
+ */
+struct smb_rw_ctl {
+    uint64_t            rwc_delivered;          /* total bytes read/written on this iod */
+    uint64_t            rwc_bytes_per_sec;      /* max delivery rate in current window */
+    uint64_t            rwc_srtt_usecs;         /* smoothed round trip time */
+    uint64_t            rwc_min_rtt_usecs;      /* min round trip time in current window */
+    struct timespec     rwc_bw_window;          /* start of rwc_bytes_per_sec window */
+    struct timespec     rwc_rtt_window;         /* start of rwc_min_rtt_usecs window */
+    uint64_t            rwc_samples;            /* number of replies sampled */
+    uint32_t            rwc_quantum_size;       /* request size, 0 = not picked yet */
+    uint32_t            rwc_quantum_nbr;        /* outstanding requests */
+};
+
+/*
+ * A message to seal or unseal as part of a batch, see smb3_crypt_batch().
+ * If rqp is set, the request is compressed if allowed and then encrypted.
+ * Otherwise m is decrypted if it is a transform message.
+ */
+struct smb3_crypt_item {
+    struct smb_rq       *rqp;
+    mbuf_t              m;
+    char                *bufferp;               /* decrypt buffer for large messages */
+    uint32_t            buf_len;
+    int                 error;
+};
+
+#define SMB_IOD_RECV_BATCH  8   /* max received messages decrypted together */
+#define SMB_IOD_SEAL_BATCH  8   /* max requests sealed together */
+#define SMB_IOD_RECV_BATCH_IDLE_SECS 30 /* free decrypt buffers once unused this long */
+
 struct smbiod {
     int                 iod_id;
     int                 iod_flags;
@@ -875,8 +940,10 @@ struct smbiod {
     int32_t             iod_asynccnt;	
     struct timespec     iod_sleeptimespec;
     struct smb_session *iod_session;
-    lck_mtx_t           iod_rqlock;           /* iod_rqlist, iod_muxwant */
+    lck_mtx_t           iod_rqlock;           /* iod_rqlist, iod_rqhash, iod_muxwant */
     struct smb_rqhead   iod_rqlist;           /* list of outstanding requests */
+    struct smb_rq_hashhead iod_rqhash[SMB_IOD_RQHASH_SIZE]; /* SMB 2/3 requests on iod_rqlist by message id */
+    uint32_t            iod_sealing;          /* seal batches in progress, locked by iod_rqlock */
     int                 iod_muxwant;
     vfs_context_t       iod_context;
     lck_mtx_t           iod_evlock;           /* iod_evlist */
@@ -932,6 +999,22 @@ struct smbiod {
     uint64_t            iod_sess_setup_message_id; /* Used for AES-GMAC signing */
 
     struct timeval      iod_connection_to; /* tcp connection timeout */
+
+    /* Adaptive read/write sizing for this channel */
+    lck_mtx_t           iod_rwctl_lock;         /* iod_read_ctl, iod_write_ctl */
+    struct smb_rw_ctl   iod_read_ctl;
+    struct smb_rw_ctl   iod_write_ctl;
+
+    /*
+     * Received messages decrypted as a batch, only used by the read thread.
+     * The decrypt buffers are also freed by the iod idle timer.
+     */
+    lck_mtx_t           iod_recv_batch_lock;    /* decrypt buffers of iod_recv_batch */
+    struct smb3_crypt_item iod_recv_batch[SMB_IOD_RECV_BATCH];
+    uint32_t            iod_recv_batch_cnt;
+    uint32_t            iod_recv_batch_next;
+    int                 iod_recv_batch_error;   /* recv error to return after the batch */
+    struct timespec     iod_recv_batch_last_used;
 };
 
 int  smb_iod_nb_intr(struct smbiod *iod);
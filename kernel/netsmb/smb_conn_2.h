@@ -26,6 +26,8 @@
 
 #ifdef _KERNEL
 
+struct smb_compress_stats;
+
 int smb2_smb_change_notify(struct smb_share *share, struct smb2_change_notify_rq *changep,
                            struct smb_rq **in_rqp, vfs_context_t context);
 int smb2_smb_close(struct smb_share *share, struct smb2_close_rq *closep, 
@@ -95,6 +97,9 @@ int smb2_smb_parse_write_one(struct mdchain *mdp,
                              struct smb2_rw_rq *writep);
 int smb2_smb_query_dir(struct smb_share *share, struct smb2_query_dir_rq *queryp,
                        struct smb_rq **compound_rqp, struct smbiod *iod, vfs_context_t context);
+int smb2_smb_query_dir_reply(struct smb2_query_dir_rq *queryp);
+int smb2_smb_query_dir_send(struct smb_share *share, struct smb2_query_dir_rq *queryp,
+                            struct smbiod *iod, vfs_context_t context);
 int smb2_smb_query_info(struct smb_share *share, struct smb2_query_info_rq *queryp, 
                         struct smb_rq **compound_rqp, struct smbiod *iod, vfs_context_t context);
 int smb2_smb_read_one(struct smb_share *share, struct smb2_rw_rq *readp,
@@ -125,7 +130,9 @@ int smb2_smb_write_one(struct smb_share *share,
                        uint32_t *allow_compressionp,
                        vfs_context_t context);
 int smb_smb_write(struct smb_share *share, SMBFID fid, uio_t uio, int ioflag,
-                  uint32_t *allow_compressionp, vfs_context_t context);
+                  uint32_t *allow_compressionp,
+                  struct smb_compress_stats *compress_statsp,
+                  vfs_context_t context);
 
 uint32_t smb2_session_maxread(struct smb_session *sessionp, uint32_t max_read);
 uint32_t smb2_session_maxwrite(struct smb_session *sessionp, uint32_t max_write);
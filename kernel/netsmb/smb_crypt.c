@@ -59,6 +59,7 @@
 #include <netsmb/smb_rq.h>
 #include <netsmb/smb_rq_2.h>
 #include <netsmb/smb_dev.h>
+#include <netsmb/smb_read_write.h>
 #include <netsmb/md4.h>
 #include <netsmb/smb_packets_2.h>
 
@@ -102,7 +103,10 @@ static void smb3_sign(struct smb_rq *rqp);
 
 static u_char N8[] = {0x4b, 0x47, 0x53, 0x21, 0x40, 0x23, 0x24, 0x25};
 
-int smb2_compress_data(uint8_t *data_startp, uint32_t data_len,
+extern lck_grp_t *smb_rw_group;
+
+int smb2_compress_data(struct smb_session *sessionp,
+                       uint8_t *data_startp, uint32_t data_len,
                        uint8_t *compress_startp, uint32_t compress_len,
                        uint16_t algorithm, int compress_flag,
                        size_t *actual_len);
@@ -1920,19 +1924,20 @@ int smb3_rq_encrypt(struct smb_rq *rqp)
     memcpy(msgp + SMB3_AES_TF_PROTO_OFF, SMB3_AES_TF_PROTO_STR,
            SMB3_AES_TF_PROTO_LEN);
     
-    /* Update session nonce */
+    /*
+     * Update session nonce and setup nonce field. Requests can be encrypted
+     * in parallel, so copy it while holding the lock to never reuse one.
+     */
+    memset(nonce, 0, 16);
     SMBC_ST_LOCK(sessionp);
     sessionp->session_smb3_nonce_low++;
     if (!sessionp->session_smb3_nonce_low) {
         sessionp->session_smb3_nonce_low++;
         sessionp->session_smb3_nonce_high++;
     }
-    SMBC_ST_UNLOCK(sessionp);
-    
-    /* Setup nonce field */
-    memset(nonce, 0, 16);
     memcpy(nonce, &sessionp->session_smb3_nonce_high, 8);
     memcpy(&nonce[8], &sessionp->session_smb3_nonce_low, 8);
+    SMBC_ST_UNLOCK(sessionp);
     
     switch (sessionp->session_smb3_encrypt_ciper) {
         case SMB2_ENCRYPTION_AES_128_GCM:
@@ -2140,7 +2145,12 @@ out:
  * Decrypts an SMB msg or msg chain given in 'mb'.
  * Note: On any error the mbuf chain is freed.
  */
-int smb3_msg_decrypt(struct smb_session *sessionp, mbuf_t *mb)
+/*
+ * Decrypt a transform message. Large messages are decrypted in *bufferpp,
+ * which is grown as needed and kept by the caller for the next message.
+ */
+int smb3_msg_decrypt(struct smb_session *sessionp, mbuf_t *mb,
+                     char **bufferpp, uint32_t *buf_lenp)
 {
     SMB3_AES_TF_HEADER      *tf_hdr;
     mbuf_t                  mb_hdr, mb_tmp, mbuf_payload;
@@ -2302,24 +2312,23 @@ int smb3_msg_decrypt(struct smb_session *sessionp, mbuf_t *mb)
          * that non alignment causes performance to be dreadful. To avoid this
          * we end up doing the decrypt in a malloc'd buffer.
          *
-         * Note: we can use a single malloc'd buffer because the iod thread
-         * is the only thread decrypting incoming traffic. It has to decrypt
-         * it before we are able to find the request rqp it belongs to.
+         * Note: messages can be decrypted in parallel, so the buffer belongs
+         * to the caller. See smb_iod_recv_next().
          */
-        if ((sessionp->decrypt_bufferp != NULL) &&
-            (msglen > sessionp->decrypt_buf_len)) {
-            SMB_FREE_DATA(sessionp->decrypt_bufferp, sessionp->decrypt_buf_len);
-            sessionp->decrypt_buf_len = 0;
+        if ((*bufferpp != NULL) &&
+            (msglen > *buf_lenp)) {
+            SMB_FREE_DATA(*bufferpp, *buf_lenp);
+            *buf_lenp = 0;
         }
 
-        if (sessionp->decrypt_bufferp == NULL) {
-            SMB_MALLOC_DATA(sessionp->decrypt_bufferp, msglen, Z_WAITOK);
-            if (sessionp->decrypt_bufferp == NULL) {
+        if (*bufferpp == NULL) {
+            SMB_MALLOC_DATA(*bufferpp, msglen, Z_WAITOK);
+            if (*bufferpp == NULL) {
                 SMBERROR("malloc for buffer failed \n");
                 error = EAUTH;
                 goto out;
             }
-           sessionp->decrypt_buf_len = msglen;
+           *buf_lenp = msglen;
         }
 
         /* copy the mbuf data into local buffer */
@@ -2328,8 +2337,8 @@ int smb3_msg_decrypt(struct smb_session *sessionp, mbuf_t *mb)
             nbytes = mbuf_len(mb_tmp);
 
             if (nbytes) {
-                if ((ncopy_bytes + nbytes) <= sessionp->decrypt_buf_len) {
-                    bcopy(mbuf_data(mb_tmp), &sessionp->decrypt_bufferp[ncopy_bytes], nbytes);
+                if ((ncopy_bytes + nbytes) <= *buf_lenp) {
+                    bcopy(mbuf_data(mb_tmp), &(*bufferpp)[ncopy_bytes], nbytes);
                     ncopy_bytes += nbytes;
                 }
                 else {
@@ -2353,14 +2362,14 @@ int smb3_msg_decrypt(struct smb_session *sessionp, mbuf_t *mb)
             case SMB2_ENCRYPTION_AES_128_GCM:
             case SMB2_ENCRYPTION_AES_256_GCM:
                 ccgcm_update(gcmode, gcm_ctx, msglen,
-                             sessionp->decrypt_bufferp, sessionp->decrypt_bufferp);
+                             *bufferpp, *bufferpp);
                break;
                 
             case SMB2_ENCRYPTION_AES_128_CCM:
             case SMB2_ENCRYPTION_AES_256_CCM:
                 /* decrypt the local buffer */
                 ccccm_update(ccmode, ctx, nonce_ctx, msglen,
-                             sessionp->decrypt_bufferp, sessionp->decrypt_bufferp);
+                             *bufferpp, *bufferpp);
                break;
         }
 
@@ -2370,8 +2379,8 @@ int smb3_msg_decrypt(struct smb_session *sessionp, mbuf_t *mb)
             nbytes = mbuf_len(mb_tmp);
 
             if (nbytes) {
-                if ((ncopy_bytes + nbytes) <= sessionp->decrypt_buf_len) {
-                    bcopy(&sessionp->decrypt_bufferp[ncopy_bytes], mbuf_data(mb_tmp), nbytes);
+                if ((ncopy_bytes + nbytes) <= *buf_lenp) {
+                    bcopy(&(*bufferpp)[ncopy_bytes], mbuf_data(mb_tmp), nbytes);
                     ncopy_bytes += nbytes;
                 }
                 else {
@@ -2461,6 +2470,236 @@ out:
     return (error);
 }
 
+/*
+ * Compress a write request if allowed and then encrypt it if do_encrypt is
+ * set. Called after the request has its message id and has been signed.
+ */
+int
+smb3_rq_seal(struct smb_rq *rqp, uint32_t do_encrypt)
+{
+    struct smb_session *sessionp = rqp->sr_session;
+    int error = 0;
+
+    /*
+     * Do any compression after signing but before encrypting
+     * 1. Only SMB 3 or later can compress
+     * 2. Server must support compression
+     * 3. Only compress non compound requests
+     * 4. Only compress Write requests.
+     *
+     * Note Read requests just have a flag set
+     */
+    if (SMBV_SMB3_OR_LATER(sessionp) &&
+        (sessionp->server_compression_algorithms_map != 0) &&
+        !(rqp->sr_flags & SMBR_COMPOUND_RQ) &&
+        (rqp->sr_command == SMB2_WRITE) &&
+        !(rqp->sr_extflags & SMB2_NO_COMPRESS_WRITE)) {
+        error = smb2_rq_compress_write(rqp);
+        if (error) {
+            /* Should never happen */
+            SMBERROR("smb2_rq_compress_write failed %d\n", error);
+            return(error);
+        }
+    }
+
+    if (do_encrypt) {
+        error = smb3_rq_encrypt(rqp);
+        if (error) {
+            /* Should never happen */
+            SMBERROR("SMB3 transform failed, error: %d\n", error);
+            return(error);
+        }
+    }
+
+    return(error);
+}
+
+/*
+ * Only hand messages to rw helper threads if there is at least this much
+ * to seal/unseal per thread, else the handoff costs more than it saves.
+ */
+#define SMB_CRYPT_HELPER_MIN_BYTES  (128 * 1024)
+
+struct smb3_crypt_batch {
+    lck_mtx_t lock;
+    uint32_t ref_cnt;                   /* caller plus queued helpers */
+    uint32_t next_item;                 /* next item to claim */
+    uint32_t done_items;
+    uint32_t item_count;
+    struct smb_session *sessionp;
+    struct smb3_crypt_item *items;      /* only valid until all are claimed */
+};
+
+static void
+smb3_crypt_item_run(struct smb_session *sessionp, struct smb3_crypt_item *itemp)
+{
+    if (itemp->rqp != NULL) {
+        itemp->error = smb3_rq_seal(itemp->rqp, 1);
+        return;
+    }
+
+    /* Only transform messages need to be decrypted */
+    if ((itemp->m != NULL) && (*(u_char *) mbuf_data(itemp->m) == 0xfd)) {
+        itemp->error = smb3_msg_decrypt(sessionp, &itemp->m,
+                                        &itemp->bufferp, &itemp->buf_len);
+        if (itemp->error) {
+            /* The message is gone */
+            itemp->m = NULL;
+        }
+    }
+}
+
+static void
+smb3_crypt_batch_run(struct smb3_crypt_batch *batchp)
+{
+    uint32_t item;
+
+    for (;;) {
+        lck_mtx_lock(&batchp->lock);
+        if (batchp->next_item >= batchp->item_count) {
+            lck_mtx_unlock(&batchp->lock);
+            break;
+        }
+        item = batchp->next_item++;
+        lck_mtx_unlock(&batchp->lock);
+
+        smb3_crypt_item_run(batchp->sessionp, &batchp->items[item]);
+
+        lck_mtx_lock(&batchp->lock);
+        batchp->done_items++;
+        if (batchp->done_items == batchp->item_count) {
+            wakeup(&batchp->done_items);
+        }
+        lck_mtx_unlock(&batchp->lock);
+    }
+}
+
+static void
+smb3_crypt_batch_rele(struct smb3_crypt_batch *batchp)
+{
+    uint32_t ref_cnt;
+
+    lck_mtx_lock(&batchp->lock);
+    ref_cnt = --batchp->ref_cnt;
+    lck_mtx_unlock(&batchp->lock);
+
+    if (ref_cnt != 0) {
+        return;
+    }
+
+    lck_mtx_destroy(&batchp->lock, smb_rw_group);
+    SMB_FREE_TYPE(struct smb3_crypt_batch, batchp);
+}
+
+/*
+ * Called by the rw helper threads for SMB_CRYPT_BATCH
+ */
+void
+smb3_crypt_batch_helper(struct smb3_crypt_batch *batchp)
+{
+    smb3_crypt_batch_run(batchp);
+    smb3_crypt_batch_rele(batchp);
+}
+
+/*
+ * Seal or unseal every item, handing items to rw helper threads if there is
+ * enough work. The calling thread does items too, so it never waits on a
+ * helper that has not started yet. Returns with every item done, each with
+ * its own error.
+ */
+void
+smb3_crypt_batch(struct smb_session *sessionp,
+                 struct smb3_crypt_item *items, uint32_t item_count)
+{
+    struct smb3_crypt_batch *batchp = NULL;
+    struct smb_rw_arg *rw_pb_ptr = NULL;
+    struct smb3_crypt_item *itemp = NULL;
+    struct mbchain *mbp = NULL;
+    uint64_t total_len = 0;
+    uint32_t helpers = 0, i;
+
+    for (i = 0; i < item_count; i++) {
+        itemp = &items[i];
+        itemp->error = 0;
+
+        if (itemp->rqp != NULL) {
+            smb_rq_getrequest(itemp->rqp, &mbp);
+            total_len += mbp->mb_count;
+        }
+        else if ((itemp->m != NULL) &&
+                 (*(u_char *) mbuf_data(itemp->m) == 0xfd)) {
+            total_len += mbuf_get_chain_len(itemp->m);
+        }
+    }
+
+    /* This thread does items too, so one less helper than it takes */
+    if ((item_count > 1) && (total_len >= (2 * SMB_CRYPT_HELPER_MIN_BYTES))) {
+        helpers = (uint32_t) MIN(total_len / SMB_CRYPT_HELPER_MIN_BYTES,
+                                 item_count) - 1;
+        helpers = MIN(helpers, SMB_CRYPT_MAX_HELPERS);
+    }
+
+    SMB_LOG_KTRACE(SMB_DBG_RW_THREAD | DBG_FUNC_NONE,
+                   0xabc007, item_count, total_len, helpers, 0);
+
+    if (helpers == 0) {
+        /* Not worth handing off, just do them all here */
+        for (i = 0; i < item_count; i++) {
+            smb3_crypt_item_run(sessionp, &items[i]);
+        }
+        return;
+    }
+
+    SMB_MALLOC_TYPE(batchp, struct smb3_crypt_batch, Z_WAITOK_ZERO);
+    if (batchp == NULL) {
+        for (i = 0; i < item_count; i++) {
+            smb3_crypt_item_run(sessionp, &items[i]);
+        }
+        return;
+    }
+
+    lck_mtx_init(&batchp->lock, smb_rw_group, LCK_ATTR_NULL);
+    batchp->ref_cnt = 1;
+    batchp->item_count = item_count;
+    batchp->sessionp = sessionp;
+    batchp->items = items;
+
+    for (i = 0; i < helpers; i++) {
+        SMB_MALLOC_TYPE(rw_pb_ptr, struct smb_rw_arg, Z_WAITOK_ZERO);
+        if (rw_pb_ptr == NULL) {
+            /* Not fatal, we just do more of the items ourself */
+            SMBERROR("SMB_MALLOC_TYPE failed\n");
+            break;
+        }
+
+        lck_mtx_init(&rw_pb_ptr->rw_arg_lock, smb_rw_group, LCK_ATTR_NULL);
+        rw_pb_ptr->command = SMB_CRYPT_BATCH;
+        rw_pb_ptr->crypt.batch = batchp;
+
+        lck_mtx_lock(&batchp->lock);
+        batchp->ref_cnt++;
+        lck_mtx_unlock(&batchp->lock);
+
+        /*
+         * Note: the rw helper thread is responsible for freeing rw_arg_lock
+         * and this rw_pb_ptr
+         */
+        rw_pb_ptr->flags |= SMB_RW_IN_USE;
+        smb_rw_proxy(rw_pb_ptr);
+    }
+
+    smb3_crypt_batch_run(batchp);
+
+    /* Wait for any items still being done by helpers */
+    lck_mtx_lock(&batchp->lock);
+    while (batchp->done_items < batchp->item_count) {
+        msleep(&batchp->done_items, &batchp->lock, PSOCK, "smb_crypt_batch", NULL);
+    }
+    lck_mtx_unlock(&batchp->lock);
+
+    smb3_crypt_batch_rele(batchp);
+}
+
 static void smb3_init_nonce(struct smb_session *sessionp)
 {
     MD5_CTX md5;
@@ -2984,7 +3223,146 @@ smb_test_crypt_performance(struct smb_session *sessionp,
 }
 #endif
 
-int smb2_compress_data(uint8_t *data_startp, uint32_t data_len,
+/*
+ * Indexed the same as the first dimension of sessionp->compress_scratch
+ */
+static const compression_algorithm smb2_compress_scratch_algs[kSmbCompressScratchAlgs] = {
+    COMPRESSION_SMB_LZNT1,
+    COMPRESSION_SMB_LZ77,
+    COMPRESSION_SMB_LZ77H
+};
+
+static size_t
+smb2_compress_scratch_size(uint32_t alg_index, uint32_t dir)
+{
+    if (dir == 0) {
+        return (compression_encode_scratch_buffer_size(smb2_compress_scratch_algs[alg_index]));
+    }
+
+    return (compression_decode_scratch_buffer_size(smb2_compress_scratch_algs[alg_index]));
+}
+
+/*
+ * Get a scratch buffer for compression_encode_buffer() (dir 0) or
+ * compression_decode_buffer() (dir 1) from the session's pool, only going to
+ * the allocator if the pool is empty.
+ */
+static char *
+smb2_compress_scratch_get(struct smb_session *sessionp, uint32_t alg_index,
+                          uint32_t dir, size_t scratch_size)
+{
+    struct smb_compress_scratch_pool *poolp = &sessionp->compress_scratch[alg_index][dir];
+    char *bufferp = NULL;
+
+    lck_mtx_lock(&sessionp->compress_scratch_lock);
+
+    if (poolp->csp_count > 0) {
+        poolp->csp_count--;
+        bufferp = poolp->csp_bufs[poolp->csp_count];
+        poolp->csp_bufs[poolp->csp_count] = NULL;
+        sessionp->compress_scratch_hits += 1;
+    }
+    else {
+        sessionp->compress_scratch_misses += 1;
+    }
+
+    nanouptime(&sessionp->compress_scratch_last_used);
+
+    lck_mtx_unlock(&sessionp->compress_scratch_lock);
+
+    if (bufferp == NULL) {
+        SMB_MALLOC_DATA(bufferp, scratch_size, Z_WAITOK);
+    }
+
+    return (bufferp);
+}
+
+/*
+ * Give a scratch buffer back to the session's pool, freeing it if the pool
+ * is already full.
+ */
+static void
+smb2_compress_scratch_put(struct smb_session *sessionp, uint32_t alg_index,
+                          uint32_t dir, char *bufferp, size_t scratch_size)
+{
+    struct smb_compress_scratch_pool *poolp = &sessionp->compress_scratch[alg_index][dir];
+
+    lck_mtx_lock(&sessionp->compress_scratch_lock);
+
+    if (poolp->csp_count < kSmbCompressScratchMax) {
+        poolp->csp_bufs[poolp->csp_count] = bufferp;
+        poolp->csp_count++;
+        bufferp = NULL;
+    }
+
+    lck_mtx_unlock(&sessionp->compress_scratch_lock);
+
+    if (bufferp != NULL) {
+        SMB_FREE_DATA(bufferp, scratch_size);
+    }
+}
+
+/*
+ * Free the pooled scratch buffers of a session. Unless force is set, this is
+ * only done once compression has not been used for
+ * kSmbCompressScratchIdleSecs so the memory is not held by idle sessions.
+ * Called by the iod idle timer and when the session is freed.
+ */
+void
+smb2_compress_scratch_reclaim(struct smb_session *sessionp, int force)
+{
+    char *free_bufs[kSmbCompressScratchAlgs][2][kSmbCompressScratchMax];
+    uint32_t free_count[kSmbCompressScratchAlgs][2];
+    struct timespec now;
+    uint32_t alg_index, dir, i;
+    int have_bufs = 0;
+
+    lck_mtx_lock(&sessionp->compress_scratch_lock);
+
+    if (!force) {
+        nanouptime(&now);
+        if ((now.tv_sec - sessionp->compress_scratch_last_used.tv_sec) <
+            kSmbCompressScratchIdleSecs) {
+            lck_mtx_unlock(&sessionp->compress_scratch_lock);
+            return;
+        }
+    }
+
+    /* Empty the pools, then free outside of the lock */
+    for (alg_index = 0; alg_index < kSmbCompressScratchAlgs; alg_index++) {
+        for (dir = 0; dir < 2; dir++) {
+            struct smb_compress_scratch_pool *poolp = &sessionp->compress_scratch[alg_index][dir];
+
+            free_count[alg_index][dir] = poolp->csp_count;
+            for (i = 0; i < poolp->csp_count; i++) {
+                free_bufs[alg_index][dir][i] = poolp->csp_bufs[i];
+                poolp->csp_bufs[i] = NULL;
+                have_bufs = 1;
+            }
+            poolp->csp_count = 0;
+        }
+    }
+
+    lck_mtx_unlock(&sessionp->compress_scratch_lock);
+
+    if (!have_bufs) {
+        return;
+    }
+
+    for (alg_index = 0; alg_index < kSmbCompressScratchAlgs; alg_index++) {
+        for (dir = 0; dir < 2; dir++) {
+            for (i = 0; i < free_count[alg_index][dir]; i++) {
+                SMB_FREE_DATA(free_bufs[alg_index][dir][i],
+                              smb2_compress_scratch_size(alg_index, dir));
+            }
+        }
+    }
+
+    SMB_LOG_COMPRESS("Freed idle compression scratch buffers \n");
+}
+
+int smb2_compress_data(struct smb_session *sessionp,
+                       uint8_t *data_startp, uint32_t data_len,
                        uint8_t *compress_startp, uint32_t compress_len,
                        uint16_t algorithm, int compress_flag,
                        size_t *actual_len)
@@ -2994,6 +3372,8 @@ int smb2_compress_data(uint8_t *data_startp, uint32_t data_len,
     char *scratch_bufferp = NULL;
     size_t actual_size = 0;
     compression_algorithm compress_algorithm = 0;
+    uint32_t alg_index = 0;
+    uint32_t dir = (compress_flag == COMPRESSION_STREAM_ENCODE) ? 0 : 1;
 #if COMPRESSION_PERFORMANCE
     struct timespec start, stop;
     nanotime(&start);
@@ -3001,15 +3381,15 @@ int smb2_compress_data(uint8_t *data_startp, uint32_t data_len,
 
     switch(algorithm) {
         case SMB2_COMPRESSION_LZNT1:
-            compress_algorithm = COMPRESSION_SMB_LZNT1;
+            alg_index = 0;
             break;
     
         case SMB2_COMPRESSION_LZ77:
-            compress_algorithm = COMPRESSION_SMB_LZ77;
+            alg_index = 1;
             break;
 
         case SMB2_COMPRESSION_LZ77_HUFFMAN:
-            compress_algorithm = COMPRESSION_SMB_LZ77H;
+            alg_index = 2;
             break;
 
         default:
@@ -3017,17 +3397,14 @@ int smb2_compress_data(uint8_t *data_startp, uint32_t data_len,
             error = EINVAL;
             goto bad;
     }
-    
-    if (compress_flag == COMPRESSION_STREAM_ENCODE) {
-        scratch_size = compression_encode_scratch_buffer_size(compress_algorithm);
-    }
-    else {
-        scratch_size = compression_decode_scratch_buffer_size(compress_algorithm);
-    }
 
-    /* Malloc scratch buffer if needed */
+    compress_algorithm = smb2_compress_scratch_algs[alg_index];
+    scratch_size = smb2_compress_scratch_size(alg_index, dir);
+
+    /* Get scratch buffer from the pool if needed */
     if (scratch_size > 0) {
-        SMB_MALLOC_DATA(scratch_bufferp, scratch_size, Z_WAITOK);
+        scratch_bufferp = smb2_compress_scratch_get(sessionp, alg_index, dir,
+                                                    scratch_size);
         if (scratch_bufferp == NULL) {
             error = ENOMEM;
             goto bad;
@@ -3094,7 +3471,8 @@ int smb2_compress_data(uint8_t *data_startp, uint32_t data_len,
 
 bad:
     if (scratch_bufferp != NULL) {
-        SMB_FREE_DATA(scratch_bufferp, scratch_size);
+        smb2_compress_scratch_put(sessionp, alg_index, dir,
+                                  scratch_bufferp, scratch_size);
     }
     
     return(error);
@@ -3138,7 +3516,8 @@ smb2_rq_compress_chunk(struct smb_session *sessionp, uint16_t algorithm,
     }
     
     if (*forward_data_repetitions > 1) {
-        sessionp->write_cnt_fwd_pattern += 1;
+        /* Chunks can be compressed in parallel, see smb2_compress_chunks_run() */
+        OSAddAtomic64(1, (volatile SInt64 *) &sessionp->write_cnt_fwd_pattern);
 
         /* Update uncompressed data length */
         RemainingChunkSize -= *forward_data_repetitions;
@@ -3187,7 +3566,7 @@ smb2_rq_compress_chunk(struct smb_session *sessionp, uint16_t algorithm,
         }
         
         if (*backward_data_repetitions > 1) {
-            sessionp->write_cnt_bwd_pattern += 1;
+            OSAddAtomic64(1, (volatile SInt64 *) &sessionp->write_cnt_bwd_pattern);
 
             /* Update uncompressed data length */
             RemainingChunkSize -= *backward_data_repetitions;
@@ -3240,7 +3619,7 @@ smb2_rq_compress_chunk(struct smb_session *sessionp, uint16_t algorithm,
          */
         compress_len = *data_len;
         
-        error = smb2_compress_data(data_startp, *data_len,
+        error = smb2_compress_data(sessionp, data_startp, *data_len,
                                    compress_startp, compress_len,
                                    algorithm, COMPRESSION_STREAM_ENCODE,
                                    actual_len);
@@ -3284,6 +3663,196 @@ smb2_rq_compress_chunk(struct smb_session *sessionp, uint16_t algorithm,
 }
 
 
+/*
+ * The chunks of one chained compressed write. The chunks are compressed by
+ * the thread doing smb2_rq_compress_write() and by up to
+ * SMB_COMPRESS_MAX_HELPERS rw helper threads, each claiming the next chunk
+ * until there are none left. Every chunk compresses into its own spot in
+ * compress_startp and has its own result so smb2_rq_compress_write() can
+ * build the chained payloads in order once all chunks are done.
+ *
+ * The job is freed by whoever drops the last reference. A helper thread that
+ * gets to run after all chunks were claimed just drops its reference, so the
+ * caller never waits on a helper that has not started.
+ */
+struct smb2_compress_chunk_result {
+    uint32_t forward_data_repetitions;
+    uint32_t backward_data_repetitions;
+    char forward_data_char;
+    char backward_data_char;
+    uint32_t data_len;
+    size_t actual_len;
+    int error;
+};
+
+struct smb2_compress_job {
+    lck_mtx_t lock;
+    uint32_t ref_cnt;                   /* caller plus queued helpers */
+    uint32_t next_chunk;                /* next chunk to claim */
+    uint32_t done_chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_len;
+    uint32_t total_len;
+    uint16_t algorithm;
+    struct smb_session *sessionp;
+    uint8_t *write_bufferp;
+    uint8_t *compress_startp;
+    struct smb2_compress_chunk_result *results;
+};
+
+static void
+smb2_compress_chunks_run(struct smb2_compress_job *jobp)
+{
+    struct smb2_compress_chunk_result *resultp = NULL;
+    uint32_t chunk, offset, len;
+
+    for (;;) {
+        lck_mtx_lock(&jobp->lock);
+        if (jobp->next_chunk >= jobp->chunk_count) {
+            lck_mtx_unlock(&jobp->lock);
+            break;
+        }
+        chunk = jobp->next_chunk++;
+        lck_mtx_unlock(&jobp->lock);
+
+        offset = chunk * jobp->chunk_len;
+        len = MIN(jobp->chunk_len, jobp->total_len - offset);
+        resultp = &jobp->results[chunk];
+
+        resultp->error = smb2_rq_compress_chunk(jobp->sessionp, jobp->algorithm,
+                                                jobp->write_bufferp + offset, len,
+                                                &resultp->forward_data_repetitions,
+                                                &resultp->forward_data_char,
+                                                &resultp->backward_data_repetitions,
+                                                &resultp->backward_data_char,
+                                                jobp->compress_startp + offset,
+                                                &resultp->data_len,
+                                                &resultp->actual_len);
+
+        lck_mtx_lock(&jobp->lock);
+        jobp->done_chunks++;
+        if (jobp->done_chunks == jobp->chunk_count) {
+            wakeup(&jobp->done_chunks);
+        }
+        lck_mtx_unlock(&jobp->lock);
+    }
+}
+
+static void
+smb2_compress_job_rele(struct smb2_compress_job *jobp)
+{
+    uint32_t ref_cnt;
+
+    lck_mtx_lock(&jobp->lock);
+    ref_cnt = --jobp->ref_cnt;
+    lck_mtx_unlock(&jobp->lock);
+
+    if (ref_cnt != 0) {
+        return;
+    }
+
+    lck_mtx_destroy(&jobp->lock, smb_rw_group);
+    SMB_FREE_TYPE_COUNT(struct smb2_compress_chunk_result, jobp->chunk_count,
+                        jobp->results);
+    SMB_FREE_TYPE(struct smb2_compress_job, jobp);
+}
+
+/*
+ * Called by the rw helper threads for SMB_COMPRESS_CHUNKS
+ */
+void
+smb2_compress_chunks_helper(struct smb2_compress_job *jobp)
+{
+    smb2_compress_chunks_run(jobp);
+    smb2_compress_job_rele(jobp);
+}
+
+/*
+ * Compress all the chunks of a chained compressed write, handing chunks to
+ * rw helper threads if there is more than one. Returns with every chunk
+ * done. Caller drops its reference with smb2_compress_job_rele().
+ */
+static int
+smb2_compress_chunks(struct smb_session *sessionp, uint16_t algorithm,
+                     uint8_t *write_bufferp, uint32_t write_buffer_len,
+                     uint8_t *compress_startp, uint32_t chunk_len,
+                     struct smb2_compress_job **jobpp)
+{
+    struct smb2_compress_job *jobp = NULL;
+    struct smb_rw_arg *rw_pb_ptr = NULL;
+    uint32_t helpers, i;
+
+    *jobpp = NULL;
+
+    if (chunk_len == 0) {
+        return(EINVAL);
+    }
+
+    SMB_MALLOC_TYPE(jobp, struct smb2_compress_job, Z_WAITOK_ZERO);
+    if (jobp == NULL) {
+        return(ENOMEM);
+    }
+
+    jobp->chunk_count = howmany(write_buffer_len, chunk_len);
+    SMB_MALLOC_TYPE_COUNT(jobp->results, struct smb2_compress_chunk_result,
+                          jobp->chunk_count, Z_WAITOK_ZERO);
+    if (jobp->results == NULL) {
+        SMB_FREE_TYPE(struct smb2_compress_job, jobp);
+        return(ENOMEM);
+    }
+
+    lck_mtx_init(&jobp->lock, smb_rw_group, LCK_ATTR_NULL);
+    jobp->ref_cnt = 1;
+    jobp->chunk_len = chunk_len;
+    jobp->total_len = write_buffer_len;
+    jobp->algorithm = algorithm;
+    jobp->sessionp = sessionp;
+    jobp->write_bufferp = write_bufferp;
+    jobp->compress_startp = compress_startp;
+
+    /* This thread does chunks too, so one less helper than chunks */
+    helpers = MIN(jobp->chunk_count - 1, SMB_COMPRESS_MAX_HELPERS);
+
+    for (i = 0; i < helpers; i++) {
+        SMB_MALLOC_TYPE(rw_pb_ptr, struct smb_rw_arg, Z_WAITOK_ZERO);
+        if (rw_pb_ptr == NULL) {
+            /* Not fatal, we just do more of the chunks ourself */
+            SMBERROR("SMB_MALLOC_TYPE failed\n");
+            break;
+        }
+
+        lck_mtx_init(&rw_pb_ptr->rw_arg_lock, smb_rw_group, LCK_ATTR_NULL);
+        rw_pb_ptr->command = SMB_COMPRESS_CHUNKS;
+        rw_pb_ptr->compress.job = jobp;
+
+        lck_mtx_lock(&jobp->lock);
+        jobp->ref_cnt++;
+        lck_mtx_unlock(&jobp->lock);
+
+        /*
+         * Note: the rw helper thread is responsible for freeing rw_arg_lock
+         * and this rw_pb_ptr
+         */
+        rw_pb_ptr->flags |= SMB_RW_IN_USE;
+        smb_rw_proxy(rw_pb_ptr);
+    }
+
+    SMB_LOG_KTRACE(SMB_DBG_WRITE_COMPRESS | DBG_FUNC_NONE,
+                   0xabc001, jobp->chunk_count, i, 0, 0);
+
+    smb2_compress_chunks_run(jobp);
+
+    /* Wait for any chunks still being done by helpers */
+    lck_mtx_lock(&jobp->lock);
+    while (jobp->done_chunks < jobp->chunk_count) {
+        msleep(&jobp->done_chunks, &jobp->lock, PSOCK, "smb_compress_chunks", NULL);
+    }
+    lck_mtx_unlock(&jobp->lock);
+
+    *jobpp = jobp;
+    return(0);
+}
+
 /*
  * SMB 3 Compress a Write request
  */
@@ -3316,7 +3885,12 @@ smb2_rq_compress_write(struct smb_rq *rqp)
     uint32_t buffer_len = 0, data_len = 0, compress_len = 0;
     size_t actual_len = 0;
     uint16_t algorithm = 0;
-    uint32_t chunk_len = 0, one_chunk_compressed = 0;
+    uint32_t chunk = 0, one_chunk_compressed = 0;
+    struct smb2_compress_job *jobp = NULL;
+    struct smb2_compress_chunk_result *resultp = NULL;
+    uint8_t *chunk_startp = NULL;
+    int compress_tried = 0;
+    struct timespec compress_start, compress_stop;
 #if COMPRESSION_PERFORMANCE
     struct timespec start, stop;
     nanotime(&start);
@@ -3474,6 +4048,10 @@ smb2_rq_compress_write(struct smb_rq *rqp)
         goto bad;
     }
 
+    /* Record what compression does for this write, see smbfs_compress_update */
+    compress_tried = 1;
+    nanouptime(&compress_start);
+
     SMB_LOG_COMPRESS("Algorithm: %s, %s, MessageID %llu, Write length %d, offset %llu \n",
                      algorithm == SMB2_COMPRESSION_LZNT1 ? "LZNT1" :
                      (algorithm == SMB2_COMPRESSION_LZ77 ? "LZ77" : "LZ77Huffman"),
@@ -3558,30 +4136,41 @@ smb2_rq_compress_write(struct smb_rq *rqp)
                          RemainingUncompressedDataSize);
 
         /*
-         * Process the rest of the uncompressed data in MAX_CHUNK_LEN chunks
-         * checking for forward/algorithm/backward
+         * Process the rest of the uncompressed data in compression_chunk_len
+         * chunks checking for forward/algorithm/backward. The chunks are
+         * compressed in parallel, then added to the payload in order.
          */
-        while (RemainingUncompressedDataSize > 0) {
-            SMB_LOG_COMPRESS("Processing RemainingUncompressedDataSize %d compression_chunk_len %d\n",
-                             RemainingUncompressedDataSize, sessionp->compression_chunk_len);
+        SMB_LOG_COMPRESS("Processing RemainingUncompressedDataSize %d compression_chunk_len %d\n",
+                         RemainingUncompressedDataSize, sessionp->compression_chunk_len);
+
+        error = smb2_compress_chunks(sessionp, algorithm,
+                                     write_bufferp, RemainingUncompressedDataSize,
+                                     compress_startp,
+                                     (uint32_t) sessionp->compression_chunk_len,
+                                     &jobp);
+        if (error) {
+            SMBERROR("smb2_compress_chunks failed %d \n", error);
+            goto bad;
+        }
 
-            chunk_len = RemainingUncompressedDataSize;
-            if (chunk_len > (uint32_t) sessionp->compression_chunk_len) {
-                chunk_len = (uint32_t) sessionp->compression_chunk_len;
-            }
-            
-            /* Process this write chunk */
-            error = smb2_rq_compress_chunk(sessionp, algorithm,
-                                           write_bufferp, chunk_len,
-                                           &forward_data_repetitions, &forward_data_char,
-                                           &backward_data_repetitions, &backward_data_char,
-                                           compress_startp, &data_len,
-                                           &actual_len);
-            if (error) {
+        for (chunk = 0; chunk < jobp->chunk_count; chunk++) {
+            resultp = &jobp->results[chunk];
+
+            if (resultp->error) {
+                error = resultp->error;
                 SMBERROR("smb2_rq_compress_chunk failed %d \n", error);
                 goto bad;
             }
 
+            /* Each chunk compressed into its own spot in compress_startp */
+            chunk_startp = compress_startp + (chunk * jobp->chunk_len);
+            forward_data_repetitions = resultp->forward_data_repetitions;
+            forward_data_char = resultp->forward_data_char;
+            backward_data_repetitions = resultp->backward_data_repetitions;
+            backward_data_char = resultp->backward_data_char;
+            data_len = resultp->data_len;
+            actual_len = resultp->actual_len;
+
             /* Did we save any space at all in this chunk? */
             if (one_chunk_compressed == 0) {
                 if ((actual_len != 0) ||
@@ -3624,7 +4213,7 @@ smb2_rq_compress_write(struct smb_rq *rqp)
                 mb_put_uint32le(compressed_mbp, data_len);                      /* OriginalDataLength */
 
                 /* Put compressed data into compression payload */
-                mb_put_mem(compressed_mbp, (caddr_t)compress_startp, actual_len, MB_MSYSTEM);
+                mb_put_mem(compressed_mbp, (caddr_t)chunk_startp, actual_len, MB_MSYSTEM);
             }
             else {
                 if (data_len != 0) {
@@ -3635,7 +4224,7 @@ smb2_rq_compress_write(struct smb_rq *rqp)
                     /* Since not LZNT1, LZ77 or LZ77+Huffman, can skip OrignalPayloadSize */
 
                     /* Put uncompressed data into compression payload */
-                    mb_put_mem(compressed_mbp, (caddr_t)compress_startp, data_len, MB_MSYSTEM);
+                    mb_put_mem(compressed_mbp, (caddr_t)chunk_startp, data_len, MB_MSYSTEM);
                 }
             }
             
@@ -3655,9 +4244,7 @@ smb2_rq_compress_write(struct smb_rq *rqp)
                 mb_put_uint32le(compressed_mbp, backward_data_repetitions);     /* Repetitions */
             }
 
-            /* Update values and loop around again */
-            write_bufferp += chunk_len;
-            RemainingUncompressedDataSize -= chunk_len;
+            RemainingUncompressedDataSize -= MIN(jobp->chunk_len, RemainingUncompressedDataSize);
         }
         
         /*
@@ -3697,7 +4284,7 @@ smb2_rq_compress_write(struct smb_rq *rqp)
          */
         compress_len = data_len;
 
-        error = smb2_compress_data(data_startp, data_len,
+        error = smb2_compress_data(sessionp, data_startp, data_len,
                                    compress_startp, compress_len,
                                    algorithm, COMPRESSION_STREAM_ENCODE,
                                    &actual_len);
@@ -3778,8 +4365,26 @@ smb2_rq_compress_write(struct smb_rq *rqp)
     sessionp->write_compress_cnt += 1;
     
 bad:
+    if (compress_tried) {
+        nanouptime(&compress_stop);
+        rqp->sr_compress_in_len = write_buffer_len;
+        if (!error && (rqp->sr_flags & SMBR_COMPRESSED)) {
+            rqp->sr_compress_out_len = (uint32_t) compressed_mbp->mb_count;
+        }
+        else {
+            rqp->sr_compress_out_len = write_buffer_len;
+        }
+        rqp->sr_compress_usecs = ((compress_stop.tv_sec - compress_start.tv_sec) * 1000000) +
+                                 ((compress_stop.tv_nsec - compress_start.tv_nsec) / 1000);
+    }
+
     SMB_LOG_KTRACE(SMB_DBG_WRITE_COMPRESS | DBG_FUNC_END,
                    error, 0, 0, 0, 0);
+
+    if (jobp != NULL) {
+        smb2_compress_job_rele(jobp);
+        jobp = NULL;
+    }
     
     if (bufferp != NULL) {
         SMB_FREE_DATA(bufferp, buffer_len);
@@ -4258,7 +4863,7 @@ smb2_rq_decompress_read(struct smb_session *sessionp, mbuf_t *mpp)
                 /*
                  * Do algorithmic decompression here
                  */
-                error = smb2_compress_data(data_startp, data_len,
+                error = smb2_compress_data(sessionp, data_startp, data_len,
                                            compress_startp, compress_len,
                                            algorithm, COMPRESSION_STREAM_DECODE,
                                            &actual_len);
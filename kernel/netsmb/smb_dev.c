@@ -863,6 +863,66 @@ ioc_convert_path_error:
             break;
         }
 
+        case SMBIOC_RW_CTL_PROPERTIES:
+        {
+            struct smbioc_rw_ctl_properties *rw_prop = (struct smbioc_rw_ctl_properties *)data;
+
+            lck_rw_lock_shared(&sdp->sd_rwlock);
+
+            /* free global lock now since we now have sd_rwlock */
+            lck_rw_unlock_shared(dev_rw_lck);
+
+            if (rw_prop->ioc_version != SMB_IOC_STRUCT_VERSION) {
+                error = EINVAL;
+            } else if (!sdp->sd_session) {
+                error = ENOTCONN;
+            } else {
+                sessionp = sdp->sd_session;
+
+                memset(&rw_prop->iod_rw_ctl[0], 0, sizeof(rw_prop->iod_rw_ctl));
+
+                lck_mtx_lock(&sessionp->iod_tailq_lock);
+
+                struct smbiod *iod = TAILQ_FIRST(&sessionp->iod_tailq_head);
+                uint32_t u;
+                for(u = 0; u < MAX_NUM_OF_IODS_IN_QUERY; u++) {
+                    struct smbioc_iod_rw_ctl *p = &rw_prop->iod_rw_ctl[u];
+                    struct smb_rw_ctl *ctls[2];
+                    struct smbioc_rw_ctl *outs[2] = {&p->read_ctl, &p->write_ctl};
+                    int k;
+
+                    if (!iod) {
+                        break;
+                    }
+
+                    ctls[0] = &iod->iod_read_ctl;
+                    ctls[1] = &iod->iod_write_ctl;
+
+                    p->iod_id = iod->iod_id;
+                    p->iod_credits_max = iod->iod_credits_max;
+
+                    lck_mtx_lock(&iod->iod_rwctl_lock);
+                    for (k = 0; k < 2; k++) {
+                        outs[k]->bytes_per_sec = ctls[k]->rwc_bytes_per_sec;
+                        outs[k]->srtt_usecs = (uint32_t) MIN(ctls[k]->rwc_srtt_usecs, UINT32_MAX);
+                        outs[k]->min_rtt_usecs = (uint32_t) MIN(ctls[k]->rwc_min_rtt_usecs, UINT32_MAX);
+                        outs[k]->quantum_size = ctls[k]->rwc_quantum_size;
+                        outs[k]->quantum_nbr = ctls[k]->rwc_quantum_nbr;
+                    }
+                    lck_mtx_unlock(&iod->iod_rwctl_lock);
+
+                    iod = TAILQ_NEXT(iod, tailq);
+                }
+
+                lck_mtx_unlock(&sessionp->iod_tailq_lock);
+
+                rw_prop->num_of_iods = u;
+            }
+
+            lck_rw_unlock_shared(&sdp->sd_rwlock);
+            break;
+        }
+
         case SMBIOC_NIC_INFO:
         {
             struct smbioc_nic_info *nic_info = (struct smbioc_nic_info *)data;
@@ -1055,6 +1115,9 @@ ioc_convert_path_error:
                 properties->read_cnt_fwd_pattern = sessionp->read_cnt_fwd_pattern;
                 properties->read_cnt_bwd_pattern = sessionp->read_cnt_bwd_pattern;
 
+                properties->compress_scratch_hits = sessionp->compress_scratch_hits;
+                properties->compress_scratch_misses = sessionp->compress_scratch_misses;
+
                 /*
                  * If we are currently using encryption, then return the
                  * cipher being used, else return 0.
@@ -1448,7 +1511,7 @@ ioc_rq_error:
                 else {
                     int ioFlags = (rwrq->ioc_writeMode & WritethroughMode) ? IO_SYNC : 0;
                     error = smb_smb_write(sdp->sd_share, fid, auio, ioFlags,
-                                          &allow_compression, context);
+                                          &allow_compression, NULL, context);
                 }
 
                 if ((error == 0) && (cmd == SMBIOC_READ)) {
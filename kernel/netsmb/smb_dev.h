@@ -329,6 +329,9 @@ struct smbioc_session_properties {
     uint64_t    read_cnt_fwd_pattern;
     uint64_t    read_cnt_bwd_pattern;
 
+    uint64_t    compress_scratch_hits;
+    uint64_t    compress_scratch_misses;
+
     char        model_info[SMB_MAXFNAMELEN * 2] __attribute((aligned(8)));
 
     char        snapshot_time[32] __attribute((aligned(8)));
@@ -389,6 +392,27 @@ struct smbioc_multichannel_properties {
     uint32_t    num_of_iod_properties;
 };
 
+/*
+ * Adaptive read/write sizing state of each channel,
+ * see struct smb_rw_ctl in smb_conn.h
+ */
+struct smbioc_rw_ctl_properties {
+    struct smbioc_iod_rw_ctl {
+        uint32_t iod_id;
+        uint32_t iod_credits_max;
+        struct smbioc_rw_ctl {
+            uint64_t bytes_per_sec;     /* max delivery rate in current window */
+            uint32_t srtt_usecs;        /* smoothed round trip time */
+            uint32_t min_rtt_usecs;     /* min round trip time in current window */
+            uint32_t quantum_size;      /* 0 if channel not sampled yet */
+            uint32_t quantum_nbr;
+        } read_ctl, write_ctl;
+    } iod_rw_ctl[MAX_NUM_OF_IODS_IN_QUERY];
+    uint32_t    ioc_version;
+    uint32_t    ioc_reserved;
+    uint32_t    num_of_iods;
+};
+
 struct smbioc_list_snapshots {
     uint32_t    ioc_version;
     uint32_t    ioc_reserved;
@@ -421,6 +445,7 @@ struct smbioc_list_snapshots {
 #define	SMBIOC_GET_OS_LANMAN	_IOR('n', 117, struct smbioc_os_lanman)
 #define SMBIOC_MULTICHANNEL_PROPERTIES    _IOWR('n', 131, struct smbioc_multichannel_properties)
 #define SMBIOC_NIC_INFO         _IOWR('n', 132, struct smbioc_nic_info)
+#define SMBIOC_RW_CTL_PROPERTIES _IOWR('n', 133, struct smbioc_rw_ctl_properties)
 /* Rest of the IOCTLs are defined in smb_dev_2.h */
 
 /*
@@ -441,6 +466,7 @@ SMB_IOC_CHECK_SIZE(struct smbioc_session_properties);
 SMB_IOC_CHECK_SIZE(struct smbioc_os_lanman);
 SMB_IOC_CHECK_SIZE(struct smbioc_multichannel_properties);
 SMB_IOC_CHECK_SIZE(struct smbioc_nic_info);
+SMB_IOC_CHECK_SIZE(struct smbioc_rw_ctl_properties);
 
 /*
 * Additional non-errno values that can be returned to NetFS, these get translate
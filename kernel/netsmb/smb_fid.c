@@ -60,16 +60,122 @@
 #include <smbfs/smbfs_node.h>
 #include <netsmb/smb_converter.h>
 
-static void smb_fid_insert_new_node(struct smb_share *share, SMB_FID_NODE *node);
 static uint32_t smb_fid_one_at_a_time(uint8_t *key, uint32_t len);
 
+#define	SMB_FID_SHARD(share, fid) \
+	(&(share)->ss_fid_shards[(fid) & SMB_FID_SHARD_MASK])
+#define	SMB_FID_BUCKET(shardp, fid) \
+	(&(shardp)->fid_buckets[((fid) >> SMB_FID_SHARD_SHIFT) & ((shardp)->fid_bucket_cnt - 1)])
+
+void
+smb_fid_table_init(struct smb_share *share)
+{
+    SMB_FID_SHARD *shardp;
+    uint32_t shard_index;
+    
+    for (shard_index = 0; shard_index < SMB_FID_SHARDS; shard_index++) {
+        shardp = &share->ss_fid_shards[shard_index];
+        
+        lck_mtx_init(&shardp->fid_lock, fid_lck_grp, fid_lck_attr);
+        
+        /* Buckets get allocated when the first fid is added */
+        shardp->fid_buckets = NULL;
+        shardp->fid_bucket_cnt = 0;
+        shardp->fid_cnt = 0;
+        LIST_INIT(&shardp->fid_live);
+        shardp->fid_collisions = 0;
+        shardp->fid_inserted = 0;
+        shardp->fid_max_iter = 0;
+    }
+}
+
+void
+smb_fid_table_destroy(struct smb_share *share)
+{
+    SMB_FID_SHARD *shardp;
+    uint32_t shard_index;
+    
+    /* Frees any fids left and their buckets */
+    smb_fid_delete_all(share);
+    
+    for (shard_index = 0; shard_index < SMB_FID_SHARDS; shard_index++) {
+        shardp = &share->ss_fid_shards[shard_index];
+        lck_mtx_destroy(&shardp->fid_lock, fid_lck_grp);
+    }
+}
+
+/*
+ * Move every fid in the shard into a new hash table with bucket_cnt
+ * buckets. Only walks the fids in the shard, not the old buckets. Called
+ * with the shard lock held.
+ */
+static int
+smb_fid_shard_resize(SMB_FID_SHARD *shardp, uint32_t bucket_cnt, int can_wait)
+{
+    struct fid_list_head *new_buckets = NULL;
+    SMB_FID_NODE *node;
+    uint32_t i;
+    
+    if (can_wait) {
+        SMB_MALLOC_TYPE_COUNT(new_buckets, struct fid_list_head, bucket_cnt, Z_WAITOK);
+    }
+    else {
+        SMB_MALLOC_TYPE_COUNT(new_buckets, struct fid_list_head, bucket_cnt, Z_NOWAIT);
+    }
+    if (new_buckets == NULL) {
+        return (ENOMEM);
+    }
+    
+    for (i = 0; i < bucket_cnt; i++) {
+        LIST_INIT(&new_buckets[i]);
+    }
+    
+    if (shardp->fid_buckets != NULL) {
+        SMB_FREE_TYPE_COUNT(struct fid_list_head, shardp->fid_bucket_cnt,
+                            shardp->fid_buckets);
+    }
+    shardp->fid_buckets = new_buckets;
+    shardp->fid_bucket_cnt = bucket_cnt;
+    
+    /* The old bucket lists are gone, so just relink every node */
+    LIST_FOREACH(node, &shardp->fid_live, live_link) {
+        LIST_INSERT_HEAD(SMB_FID_BUCKET(shardp, node->fid), node, link);
+    }
+    
+    return (0);
+}
+
+/* Find the fid in its shard. Called with the shard lock held. */
+static SMB_FID_NODE *
+smb_fid_shard_find(SMB_FID_SHARD *shardp, SMBFID fid)
+{
+    SMB_FID_NODE *node;
+    uint32_t iter = 0;
+    
+    if (shardp->fid_buckets == NULL) {
+        return (NULL);
+    }
+    
+    LIST_FOREACH(node, SMB_FID_BUCKET(shardp, fid), link) {
+        if (node->fid == fid) {
+            break;
+        }
+        iter++;
+    }
+    
+    if (iter >= shardp->fid_max_iter) {
+        shardp->fid_max_iter = iter;
+    }
+    
+    return (node);
+}
+
 /* smb_fid_count_all() is used for Debugging */
 uint64_t
 smb_fid_count_all(struct smb_share *share)
 {
-    FID_HASH_TABLE_SLOT *slotPtr;
-    SMB_FID_NODE *node, *temp_node;
-    uint32_t table_index;
+    SMB_FID_SHARD *shardp;
+    uint32_t shard_index;
     uint64_t count = 0;
     
     if (share == NULL) {
@@ -77,61 +183,58 @@ smb_fid_count_all(struct smb_share *share)
         return (0);
     }
     
-    smb_fid_table_lock(share);
-    
-    for (table_index = 0; table_index < SMB_FID_TABLE_SIZE; table_index += 1) {
-        slotPtr = &share->ss_fid_table[table_index];
-        if (slotPtr == NULL) {
-            continue;
-        }
+    for (shard_index = 0; shard_index < SMB_FID_SHARDS; shard_index++) {
+        shardp = &share->ss_fid_shards[shard_index];
         
-        LIST_FOREACH_SAFE(node, &slotPtr->fid_list, link, temp_node) {
-            count++;
-        }
+        lck_mtx_lock(&shardp->fid_lock);
+        count += shardp->fid_cnt;
+        lck_mtx_unlock(&shardp->fid_lock);
     }
     
-    smb_fid_table_unlock(share);
-    
     return count;
 }
 
 void
 smb_fid_delete_all(struct smb_share *share)
 {
-    FID_HASH_TABLE_SLOT *slotPtr;
+    SMB_FID_SHARD *shardp;
     SMB_FID_NODE *node, *temp_node;
-    uint32_t table_index;
+    uint32_t shard_index;
 
     if (share == NULL) {
         SMBERROR("share is null\n");
         return;
     }
     
-    smb_fid_table_lock(share);
-    
-    for (table_index = 0; table_index < SMB_FID_TABLE_SIZE; table_index += 1) {
-        slotPtr = &share->ss_fid_table[table_index];
-        if (slotPtr == NULL) {
-            continue;
-        }
+    for (shard_index = 0; shard_index < SMB_FID_SHARDS; shard_index++) {
+        shardp = &share->ss_fid_shards[shard_index];
         
-        LIST_FOREACH_SAFE(node, &slotPtr->fid_list, link, temp_node) {
-            LIST_REMOVE(node, link);
+        lck_mtx_lock(&shardp->fid_lock);
+        
+        LIST_FOREACH_SAFE(node, &shardp->fid_live, live_link, temp_node) {
+            LIST_REMOVE(node, live_link);
             SMB_FREE_TYPE(SMB_FID_NODE, node);
         }
+        shardp->fid_cnt = 0;
+        
+        /* Every bucket list pointed at the freed nodes, so toss them too */
+        if (shardp->fid_buckets != NULL) {
+            SMB_FREE_TYPE_COUNT(struct fid_list_head, shardp->fid_bucket_cnt,
+                                shardp->fid_buckets);
+            shardp->fid_buckets = NULL;
+            shardp->fid_bucket_cnt = 0;
+        }
+        
+        lck_mtx_unlock(&shardp->fid_lock);
     }
-    
-    smb_fid_table_unlock(share);
 }
 
 int 
 smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
                        SMB2FID *smb2_fid)
 {
-    FID_HASH_TABLE_SLOT *slotPtr;
+    SMB_FID_SHARD *shardp;
     SMB_FID_NODE *node;
-    uint32_t table_index, iter;
-    uint32_t found_it = 0;
     int error = EINVAL;
     
     /* cant put it into smp because that is NULL for DCERPC calls to srvsvc */
@@ -148,46 +251,30 @@ smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
         return (0);
     }
     
-    smb_fid_table_lock(share);
-    
-    /* calculate the slot */
-    table_index = fid & SMB_FID_TABLE_MASK;
-    if (table_index >= SMB_FID_TABLE_SIZE) {
-        SMBERROR("Bad table_index: %u for fid %llx\n", table_index, fid);
-        goto exit;
-    };
-    
-    slotPtr = &share->ss_fid_table[table_index];
-    if (slotPtr == NULL) {
-        SMBERROR("slotPtr is null for table_index %u, fid %llx\n", 
-                 table_index, fid);
-        goto exit;
-    };
+    shardp = SMB_FID_SHARD(share, fid);
+    lck_mtx_lock(&shardp->fid_lock);
     
-    iter = 0;
-    LIST_FOREACH(node, &slotPtr->fid_list, link) {
-        if (node->fid == fid) {
-            *smb2_fid = node->smb2_fid;
-            found_it = 1;
+    node = smb_fid_shard_find(shardp, fid);
+    if (node != NULL) {
+        *smb2_fid = node->smb2_fid;
+        
+        if (remove_fid == 1) {
+            /*SMBERROR("remove SMB 2/3 fid %llx %llx -> fid %llx\n",
+                     node->smb2_fid.fid_persistent,
+                     node->smb2_fid.fid_volatile,
+                     fid);*/
+            LIST_REMOVE(node, link);
+            LIST_REMOVE(node, live_link);
+            SMB_FREE_TYPE(SMB_FID_NODE, node);
+            shardp->fid_cnt--;
             
-            if (remove_fid == 1) {
-                /*SMBERROR("remove SMB 2/3 fid %llx %llx -> fid %llx\n",
-                         node->smb2_fid.fid_persistent,
-                         node->smb2_fid.fid_volatile,
-                         fid);*/
-                LIST_REMOVE(node, link);
-                SMB_FREE_TYPE(SMB_FID_NODE, node);
+            /* Shrink if mostly empty, not worth waiting for memory though */
+            if ((shardp->fid_bucket_cnt > SMB_FID_MIN_BUCKETS) &&
+                (shardp->fid_cnt < (shardp->fid_bucket_cnt / SMB_FID_MIN_LOAD_DIV))) {
+                (void) smb_fid_shard_resize(shardp, shardp->fid_bucket_cnt / 2, 0);
             }
-            break;
         }
-        iter++;
-    }
-    
-    if (iter >= share->ss_fid_max_iter) {
-        share->ss_fid_max_iter = iter;
-    }
-
-    if (found_it == 1) {
+        
         /*SMBERROR("fid %llx -> SMB 2/3 fid %llx %llx\n",
                  fid,
                  smb2_fid->fid_persistent,
@@ -197,8 +284,8 @@ smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
     else {
         SMBERROR("No SMB 2/3 fid found for fid %llx\n", fid);
     }
-exit:    
-    smb_fid_table_unlock(share);
+    
+    lck_mtx_unlock(&shardp->fid_lock);
     return (error);
 }
 
@@ -206,16 +293,16 @@ int
 smb_fid_get_user_fid(struct smb_share *share, SMB2FID smb2_fid, SMBFID *ret_fid)
 {
     uint64_t fid, val1, val2;
+    SMB_FID_SHARD *shardp;
     SMB_FID_NODE *node;
-    int error = EINVAL;
+    struct fid_list_head *bucketp;
+    int error = 0;
     
     if (share == NULL) {
         SMBERROR("share is null\n");
         return EINVAL;
     };    
     
-    smb_fid_table_lock(share);
-    
     val1 = smb_fid_one_at_a_time((uint8_t *)&smb2_fid.fid_persistent,
                                  sizeof(smb2_fid.fid_persistent));
     val2 = smb_fid_one_at_a_time((uint8_t *)&smb2_fid.fid_volatile,
@@ -223,48 +310,51 @@ smb_fid_get_user_fid(struct smb_share *share, SMB2FID smb2_fid, SMBFID *ret_fid)
     
     fid = (val1 << 32) | val2;
     
+    /* Allocate before taking the lock so other opens are not held up */
     SMB_MALLOC_TYPE(node, SMB_FID_NODE, Z_WAITOK);
-    if (node != NULL) {
-        node->fid = fid;
-        node->smb2_fid = smb2_fid;
-        
-        // insert our new node into the hash table
-        smb_fid_insert_new_node(share, node);
-        /*SMBERROR("insert SMB 2/3 fid %llx %llx -> fid %llx\n",
-                 smb2_fid.fid_persistent,
-                 smb2_fid.fid_volatile,
-                 fid);*/
-        *ret_fid = fid;
-        error = 0;
-    }
-    else {
+    if (node == NULL) {
         SMBERROR("malloc failed\n");
-        error = ENOMEM;
+        return (ENOMEM);
     }
+    node->fid = fid;
+    node->smb2_fid = smb2_fid;
     
-    smb_fid_table_unlock(share);
-    return (error);
-}
-
-static void
-smb_fid_insert_new_node(struct smb_share *share, SMB_FID_NODE *node)
-{
-    FID_HASH_TABLE_SLOT *slotPtr;
-    uint32_t table_index;
+    shardp = SMB_FID_SHARD(share, fid);
+    lck_mtx_lock(&shardp->fid_lock);
     
-    // calculate the slot
-    table_index = node->fid & SMB_FID_TABLE_MASK;
-    DBG_ASSERT(table_index < SMB_FID_TABLE_SIZE);
+    if (shardp->fid_buckets == NULL) {
+        error = smb_fid_shard_resize(shardp, SMB_FID_MIN_BUCKETS, 1);
+    }
+    else if (shardp->fid_cnt >= (shardp->fid_bucket_cnt * SMB_FID_MAX_LOAD)) {
+        /* Not fatal if we can not grow, the chains just get longer */
+        (void) smb_fid_shard_resize(shardp, shardp->fid_bucket_cnt * 2, 1);
+    }
     
-    slotPtr = &share->ss_fid_table[table_index];
+    if (error) {
+        lck_mtx_unlock(&shardp->fid_lock);
+        SMBERROR("malloc failed\n");
+        SMB_FREE_TYPE(SMB_FID_NODE, node);
+        return (error);
+    }
     
-    if (LIST_EMPTY(&slotPtr->fid_list)) {
-    } 
-    else {
-        share->ss_fid_collisions++;
+    // insert our new node into the hash table
+    bucketp = SMB_FID_BUCKET(shardp, fid);
+    if (!LIST_EMPTY(bucketp)) {
+        shardp->fid_collisions++;
     }
-    LIST_INSERT_HEAD(&slotPtr->fid_list, node, link);
-    share->ss_fid_inserted++;
+    LIST_INSERT_HEAD(bucketp, node, link);
+    LIST_INSERT_HEAD(&shardp->fid_live, node, live_link);
+    shardp->fid_cnt++;
+    shardp->fid_inserted++;
+    
+    /*SMBERROR("insert SMB 2/3 fid %llx %llx -> fid %llx\n",
+             smb2_fid.fid_persistent,
+             smb2_fid.fid_volatile,
+             fid);*/
+    *ret_fid = fid;
+    
+    lck_mtx_unlock(&shardp->fid_lock);
+    return (error);
 }
 
 /* A quick little hash function
@@ -291,10 +381,8 @@ smb_fid_one_at_a_time(uint8_t *key, uint32_t len)
 int
 smb_fid_update_kernel_fid(struct smb_share *share, SMBFID fid, SMB2FID new_smb2_fid)
 {
-    FID_HASH_TABLE_SLOT *slotPtr;
+    SMB_FID_SHARD *shardp;
     SMB_FID_NODE *node;
-    uint32_t table_index, iter;
-    uint32_t found_it = 0;
     int error = EINVAL;
     
     if (share == NULL) {
@@ -302,37 +390,12 @@ smb_fid_update_kernel_fid(struct smb_share *share, SMBFID fid, SMB2FID new_smb2_
         return EINVAL;
     };
 
-    smb_fid_table_lock(share);
-    
-    /* calculate the slot */
-    table_index = fid & SMB_FID_TABLE_MASK;
-    if (table_index >= SMB_FID_TABLE_SIZE) {
-        SMBERROR("Bad table_index: %u for fid %llx\n", table_index, fid);
-        goto exit;
-    };
+    shardp = SMB_FID_SHARD(share, fid);
+    lck_mtx_lock(&shardp->fid_lock);
     
-    slotPtr = &share->ss_fid_table[table_index];
-    if (slotPtr == NULL) {
-        SMBERROR("slotPtr is null for table_index %u, fid %llx\n",
-                 table_index, fid);
-        goto exit;
-    };
-    
-    iter = 0;
-    LIST_FOREACH(node, &slotPtr->fid_list, link) {
-        if (node->fid == fid) {
-            node->smb2_fid = new_smb2_fid;
-            found_it = 1;
-            break;
-        }
-        iter++;
-    }
-    
-    if (iter >= share->ss_fid_max_iter) {
-        share->ss_fid_max_iter = iter;
-    }
-    
-    if (found_it == 1) {
+    node = smb_fid_shard_find(shardp, fid);
+    if (node != NULL) {
+        node->smb2_fid = new_smb2_fid;
         /*SMBERROR("fid %llx updated to SMB 2/3 fid %llx %llx\n",
          fid,
          new_smb2_fid.fid_persistent,
@@ -342,8 +405,7 @@ smb_fid_update_kernel_fid(struct smb_share *share, SMBFID fid, SMB2FID new_smb2_
     else {
         SMBERROR("No SMB 2/3 fid found for fid %llx\n", fid);
     }
-exit:
-    smb_fid_table_unlock(share);
+    
+    lck_mtx_unlock(&shardp->fid_lock);
     return (error);
 }
-
@@ -26,30 +26,46 @@
 
 #include <netsmb/smb_2.h>
 
-#define	smb_fid_table_lock(share)	(lck_mtx_lock(&(share)->ss_fid_lock))
-#define	smb_fid_table_unlock(share)	(lck_mtx_unlock(&(share)->ss_fid_lock))
-
 LIST_HEAD(fid_list_head, fid_node_t);
 
-// An element in the global fid hash table
+// An element in the fid index
 typedef struct fid_node_t
 {
 	SMBFID  fid;
 	SMB2FID smb2_fid;
-	LIST_ENTRY(fid_node_t) link;
+	LIST_ENTRY(fid_node_t) link;		/* in its hash bucket */
+	LIST_ENTRY(fid_node_t) live_link;	/* in its shard's fid_live list */
 	
 } SMB_FID_NODE;
 
-typedef struct fid_hash_table_slot
+/*
+ * The fid index is split into shards picked by the low bits of the fid. Each
+ * shard has its own lock and a hash table that grows and shrinks with the
+ * number of fids in it.
+ */
+#define SMB_FID_SHARD_SHIFT 4
+#define SMB_FID_SHARDS (1 << SMB_FID_SHARD_SHIFT)
+#define SMB_FID_SHARD_MASK (SMB_FID_SHARDS - 1)
+
+#define SMB_FID_MIN_BUCKETS 64		/* per shard, must be a power of 2 */
+#define SMB_FID_MAX_LOAD 2			/* grow above 2 fids per bucket */
+#define SMB_FID_MIN_LOAD_DIV 8		/* shrink below 1 fid per 8 buckets */
+
+typedef struct fid_shard
 {
-	struct fid_list_head fid_list;
+	lck_mtx_t fid_lock;
+	struct fid_list_head *fid_buckets;	/* fid_bucket_cnt of them */
+	uint32_t fid_bucket_cnt;
+	uint32_t fid_cnt;
+	struct fid_list_head fid_live;		/* every fid in this shard */
+	uint64_t fid_collisions;
+	uint64_t fid_inserted;
+	uint64_t fid_max_iter;
 	
-} FID_HASH_TABLE_SLOT;
-
-// Global fid hash table
-#define SMB_FID_TABLE_SIZE 4096
-#define SMB_FID_TABLE_MASK 0x0000000000000fff
+} SMB_FID_SHARD;
 
+void smb_fid_table_init(struct smb_share *share);
+void smb_fid_table_destroy(struct smb_share *share);
 uint64_t smb_fid_count_all(struct smb_share *share);
 void smb_fid_delete_all(struct smb_share *share);
 int smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
@@ -90,6 +90,9 @@ static int smb_iod_proclaim_main(struct smbiod *iod, struct smbiod *iod_main);
 static void smb_iod_read_thread(void *arg, wait_result_t wr);
 static void smb_iod_detach_con_entry(struct smbiod *iod);
 static void smb_iod_lease_dequeue(struct smbiod *iod);
+static struct smb_rq *smb_iod_rq_hash_lookup(struct smbiod *iod,
+                                             uint64_t message_id,
+                                             uint32_t *visited);
 
 /*
  * Check to see if the share has a routine to handle going away, if so.
@@ -271,6 +274,17 @@ smb_iod_rqprocessed(struct smb_rq *rqp, int error, int flags)
         if (rqp->sr_flags & SMBR_INTERNAL) {
             wakeup(&rqp->sr_iod->iod_flags);
         }
+
+        /*
+         * Pipelined read/writes want to know when any of their requests
+         * completes. The owner still calls smb_rq_reply() which will not
+         * block since the reply is here. Callback is done with SMBRQ_SLOCK
+         * held so it must not take the iod or rq locks.
+         */
+        if (rqp->sr_flags & SMBR_CALLBACK) {
+            DBG_ASSERT(rqp->sr_callback);
+            rqp->sr_callback(rqp->sr_callback_args);
+        }
     }
 	SMBRQ_SUNLOCK(rqp);
     
@@ -290,6 +304,13 @@ static void smb_iod_invrq(struct smbiod *iod)
 	 * Invalidate all outstanding requests for this connection
 	 */
 	SMB_IOD_RQLOCK(iod);
+
+	/* Let any seal batch finish so it sees the connection went away */
+	while (iod->iod_sealing > 0) {
+		msleep(&iod->iod_sealing, SMB_IOD_RQLOCKPTR(iod), PWAIT,
+			   "iod-invrq-seal-wait", 0);
+	}
+
 	TAILQ_FOREACH_SAFE(rqp, &iod->iod_rqlist, sr_link, trqp) {
 		smb_iod_rqprocessed(rqp, ENOTCONN, SMBR_DEAD);
 	}
@@ -957,6 +978,11 @@ smb_iod_sendrq(struct smbiod *iod, struct smb_rq *rqp)
             break;
 	}
 
+    if (rqp->sr_extflags & SMB2_REQ_SEAL_PENDING) {
+        /* Not encrypted yet, smb_iod_sendall() will get to it */
+        return 0;
+    }
+
     if (rqp->sr_extflags & SMB2_REQUEST) {
         /* filled in by smb2_rq_init_internal */
 
@@ -1606,7 +1632,156 @@ exit:
     return error;
 }
 
-    
+
+/*
+ * Drop any received messages that have not been processed yet. Called when
+ * the connection is going away, since their replies no longer mean anything.
+ */
+static void
+smb_iod_recv_batch_flush(struct smbiod *iod)
+{
+    uint32_t i;
+
+    for (i = iod->iod_recv_batch_next; i < iod->iod_recv_batch_cnt; i++) {
+        if (iod->iod_recv_batch[i].m != NULL) {
+            mbuf_freem(iod->iod_recv_batch[i].m);
+            iod->iod_recv_batch[i].m = NULL;
+        }
+    }
+
+    iod->iod_recv_batch_cnt = 0;
+    iod->iod_recv_batch_next = 0;
+    iod->iod_recv_batch_error = 0;
+}
+
+/*
+ * Free the decrypt buffers of the receive batch. Unless force is set, this is
+ * only done once no batch has been decrypted for SMB_IOD_RECV_BATCH_IDLE_SECS
+ * so idle channels do not hold on to buffers sized for their largest reply.
+ * Called by the iod idle timer and when the iod is destroyed.
+ */
+static void
+smb_iod_recv_batch_reclaim(struct smbiod *iod, int force)
+{
+    char *free_bufs[SMB_IOD_RECV_BATCH];
+    uint32_t free_lens[SMB_IOD_RECV_BATCH];
+    struct timespec now;
+    uint32_t i;
+
+    lck_mtx_lock(&iod->iod_recv_batch_lock);
+
+    if (!force) {
+        nanouptime(&now);
+        if ((now.tv_sec - iod->iod_recv_batch_last_used.tv_sec) <
+            SMB_IOD_RECV_BATCH_IDLE_SECS) {
+            lck_mtx_unlock(&iod->iod_recv_batch_lock);
+            return;
+        }
+    }
+
+    /* Take the buffers, then free outside of the lock */
+    for (i = 0; i < SMB_IOD_RECV_BATCH; i++) {
+        free_bufs[i] = iod->iod_recv_batch[i].bufferp;
+        free_lens[i] = iod->iod_recv_batch[i].buf_len;
+        iod->iod_recv_batch[i].bufferp = NULL;
+        iod->iod_recv_batch[i].buf_len = 0;
+    }
+
+    lck_mtx_unlock(&iod->iod_recv_batch_lock);
+
+    for (i = 0; i < SMB_IOD_RECV_BATCH; i++) {
+        if (free_bufs[i] != NULL) {
+            SMB_FREE_DATA(free_bufs[i], free_lens[i]);
+        }
+    }
+}
+
+static void
+smb_iod_recv_batch_free(struct smbiod *iod)
+{
+    smb_iod_recv_batch_flush(iod);
+    smb_iod_recv_batch_reclaim(iod, 1);
+}
+
+/*
+ * Return the next received message, decrypted if it was a transform message.
+ *
+ * On an encrypted session, the read thread would otherwise decrypt one
+ * message at a time. So if more messages are already waiting on the socket,
+ * read in up to SMB_IOD_RECV_BATCH of them and decrypt them together with
+ * the rw helper threads, then hand them back in the order they arrived.
+ * Only called by the read thread.
+ */
+static int
+smb_iod_recv_next(struct smbiod *iod, mbuf_t *mpp)
+{
+    struct smb3_crypt_item *itemp = NULL;
+    mbuf_t m = NULL;
+    uint32_t nread = 0;
+    int error = 0;
+
+    *mpp = NULL;
+
+    if (iod->iod_recv_batch_next >= iod->iod_recv_batch_cnt) {
+        iod->iod_recv_batch_cnt = 0;
+        iod->iod_recv_batch_next = 0;
+
+        if (iod->iod_recv_batch_error) {
+            /* Error that ended the last batch */
+            error = iod->iod_recv_batch_error;
+            iod->iod_recv_batch_error = 0;
+            return (error);
+        }
+
+        while (iod->iod_recv_batch_cnt < SMB_IOD_RECV_BATCH) {
+            m = NULL;
+            error = SMB_TRAN_RECV(iod, &m);
+            if (error || (m == NULL)) {
+                if (iod->iod_recv_batch_cnt == 0) {
+                    return (error);
+                }
+
+                /* Return it after the messages we already have */
+                iod->iod_recv_batch_error = error;
+                break;
+            }
+
+            itemp = &iod->iod_recv_batch[iod->iod_recv_batch_cnt++];
+            itemp->rqp = NULL;
+            itemp->m = m;
+            itemp->error = 0;
+
+            /* Only batch up encrypted messages */
+            if (*(u_char *) mbuf_data(m) != 0xfd) {
+                break;
+            }
+
+            /* Is another message already waiting? Dont block for one */
+            nread = 0;
+            if ((SMB_TRAN_GETPARAM(iod, SMBTP_NREAD, &nread) != 0) ||
+                (nread == 0)) {
+                break;
+            }
+        }
+
+        /* Keep the iod idle timer from freeing the decrypt buffers */
+        lck_mtx_lock(&iod->iod_recv_batch_lock);
+        nanouptime(&iod->iod_recv_batch_last_used);
+        smb3_crypt_batch(iod->iod_session, iod->iod_recv_batch,
+                         iod->iod_recv_batch_cnt);
+        lck_mtx_unlock(&iod->iod_recv_batch_lock);
+    }
+
+    itemp = &iod->iod_recv_batch[iod->iod_recv_batch_next++];
+    error = itemp->error;
+    if (!error) {
+        *mpp = itemp->m;
+    }
+    itemp->m = NULL;
+
+    return (error);
+}
+
 /*
  * Process incoming packets
  */
@@ -1633,6 +1808,8 @@ smb_iod_recvall(struct smbiod *iod)
     int update_hash = 0;
     uint8_t zero_block[SHA512_DIGEST_LENGTH] = {0};
     size_t mbuf_chain_len = 0, len, offset;
+    uint32_t rq_visited = 0;
+    int rq_hash_hit = 0;
 
 	for (;;) {
         m = NULL;
@@ -1641,9 +1818,11 @@ smb_iod_recvall(struct smbiod *iod)
         temp_rqp = NULL;
         skip_wakeup = 0;
         update_hash = 0;
+        rq_visited = 0;
+        rq_hash_hit = 0;
         
         /* this reads in the entire response packet based on the NetBIOS hdr */
-		error = SMB_TRAN_RECV(iod, &m);
+		error = smb_iod_recv_next(iod, &m);
         if (error) {
             if (error == EWOULDBLOCK) {
                 break;
@@ -1651,6 +1830,9 @@ smb_iod_recvall(struct smbiod *iod)
             else {
                 SMBWARNING("id %d:SMB_TRAN_RECV failed %d\n", iod->iod_id, error);
                 if (SMB_TRAN_FATAL(iod, error) && (!(iod->iod_flags & SMBIOD_SHUTDOWN))) {
+                    /* Anything else already read in is from the old connection */
+                    smb_iod_recv_batch_flush(iod);
+
                     /* Tell send thread to start reconnect */
                     SMBWARNING("id %d: Set read-thread error at state %d \n",
                                iod->iod_id, iod->iod_state);
@@ -1805,18 +1987,39 @@ smb_iod_recvall(struct smbiod *iod)
         /*
          * Search queue of smb_rq to find a match for this reply
          *
+         * For SMB 2/3, first look up the message id in iod_rqhash. If that
+         * finds the request, the loop below starts at it and matches it on
+         * the first pass. Replies to the middle of a compound chain, lease
+         * breaks and SMB 1 replies are not in the hash, so for those we
+         * start at the head of iod_rqlist and walk it.
+         *
          * If we find a matching rqp, wake up the thread waiting for the reply
-         * and break out of the TAILQ_FOREACH_SAFE loop as we are done.
+         * and break out of the loop as we are done.
          *
          * Otherwise we search all rqp's, not find any matches, and exit the
-         * TAILQ_FOREACH_SAFE loop with rqp = null.
+         * loop with rqp = null.
          */
         SMB_LOG_KTRACE(SMB_DBG_IOD_RECVALL | DBG_FUNC_START, iod->iod_id, message_id, 0, 0, 0);
 
         SMB_IOD_RQLOCK(iod);
         drop_req_lock = 1;
         nanouptime(&iod->iod_lastrecv);
-		TAILQ_FOREACH_SAFE(rqp, &iod->iod_rqlist, sr_link, trqp) {
+
+        rqp = NULL;
+        if (smb2_packet) {
+            rqp = smb_iod_rq_hash_lookup(iod, message_id, &rq_visited);
+            rq_hash_hit = (rqp != NULL);
+        }
+        if (rqp == NULL) {
+            rqp = TAILQ_FIRST(&iod->iod_rqlist);
+        }
+
+		for (; rqp != NULL; rqp = trqp) {
+            trqp = TAILQ_NEXT(rqp, sr_link);
+            if (!rq_hash_hit) {
+                rq_visited++;
+            }
+
             if (smb2_packet) {
                 if (rqp->sr_messageid == message_id) {
                     /*
@@ -1918,6 +2121,7 @@ smb_iod_recvall(struct smbiod *iod)
                 }
                 else {
                     rqp->sr_extflags |= SMB2_RESPONSE;
+                    rqp->sr_timereplied = iod->iod_lastrecv;
                 }
 
                 switch(rqp->sr_command) {
@@ -2178,7 +2382,7 @@ smb_iod_recvall(struct smbiod *iod)
                  */
             }
 
-            /* Fall out of the TAILQ_FOREACH_SAFE loop */
+            /* Fall out of the search loop */
             break;
 		}
 
@@ -2186,6 +2390,8 @@ smb_iod_recvall(struct smbiod *iod)
             SMB_IOD_RQUNLOCK(iod);
         }
 
+        SMB_LOG_KTRACE(SMB_DBG_IOD_RQ_LOOKUP | DBG_FUNC_NONE, iod->iod_id, message_id, rq_visited, rq_hash_hit, 0);
+
         SMB_LOG_KTRACE(SMB_DBG_IOD_RECVALL | DBG_FUNC_END, 0, iod->iod_id, message_id, 0, 0);
 
         if (rqp == NULL) {
@@ -2309,8 +2515,12 @@ smb_iod_request(struct smbiod *iod, int event, void *ident)
     return error;
 }
 
+/*
+ * Assign the message id and sign the request. If can_defer_seal is set,
+ * compressing and encrypting it is left to smb_iod_sendall().
+ */
 static int
-smb_iod_rq_sign(struct smb_rq *rqp)
+smb_iod_rq_sign(struct smb_rq *rqp, int can_defer_seal)
 {
     struct smb_session *sessionp = rqp->sr_session;
     uint32_t do_encrypt;
@@ -2322,6 +2532,8 @@ smb_iod_rq_sign(struct smb_rq *rqp)
     smb_rq_getrequest(rqp, &mbp);
     mb_fixhdr(mbp);
 
+    rqp->sr_extflags &= ~SMB2_REQ_SEAL_PENDING;
+
     /*
      * SMB 2/3
      *
@@ -2372,42 +2584,78 @@ smb_iod_rq_sign(struct smb_rq *rqp)
         }
     }
 
-    /*
-     * Do any compression after signing but before encrypting
-     * 1. Only SMB 3 or later can compress
-     * 2. Server must support compression
-     * 3. Only compress non compound requests
-     * 4. Only compress Write requests.
-     *
-     * Note Read requests just have a flag set
-     */
-    if (SMBV_SMB3_OR_LATER(sessionp) &&
-        (sessionp->server_compression_algorithms_map != 0) &&
-        !(rqp->sr_flags & SMBR_COMPOUND_RQ) &&
-        (rqp->sr_command == SMB2_WRITE) &&
-        !(rqp->sr_extflags & SMB2_NO_COMPRESS_WRITE)) {
-        error = smb2_rq_compress_write(rqp);
-        if (error) {
-            /* Should never happen */
-            SMBERROR("smb2_rq_compress_write failed %d\n", error);
-            goto exit;
-        }
+    if (do_encrypt && can_defer_seal) {
+        /*
+         * Leave compressing and encrypting to smb_iod_sendall() so the
+         * requests queued together get sealed in parallel.
+         */
+        rqp->sr_extflags |= SMB2_REQ_SEAL_PENDING;
+        goto exit;
     }
 
-    if (do_encrypt) {
-        error = smb3_rq_encrypt(rqp);
-        if (error) {
-            /* Should never happen */
-            SMBERROR("SMB3 transform failed, error: %d\n", error);
-            goto exit;
-        }
-    }
+    /* Compress and/or encrypt now */
+    error = smb3_rq_seal(rqp, do_encrypt);
 
 exit:
     SMB_LOG_KTRACE(SMB_DBG_IOD_RQ_SIGN | DBG_FUNC_END, error, rqp->sr_messageid, rqp->sr_command, 0, 0);
     return(error);
 }
 
+/*
+ * Add a SMB 2/3 request to the message id hash. Its message id must already
+ * be assigned by smb_iod_rq_sign(). Only the first request of a compound
+ * chain is hashed, replies to the rest of the chain are found by walking
+ * iod_rqlist. Must be called with iod_rqlock held.
+ */
+static void
+smb_iod_rq_hash_insert(struct smbiod *iod, struct smb_rq *rqp)
+{
+    if (!(rqp->sr_extflags & SMB2_REQUEST) ||
+        (rqp->sr_hash_link.le_prev != NULL)) {
+        return;
+    }
+
+    LIST_INSERT_HEAD(SMB_IOD_RQHASH(iod, rqp->sr_messageid), rqp, sr_hash_link);
+}
+
+/*
+ * Must be called with iod_rqlock held.
+ */
+static void
+smb_iod_rq_hash_remove(struct smb_rq *rqp)
+{
+    if (rqp->sr_hash_link.le_prev == NULL) {
+        /* Never hashed (SMB 1) or already removed */
+        return;
+    }
+
+    LIST_REMOVE(rqp, sr_hash_link);
+    rqp->sr_hash_link.le_next = NULL;
+    rqp->sr_hash_link.le_prev = NULL;
+}
+
+/*
+ * Find the outstanding SMB 2/3 request with this message id. Returns NULL if
+ * there is none in the hash, in which case the caller has to fall back to
+ * walking iod_rqlist. *visited is incremented for every request looked at.
+ * Must be called with iod_rqlock held.
+ */
+static struct smb_rq *
+smb_iod_rq_hash_lookup(struct smbiod *iod, uint64_t message_id,
+                       uint32_t *visited)
+{
+    struct smb_rq *rqp;
+
+    LIST_FOREACH(rqp, SMB_IOD_RQHASH(iod, message_id), sr_hash_link) {
+        (*visited)++;
+        if (rqp->sr_messageid == message_id) {
+            return (rqp);
+        }
+    }
+
+    return (NULL);
+}
+
 /*
  * Place request in the queue.
  * Request from smbiod have a high priority.
@@ -2438,7 +2686,7 @@ smb_iod_rq_enqueue(struct smb_rq *rqp)
 		SMB_IOD_RQLOCK(iod);
 
         if (rqp->sr_extflags & SMB2_REQUEST) {
-            error = smb_iod_rq_sign(rqp);
+            error = smb_iod_rq_sign(rqp, 0);
             if (error) {
                 SMBERROR("smb_iod_rq_sign failed %d \n", error);
                 SMB_IOD_RQUNLOCK(iod);
@@ -2448,6 +2696,7 @@ smb_iod_rq_enqueue(struct smb_rq *rqp)
 
         rqp->sr_flags |= SMBR_ENQUEUED;
         TAILQ_INSERT_HEAD(&iod->iod_rqlist, rqp, sr_link);
+        smb_iod_rq_hash_insert(iod, rqp);
 
 		/*
 		 * <76213940> Hold RQ lock during this loop to avoid a possible race
@@ -2653,7 +2902,7 @@ smb_iod_rq_enqueue(struct smb_rq *rqp)
     }
     
     if (rqp->sr_extflags & SMB2_REQUEST) {
-        error = smb_iod_rq_sign(rqp);
+        error = smb_iod_rq_sign(rqp, 1);
         if (error) {
             SMBERROR("smb_iod_rq_sign failed %d \n", error);
             SMB_IOD_RQUNLOCK(iod);
@@ -2663,6 +2912,7 @@ smb_iod_rq_enqueue(struct smb_rq *rqp)
 
     rqp->sr_flags |= SMBR_ENQUEUED;
     TAILQ_INSERT_TAIL(&iod->iod_rqlist, rqp, sr_link);
+    smb_iod_rq_hash_insert(iod, rqp);
     
 	SMB_IOD_RQUNLOCK(iod);
 
@@ -2688,9 +2938,16 @@ smb_iod_removerq(struct smb_rq *rqp)
 	struct smbiod *iod = rqp->sr_iod;
 
 	SMB_IOD_RQLOCK(iod);
+
+	/* A seal batch may still be using it */
+	while (rqp->sr_extflags & SMB2_REQ_SEALING) {
+		msleep(&iod->iod_sealing, SMB_IOD_RQLOCKPTR(iod), PWAIT,
+			   "iod-removerq-seal-wait", 0);
+	}
     
 	if (rqp->sr_flags & SMBR_INTERNAL) {
 		TAILQ_REMOVE(&iod->iod_rqlist, rqp, sr_link);
+        smb_iod_rq_hash_remove(rqp);
         rqp->sr_flags &= ~SMBR_ENQUEUED;
 
         SMB_IOD_RQUNLOCK(iod);
@@ -2698,6 +2955,7 @@ smb_iod_removerq(struct smb_rq *rqp)
 	}
     
 	TAILQ_REMOVE(&iod->iod_rqlist, rqp, sr_link);
+    smb_iod_rq_hash_remove(rqp);
     rqp->sr_flags &= ~SMBR_ENQUEUED;
 
     SMB_IOD_RQUNLOCK(iod);
@@ -2846,6 +3104,109 @@ smb_iod_errorout_share_request(struct smb_share *share, int error)
 	SMB_IOD_RQUNLOCK(iod);
 }
 
+/*
+ * Compress and encrypt the queued requests that smb_iod_rq_sign() left for
+ * us, a batch at a time so they get done in parallel by the rw helper
+ * threads. The batch stays on iod_rqlist, in its place, marked with
+ * SMB2_REQ_SEALING so iod_rqlock does not have to be held while it is sealed.
+ * smb_iod_sendall() skips those requests and smb_iod_invrq() and
+ * smb_iod_removerq() wait for them. If the connection went down or a
+ * reconnect came and went while sealing, the keys used may be stale so the
+ * batch is failed like smb_iod_sendall() fails requests caught by a
+ * reconnect. A request that fails to seal is completed with the error.
+ * Called with iod_rqlock held, which is dropped and retaken.
+ */
+static void
+smb_iod_seal_pending(struct smbiod *iod)
+{
+    struct smb3_crypt_item items[SMB_IOD_SEAL_BATCH];
+    struct smb_rq *rqp;
+    uint32_t count, i, reconnect_count;
+    int stale;
+
+    for (;;) {
+        /* Keys can change during a reconnect, wait for it to finish */
+        if ((iod->iod_state != SMBIOD_ST_SESSION_ACTIVE) ||
+            (iod->iod_flags & (SMBIOD_RECONNECT | SMBIOD_START_RECONNECT))) {
+            break;
+        }
+
+        count = 0;
+        TAILQ_FOREACH(rqp, &iod->iod_rqlist, sr_link) {
+            if (count >= SMB_IOD_SEAL_BATCH) {
+                break;
+            }
+
+            if (!(rqp->sr_extflags & SMB2_REQ_SEAL_PENDING) ||
+                (rqp->sr_extflags & SMB2_REQ_SEALING) ||
+                (rqp->sr_state != SMBRQ_NOTSENT)) {
+                continue;
+            }
+
+            rqp->sr_extflags |= SMB2_REQ_SEALING;
+
+            bzero(&items[count], sizeof(items[count]));
+            items[count].rqp = rqp;
+            count++;
+        }
+
+        if (count == 0) {
+            break;
+        }
+
+        SMB_LOG_KTRACE(SMB_DBG_IOD_SENDALL | DBG_FUNC_NONE, 0xabc003, iod->iod_id, count, 0, 0);
+
+        iod->iod_sealing++;
+        reconnect_count = iod->iod_session->session_reconnect_count;
+
+        SMB_IOD_RQUNLOCK(iod);
+        smb3_crypt_batch(iod->iod_session, items, count);
+        SMB_IOD_RQLOCK(iod);
+
+        stale = ((iod->iod_state != SMBIOD_ST_SESSION_ACTIVE) ||
+                 (iod->iod_flags & (SMBIOD_RECONNECT | SMBIOD_START_RECONNECT)) ||
+                 (reconnect_count != iod->iod_session->session_reconnect_count));
+
+        for (i = 0; i < count; i++) {
+            rqp = items[i].rqp;
+            rqp->sr_extflags &= ~SMB2_REQ_SEALING;
+
+            if (rqp->sr_state == SMBRQ_NOTIFIED) {
+                /* Already failed while we were sealing it */
+                continue;
+            }
+
+            if (stale) {
+                /* Sealed with keys that may be gone, never send it */
+                rqp->sr_extflags &= ~SMB2_REQ_SENT;
+                if (iod->iod_state == SMBIOD_ST_DEAD) {
+                    smb_iod_rqprocessed(rqp, ENOTCONN, SMBR_DEAD);
+                }
+                else if (rqp->sr_flags & SMBR_ASYNC) {
+                    smb_iod_rqprocessed(rqp, ETIMEDOUT, SMBR_RECONNECTED);
+                }
+                else {
+                    /* Same as a reconnect, the caller rebuilds it */
+                    smb_iod_rqprocessed(rqp, EAGAIN, SMBR_RECONNECTED);
+                }
+                continue;
+            }
+
+            rqp->sr_extflags &= ~SMB2_REQ_SEAL_PENDING;
+            if (items[i].error) {
+                smb_iod_rqprocessed(rqp, items[i].error, 0);
+            }
+        }
+
+        iod->iod_sealing--;
+        wakeup(&iod->iod_sealing);
+
+        if (stale) {
+            break;
+        }
+    }
+}
+
 int
 smb_iod_sendall(struct smbiod *iod)
 {
@@ -2873,7 +3234,15 @@ smb_iod_sendall(struct smbiod *iod)
     
     SMB_IOD_RQLOCK(iod);
 
+    /* Compress and encrypt the requests queued since last time */
+    smb_iod_seal_pending(iod);
+
     TAILQ_FOREACH_SAFE(rqp, &iod->iod_rqlist, sr_link, trqp) {
+        if (rqp->sr_extflags & SMB2_REQ_SEALING) {
+            /* Another thread is sealing it, it will deal with it */
+            continue;
+        }
+
 		if (iod->iod_state == SMBIOD_ST_DEAD) {
 			/* session is down, just time out any message on the list */
 			smb_iod_rqprocessed(rqp, ETIMEDOUT, 0);
@@ -3881,6 +4250,7 @@ static void smb_iod_thread(void *arg, __unused wait_result_t wr)
 	vfs_context_t context;
     int iod_id = iod->iod_id;
     struct smbiod_event *evp = NULL, *tevp = NULL;
+    int error = 0;
 
 	/* 
 	 * The iod sets the iod_p to kernproc when launching smb_iod_thread in
@@ -3935,13 +4305,23 @@ static void smb_iod_thread(void *arg, __unused wait_result_t wr)
 			continue;
         }
 
-        msleep(&iod->iod_flags, SMB_IOD_FLAGSLOCKPTR(iod), PWAIT, "iod thread idle",
-               &iod->iod_sleeptimespec);
+        error = msleep(&iod->iod_flags, SMB_IOD_FLAGSLOCKPTR(iod), PWAIT, "iod thread idle",
+                       &iod->iod_sleeptimespec);
 
         iod->iod_workflag = 0;
 
         SMB_IOD_FLAGSUNLOCK(iod);
 
+        if (error == EWOULDBLOCK) {
+            /*
+             * Idle timer went off with no work to do. Free pooled
+             * compression scratch buffers and decrypt buffers that have
+             * not been used for a while.
+             */
+            smb2_compress_scratch_reclaim(sessionp, 0);
+            smb_iod_recv_batch_reclaim(iod, 0);
+        }
+
         SMB_LOG_KTRACE(SMB_DBG_IOD_THREAD | DBG_FUNC_END, 0, iod->iod_id, 0xabc003, 0, 0);
 	}
 
@@ -4134,6 +4514,9 @@ smb_iod_read_thread(void *arg, __unused wait_result_t wr)
                              iod->iod_sleeptimespec.tv_sec,
                              iod->iod_sleeptimespec.tv_nsec);
             #endif
+            /* Anything already read in is from the old connection */
+            smb_iod_recv_batch_flush(iod);
+
             msleep(&iod->iod_flags, 0, PWAIT, "iod read thread idle", &iod->iod_sleeptimespec);
             continue;
         }
@@ -4163,6 +4546,7 @@ smb_iod_create(struct smb_session *sessionp, struct smbiod **iodpp)
 	struct smbiod	*iod;
 	kern_return_t	result;
 	thread_t		thread;
+	int				i;
 
     SMB_MALLOC_TYPE(iod, struct smbiod, Z_WAITOK_ZERO);
 	iod->iod_id = smb_iod_next++;
@@ -4195,6 +4579,9 @@ smb_iod_create(struct smb_session *sessionp, struct smbiod **iodpp)
 
 	lck_mtx_init(&iod->iod_rqlock, iodrq_lck_group, iodrq_lck_attr);
 	TAILQ_INIT(&iod->iod_rqlist);
+	for (i = 0; i < SMB_IOD_RQHASH_SIZE; i++) {
+		LIST_INIT(&iod->iod_rqhash[i]);
+	}
 	lck_mtx_init(&iod->iod_evlock, iodev_lck_group, iodev_lck_attr);
 	STAILQ_INIT(&iod->iod_evlist);
 
@@ -4202,6 +4589,8 @@ smb_iod_create(struct smb_session *sessionp, struct smbiod **iodpp)
 
     lck_mtx_init(&iod->iod_credits_lock, iodev_lck_group, iodev_lck_attr);
     lck_mtx_init(&iod->iod_tdata_lock, iodtdata_lck_group, iodtdata_lck_attr);
+    lck_mtx_init(&iod->iod_rwctl_lock, iodev_lck_group, iodev_lck_attr);
+    lck_mtx_init(&iod->iod_recv_batch_lock, iodev_lck_group, iodev_lck_attr);
 	/*
 	 * The IOCreateThread routine has been depricated. Just copied
 	 * that code here
@@ -4302,11 +4691,15 @@ smb_iod_destroy(struct smbiod *iod, bool selfclean)
     iod->iod_full_mackey = NULL;
     iod->iod_full_mackeylen = 0;
 
+    smb_iod_recv_batch_free(iod);
+
     lck_mtx_destroy(&iod->iod_flagslock, iodflags_lck_group);
 	lck_mtx_destroy(&iod->iod_rqlock, iodrq_lck_group);
 	lck_mtx_destroy(&iod->iod_evlock, iodev_lck_group);
     lck_mtx_destroy(&iod->iod_credits_lock, iodev_lck_group);
     lck_mtx_destroy(&iod->iod_tdata_lock, iodtdata_lck_group);
+    lck_mtx_destroy(&iod->iod_rwctl_lock, iodev_lck_group);
+    lck_mtx_destroy(&iod->iod_recv_batch_lock, iodev_lck_group);
 
     int id = iod->iod_id;
 
@@ -84,6 +84,8 @@ static struct smb_rw_queue {
 	struct smb_rw_q	rwq_queue[1];   /* Each dog has their own food bowl */
 	thread_t		rwq_thd;
 	uint32_t		rwq_flags;
+	volatile uint32_t rwq_depth;    /* items on rwq_queue, protected by rwq_lock */
+	volatile uint32_t rwq_busy;     /* worker is processing an item, unlocked hint */
 } *smb_rw_queue_tbl;
 
 
@@ -111,6 +113,8 @@ volatile uint32_t smb_rw_queue_count;
 #endif
 
 static void smb_rw_start(void);
+static struct smb_rw_arg *smb_rw_steal(int qi);
+static void smb_rw_wakeup_idle_peer(int qi);
 
 
 /*
@@ -126,10 +130,20 @@ smb_rw_thread(void *arg, wait_result_t wr __unused)
 
 	DPRINT("%d started\n", qi);
 	while (!smb_rw_shutdown) {
+        ep = NULL;
 		lck_mtx_lock(myqueue->rwq_lock);
 
-        /* If no work, then sleep */
+        /* If no work, try to steal some from a busy peer, else sleep */
 		while (!smb_rw_shutdown && TAILQ_EMPTY(myqueue->rwq_queue)) {
+            /*
+             * Peers are only try locked, so holding our own queue lock here
+             * can not deadlock and keeps us from missing a wakeup.
+             */
+            ep = smb_rw_steal(qi);
+            if (ep != NULL) {
+                break;
+            }
+
 			myqueue->rwq_flags |= SMB_RW_QUEUE_SLEEPING;
 			error = msleep(myqueue, myqueue->rwq_lock, PSOCK,
                            "smb_rw_handler idle", NULL);
@@ -139,20 +153,24 @@ smb_rw_thread(void *arg, wait_result_t wr __unused)
 			}
 		}
         
-        /* Are we shutting down now? */
-		if (smb_rw_shutdown) {
+        /* Are we shutting down now? Any work we stole still gets done */
+		if (smb_rw_shutdown && (ep == NULL)) {
 			lck_mtx_unlock(myqueue->rwq_lock);
 			break;
 		}
 
         /* Dequeue the work and process it */
-        ep = TAILQ_FIRST(myqueue->rwq_queue);
-        DPRINT("%d dequeue %p from %p\n", qi, ep, myqueue);
-        
-        TAILQ_REMOVE(myqueue->rwq_queue, ep, sra_svcq);
-        
-        ep->flags &= ~SMB_RW_QUEUED;
-        
+        if (ep == NULL) {
+            ep = TAILQ_FIRST(myqueue->rwq_queue);
+            DPRINT("%d dequeue %p from %p\n", qi, ep, myqueue);
+
+            TAILQ_REMOVE(myqueue->rwq_queue, ep, sra_svcq);
+            myqueue->rwq_depth--;
+
+            ep->flags &= ~SMB_RW_QUEUED;
+        }
+
+        myqueue->rwq_busy = 1;
         lck_mtx_unlock(myqueue->rwq_lock);
         
 #ifdef SMB_RW_Q_DEBUG
@@ -221,11 +239,39 @@ smb_rw_thread(void *arg, wait_result_t wr __unused)
                 SMB_LOG_KTRACE(SMB_DBG_RW_THREAD | DBG_FUNC_END, error, qi, 0, 0, 0);
                 break;
 
+            case SMB_COMPRESS_CHUNKS:
+                /* Compress chunks of the write until there are none left */
+                smb2_compress_chunks_helper(ep->compress.job);
+
+                SMB_LOG_KTRACE(SMB_DBG_RW_THREAD | DBG_FUNC_NONE, 0xabc005, qi, 0, 0, 0);
+
+                /* Just free the smb_rw_arg like for lease break acks */
+                lck_mtx_destroy(&ep->rw_arg_lock, smb_rw_group);
+                SMB_FREE_TYPE(struct smb_rw_arg, ep);
+
+                SMB_LOG_KTRACE(SMB_DBG_RW_THREAD | DBG_FUNC_END, 0, qi, 0, 0, 0);
+                break;
+
+            case SMB_CRYPT_BATCH:
+                /* Seal/unseal messages of the batch until there are none left */
+                smb3_crypt_batch_helper(ep->crypt.batch);
+
+                SMB_LOG_KTRACE(SMB_DBG_RW_THREAD | DBG_FUNC_NONE, 0xabc006, qi, 0, 0, 0);
+
+                /* Just free the smb_rw_arg like for lease break acks */
+                lck_mtx_destroy(&ep->rw_arg_lock, smb_rw_group);
+                SMB_FREE_TYPE(struct smb_rw_arg, ep);
+
+                SMB_LOG_KTRACE(SMB_DBG_RW_THREAD | DBG_FUNC_END, 0, qi, 0, 0, 0);
+                break;
+
             default:
                 SMBERROR("Unknown command %d\n", ep->command);
                 SMB_LOG_KTRACE(SMB_DBG_RW_THREAD | DBG_FUNC_END, EINVAL, qi, 0, 0, 0);
                 break;
         }
+
+        myqueue->rwq_busy = 0;
     }
 
     /* This thread is exiting */
@@ -272,6 +318,8 @@ smb_rw_init(void)
 		smb_rw_queue_tbl[i].rwq_lock = lck_mtx_alloc_init(smb_rw_group, LCK_ATTR_NULL);
 		smb_rw_queue_tbl[i].rwq_thd = THREAD_NULL;
 		smb_rw_queue_tbl[i].rwq_flags = 0;
+		smb_rw_queue_tbl[i].rwq_depth = 0;
+		smb_rw_queue_tbl[i].rwq_busy = 0;
 	}
     
 	smb_rw_shutdown_lock = lck_mtx_alloc_init(smb_rw_group, LCK_ATTR_NULL);
@@ -387,6 +435,7 @@ smb_rw_cleanup(void)
 		while (!TAILQ_EMPTY(queue->rwq_queue)) {
 			struct smb_rw_arg *ep = TAILQ_FIRST(queue->rwq_queue);
 			TAILQ_REMOVE(queue->rwq_queue, ep, sra_svcq);
+			queue->rwq_depth--;
 			ep->flags &= ~SMB_RW_QUEUED;
 		}
 		lck_mtx_unlock(queue->rwq_lock);
@@ -406,6 +455,131 @@ smb_rw_cleanup(void)
     lck_grp_free(smb_rw_group);
 }
 
+/*
+ * Returns the range of queues [*firstp, *firstp + *countp) that are of the
+ * same type as queue qi.
+ */
+static void
+smb_rw_queue_range(int qi, int *firstp, int *countp)
+{
+    if (qi < smb_strategy_thread_count) {
+        *firstp = 0;
+        *countp = smb_strategy_thread_count;
+    }
+    else {
+        *firstp = smb_strategy_thread_count;
+        *countp = smb_rw_thread_count;
+    }
+}
+
+/*
+ * Work stealing. A worker whose own queue is empty takes the oldest item off
+ * the queue of a peer instead of going to sleep, so work queued behind a
+ * long request does not wait on that one worker. Only queues of the same
+ * type (strategy or rw) are stolen from, see smb_rw_get_queue_id() for why
+ * the two types must stay apart. Returns NULL if there is nothing to steal.
+ */
+static struct smb_rw_arg *
+smb_rw_steal(int qi)
+{
+    struct smb_rw_queue *queue = NULL;
+    struct smb_rw_arg *ep = NULL;
+    int first = 0, count = 0, i, victim;
+
+    smb_rw_queue_range(qi, &first, &count);
+
+    for (i = 1; i < count; i++) {
+        victim = first + (((qi - first) + i) % count);
+        queue = &smb_rw_queue_tbl[victim];
+
+        /* Unlocked peek, rechecked once we have the lock */
+        if (queue->rwq_depth == 0) {
+            continue;
+        }
+
+        /* Never wait on a busy peer, just move on to the next one */
+        if (!lck_mtx_try_lock(queue->rwq_lock)) {
+            continue;
+        }
+
+        ep = TAILQ_FIRST(queue->rwq_queue);
+        if (ep != NULL) {
+            TAILQ_REMOVE(queue->rwq_queue, ep, sra_svcq);
+            queue->rwq_depth--;
+            ep->flags &= ~SMB_RW_QUEUED;
+        }
+        lck_mtx_unlock(queue->rwq_lock);
+
+        if (ep != NULL) {
+            DPRINT("%d stole %p from %d\n", qi, ep, victim);
+            SMB_LOG_KTRACE(SMB_DBG_RW_THREAD | DBG_FUNC_NONE, 0xabc004, qi, victim, 0, 0);
+            break;
+        }
+    }
+
+    return ep;
+}
+
+/*
+ * Work was just queued on qi but its worker is busy. Wake up a sleeping peer
+ * of the same type, if any, so it can steal the work.
+ */
+static void
+smb_rw_wakeup_idle_peer(int qi)
+{
+    struct smb_rw_queue *queue = NULL;
+    int first = 0, count = 0, i;
+
+    smb_rw_queue_range(qi, &first, &count);
+
+    for (i = 1; i < count; i++) {
+        queue = &smb_rw_queue_tbl[first + (((qi - first) + i) % count)];
+
+        /*
+         * The flag is read unlocked. If we miss a peer that is just going to
+         * sleep, the work is still done by the worker of qi.
+         */
+        if (queue->rwq_flags & SMB_RW_QUEUE_SLEEPING) {
+            wakeup(queue);
+            break;
+        }
+    }
+}
+
+/*
+ * Pick a read/write queue. Prefer the queue tied to the iod so that requests
+ * for a channel tend to be sent from the same worker, but if that worker is
+ * busy use the next idle one. If every worker is busy, round robin and let
+ * the workers steal from each other as they free up.
+ */
+static int
+smb_rw_get_rw_queue_id(struct smbiod *iod)
+{
+    struct smb_rw_queue *queue = NULL;
+    uint32_t start, i;
+    int qi;
+
+    if (iod != NULL) {
+        start = SMB_RW_HASH((uint32_t) iod->iod_id);
+    }
+    else {
+        start = SMB_RW_HASH(atomic_fetch_add(&rw_round_robin_index, 1));
+    }
+
+    for (i = 0; i < (uint32_t) smb_rw_thread_count; i++) {
+        /* make sure to skip over the first smb_strategy_thread_count */
+        qi = smb_strategy_thread_count + SMB_RW_HASH(start + i);
+        queue = &smb_rw_queue_tbl[qi];
+
+        if ((queue->rwq_busy == 0) && (queue->rwq_depth == 0)) {
+            return qi;
+        }
+    }
+
+    return smb_strategy_thread_count +
+           SMB_RW_HASH(atomic_fetch_add(&rw_round_robin_index, 1));
+}
+
 /*
  * There are two types of queues
  * 1. the first smb_strategy_thread_count strategy queues that only handle strategy calls
@@ -417,18 +591,20 @@ smb_rw_cleanup(void)
 static int
 smb_rw_get_queue_id(struct smb_rw_arg *uap)
 {
-    uint32_t qi = 0;
+    int qi = 0;
     switch(uap->command) {
         case SMB_VNOP_STRATEGY:
             qi = SMB_STRATEGY_HASH(atomic_fetch_add(&strategy_round_robin_index, 1));
             break;
         case SMB_READ_WRITE:
+            qi = smb_rw_get_rw_queue_id((uap->rw.rqp != NULL) ? uap->rw.rqp->sr_iod : NULL);
+            break;
         case SMB_LEASE_BREAK_ACK:
-            /*
-             * make sure to skip over the first smb_strategy_thread_count
-             */
-            qi = SMB_RW_HASH(atomic_fetch_add(&rw_round_robin_index, 1));
-            qi += smb_strategy_thread_count;
+            qi = smb_rw_get_rw_queue_id(uap->lease.iod);
+            break;
+        case SMB_COMPRESS_CHUNKS:
+        case SMB_CRYPT_BATCH:
+            qi = smb_rw_get_rw_queue_id(NULL);
             break;
         default:
             SMBERROR("Unknown command %d", uap->command);
@@ -446,7 +622,7 @@ void
 smb_rw_proxy(void *arg)
 {
 	struct smb_rw_arg *uap = (struct smb_rw_arg *) arg;
-    uint32_t qi = 0;
+    int qi = 0;
     struct smb_rw_queue *myqueue = NULL;
     
     qi = smb_rw_get_queue_id(uap);
@@ -466,11 +642,16 @@ smb_rw_proxy(void *arg)
 	}
 
 	TAILQ_INSERT_TAIL(myqueue->rwq_queue, uap, sra_svcq);
+    myqueue->rwq_depth++;
 
 	uap->flags |= SMB_RW_QUEUED;
     if (myqueue->rwq_flags & SMB_RW_QUEUE_SLEEPING) {
 		wakeup(myqueue);
     }
+    else {
+        /* Our worker is busy, let an idle one steal this */
+        smb_rw_wakeup_idle_peer(qi);
+    }
 
 #ifdef SMB_RW_Q_DEBUG
 	{
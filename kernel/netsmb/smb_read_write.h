@@ -26,6 +26,8 @@
 
 #define SMB_MAX_RW_HASH_SZ    12    /* Number of global worker threads */
 #define SMB_STRATEGY_HASH_SZ   4    /* Number of strategy worker threads */
+#define SMB_COMPRESS_MAX_HELPERS 4  /* Max rw threads helping compress one write */
+#define SMB_CRYPT_MAX_HELPERS 4     /* Max rw threads helping seal/unseal one batch */
 
 void smb_rw_init(void);
 void smb_rw_cleanup(void);
@@ -37,6 +39,8 @@ typedef enum _SMB_RW_CMD_FLAGS
     SMB_READ_WRITE = 0x0001,         /* Read/write */
     SMB_LEASE_BREAK_ACK = 0x0002,    /* Lease break ack exchange */
     SMB_VNOP_STRATEGY = 0x0004,      /* vnop_strategy read/write */
+    SMB_COMPRESS_CHUNKS = 0x0008,    /* Help compress chunks of a write */
+    SMB_CRYPT_BATCH = 0x0010,        /* Help seal/unseal a batch of messages */
 } _SMB_RW_CMD_FLAGS;
 
 /* smb_rw_arg flags */
@@ -55,6 +59,35 @@ typedef enum _SMB_RW_FLAGS
     SMB_RW_AVOID_QUEUE_ID =       0x0004
 } _SMB_RW_FLAGS;
 
+/*
+ * Shared by all the smb_rw_arg of one pipelined read/write. The iod read
+ * thread sets SMB_RW_REPLY_RCVD on an smb_rw_arg under the lock and wakes up
+ * the thread that issued the read/write.
+ */
+struct smb_rw_completion {
+    lck_mtx_t lock;
+    uint32_t in_flight;                 /* smb_rw_arg with a request sent */
+};
+
+/*
+ * Channels that one large read/write is striped over, see
+ * smb2_smb_rw_stripe_pick()
+ */
+struct smb_rw_stripe {
+    struct smbiod *iod;
+    uint64_t link_speed;                /* bits/sec, weight until sampled */
+    uint64_t inflight;                  /* bytes of this transfer outstanding */
+};
+
+struct smb_rw_stripe_set {
+    struct smb_rw_stripe *stripes;
+    uint32_t count;                     /* entries in use */
+    uint32_t max_count;                 /* entries allocated */
+};
+
+struct smb2_compress_job;
+struct smb3_crypt_batch;
+
 struct smb_rw_arg {
     /* Common */
     TAILQ_ENTRY(smb_rw_arg) sra_svcq;
@@ -70,6 +103,7 @@ struct smb_rw_arg {
             struct smb2_rw_rq *read_writep;
             struct smb_rq *rqp;
             user_ssize_t resid;
+            struct smb_rw_completion *completion; /* NULL unless pipelined */
         } rw;
         
         /* Lease Break Ack */
@@ -86,6 +120,16 @@ struct smb_rw_arg {
         struct {
             struct buf *bp;
         } strategy;
+
+        /* Compress chunks */
+        struct {
+            struct smb2_compress_job *job;
+        } compress;
+
+        /* Seal/unseal messages */
+        struct {
+            struct smb3_crypt_batch *batch;
+        } crypt;
     };
 };
 
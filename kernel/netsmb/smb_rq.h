@@ -57,6 +57,7 @@
 
 #define SMBR_COMPRESSED     0x40000  /* Request or Reply is compressed IO */
 #define SMBR_DONT_COMPRESS  0x80000  /* Write request is not allowed to be compressed */
+#define SMBR_CALLBACK       0x100000 /* Not async, but also call sr_callback when the reply is processed */
 
 /* smb_t2rq t2_flags and smb_ntrq nt_flags */
 #define SMBT2_ALLSENT		0x0001	/* all data and params are sent */
@@ -155,11 +156,16 @@ struct smb_rq {
 	int				sr_timo;
 	struct timespec sr_credit_timesent;	/* Used for crediting */
 	struct timespec sr_timesent;	/* Time request sent, can be reset by Async response */
+	struct timespec sr_timereplied;	/* Time final reply was matched */
+	uint32_t		sr_compress_in_len;	/* Write bytes given to compression */
+	uint32_t		sr_compress_out_len;	/* Bytes sent after compression */
+	uint64_t		sr_compress_usecs;	/* Time spent compressing */
 	uint64_t        sr_threadId;
 	int				sr_lerror;
 	lck_mtx_t		sr_slock;		/* short term locks */
 	struct smb_t2rq *sr_t2;
 	TAILQ_ENTRY(smb_rq)	sr_link;
+	LIST_ENTRY(smb_rq)	sr_hash_link;	/* iod_rqhash, by sr_messageid */
 	void *sr_callback_args;
 	void (*sr_callback)(void *);
 };
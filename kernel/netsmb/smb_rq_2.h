@@ -39,6 +39,8 @@ typedef enum _SMB2_CMD_FLAGS
 #define SMB2_NO_COMPRESS_WRITE      0x0010  /* Compressed writes not allowed */
 #define SMB2_FAILED_COMPRESS_WRITE  0x0020  /* Failed to compress this write */
 #define SMB2_HDR_PREPARSED          0x0040  /* SMB2 header has been parsed already */
+#define SMB2_REQ_SEAL_PENDING       0x0080  /* smb_iod_sendall() must compress/encrypt it */
+#define SMB2_REQ_SEALING            0x0100  /* smb_iod_seal_pending() is sealing it */
 #define SMB2_REQ_NO_BLOCK	    0x80000000	/* dont block waiting for credits */
 
 
@@ -322,6 +324,8 @@ struct smb2_rw_rq {
     uio_t auio;
     user_ssize_t io_len;
     enum smb_mc_control mc_flags;
+    uint64_t delivered;     /* iod bytes read/written when this was filled in */
+    struct smb_compress_stats *compress_statsp; /* write compression results, can be NULL */
     
     /* return values */
 	uint32_t ret_ntstatus;
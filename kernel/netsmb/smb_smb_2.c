@@ -72,9 +72,9 @@ SYSCTL_INT(_net_smb_fs, OID_AUTO, maxread, CTLFLAG_RW, &smb_maxread, 0, "");
  *
  */
 
-void smb2_smb_adjust_quantum_sizes(struct smb_share *share, int32_t doingRead,
-                                   uint32_t inQuantumSize, uint32_t inQuantumNbr,
-                                   struct timeval totalTime, uint64_t totalDataLen);
+void smb2_smb_adjust_quantum_sizes(struct smb_session *sessionp, struct smb_rq *rqp,
+                                   struct smb2_rw_rq *read_writep,
+                                   int32_t doingRead, user_ssize_t len);
 
 static int
 smb2_smb_parse_create_contexts(struct smb_share *share, struct mdchain *mdp,
@@ -109,9 +109,13 @@ smb2_smb_read_write_fill(struct smb_share *share,
                          struct smb2_rw_rq *master_read_writep,
                          struct smb2_rw_rq *read_writep, struct smb_rq **rqp,
                          uint32_t do_read, uint32_t quantum_size,
+                         struct smbiod *iod,
                          uint32_t *allow_compressionp,
                          vfs_context_t context);
 
+static void
+smb2_smb_rw_stripe_free(struct smb_rw_stripe_set *stripe_setp);
+
 static uint32_t
 smb2_session_maxtransact(struct smb_session *sessionp);
 
@@ -1042,385 +1046,281 @@ smb2_smb_add_negotiate_contexts(struct smb_session *sessionp,
     return (error);
 }
 
-void smb2_smb_adjust_quantum_sizes(struct smb_share *share, int32_t doingRead,
-                                   uint32_t inQuantumSize, uint32_t inQuantumNbr,
-                                   struct timeval totalTime, uint64_t totalDataLen)
+/*
+ * Pick the request size and number of outstanding requests for one direction
+ * of an iod from its current bandwidth and round trip time estimates.
+ *
+ * Must be called with iod_rwctl_lock held.
+ */
+static void
+smb2_smb_rw_ctl_update(struct smb_session *sessionp, struct smbiod *iod,
+                       struct smb_rw_ctl *ctl, int32_t doingRead)
 {
-    struct smb_session *sessionp = NULL;
-    uint64_t totalElapsedTimeMicroSecs = 0; /* time to send totalDataLen amount of data */
-    uint64_t bytesPerSec = 0;               /* curr bytes per second */
-    uint32_t currQuantumSize = 0;
-    uint32_t newQuantumNumber = 0, newQuantumSize = 0;
-    uint32_t changedQuantumSize = 0;
-    uint32_t estimated_credits = 0;
-    int32_t check_credits = 0;
-    int32_t throttle = 0;
-    uint64_t *bytes_secp = NULL;
     uint32_t *quantum_sizep = NULL;
-    uint32_t *quantum_countp = NULL, which_checked = 0;
-    uint32_t *total_timep = NULL;
-    uint64_t *total_bytesp = NULL;
+    uint32_t *quantum_countp = NULL;
+    uint32_t min_size, max_size, min_nbr;
+    uint32_t new_size, new_nbr;
+    uint32_t credits_per_rq, credits_avail;
+    uint64_t bdp, inflight;
 
-    if (share == NULL) {
-        SMBERROR("share is null? \n");
-        return;
+    if (doingRead) {
+        quantum_sizep = sessionp->iod_readSizes;
+        quantum_countp = sessionp->iod_readCounts;
     }
-    
-    sessionp = SS_TO_SESSION(share);
-    if (sessionp == NULL) {
-        SMBERROR("sessionp is null? \n");
-        return;
+    else {
+        quantum_sizep = sessionp->iod_writeSizes;
+        quantum_countp = sessionp->iod_writeCounts;
     }
 
-    struct smbiod *iod = NULL;
-    if (smb_iod_get_main_iod(sessionp, &iod, __FUNCTION__)) { // TBD: Do we need a for loop on all iods?
-        SMBERROR("Invalid iod\n");
-        return;
+    /* These can be changed by mount args, so dont trust their order */
+    min_size = MIN(quantum_sizep[0], quantum_sizep[2]);
+    max_size = MAX(quantum_sizep[0], quantum_sizep[2]);
+    min_nbr = MIN(quantum_countp[0], MIN(quantum_countp[1], quantum_countp[2]));
+    if (min_nbr == 0) {
+        min_nbr = 1;
     }
 
-    /* Paranoid checks */
-    if ((totalTime.tv_sec == 0) && (totalTime.tv_usec == 0)) {
-        SMBERROR("totalTime is 0? \n");
-        smb_iod_rel(iod, NULL, __FUNCTION__);
-        return;
+    /*
+     * Bandwidth delay product of this channel. Keep about twice that in
+     * flight so that if the channel can go faster, the delivery rate samples
+     * will show it.
+     */
+    bdp = (ctl->rwc_bytes_per_sec * ctl->rwc_min_rtt_usecs) / 1000000;
+    inflight = bdp * 2;
+
+    /*
+     * Use the largest size we can while still having min_nbr requests in
+     * flight, in whole credits (64K each).
+     */
+    new_size = (uint32_t) MIN(inflight / min_nbr, max_size);
+    new_size = MAX(new_size, min_size);
+    new_size = roundup(new_size, 64 * 1024);
+    if (new_size > max_size) {
+        new_size = max_size;
     }
-    
-    if (totalDataLen == 0) {
-        SMBERROR("totalDataLen is 0? \n");
-        smb_iod_rel(iod, NULL, __FUNCTION__);
-        return;
+    if (new_size == 0) {
+        /* Paranoid check */
+        new_size = 64 * 1024;
     }
 
-    /* calculate bytes per second */
-    totalElapsedTimeMicroSecs = totalTime.tv_sec * 1000000;
-    totalElapsedTimeMicroSecs += totalTime.tv_usec;
-    
-    if (totalElapsedTimeMicroSecs == 0) {
-        /* Paranoid check */
-        SMBERROR("totalElapsedTimeMicroSecs is 0? \n");
-        smb_iod_rel(iod, NULL, __FUNCTION__);
-        return;
+    new_nbr = (uint32_t) MIN(howmany(inflight, new_size), kQuantumNumberLimit);
+    new_nbr = MAX(new_nbr, min_nbr);
+
+    /*
+     * Stay within the credit window the server has granted on this iod,
+     * leaving some credits for everything else.
+     */
+    credits_per_rq = howmany(new_size, 64 * 1024);
+    if (iod->iod_credits_max > kCREDIT_QUANTUM_RESERVE) {
+        credits_avail = iod->iod_credits_max - kCREDIT_QUANTUM_RESERVE;
+    }
+    else {
+        credits_avail = credits_per_rq;
     }
 
-    bytesPerSec = (totalDataLen * 1000000) / totalElapsedTimeMicroSecs;
+    if ((new_nbr * credits_per_rq) > credits_avail) {
+        new_nbr = MAX(credits_avail / credits_per_rq, 1);
+    }
 
-    SMB_LOG_KTRACE(SMB_DBG_ADJUST_QUANTUM_SIZES | DBG_FUNC_START, doingRead, bytesPerSec, inQuantumNbr, inQuantumSize, 0);
+    if ((new_size != ctl->rwc_quantum_size) ||
+        (new_nbr != ctl->rwc_quantum_nbr)) {
+        SMB_LOG_IO("id %d new %s quantum count %d size %d (rate %llu rtt %llu credits %u)\n",
+                   iod->iod_id, doingRead ? "read" : "write", new_nbr, new_size,
+                   ctl->rwc_bytes_per_sec, ctl->rwc_min_rtt_usecs,
+                   iod->iod_credits_max);
 
-    if (bytesPerSec == 0) {
-        /* Paranoid check */
-        SMBERROR("bytesPerSec is 0? \n");
-        goto exit;
+        SMB_LOG_KTRACE(SMB_DBG_ADJUST_QUANTUM_SIZES | DBG_FUNC_NONE,
+                       doingRead ? 0xabc001 : 0xabc002,
+                       new_nbr, new_size, iod->iod_id, 0);
+
+        ctl->rwc_quantum_size = new_size;
+        ctl->rwc_quantum_nbr = new_nbr;
     }
+}
 
-    lck_mtx_lock(&sessionp->iod_quantum_lock);
+/*
+ * Called as each read/write reply is processed. Updates the round trip time
+ * and delivery rate estimates of the iod that the request went out on and
+ * then resizes its requests.
+ */
+void smb2_smb_adjust_quantum_sizes(struct smb_session *sessionp, struct smb_rq *rqp,
+                                   struct smb2_rw_rq *read_writep,
+                                   int32_t doingRead, user_ssize_t len)
+{
+    struct smbiod *iod = NULL;
+    struct smb_rw_ctl *ctl = NULL;
+    struct timespec rtt = {0}, now = {0}, elapsed = {0};
+    uint64_t rtt_usecs = 0;
+    uint64_t delivered = 0;
+    uint64_t bytesPerSec = 0;
 
-    if (doingRead) {
-        bytes_secp = sessionp->iod_readBytePerSec;
-        quantum_sizep = sessionp->iod_readSizes;
-        quantum_countp = sessionp->iod_readCounts;
-        currQuantumSize = sessionp->iod_readQuantumSize;
-        
-        total_timep = sessionp->iod_readTotalTime;
-        total_bytesp = sessionp->iod_readTotalBytes;
+    if ((sessionp == NULL) || (rqp == NULL) || (read_writep == NULL)) {
+        SMBERROR("Null pointer passed in! \n");
+        return;
     }
-    else {
-        bytes_secp = sessionp->iod_writeBytePerSec;
-        quantum_sizep = sessionp->iod_writeSizes;
-        quantum_countp = sessionp->iod_writeCounts;
-        currQuantumSize = sessionp->iod_writeQuantumSize;
 
-        total_timep = sessionp->iod_writeTotalTime;
-        total_bytesp = sessionp->iod_writeTotalBytes;
+    iod = rqp->sr_iod;
+    if ((iod == NULL) || (len <= 0)) {
+        return;
     }
 
-    if (inQuantumSize == quantum_sizep[2]) {
-        /* Keep track of cumulative time and bytes */
-        total_timep[2] += totalElapsedTimeMicroSecs;
-        total_bytesp[2] += totalDataLen;
-        bytesPerSec = (total_bytesp[2] * 1000000) / total_timep[2];
-        
-        if (total_timep[2] >= sessionp->rw_max_check_time) {
-            /* Save cumulative bytes/sec */
-            bytes_secp[2] = bytesPerSec;
-        }
-        
-        which_checked = 3;
-        SMB_LOG_IO("Max size: total bytes %llu, total microSecs %u, currBytes/Sec %llu \n",
-                   total_bytesp[2], total_timep[2], bytesPerSec);
+    /* Only trust replies that we timed */
+    if ((rqp->sr_timereplied.tv_sec == 0) && (rqp->sr_timereplied.tv_nsec == 0)) {
+        return;
     }
-    else {
-        if (inQuantumSize == quantum_sizep[1]) {
-            total_timep[1] += totalElapsedTimeMicroSecs;
-            total_bytesp[1] += totalDataLen;
-            bytesPerSec = (total_bytesp[1] * 1000000) / total_timep[1];
 
-            if (total_timep[1] >= sessionp->rw_max_check_time) {
-                /* Save cumulative bytes/sec */
-                bytes_secp[1] = bytesPerSec;
-            }
+    rtt = rqp->sr_timereplied;
+    timespecsub(&rtt, &rqp->sr_timesent);
+    if (rtt.tv_sec < 0) {
+        return;
+    }
+    rtt_usecs = (rtt.tv_sec * 1000000) + (rtt.tv_nsec / 1000);
+    if (rtt_usecs == 0) {
+        rtt_usecs = 1;
+    }
 
-            which_checked = 2;
-            SMB_LOG_IO("Med size: total bytes %llu, total microSecs %u, currBytes/Sec %llu \n",
-                       total_bytesp[1], total_timep[1], bytesPerSec);
-        }
-        else {
-            if (inQuantumSize == quantum_sizep[0]) {
-                total_timep[0] += totalElapsedTimeMicroSecs;
-                total_bytesp[0] += totalDataLen;
-                bytesPerSec = (total_bytesp[0] * 1000000) / total_timep[0];
-
-                if (total_timep[0] >= sessionp->rw_max_check_time) {
-                    /* Save cumulative bytes/sec */
-                    bytes_secp[0] = bytesPerSec;
-                }
+    ctl = doingRead ? &iod->iod_read_ctl : &iod->iod_write_ctl;
 
-                which_checked = 2;
-                SMB_LOG_IO("Min size: total bytes %llu, total microSecs %u, currBytes/Sec %llu \n",
-                           total_bytesp[0], total_timep[0], bytesPerSec);
-            }
-            else {
-                SMBERROR("No match for quantumSize %u \n", inQuantumSize);
-                lck_mtx_unlock(&sessionp->iod_quantum_lock);
-                goto exit;
-            }
-        }
-    }
+    SMB_LOG_KTRACE(SMB_DBG_ADJUST_QUANTUM_SIZES | DBG_FUNC_START,
+                   doingRead, iod->iod_id, rtt_usecs, len, 0);
+
+    lck_mtx_lock(&iod->iod_rwctl_lock);
 
     /*
-     * If we have all three bytes/sec, then check to see which size
-     * (min, med, max) had the fastest cumulative bytes/sec and use that size
+     * Delivery rate is everything this iod read or wrote while this request
+     * was outstanding, so overlapping requests from all files are counted.
      */
-    if ((bytes_secp[0] != 0) &&
-        (bytes_secp[1] != 0) &&
-        (bytes_secp[2] != 0)) {
-        if ((bytes_secp[2] > bytes_secp[0]) &&
-            (bytes_secp[2] > bytes_secp[1])) {
-            /* Largest is the fastest */
-            newQuantumSize = quantum_sizep[2];
-            newQuantumNumber = quantum_countp[2];
-        }
-        else {
-            if ((bytes_secp[0] > bytes_secp[2]) &&
-                (bytes_secp[0] > bytes_secp[1])) {
-                /* Smallest is the fastest */
-                newQuantumSize = quantum_sizep[0];
-                newQuantumNumber = quantum_countp[0];
-            }
-            else {
-                /* Assume medium is the fastest */
-                newQuantumSize = quantum_sizep[1];
-                newQuantumNumber = quantum_countp[1];
-            }
-        }
+    ctl->rwc_delivered += len;
+    delivered = ctl->rwc_delivered - read_writep->delivered;
+    bytesPerSec = (delivered * 1000000) / rtt_usecs;
 
-        /* Are we changing quantum size? */
-        if (newQuantumSize != currQuantumSize) {
-            changedQuantumSize = 1;
-            if (newQuantumSize > currQuantumSize) {
-                /* If we are increasing, then need to check credits */
-                check_credits = 1;
-            }
-        }
-    }
+    nanouptime(&now);
 
-    lck_mtx_unlock(&sessionp->iod_quantum_lock);
+    /* Max filter on delivery rate, restarted every rw_max_check_time */
+    elapsed = now;
+    timespecsub(&elapsed, &ctl->rwc_bw_window);
+    if ((bytesPerSec > ctl->rwc_bytes_per_sec) ||
+        (((uint64_t) elapsed.tv_sec * 1000000) + (elapsed.tv_nsec / 1000) > sessionp->rw_max_check_time)) {
+        ctl->rwc_bytes_per_sec = bytesPerSec;
+        ctl->rwc_bw_window = now;
+    }
 
     /*
-     * If possibly increasing number of credits that we need, then check to
-     * make sure we do not exceed our credit limits
+     * Min filter on round trip time, restarted every kQuantumRecheckTimeOut
+     * so that we notice if the path got slower.
      */
-    if (check_credits == 1) {
-        estimated_credits = (newQuantumSize * newQuantumNumber) / (64 * 1024);
-        
-        if (estimated_credits > iod->iod_credits_max) {
-            /* Should never happen */
-            SMBERROR("est credits %d > max credits %d??? \n",
-                      estimated_credits, iod->iod_credits_max);
-
-            throttle = 1;
-        }
-        else {
-            if ((iod->iod_credits_max - estimated_credits) < kCREDIT_QUANTUM_RESERVE) {
-                SMBERROR("remaining credits %d < low Quantum credits %d \n",
-                           (iod->iod_credits_max - estimated_credits),
-                           kCREDIT_QUANTUM_RESERVE);
-                throttle = 1;
-            }
-        }
-        
-        if (throttle) {
-            /*
-             * Increasing the quantum size does not increase the credit
-             * load by that much. We must be at max number of credits
-             * granted so dont increase quantum size.
-             */
-            SMBERROR("Skip quantum size increase due to throttle \n");
-            goto exit;
-        }
+    elapsed = now;
+    timespecsub(&elapsed, &ctl->rwc_rtt_window);
+    if ((ctl->rwc_min_rtt_usecs == 0) ||
+        (rtt_usecs < ctl->rwc_min_rtt_usecs) ||
+        (elapsed.tv_sec > kQuantumRecheckTimeOut)) {
+        ctl->rwc_min_rtt_usecs = rtt_usecs;
+        ctl->rwc_rtt_window = now;
     }
 
-    if (changedQuantumSize == 1) {
-        lck_mtx_lock(&sessionp->iod_quantum_lock);
-
-        if (doingRead == 1) {
-            SMB_LOG_IO("AdjustQuantumSizes: new read quantum count %d size %d\n",
-                       newQuantumNumber, newQuantumSize);
-            
-            SMB_LOG_KTRACE(SMB_DBG_ADJUST_QUANTUM_SIZES | DBG_FUNC_NONE, 0xabc001, newQuantumNumber, newQuantumSize, 0, 0);
-            
-            sessionp->iod_readQuantumSize = newQuantumSize;
-            sessionp->iod_readQuantumNumber = newQuantumNumber;
-        }
-        else {
-            SMB_LOG_IO("AdjustQuantumSizes: new write quantum count %d size %d\n",
-                       newQuantumNumber, newQuantumSize);
-            
-            SMB_LOG_KTRACE(SMB_DBG_ADJUST_QUANTUM_SIZES | DBG_FUNC_NONE, 0xabc002, newQuantumNumber, newQuantumSize, 0, 0);
+    if (ctl->rwc_srtt_usecs == 0) {
+        ctl->rwc_srtt_usecs = rtt_usecs;
+    }
+    else {
+        ctl->rwc_srtt_usecs = ((ctl->rwc_srtt_usecs * 7) + rtt_usecs) / 8;
+    }
+    ctl->rwc_samples += 1;
 
-            sessionp->iod_writeQuantumSize = newQuantumSize;
-            sessionp->iod_writeQuantumNumber = newQuantumNumber;
-        }
+    smb2_smb_rw_ctl_update(sessionp, iod, ctl, doingRead);
 
-        lck_mtx_unlock(&sessionp->iod_quantum_lock);
-    }
-exit:
-    SMB_LOG_KTRACE(SMB_DBG_ADJUST_QUANTUM_SIZES | DBG_FUNC_END, 0, which_checked, 0, 0, 0);
+    SMB_LOG_KTRACE(SMB_DBG_ADJUST_QUANTUM_SIZES | DBG_FUNC_END,
+                   ctl->rwc_min_rtt_usecs, ctl->rwc_bytes_per_sec,
+                   ctl->rwc_quantum_nbr, ctl->rwc_quantum_size, 0);
 
-    smb_iod_rel(iod, NULL, __FUNCTION__);
-    return;
+    lck_mtx_unlock(&iod->iod_rwctl_lock);
 }
 
+/*
+ * Requests are spread round robin over the active channels, so use the
+ * smallest size any of them wants and enough requests to fill all of them.
+ */
 static void smb2_smb_get_quantum_sizes(struct smb_session *sessionp, user_ssize_t len, int32_t doingRead,
-                                       uint32_t *retQuantumSize, uint32_t *retQuantumNbr,
-                                       int *recheck)
+                                       uint32_t *retQuantumSize, uint32_t *retQuantumNbr)
 {
-    struct timeval current_time = {0}, elapsed_time = {0};
-    uint32_t *quantum_sizep = NULL;
-    uint32_t *quantum_countp = NULL;
-    uint32_t *total_timep = NULL;
+    struct smbiod *iod = NULL;
+    struct smb_rw_ctl *ctl = NULL;
+    uint32_t size = 0;
+    uint64_t inflight = 0, nbr = 0;
+    uint32_t iod_size, iod_nbr;
 
     /* Paranoid checks */
     if ((sessionp == NULL) ||
         (retQuantumSize == NULL) ||
-        (retQuantumNbr == NULL) ||
-        (recheck == NULL)) {
+        (retQuantumNbr == NULL)) {
         SMBERROR("Null pointer passed in! \n");
         return;
     }
 
     lck_mtx_lock(&sessionp->iod_quantum_lock);
 
+    /* Starting values until the channels have been sampled */
+    if (doingRead) {
+        *retQuantumSize = sessionp->iod_readSizes[1];
+        *retQuantumNbr = sessionp->iod_readCounts[1];
+    }
+    else {
+        *retQuantumSize = sessionp->iod_writeSizes[1];
+        *retQuantumNbr = sessionp->iod_writeCounts[1];
+    }
+
     /*
-     * For dev testing to force using the medium quantum size and number.
-     * Default is to be off and use the byte/sec method.
+     * For dev testing to force using the initial quantum size and number.
+     * Default is to be off and use the per channel controllers.
      */
     if ((sessionp->rw_gb_threshold != 0) &&
         ((sessionp->active_channel_speed / 1000000000) > sessionp->rw_gb_threshold)) {
-        /* Force using the med quantum size */
-        if (doingRead) {
-            *retQuantumSize = sessionp->iod_readSizes[1];
-            *retQuantumNbr = sessionp->iod_readCounts[1];
-        }
-        else {
-            *retQuantumSize = sessionp->iod_writeSizes[1];
-            *retQuantumNbr = sessionp->iod_writeCounts[1];
-        }
-
         SMB_LOG_IO("Force using quantum count %d size %d\n",
                    *retQuantumNbr, *retQuantumSize);
-
         goto exit;
     }
 
-    /*
-     * Is it time to recheck quantum sizes and do we have a large enoungh
-     * IO request to be able to recheck?
-     */
-    microtime(&current_time);
-    timersub (&current_time, &sessionp->iod_last_recheck_time, &elapsed_time);
-    if (elapsed_time.tv_sec > kQuantumRecheckTimeOut) {
-        /*
-         * I did have code that would determine what the current size we
-         * were using and only recheck the other two, and the in use size was
-         * constantly updating its bytes/sec. I prefer being able to see all
-         * three speeds rechecked and their results.  Simplier code too.
-         */
-        bzero(sessionp->iod_readBytePerSec, sizeof(sessionp->iod_readBytePerSec));
-        bzero(sessionp->iod_readTotalTime, sizeof(sessionp->iod_readTotalTime));
-        bzero(sessionp->iod_readTotalBytes, sizeof(sessionp->iod_readTotalBytes));
+    lck_mtx_lock(&sessionp->iod_tailq_lock);
 
-        bzero(sessionp->iod_writeBytePerSec, sizeof(sessionp->iod_writeBytePerSec));
-        bzero(sessionp->iod_writeTotalTime, sizeof(sessionp->iod_writeTotalTime));
-        bzero(sessionp->iod_writeTotalBytes, sizeof(sessionp->iod_writeTotalBytes));
-    }
+    TAILQ_FOREACH(iod, &sessionp->iod_tailq_head, tailq) {
+        if ((iod->iod_state != SMBIOD_ST_SESSION_ACTIVE) ||
+            ((iod->iod_flags & (SMBIOD_RECONNECT | SMBIOD_START_RECONNECT | SMBIOD_SHUTDOWN | SMBIOD_RUNNING | SMBIOD_INACTIVE_CHANNEL)) != SMBIOD_RUNNING)) {
+            continue;
+        }
 
-    if (doingRead) {
-        quantum_sizep = sessionp->iod_readSizes;
-        quantum_countp = sessionp->iod_readCounts;
-        total_timep = sessionp->iod_readTotalTime;
+        ctl = doingRead ? &iod->iod_read_ctl : &iod->iod_write_ctl;
 
-        /* assume we stay with current settings */
-        *retQuantumSize = sessionp->iod_readQuantumSize;
-        *retQuantumNbr = sessionp->iod_readQuantumNumber;
-        
-        /* Ensure all comparisons are done with same length of IO */
-        if (len < smb_maxsegreadsize) {
-            goto exit;
-        }
-    }
-    else {
-        quantum_sizep = sessionp->iod_writeSizes;
-        quantum_countp = sessionp->iod_writeCounts;
-        total_timep = sessionp->iod_writeTotalTime;
+        lck_mtx_lock(&iod->iod_rwctl_lock);
+        iod_size = ctl->rwc_quantum_size;
+        iod_nbr = ctl->rwc_quantum_nbr;
+        lck_mtx_unlock(&iod->iod_rwctl_lock);
 
-        /* assume we stay with current settings */
-        *retQuantumSize = sessionp->iod_writeQuantumSize;
-        *retQuantumNbr = sessionp->iod_writeQuantumNumber;
-        
-        /* Ensure all comparisons are done with same length of IO */
-        if (len < smb_maxsegwritesize) {
-            goto exit;
+        if (iod_size == 0) {
+            /* Not sampled yet */
+            iod_size = *retQuantumSize;
+            iod_nbr = *retQuantumNbr;
         }
-    }
-
-    /*
-     * Do multiple sequential checks of max, med, then min
-     */
-    if ((*recheck == 0) && (total_timep[2] < sessionp->rw_max_check_time)) {
-        /*
-         * Check max quantum size first. Since first reads tend to be
-         * slow starting probably due to setup of read ahead, best to
-         * start with largest IO. This attempts to minimizes the impact
-         * of the slow read start to the bytes/sec calculations.
-         */
-        *retQuantumSize = quantum_sizep[2];
-        *retQuantumNbr = quantum_countp[2];
-        *recheck = 1;
-    }
 
-    if ((*recheck == 0) && (total_timep[1] < sessionp->rw_max_check_time)) {
-        /* Check med quantum size */
-        *retQuantumSize = quantum_sizep[1];
-        *retQuantumNbr = quantum_countp[1];
-        *recheck = 1;
+        if ((size == 0) || (iod_size < size)) {
+            size = iod_size;
+        }
+        inflight += (uint64_t) iod_size * iod_nbr;
     }
 
-    if ((*recheck == 0) && (total_timep[0] < sessionp->rw_max_check_time)) {
-        /* Check min quantum size */
-        *retQuantumSize = quantum_sizep[0];
-        *retQuantumNbr = quantum_countp[0];
-        *recheck = 1;
-    }
+    lck_mtx_unlock(&sessionp->iod_tailq_lock);
 
-    if (*recheck == 1) {
-        /* save time that we last checked speeds */
-        microtime(&sessionp->iod_last_recheck_time);
+    if (size != 0) {
+        nbr = howmany(inflight, size);
+        *retQuantumSize = size;
+        *retQuantumNbr = (uint32_t) MIN(MAX(nbr, 1), kQuantumNumberLimit);
     }
 
 exit:
-    /* Try to have at least one quantum per channel */
-    if (sessionp->active_channel_count > kQuantumMedNumber) {
-        *retQuantumNbr += sessionp->active_channel_count - kQuantumMedNumber;
+    /* No point in more requests than it takes to do this IO */
+    if ((len > 0) && (*retQuantumSize != 0)) {
+        nbr = howmany(len, *retQuantumSize);
+        if (nbr < *retQuantumNbr) {
+            *retQuantumNbr = (uint32_t) MAX(nbr, 1);
+        }
     }
 
     lck_mtx_unlock(&sessionp->iod_quantum_lock);
@@ -2725,6 +2625,7 @@ resend:
         case FSCTL_SRV_ENUMERATE_SNAPSHOTS:
         case FSCTL_SRV_REQUEST_RESUME_KEY:
         case FSCTL_QUERY_NETWORK_INTERFACE_INFO:
+        case FSCTL_SET_SPARSE:
             mb_put_uint32le(mbp, 0);                    /* Input offset */
             mb_put_uint32le(mbp, 0);                    /* Input count */
             mb_put_uint32le(mbp, 0);                    /* Max input resp */
@@ -2869,7 +2770,30 @@ resend:
                 rqp->sr_flags |= SMBR_NO_TIMEOUT;
             }
             break;
-            
+
+        case FSCTL_SET_ZERO_DATA:
+        case FSCTL_QUERY_ALLOCATED_RANGES:
+            mb_put_uint32le(mbp, 120);                  /* Input offset */
+            mb_put_uint32le(mbp, ioctlp->snd_input_len); /* Input count */
+            mb_put_uint32le(mbp, 0);                    /* Max input resp */
+            mb_put_uint32le(mbp, 0);                    /* Output offset */
+            mb_put_uint32le(mbp, 0);                    /* Output count */
+            mb_put_uint32le(mbp, ioctlp->rcv_output_len); /* Max output resp */
+            mb_put_uint32le(mbp, SMB2_IOCTL_IS_FSCTL);  /* Flags */
+            mb_put_uint32le(mbp, 0);                    /* Reserved2 */
+
+            /* Fill in FILE_ZERO_DATA_INFORMATION or FILE_ALLOCATED_RANGE_BUFFER */
+            if ((ioctlp->snd_input_buffer == NULL) ||
+                (ioctlp->snd_input_len == 0)) {
+                SMBERROR("ioctlp->snd_input_buffer is null \n");
+                error = EBADRPC;
+                goto bad;
+            }
+
+            mb_put_mem(mbp, (char *) ioctlp->snd_input_buffer,
+                       ioctlp->snd_input_len, MB_MSYSTEM);
+            break;
+
         case FSCTL_VALIDATE_NEGOTIATE_INFO:
             /* This request must be signed */
             rqp->sr_flags |= SMBR_SIGNED;
@@ -6342,9 +6266,36 @@ smb2_smb_parse_ioctl(struct mdchain *mdp,
             break;
             
         case FSCTL_SET_REPARSE_POINT:
+        case FSCTL_SET_ZERO_DATA:
+        case FSCTL_SET_SPARSE:
             /* Nothing to parse in this reply */
             break;
 
+        case FSCTL_QUERY_ALLOCATED_RANGES:
+            /* A file that is all holes returns no ranges at all */
+            if (ioctlp->ret_output_len == 0) {
+                break;
+            }
+
+            /*
+             * Data offset is from the beginning of SMB 2/3 Header
+             * Calculate how much further we have to go to get to it.
+             */
+            if (ret_output_offset > 0) {
+                ret_output_offset -= SMB2_HDRLEN;
+                /* already parsed 48 bytes worth of the response */
+                ret_output_offset -= 48;
+
+                error = md_get_mem(mdp, NULL, ret_output_offset, MB_MSYSTEM);
+                if (error) {
+                    goto bad;
+                }
+            }
+
+            /* Now fetch the FILE_ALLOCATED_RANGE_BUFFER array */
+            error = smb2_smb_parse_ioctl_get_data(mdp, ioctlp);
+            break;
+
         case FSCTL_SRV_REQUEST_RESUME_KEY:
             /* validate some return values */
             if (ioctlp->ret_input_len != 0) {
@@ -7744,7 +7695,7 @@ smb2_smb_parse_query_dir_both_dir_info(struct smb_share *share, struct mdchain *
     }
     
     if (ctx != NULL) {
-        current_query = SLIST_FIRST(&ctx->f_queries);
+        current_query = STAILQ_FIRST(&ctx->f_queries);
         /* save where we last left off searching */
         ctx->f_resume_file_index = file_index;
         
@@ -8430,6 +8381,58 @@ bad:
     return error;
 }
 
+/*
+ * Build and send a Query Dir without waiting for its reply, so it can be in
+ * flight while the entries of the previous reply are handed out. The server
+ * does not have to complete Query Dirs on the same handle in order, so only
+ * send one at a time per handle. The reply is collected with
+ * smb2_smb_query_dir_reply() and queryp->ret_rqp must be freed by the caller
+ * even on error.
+ */
+int
+smb2_smb_query_dir_send(struct smb_share *share, struct smb2_query_dir_rq *queryp,
+                        struct smbiod *iod, vfs_context_t context)
+{
+    struct smb_rq *rqp = NULL;
+    int error;
+
+    error = smb2_smb_query_dir(share, queryp, &rqp, iod, context);
+    if (error) {
+        return error;
+    }
+
+    /* In this situation, its not a compound request */
+    rqp->sr_flags &= ~SMBR_COMPOUND_RQ;
+    rqp->sr_timo = rqp->sr_session->session_timo;
+    rqp->sr_state = SMBRQ_NOTSENT;
+
+    return (smb_iod_rq_enqueue(rqp));
+}
+
+/*
+ * Wait for the reply of a Query Dir sent by smb2_smb_query_dir_send() and
+ * parse it. On success, mdp of queryp->ret_rqp is left pointing at the
+ * output buffer.
+ */
+int
+smb2_smb_query_dir_reply(struct smb2_query_dir_rq *queryp)
+{
+    struct smb_rq *rqp = queryp->ret_rqp;
+    struct mdchain *mdp;
+    int error;
+
+    error = smb_rq_reply(rqp);
+    queryp->ret_ntstatus = rqp->sr_ntstatus;
+    if (error) {
+        return error;
+    }
+
+    /* Now get pointer to response data */
+    smb_rq_getreply(rqp, &mdp);
+
+    return (smb2_smb_parse_query_dir(mdp, queryp));
+}
+
 /*
  * The calling routine must hold a reference on the share
  */
@@ -8915,6 +8918,329 @@ smb2_smb_read_uio(struct smb_share *share, SMBFID fid, uio_t uio,
 	return error;
 }
 
+/*
+ * Completion callback for pipelined read/writes. Called by the iod read
+ * thread from smb_iod_rqprocessed() with SMBRQ_SLOCK held.
+ */
+static void
+smb2_smb_rw_callback(void *arg)
+{
+    struct smb_rw_arg *rw_pb = (struct smb_rw_arg *) arg;
+    struct smb_rw_completion *completionp = rw_pb->rw.completion;
+
+    lck_mtx_lock(&completionp->lock);
+    rw_pb->flags |= SMB_RW_REPLY_RCVD;
+    wakeup(completionp);
+    lck_mtx_unlock(&completionp->lock);
+}
+
+/*
+ * Sign/seal and queue a pipelined read/write from the calling thread.
+ * smb2_smb_rw_callback() marks it done when the reply arrives.
+ */
+static int
+smb2_smb_rw_enqueue_callback(struct smb_rw_arg *rw_pb)
+{
+    struct smb_rw_completion *completionp = rw_pb->rw.completion;
+    struct smb_rq *rqp = rw_pb->rw.rqp;
+    int error = 0;
+
+    lck_mtx_lock(&completionp->lock);
+    rw_pb->flags &= ~SMB_RW_REPLY_RCVD;
+    rw_pb->flags |= SMB_RW_IN_USE;
+    completionp->in_flight++;
+    lck_mtx_unlock(&completionp->lock);
+
+    rqp->sr_callback = smb2_smb_rw_callback;
+    rqp->sr_callback_args = rw_pb;
+    rqp->sr_flags |= SMBR_CALLBACK;
+
+    error = smb_iod_rq_enqueue(rqp);
+    if (error) {
+        lck_mtx_lock(&completionp->lock);
+        rw_pb->flags &= ~SMB_RW_IN_USE;
+        completionp->in_flight--;
+        lck_mtx_unlock(&completionp->lock);
+    }
+
+    return error;
+}
+
+/*
+ * Wait for any of the pipelined read/writes to get its reply. Replies do not
+ * arrive in order, so this lets the caller refill whichever slot finished
+ * first. Returns the index of that slot or count if nothing is in flight.
+ */
+static uint32_t
+smb2_smb_rw_wait_any(struct smb_rw_completion *completionp,
+                     struct smb_rw_arg *rw_pb, uint32_t count)
+{
+    uint32_t j = count;
+    int error = 0;
+
+    lck_mtx_lock(&completionp->lock);
+
+    while (completionp->in_flight > 0) {
+        for (j = 0; j < count; j++) {
+            if ((rw_pb[j].flags & SMB_RW_IN_USE) &&
+                (rw_pb[j].flags & SMB_RW_REPLY_RCVD)) {
+                break;
+            }
+        }
+
+        if (j < count) {
+            completionp->in_flight--;
+            break;
+        }
+
+        error = msleep(completionp, &completionp->lock, PSOCK,
+                       "smb_rw_completion_wait", NULL);
+        if (error) {
+            SMBERROR("msleep for rw completion error %d\n", error);
+        }
+        j = count;
+    }
+
+    lck_mtx_unlock(&completionp->lock);
+
+    return j;
+}
+
+/*
+ * Channels are only used for striping if they could be picked by
+ * smb_iod_get_any_iod() right now.
+ */
+static int
+smb2_smb_rw_stripe_iod_active(struct smbiod *iod)
+{
+    return ((iod->iod_state == SMBIOD_ST_SESSION_ACTIVE) &&
+            ((iod->iod_flags & (SMBIOD_RECONNECT | SMBIOD_START_RECONNECT | SMBIOD_SHUTDOWN | SMBIOD_RUNNING | SMBIOD_INACTIVE_CHANNEL)) == SMBIOD_RUNNING));
+}
+
+/*
+ * Build the table of channels that one large read/write gets striped over,
+ * holding a reference on each iod until smb2_smb_rw_stripe_free(). With less
+ * than two active channels, stripe_setp->count is 0 and requests just use
+ * any iod.
+ */
+static void
+smb2_smb_rw_stripe_init(struct smb_session *sessionp,
+                        struct smb_rw_stripe_set *stripe_setp)
+{
+    struct smb_rw_stripe *stripes = NULL;
+    struct smbiod *iod = NULL;
+    uint32_t count = 0, max_count = 0;
+
+    bzero(stripe_setp, sizeof(*stripe_setp));
+
+    if (!(sessionp->session_flags & SMBV_MULTICHANNEL_ON)) {
+        return;
+    }
+
+    lck_mtx_lock(&sessionp->iod_tailq_lock);
+    TAILQ_FOREACH(iod, &sessionp->iod_tailq_head, tailq) {
+        if (smb2_smb_rw_stripe_iod_active(iod)) {
+            max_count++;
+        }
+    }
+    lck_mtx_unlock(&sessionp->iod_tailq_lock);
+
+    if (max_count < 2) {
+        return;
+    }
+
+    SMB_MALLOC_TYPE_COUNT(stripes, struct smb_rw_stripe, max_count, Z_WAITOK_ZERO);
+    if (stripes == NULL) {
+        /* Not fatal, we just wont stripe */
+        SMBERROR("failed to allocate stripes");
+        return;
+    }
+
+    lck_mtx_lock(&sessionp->iod_tailq_lock);
+    TAILQ_FOREACH(iod, &sessionp->iod_tailq_head, tailq) {
+        if (count >= max_count) {
+            break;
+        }
+
+        if (!smb2_smb_rw_stripe_iod_active(iod)) {
+            continue;
+        }
+
+        /*
+         * Link speed is used to weight a channel until it has delivery rate
+         * samples of its own.
+         */
+        lck_mtx_lock(&sessionp->session_interface_table.interface_table_lck);
+        if (iod->iod_conn_entry.con_entry != NULL) {
+            stripes[count].link_speed = iod->iod_conn_entry.con_entry->con_speed;
+        }
+        lck_mtx_unlock(&sessionp->session_interface_table.interface_table_lck);
+
+        iod->iod_ref_cnt++;
+        SMB_LOG_MC_REF("id %u function %s flags 0x%x ref_cnt %u\n",
+                       iod->iod_id, __FUNCTION__, iod->iod_flags, iod->iod_ref_cnt);
+
+        stripes[count].iod = iod;
+        count++;
+    }
+    lck_mtx_unlock(&sessionp->iod_tailq_lock);
+
+    stripe_setp->stripes = stripes;
+    stripe_setp->count = count;
+    stripe_setp->max_count = max_count;
+
+    if (count < 2) {
+        smb2_smb_rw_stripe_free(stripe_setp);
+    }
+}
+
+static void
+smb2_smb_rw_stripe_free(struct smb_rw_stripe_set *stripe_setp)
+{
+    uint32_t i;
+
+    if (stripe_setp->stripes == NULL) {
+        return;
+    }
+
+    for (i = 0; i < stripe_setp->count; i++) {
+        smb_iod_rel(stripe_setp->stripes[i].iod, NULL, __FUNCTION__);
+    }
+
+    SMB_FREE_TYPE_COUNT(struct smb_rw_stripe, stripe_setp->max_count,
+                        stripe_setp->stripes);
+    bzero(stripe_setp, sizeof(*stripe_setp));
+}
+
+/*
+ * Pick the channel for the next len bytes of a striped read/write. This is
+ * the channel that would finish them first given what it already has in
+ * flight for this transfer and its current delivery rate, so faster
+ * channels get proportionally more of the transfer. Since it is redone for
+ * every refill, a channel that slows down stops getting new extents and the
+ * tail of the transfer goes to the faster channels. Channels without
+ * enough credits for the request are only used if all of them are short.
+ *
+ * Returns NULL if not striping or no striped channel is usable anymore, in
+ * which case the request goes out on any iod.
+ */
+static struct smbiod *
+smb2_smb_rw_stripe_pick(struct smb_rw_stripe_set *stripe_setp,
+                        uint32_t do_read, user_ssize_t len)
+{
+    struct smb_rw_stripe *stripe = NULL;
+    struct smb_rw_ctl *ctl = NULL;
+    uint64_t weight, finish, best_finish = 0;
+    uint32_t credits_needed = (uint32_t) howmany(len, 64 * 1024);
+    uint32_t i, best = stripe_setp->count;
+    int have_credits, best_have_credits = 0;
+
+    for (i = 0; i < stripe_setp->count; i++) {
+        stripe = &stripe_setp->stripes[i];
+
+        if (!smb2_smb_rw_stripe_iod_active(stripe->iod)) {
+            continue;
+        }
+
+        ctl = do_read ? &stripe->iod->iod_read_ctl : &stripe->iod->iod_write_ctl;
+
+        lck_mtx_lock(&stripe->iod->iod_rwctl_lock);
+        weight = ctl->rwc_bytes_per_sec;
+        lck_mtx_unlock(&stripe->iod->iod_rwctl_lock);
+
+        if (weight == 0) {
+            /* Not sampled yet, go by link speed in bits/sec */
+            weight = stripe->link_speed / 8;
+        }
+        if (weight == 0) {
+            weight = 1;
+        }
+
+        /* Expected time to finish, in usecs */
+        finish = ((stripe->inflight + len) * 1000000) / weight;
+
+        have_credits = (OSAddAtomic(0, &stripe->iod->iod_credits_granted) >= (SInt32) credits_needed);
+
+        if ((best == stripe_setp->count) ||
+            (have_credits > best_have_credits) ||
+            ((have_credits == best_have_credits) && (finish < best_finish))) {
+            best = i;
+            best_finish = finish;
+            best_have_credits = have_credits;
+        }
+    }
+
+    if (best == stripe_setp->count) {
+        return (NULL);
+    }
+
+    stripe = &stripe_setp->stripes[best];
+
+    SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE, 0xabc006,
+                   stripe->iod->iod_id, len, stripe->inflight, 0);
+
+    return (stripe->iod);
+}
+
+/*
+ * Track how much of this transfer is in flight on the channel a request went
+ * out on. Called with sent set once the request is filled in, since credits
+ * can make it smaller than asked for, and with sent clear when its reply has
+ * been processed.
+ */
+static void
+smb2_smb_rw_stripe_update(struct smb_rw_stripe_set *stripe_setp,
+                          struct smb_rq *rqp, user_ssize_t io_len, int sent)
+{
+    struct smb_rw_stripe *stripe = NULL;
+    uint32_t i;
+
+    if (rqp == NULL) {
+        return;
+    }
+
+    for (i = 0; i < stripe_setp->count; i++) {
+        stripe = &stripe_setp->stripes[i];
+
+        if (stripe->iod != rqp->sr_iod) {
+            continue;
+        }
+
+        if (sent) {
+            stripe->inflight += io_len;
+        }
+        else if (stripe->inflight >= (uint64_t) io_len) {
+            stripe->inflight -= io_len;
+        }
+        else {
+            stripe->inflight = 0;
+        }
+        break;
+    }
+}
+
+/*
+ * Add what compression did for this write request to the caller's stats so
+ * smbfs can decide if it is worth compressing writes to this file.
+ */
+static void
+smb2_smb_write_compress_stats(struct smb_compress_stats *statsp,
+                              struct smb_rq *rqp)
+{
+    if ((statsp == NULL) || (rqp == NULL) || (rqp->sr_compress_in_len == 0)) {
+        return;
+    }
+
+    statsp->in_bytes += rqp->sr_compress_in_len;
+    statsp->out_bytes += rqp->sr_compress_out_len;
+    statsp->usecs += rqp->sr_compress_usecs;
+    statsp->writes += 1;
+
+    if (rqp->sr_extflags & SMB2_FAILED_COMPRESS_WRITE) {
+        statsp->fails += 1;
+    }
+}
+
 static int
 smb2_smb_read_write_async(struct smb_share *share,
                           struct smb2_rw_rq *in_read_writep,
@@ -8925,17 +9251,20 @@ smb2_smb_read_write_async(struct smb_share *share,
 {
     int error = 0;
     struct mdchain *mdp;
-    unsigned int i, j;
+    unsigned int i, j, k;
     struct smb_rw_arg *rw_pb = NULL;
     int done = 0;
-    int reconnect = 0, recheck = 0;
+    int reconnect = 0;
     struct smb2_rw_rq tmp_read_write;
     user_ssize_t saved_len, saved_rresid;
     struct smb_session *sessionp = NULL;
     uint32_t quantumSize = 0;
     uint32_t quantumNbr = 0;
     uint32_t single_thread = 1;
-    struct timeval start_time = {0}, current_time = {0}, elapsed_time = {0};
+    uint32_t use_callback = 0;
+    struct smb_rw_completion completion;
+    struct smb_rw_stripe_set stripe_set = {0};
+    struct smbiod *stripe_iod = NULL;
     int do_short_read = 0;
     user_ssize_t short_read_len = 0;
     struct smb2_rw_rq short_read_rq = {0};
@@ -8997,17 +9326,20 @@ smb2_smb_read_write_async(struct smb_share *share,
      * replies get their signing or sealing verified by each iod's read thread
      * for parallelism when we have more than one channel.
      *
-     * One problem with the multi thread model is that the bytes/sec
-     * calculations for which quantum size/count to use is skewed by the
-     * various thread contention and that can cause a slower quantum size/count
-     * to be selected.  
-     
-     * %%% TO DO %%% Try adding a time stamp sr_time_replied when reply arrives
-     * for each rqp, then get elapsed time per rqp with
-     * elapsedTime += (sr_time_replied - rqp->sr_time_sent)
-     *
      * If not signing or sealing, use single thread model since its performance
-     * is equivalent and its bytes/sec calculations are much more accurate.
+     * is equivalent.
+     *
+     * The helper threads are shared by all mounts and each one blocks until
+     * its reply arrives, so they also cap the number of outstanding requests.
+     * With a single channel, there is no parallel signing or sealing to gain
+     * since that is serialized on the iod anyway, so instead send the
+     * requests from this thread. The number of outstanding requests is then
+     * only limited by quantumNbr and the credits.
+     *
+     * For writes, the iod read thread marks each request done as its reply
+     * arrives (use_callback) and we refill them in the order they complete.
+     * Reads are still waited on in order so that a short read or EOF leaves
+     * *rresid covering contiguous data.
      */
     if (sessionp->session_hflags2 & SMB_FLAGS2_SECURITY_SIGNATURE) {
         single_thread = 0;
@@ -9028,24 +9360,50 @@ smb2_smb_read_write_async(struct smb_share *share,
         }
     }
 
+    if ((single_thread == 0) && (sessionp->active_channel_count <= 1)) {
+        use_callback = 1;
+    }
+
     /* This is for dev testing to force single or multi thread mode */
     switch(sessionp->rw_gb_threshold) {
         case 2:
             /* Force single thread mode */
             single_thread = 0;
+            use_callback = 0;
             break;
         case 3:
             /* Force multi thread mode */
             single_thread = 1;
+            use_callback = 0;
+            break;
+        case 4:
+            /* Force callback mode for writes */
+            use_callback = 1;
             break;
         default:
             /* Do nothing */
             break;
     }
 
+    if (use_callback) {
+        /*
+         * Requests are sent and their replies are waited on by this thread
+         * just like single thread mode, only the order differs.
+         */
+        single_thread = 1;
+
+        if (do_read) {
+            use_callback = 0;
+        }
+        else {
+            lck_mtx_init(&completion.lock, smb_rw_group, LCK_ATTR_NULL);
+            completion.in_flight = 0;
+        }
+    }
+
     if (sessionp->session_sopt.sv_active_capabilities & SMB2_GLOBAL_CAP_LARGE_MTU) {
         /* Get the quantum size and number to use */
-        smb2_smb_get_quantum_sizes(sessionp, *len, do_read, &quantumSize, &quantumNbr, &recheck);
+        smb2_smb_get_quantum_sizes(sessionp, *len, do_read, &quantumSize, &quantumNbr);
     }
     else {
         /*
@@ -9070,8 +9428,8 @@ smb2_smb_read_write_async(struct smb_share *share,
 
     SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE, 0xabc001, single_thread, quantumNbr, quantumSize, 0);
 
-    SMB_LOG_IO("do_read %d single thread %d length <%lld> quantum_nbr <%d> quantum_size <%d> \n",
-               do_read, single_thread, saved_len, quantumNbr, quantumSize);
+    SMB_LOG_IO("do_read %d single thread %d callback %d length <%lld> quantum_nbr <%d> quantum_size <%d> \n",
+               do_read, single_thread, use_callback, saved_len, quantumNbr, quantumSize);
     
 resend:
     /* Use a temp smb2_rw_rq instead of in_read_writep */
@@ -9090,7 +9448,21 @@ resend:
     tmp_read_write.ret_ntstatus = 0;
     tmp_read_write.ret_len = 0;
 
+    /*
+     * With multiple channels, spread the requests over them by how fast each
+     * one is going instead of round robin.
+     */
+    smb2_smb_rw_stripe_init(sessionp, &stripe_set);
+
     /* Zero out param blocks */
+    if (use_callback) {
+        /*
+         * No requests are in flight yet. A retry after a reconnect also
+         * starts from zero, since bad: waited for all earlier completions.
+         */
+        completion.in_flight = 0;
+    }
+
     for (i = 0; i < quantumNbr; i++) {
         bzero(&rw_pb[i], sizeof(rw_pb[i]));
         
@@ -9098,30 +9470,11 @@ resend:
         if (!single_thread) {
             lck_mtx_init(&rw_pb[i].rw_arg_lock, smb_rw_group, LCK_ATTR_NULL);
         }
+        if (use_callback) {
+            rw_pb[i].rw.completion = &completion;
+        }
     }
 
-    /*
-     * %%% TO DO for multichannel.
-     * How to calculate how much time was spent on each iod and how much data
-     * was sent on each iod so we can calulate a bytes/sec for each iod.
-     * iods (especially different speed NICs) can have different quantum sizes
-     * and quantum numbers that work the fastest for that NIC. The current
-     * code is assuming the same quantum size for all iods and that will need
-     * to be fixed.
-     *
-     * I tried timing from when request was sent to when we processed the
-     * reply, but it doesnt take into account all the overlapping IOs that
-     * happen on the wire. Mainly, the request timings just kept indicating
-     * the wrong quantumSize/quantumNbr set was the fastest.
-     *
-     * Watch out on reading that the first several responses take a longer
-     * time to return probably due to read ahead caching on the server.
-     *
-     * Also have to handle multiple shares doing copies at the same time on a
-     * session that has multiple active channels.
-     */
-    microtime(&start_time);  /* save time that we started */
-
     /* Fill in initial requests */
     for (i = 0; i < quantumNbr; i++) {
         bool no_credits = false;
@@ -9137,9 +9490,11 @@ resend:
         /*
          * Fill in the Read/Write request
          */
+        stripe_iod = smb2_smb_rw_stripe_pick(&stripe_set, do_read,
+                                             MIN(quantumSize, uio_resid(tmp_read_write.auio)));
         error = smb2_smb_read_write_fill(share, &tmp_read_write,
                                          rw_pb[i].rw.read_writep, &rw_pb[i].rw.rqp,
-                                         do_read, quantumSize,
+                                         do_read, quantumSize, stripe_iod,
                                          allow_compressionp, context);
         
         if (error) {
@@ -9160,6 +9515,9 @@ resend:
             }
         }
 
+        smb2_smb_rw_stripe_update(&stripe_set, rw_pb[i].rw.rqp,
+                                  rw_pb[i].rw.read_writep->io_len, 1);
+
         rw_pb[i].error = 0;
 
         if (!single_thread) {
@@ -9185,6 +9543,15 @@ resend:
         for (j = 0; j < i; j++) {
             SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE, 0xabc003, smb_hideaddr(rw_pb[j].rw.rqp), j, 0, 0);
             
+            if (use_callback) {
+                error = smb2_smb_rw_enqueue_callback(&rw_pb[j]);
+                if (error) {
+                    SMBERROR("smb2_smb_rw_enqueue_callback failed %d\n", error);
+                    goto bad;
+                }
+                continue;
+            }
+
             error = smb_iod_rq_enqueue(rw_pb[j].rw.rqp);
             if (error) {
                 SMBERROR("smb_iod_rq_enqueue failed %d\n", error);
@@ -9200,7 +9567,20 @@ resend:
         /* Assume we are done */
         done = 1;
         
-        for (j = 0; j < i; j++) {
+        for (k = 0; k < i; k++) {
+            j = k;
+            if (use_callback) {
+                /* Take whichever request completed first */
+                j = smb2_smb_rw_wait_any(&completion, rw_pb, i);
+                if (j == i) {
+                    /* Nothing left in flight */
+                    break;
+                }
+
+                /* Others may still be in flight, check again when done */
+                done = 0;
+            }
+
             if (!single_thread) {
                 lck_mtx_lock(&rw_pb[j].rw_arg_lock);
             }
@@ -9284,6 +9664,24 @@ resend:
                     goto bad;
                 }
 
+                smb2_smb_rw_stripe_update(&stripe_set, rw_pb[j].rw.rqp,
+                                          rw_pb[j].rw.read_writep->io_len, 0);
+
+                if (!do_read) {
+                    smb2_smb_write_compress_stats(in_read_writep->compress_statsp,
+                                                  rw_pb[j].rw.rqp);
+                }
+
+                /*
+                 * Feed the round trip time and delivery rate of this reply
+                 * to the controller of the iod it went out on.
+                 */
+                if (sessionp->session_sopt.sv_active_capabilities & SMB2_GLOBAL_CAP_LARGE_MTU) {
+                    smb2_smb_adjust_quantum_sizes(sessionp, rw_pb[j].rw.rqp,
+                                                  rw_pb[j].rw.read_writep,
+                                                  do_read, rw_pb[j].rw.resid);
+                }
+
                 /* Add up amount of IO that we have done so far */
                 *rresid += rw_pb[j].rw.resid;
                 tmp_read_write.ret_len += rw_pb[j].rw.resid;
@@ -9349,11 +9747,14 @@ resend:
                          * The more common case where we have more data to
                          * read or write.
                          */
+                        stripe_iod = smb2_smb_rw_stripe_pick(&stripe_set, do_read,
+                                                             MIN(quantumSize, uio_resid(tmp_read_write.auio)));
                         error = smb2_smb_read_write_fill(share,
                                                          &tmp_read_write,
                                                          rw_pb[j].rw.read_writep,
                                                          &rw_pb[j].rw.rqp,
                                                          do_read, quantumSize,
+                                                         stripe_iod,
                                                          allow_compressionp, context);
                     }
                     else {
@@ -9361,11 +9762,14 @@ resend:
                          * <63197657> The less common case where we had a short
                          * read. Request just the missing read data
                          */
+                        stripe_iod = smb2_smb_rw_stripe_pick(&stripe_set, do_read,
+                                                             short_read_len);
                         error = smb2_smb_read_write_fill(share,
                                                          &short_read_rq,
                                                          rw_pb[j].rw.read_writep,
                                                          &rw_pb[j].rw.rqp,
                                                          do_read, quantumSize,
+                                                         stripe_iod,
                                                          allow_compressionp, context);
                         uio_free(short_read_rq.auio);
                         do_short_read = 0;
@@ -9386,10 +9790,22 @@ resend:
                         rw_pb[j].flags &= ~SMB_RW_REPLY_RCVD;
                     }
 
+                    smb2_smb_rw_stripe_update(&stripe_set, rw_pb[j].rw.rqp,
+                                              rw_pb[j].rw.read_writep->io_len, 1);
+
                     /* Queue it up to be sent */
                     rw_pb[j].error = 0;
 
-                    if (single_thread) {
+                    if (use_callback) {
+                        SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE, 0xabc003, smb_hideaddr(rw_pb[j].rw.rqp), j, 0, 0);
+
+                        error = smb2_smb_rw_enqueue_callback(&rw_pb[j]);
+                        if (error) {
+                            SMBERROR("smb2_smb_rw_enqueue_callback failed %d\n", error);
+                            goto bad;
+                        }
+                    }
+                    else if (single_thread) {
                         SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE, 0xabc003, smb_hideaddr(rw_pb[j].rw.rqp), j, 0, 0);
 
                         error = smb_iod_rq_enqueue(rw_pb[j].rw.rqp);
@@ -9416,8 +9832,6 @@ resend:
     } /* While loop */
 
 bad:
-    microtime(&current_time);  /* get time that we finished */
-
     SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_NONE, 0xabc005, error, 0, 0, 0);
 
     for (i = 0; i < quantumNbr; i++) {
@@ -9466,6 +9880,9 @@ bad:
         }
     }
 
+    /* Drop the iod refs, a resend looks at the channels again */
+    smb2_smb_rw_stripe_free(&stripe_set);
+
     if (reconnect == 1) {
         /* If failed due to reconnect, restore original values and try again */
         *len = saved_len;
@@ -9501,32 +9918,15 @@ bad:
         uio_free(tmp_read_write.auio);
     }
 
-    /*
-     * Only if
-     * 1. Server supports large MTUs
-     * 2. Multiple read/writes were done
-     * 3. We are rechecking the speeds
-     * Then call smb2_smb_adjust_quantum_sizes() to see if we need to change
-     * quantum size and number.
-     */
-    if ((error == 0) &&
-        (sessionp->session_sopt.sv_active_capabilities & SMB2_GLOBAL_CAP_LARGE_MTU) &&
-        (recheck == 1)) {
-        /* Get elapsed time for this transfer */
-        timersub (&current_time, &start_time, &elapsed_time);
-
-        SMB_LOG_IO("quantumSize %d, etime %ld:%d len %lld \n",
-                   quantumSize, elapsed_time.tv_sec, elapsed_time.tv_usec, saved_len);
-        smb2_smb_adjust_quantum_sizes(share, do_read,
-                                      quantumSize, quantumNbr,
-                                      elapsed_time, saved_len);
-    }
-
 done:
     if (rw_pb != NULL) {
         SMB_FREE_TYPE_COUNT(struct smb_rw_arg, quantumNbr, rw_pb);
     }
 
+    if (use_callback) {
+        lck_mtx_destroy(&completion.lock, smb_rw_group);
+    }
+
     SMB_LOG_KTRACE(SMB_DBG_SMB_RW_ASYNC | DBG_FUNC_END, error, *rresid, 0, 0, 0);
 	return error;
 }
@@ -9537,6 +9937,7 @@ smb2_smb_read_write_fill(struct smb_share *share,
                          struct smb2_rw_rq *read_writep,
                          struct smb_rq **rqp,
                          uint32_t do_read, uint32_t quantum_size,
+                         struct smbiod *iod,
                          uint32_t *allow_compressionp,
                          vfs_context_t context)
 {
@@ -9586,11 +9987,11 @@ smb2_smb_read_write_fill(struct smb_share *share,
     if (do_read) {
         error = smb2_smb_read_one(share, read_writep,
                                   &len, &resid,
-                                  rqp, NULL,
+                                  rqp, iod,
                                   *allow_compressionp, context);
     }
     else {
-        error = smb2_smb_write_one(share, read_writep, &len, &resid, rqp, NULL,
+        error = smb2_smb_write_one(share, read_writep, &len, &resid, rqp, iod,
                                    allow_compressionp, context);
     }
     
@@ -9608,6 +10009,16 @@ smb2_smb_read_write_fill(struct smb_share *share,
     
     /* In this situation, its not a compound request */
     (*rqp)->sr_flags &= ~SMBR_COMPOUND_RQ;
+
+    /* Snapshot for the delivery rate sample when the reply arrives */
+    if ((*rqp)->sr_iod != NULL) {
+        struct smb_rw_ctl *ctl = do_read ? &(*rqp)->sr_iod->iod_read_ctl :
+                                           &(*rqp)->sr_iod->iod_write_ctl;
+
+        lck_mtx_lock(&(*rqp)->sr_iod->iod_rwctl_lock);
+        read_writep->delivered = ctl->rwc_delivered;
+        lck_mtx_unlock(&(*rqp)->sr_iod->iod_rwctl_lock);
+    }
     
     if (do_read == 0) {
         (*rqp)->sr_timo = SMBWRTTIMO;
@@ -10299,6 +10710,9 @@ resend:
     if (share->ss_share_caps & SMB2_SHARE_CAP_DFS) {
         share->optionalSupport |= SMB_SHARE_IS_IN_DFS;
     }
+
+    /* Server may have changed under us, relearn which FSCTLs it supports */
+    share->ss_fsctl_refused = 0;
     
     /* Get Maximal Access */
     error = md_get_uint32le(mdp, &share->maxAccessRights);
@@ -10652,6 +11066,8 @@ resend:
     if (error) {
         goto bad;
     }
+
+    smb2_smb_write_compress_stats(writep->compress_statsp, rqp);
     
 bad:    
     if (auio != NULL) {
@@ -10665,7 +11081,9 @@ bad:
 
 static int
 smb2_smb_write_uio(struct smb_share *share, SMBFID fid, uio_t uio, int ioflag,
-                   uint32_t *allow_compressionp, vfs_context_t context)
+                   uint32_t *allow_compressionp,
+                   struct smb_compress_stats *compress_statsp,
+                   vfs_context_t context)
 {
 #pragma unused(ioflag)
     int error;
@@ -10698,6 +11116,7 @@ again:
     writep->fid = fid;
     writep->auio = temp_uio;
     writep->mc_flags = 0;
+    writep->compress_statsp = compress_statsp;
     
     error = smb2_smb_write(share, writep, allow_compressionp, context);
 	
@@ -10752,13 +11171,16 @@ done:
  */
 int
 smb_smb_write(struct smb_share *share, SMBFID fid, uio_t uio, int ioflag,
-              uint32_t *allow_compressionp, vfs_context_t context)
+              uint32_t *allow_compressionp,
+              struct smb_compress_stats *compress_statsp,
+              vfs_context_t context)
 {
     int error;
     
     if (SS_TO_SESSION(share)->session_flags & SMBV_SMB2) {
         error = smb2_smb_write_uio(share, fid, uio, ioflag,
-                                   allow_compressionp, context);
+                                   allow_compressionp, compress_statsp,
+                                   context);
     }
     else {
         error = smb1_write(share, fid, uio, ioflag, context);
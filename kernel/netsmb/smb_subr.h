@@ -342,14 +342,24 @@ int smb2_rq_compress_chunk(struct smb_session *sessionp, uint16_t algorithm,
                            uint8_t *compress_startp, uint32_t *data_len,
                            size_t *actual_len);
 int smb2_rq_compress_write(struct smb_rq *rqp);
+struct smb2_compress_job;
+void smb2_compress_chunks_helper(struct smb2_compress_job *jobp);
 int smb2_rq_decompress_read(struct smb_session *sessionp, mbuf_t *mpp);
+void smb2_compress_scratch_reclaim(struct smb_session *sessionp, int force);
 
 int  smb2_rq_sign(struct smb_rq *rqp);
 int  smb2_rq_verify(struct smb_rq *rqp, struct mdchain *mdp, uint8_t *signature);
 int  smb3_derive_channel_keys(struct smbiod *iod);
 int  smb3_derive_keys(struct smbiod *iod);
 int  smb3_rq_encrypt(struct smb_rq *rqp);
-int  smb3_msg_decrypt(struct smb_session *sessionp, mbuf_t *m);
+int  smb3_rq_seal(struct smb_rq *rqp, uint32_t do_encrypt);
+int  smb3_msg_decrypt(struct smb_session *sessionp, mbuf_t *m,
+                      char **bufferpp, uint32_t *buf_lenp);
+struct smb3_crypt_item;
+struct smb3_crypt_batch;
+void smb3_crypt_batch(struct smb_session *sessionp,
+                      struct smb3_crypt_item *items, uint32_t item_count);
+void smb3_crypt_batch_helper(struct smb3_crypt_batch *batchp);
 int smb3_verify_session_setup(struct smb_session *sessionp, struct smbiod *iod,
                               uint8_t *sess_setup_reply, size_t sess_setup_len);
 
@@ -54,6 +54,7 @@
 #define SMBTP_QOS       6   /* RW - uint32_t */
 #define SMBTP_IP_ADDR   7   /* R  - struct sockaddr_storage */
 #define SMBTP_BOUND_IF  8   /* W  - uint32_t */
+#define SMBTP_NREAD     9   /* R  - uint32_t, bytes waiting to be read */
 
 struct smb_tran_ops;
 
@@ -945,7 +945,7 @@ static int
 smb_nbst_recv(struct smbiod *iod, mbuf_t *mpp)
 {
 	struct nbpcb *nbp = iod->iod_tdata;
-	uint8_t rpcode, *hp;
+	uint8_t rpcode;
 	int error, rplen;
 
     SMB_LOG_KTRACE(SMB_DBG_NBST_RECV | DBG_FUNC_START, iod->iod_id, 0, 0, 0, 0);
@@ -961,14 +961,11 @@ smb_nbst_recv(struct smbiod *iod, mbuf_t *mpp)
         error = mbuf_pullup(mpp, 1);
     }
 
-    // Check for a transform header (encrypted msg)
-    if (!error) {
-        hp = mbuf_data(*mpp);
-        if (*hp == 0xfd) {
-            error = smb3_msg_decrypt(iod->iod_session, mpp);
-        }
-    }
-    
+    /*
+     * Transform headers (encrypted msgs) are decrypted by the caller, so
+     * several can be decrypted in parallel. See smb_iod_recv_next().
+     */
+
     if (error) {
         *mpp = NULL;
     }
@@ -989,6 +986,8 @@ static int
 smb_nbst_getparam(struct smbiod *iod, int param, void *data)
 {
 	struct nbpcb *nbp = iod->iod_tdata;
+	int nread, error;
+	int optlen;
 
 	/* Should never happen, but just in case */
 	if (nbp == NULL) {
@@ -1017,6 +1016,16 @@ smb_nbst_getparam(struct smbiod *iod, int param, void *data)
         case SMBTP_IP_ADDR:
             memcpy(data, &nbp->nbp_sock_addr, sizeof(nbp->nbp_sock_addr));
             break;
+        case SMBTP_NREAD:
+            nread = 0;
+            optlen = sizeof(nread);
+            error = sock_getsockopt(nbp->nbp_tso, SOL_SOCKET, SO_NREAD,
+                                    &nread, &optlen);
+            if (error) {
+                return (error);
+            }
+            *(uint32_t*)data = (uint32_t) nread;
+            break;
 	    default:
 			return (EINVAL);
 	}
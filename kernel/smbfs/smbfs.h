@@ -209,6 +209,24 @@ typedef enum _SMB_FILE_FLAGS
 
 #define SMB_MAX_LOCKS_RETURNED 25
 
+/*
+ * What SMB compression achieved on the writes of a file or of all the files
+ * with one extension. Used to stop compressing data that does not compress,
+ * see smbfs_compress_update().
+ */
+#define SMB_COMPRESS_EXT_LEN 16
+
+struct smb_compress_stats {
+	uint64_t in_bytes;	/* write data given to the compressor */
+	uint64_t out_bytes;	/* bytes sent for that data */
+	uint64_t usecs;		/* time spent compressing */
+	uint32_t writes;	/* write requests compression was tried on */
+	uint32_t fails;		/* write requests that did not compress at all */
+	uint32_t bad_cnt;	/* write calls in a row that did not compress enough */
+	uint32_t disabled_cnt;	/* times in a row compression got turned off */
+	time_t reprobe_time;	/* if not 0, no compression until this uptime */
+};
+
 /* struct smb_lease flags */
 typedef enum _SMB_LEASE_FLAGS
 {
@@ -294,6 +312,11 @@ struct smb_file {
 
 	time_t rsrc_fork_timer;
 	time_t symlink_timer;
+
+	/* Compression results for this file and for its extension */
+	struct smb_compress_stats compress;
+	struct smb_compress_stats compress_ext;
+	char compress_ext_name[SMB_COMPRESS_EXT_LEN];
 };
 
 /* smb_file flags */
@@ -322,6 +345,47 @@ struct smb_dir {
 	time_t enum_timer;
 };
 
+/* Mount wide smbnode hash table info */
+struct smb_node_hash_stats {
+	int64_t lock_contended;
+	uint64_t buckets;
+	uint64_t used_buckets;	/* estimated from one sampled lock stripe */
+	uint64_t nodes;
+	uint64_t max_chain;	/* longest chain in the sampled lock stripe */
+	uint32_t grow_cnt;
+	uint32_t shrink_cnt;
+};
+
+/* Mount wide dir enum cache allocations */
+struct smb_dir_arena_stats {
+	int64_t entries_added;
+	int64_t entry_block_allocs;
+	int64_t entry_block_frees;
+	int64_t name_chunk_allocs;
+	int64_t name_chunk_frees;
+	int64_t bytes_in_use;
+};
+
+/* Global dir enumeration cache info */
+struct smb_global_dir_cache_stats {
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t evictions;
+	uint64_t dirs;
+	uint64_t bytes;
+	uint64_t max_bytes;
+	uint32_t max_dirs;
+	uint32_t pad;
+};
+
+/* Mount wide smbfs_sync pass info */
+struct smb_sync_stats {
+	uint32_t list_nodes;	/* nodes on sm_sync_list now */
+	uint32_t last_nodes;	/* nodes visited by last sync pass */
+	uint64_t last_usecs;
+	uint64_t max_usecs;
+};
+
 struct smbStatPB {
 	uint32_t vnode_type;
 	uint32_t pad;
@@ -347,6 +411,11 @@ struct smbStatPB {
 	uint32_t lease_epoch;
 	uint32_t lease_def_close_reuse_cnt;
 	time_t lease_def_close_timer;
+
+	struct smb_node_hash_stats node_hash;
+	struct smb_dir_arena_stats dir_arena;
+	struct smb_global_dir_cache_stats dir_cache;
+	struct smb_sync_stats sync;
 };
 
 struct smb_update_lease {
@@ -525,6 +594,30 @@ struct smbfs_notify_change;
 #define SVRMSG_RCVD_GOING_DOWN	0x0000000000000001
 #define SVRMSG_RCVD_SHUTDOWN_CANCEL	0x0000000000000002
 
+/* Compression results of one file extension on this mount */
+#define kSmbCompressExtMax 64
+
+struct smb_compress_ext {
+	char			ce_name[SMB_COMPRESS_EXT_LEN];
+	struct smb_compress_stats ce_stats;
+};
+
+/*
+ * Number of locks protecting the smbnode hash table, a bucket is covered by
+ * the lock picked by the low bits of its hash value. Must be a power of 2.
+ */
+#define SMBFS_HASH_LOCK_STRIPES 64
+
+/*
+ * The smbnode hash table starts at kSmbfsHashMinLen buckets and is resized
+ * to keep between 1 and kSmbfsHashMaxLoad nodes per bucket. Never smaller
+ * than SMBFS_HASH_LOCK_STRIPES so a lock covers the same hash values in
+ * every table size.
+ */
+#define kSmbfsHashMinLen	1024
+#define kSmbfsHashMaxLoad	2
+#define kSmbfsHashMinLoadDiv	8	/* shrink below 1/8 node per bucket */
+
 struct smbmount {
 	uint64_t		ntwrk_uid;
 	uint64_t		ntwrk_gid;
@@ -541,9 +634,20 @@ struct smbmount {
 	struct smb_share * 	sm_share;
 	lck_rw_t		sm_rw_sharelock;
 	int			sm_flags;
-	lck_mtx_t		*sm_hashlock;
+	lck_mtx_t		sm_hashlock[SMBFS_HASH_LOCK_STRIPES]; /* striped by hash value */
+	int64_t			sm_hashlock_contended;	/* times a hash lock was already held */
 	LIST_HEAD(smbnode_hashhead, smbnode) *sm_hash;
 	u_long			sm_hashlen;
+	struct smbnode_hashhead	*sm_oldhash;	/* table being moved into sm_hash */
+	u_long			sm_oldhashlen;
+	uint8_t			sm_hash_migrated[SMBFS_HASH_LOCK_STRIPES]; /* stripe is out of sm_oldhash */
+	int32_t			sm_hash_migrate_left;	/* stripes still in sm_oldhash */
+	uint32_t		sm_hash_cnt[SMBFS_HASH_LOCK_STRIPES]; /* nodes per lock stripe */
+	lck_mtx_t		sm_hash_resize_lock;	/* one resize at a time */
+	uint32_t		sm_hash_grow_cnt;
+	uint32_t		sm_hash_shrink_cnt;
+	int32_t			sm_hash_stats_stripe;	/* next stripe smbfs_hash_stats samples */
+	struct smb_dir_arena_stats sm_dir_arena;	/* updated atomically */
 	uint32_t		sm_status; /* status bits for this mount */
 	time_t			sm_statfstime; /* sm_statfsbuf cache time */
 	lck_mtx_t		sm_statfslock; /* sm_statsbuf lock */
@@ -553,6 +657,25 @@ struct smbmount {
 	lck_mtx_t		sm_svrmsg_lock;		/* protects svrmsg fields */
 	uint64_t		sm_svrmsg_pending;	/* svrmsg replies pending (bits defined above) */
 	uint32_t		sm_svrmsg_shutdown_delay;  /* valid when SVRMSG_GOING_DOWN is set */
+	lck_mtx_t		sm_compress_lock;	/* protects sm_compress_ext and n_compress */
+	struct smb_compress_ext	sm_compress_ext[kSmbCompressExtMax]; /* learned per extension */
+	uint32_t		sm_compress_ext_cnt;
+	/* Dir enum Create/Query/Close fan out, a hint so updated without a lock */
+	uint32_t		sm_dir_async_window;
+	uint64_t		sm_dir_async_min_rtt_usecs;
+	uint64_t		sm_dir_async_srtt_usecs;
+	struct timespec		sm_dir_async_rtt_window; /* min rtt filter start */
+	uint32_t		sm_path_gen;	/* bumped on dir rename, ages every n_path_cache */
+	/* Nodes smbfs_sync has work for, see smbfs_sync_list_add */
+	lck_mtx_t		sm_sync_lock;
+	TAILQ_HEAD(, smbnode)	sm_sync_list;
+	uint32_t		sm_sync_cnt;
+	uint32_t		sm_sync_last_nodes;	/* nodes visited by last sync pass */
+	uint64_t		sm_sync_last_usecs;	/* time taken by last sync pass */
+	uint64_t		sm_sync_max_usecs;	/* slowest sync pass */
+	/* Files with a deferred close, least recently used first */
+	lck_mtx_t		sm_def_close_lock;
+	TAILQ_HEAD(, smbnode)	sm_def_close_lru;
 };
 
 #define VFSTOSMBFS(mp)		((struct smbmount *)(vfs_fsprivate(mp)))
@@ -744,55 +867,32 @@ enum {
 	
 	SMB_DBG_ADJUST_QUANTUM_SIZES      = SMB_DBG_CODE(100),  /* 0x030A0190 */
 	SMB_DBG_BUF_MAP           	  = SMB_DBG_CODE(101),  /* 0x030A0194 */
-	SMB_DBG_BUF_UNMAP           	  = SMB_DBG_CODE(102)   /* 0x030A0198 */
+	SMB_DBG_BUF_UNMAP           	  = SMB_DBG_CODE(102),  /* 0x030A0198 */
+
+	SMB_DBG_IOD_RQ_LOOKUP             = SMB_DBG_CODE(103)   /* 0x030A019C */
 };
 
 /* 
  * Global dir enumeration caching
  *
- * Have to be careful of kern.maxfilesperproc which is at 10240. Each cached
- * dir will counts as an open file, thus keep max dirs cache upper limit at 300
+ * Cached dirs are kept on an LRU list and pruned by the memory their enum
+ * caches actually use (entry blocks and name chunks), not by a fixed number
+ * of dirs. The budget is 1/k_dir_cache_mem_divisor of system RAM, but never
+ * less than k_min_dir_cache_bytes. The max entries per dir still scales with
+ * system RAM so one huge dir can not use up the whole budget.
  *
- * Assumptions (dir entry struct size 288 + name len = assume avg 600 bytes)
- * 1. Less than or equal to 2 GB of system RAM
- *		a) Use up to max of 0.25 GB
- *		b) Max dirs to cache - 200
- *		c) Max entries per dir - 2048 (round down to 2,000)
- *		d) 600 * 200 * 2048 = 0.23 GB
- * 2. Less than or equal to 4 GB of system RAM
- *		a) Use up to max of 0.5 GB
- *		b) Max dirs to cache - 300
- *		c) Max entries per dir - 4096 (round down to 4,000)
- *		d) 600 * 300 * 4096 = 0.69 GB
- * 3. Less than or equal to 8 GB of system RAM
- *		a) Use up to max of 1 GB
- *		b) Max dirs to cache - 300
- *		c) Max entries per dir - 7168  (round down to 6,000)
- *		d) 600 * 300 * 7168 = 1.2 GB
- * 4. Less than or equal to 16 GB of system RAM
- *		a) Use up to max of 2 GB
- *		b) Max dirs to cache - 300
- *		c) Max entries per dir - 9216  (round down to 8,000)
- *		d) 600 * 300 * 8192 = 1.37 GB
- * 5. More than or equal to 16 GB of system RAM
- *		a) Use up to max of 4 GB
- *		b) Max dirs to cache - 300
- *		c) Max entries per dir - 11000  (round down to 10,000)
- *		d) 600 * 300 * 11000 = 1.84 GB
+ * Have to be careful of kern.maxfilesperproc which is at 10240. Each cached
+ * dir can hold an open dir handle, so the number of dirs is still capped at
+ * k_max_dirs_cached, which is also the largest max_dirs_cached preference.
  */
-#define k_2GB_max_dirs_cached 200
-#define k_2GB_max_dir_entries_cached 2000
+#define k_dir_cache_mem_divisor 64
+#define k_min_dir_cache_bytes (16 * 1024 * 1024)
+#define k_max_dirs_cached 5000
 
-#define k_4GB_max_dirs_cached 300
+#define k_2GB_max_dir_entries_cached 2000
 #define k_4GB_max_dir_entries_cached 4000
-
-#define k_8GB_max_dirs_cached 300
 #define k_8GB_max_dir_entries_cached 6000
-
-#define k_16GB_max_dirs_cached 300
 #define k_16GB_max_dir_entries_cached 8000
-
-#define k_LotsOfGB_max_dirs_cached 300
 #define k_LotsOfGB_max_dir_entries_cached 10000
 
 #define k_entry_struct_size 600;
@@ -804,13 +904,20 @@ struct global_dir_cache_entry {
 	uint32_t		dir_vid;		/* dir vid */
 	struct timespec		last_access_time;	/* last access time */
 	uint64_t		cached_cnt;		/* how many entries cached */
-	struct global_dir_cache_entry *next;		/* next in list */
+	uint64_t		cached_bytes;		/* memory used by its enum caches */
+	LIST_ENTRY(global_dir_cache_entry) hash_link;	/* hashed by dvp and vid */
+	TAILQ_ENTRY(global_dir_cache_entry) lru_link;	/* least recently used first */
+	uint32_t		in_lru;			/* on lru list, has entries cached */
 };
 
-/* File Handle Leasing */
+/* File Handle Leasing, defaults for the net.smb.fs.def_close_* sysctls */
 #define k_def_close_timeout 30		/* default 30 secs timeout */
-#define k_def_close_lo_water 25		/* when to start closing def closes <unused> */
-#define k_def_close_hi_water 100	/* dont allow any more def closes */
+#define k_def_close_lo_water 25		/* idle def closes kept past the timeout */
+#define k_def_close_hi_water 100	/* def closes per share, LRU one is evicted */
+
+/* smbfs_sync only visits nodes on sm_sync_list */
+#define kSmbSyncListSlack 64		/* room for nodes added while allocating */
+#define kSmbSyncSlowUsecs (2 * USEC_PER_SEC)	/* warn if a sync pass is slower */
 
 #endif	/* KERNEL */
 
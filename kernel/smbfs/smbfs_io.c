@@ -471,8 +471,11 @@ done:
 }
 
 /*
- * This routine will zero fill the data between from and to. We may want to allocate
- * smbzeroes in the future.
+ * This routine will zero fill the data between from and to. For SMB 2/3 we
+ * first try to have the server do it with FSCTL_SET_ZERO_DATA, which is one
+ * round trip no matter how big the range. If the share refuses that FSCTL,
+ * it gets remembered on the share and we write smbzeroes like we always did.
+ * We may want to allocate smbzeroes in the future.
  *
  * The calling routine must hold a reference on the share
  */
@@ -487,6 +490,29 @@ smbfs_zero_fill(struct smb_share *share, SMBFID fid, u_quad_t from,
 	int error = 0;
 	uio_t uio;
     uint32_t allow_compression = 1; /* Seems like a great place to compress */
+
+    if ((SS_TO_SESSION(share)->session_flags & SMBV_SMB2) &&
+        !(share->ss_fsctl_refused & SMBS_FSCTL_NO_ZERO_DATA)) {
+        /*
+         * FSCTL_SET_ZERO_DATA never moves the eof, so grow the file out to
+         * "to" first and then zero the range that used to be past the eof.
+         */
+        error = smbfs_smb_seteof(share, fid, to, context);
+        if (!error) {
+            error = smbfs_smb_set_zero_data(share, fid, from, to, context);
+            if (!error) {
+                return (0);
+            }
+        }
+
+        if (error != ENOTSUP) {
+            return (error);
+        }
+
+        SMBDEBUG("FSCTL_SET_ZERO_DATA not supported, writing zeros from=%llu to=%llu\n",
+                 from, to);
+        error = 0;
+    }
     
 	/*
 	 * Coherence callers must prevent VM from seeing the file size
@@ -498,7 +524,7 @@ smbfs_zero_fill(struct smb_share *share, SMBFID fid, u_quad_t from,
 		uio_reset(uio, from, UIO_SYSSPACE, UIO_WRITE );
 		uio_addiov(uio, CAST_USER_ADDR_T(&smbzeroes[0]), len);
 		error = smb_smb_write(share, fid, uio, ioflag,
-                              &allow_compression, context);
+                              &allow_compression, NULL, context);
 		if (error)
 			break;
 			/* nothing written */
@@ -556,21 +582,89 @@ smbfs_0extend(struct smb_share *share, SMBFID fid, u_quad_t from,
 		uio = uio_create(1, (to - 1) , UIO_SYSSPACE, UIO_WRITE);
 		uio_addiov(uio, CAST_USER_ADDR_T(&onezero), len);
 		error = smb_smb_write(share, fid, uio, ioflag,
-                              allow_compressionp, context);
+                              allow_compressionp, NULL, context);
 		uio_free(uio);
 	}
 	return(error);
 }
 
 /*
+ * Copy len bytes of zeros into the uio, used for the holes of sparse files.
+ */
+static int
+smbfs_zero_uio(uio_t uio, user_ssize_t len)
+{
+	int this_len;
+	int error = 0;
+
+	while (len > 0) {
+		this_len = (int) MIN(len, (user_ssize_t) sizeof(smbzeroes));
+		error = uiomove(smbzeroes, this_len, uio);
+		if (error)
+			break;
+		len -= this_len;
+	}
+	return (error);
+}
+
+/*
+ * If np is not NULL and the file is sparse, the holes are zero filled locally
+ * from the allocated range cache and only the allocated ranges are read from
+ * the server.
+ *
  * The calling routine must hold a reference on the share
  */
 int 
-smbfs_doread(struct smb_share *share, off_t endOfFile, uio_t uiop, 
-             SMBFID fid, uint32_t allow_compression, vfs_context_t context)
+smbfs_doread(struct smb_share *share, struct smbnode *np, off_t endOfFile,
+             uio_t uiop, SMBFID fid, uint32_t allow_compression,
+             vfs_context_t context)
 {
 #pragma unused(endOfFile)
 	int error;
+	user_ssize_t len, remaining;
+	uint64_t offset, run_end;
+	int is_hole;
+	struct smbfs_alloc_range_list list = {0};
+
+	while ((np != NULL) && (uio_resid(uiop) > 0)) {
+		offset = uio_offset(uiop);
+		if (smbfs_alloc_range_lookup(share, np, fid, offset, &is_hole,
+									 &run_end, &list, context)) {
+			/* Not sparse or nothing known, just read it */
+			break;
+		}
+
+		len = (user_ssize_t) MIN((uint64_t) uio_resid(uiop), run_end - offset);
+		if (is_hole) {
+			error = smbfs_zero_uio(uiop, len);
+			if (error)
+				goto done;
+			continue;
+		}
+
+		if (len == uio_resid(uiop)) {
+			/* Rest of the request is data */
+			break;
+		}
+
+		/* Read just this run of data, then put back the rest of the resid */
+		remaining = uio_resid(uiop) - len;
+		uio_setresid(uiop, len);
+		error = smb_smb_read(share, fid, uiop, allow_compression, context);
+		uio_setresid(uiop, uio_resid(uiop) + remaining);
+		if (error)
+			goto done;
+
+		if (uio_resid(uiop) > remaining) {
+			/* Short read, the server eof came first */
+			goto done;
+		}
+	}
+
+	if (uio_resid(uiop) == 0) {
+		error = 0;
+		goto done;
+	}
 
     /*
      * Dont check for reads past EOF or try to pin the request size to the
@@ -579,6 +673,8 @@ smbfs_doread(struct smb_share *share, off_t endOfFile, uio_t uiop,
      */
 	error = smb_smb_read(share, fid, uiop, allow_compression, context);
 
+done:
+	smbfs_alloc_range_list_free(&list);
 	return error;
 }
 
@@ -587,13 +683,18 @@ smbfs_doread(struct smb_share *share, off_t endOfFile, uio_t uiop,
  * reconnect. We need to dup the uio before the write and if it fails reset 
  * it back to the dup verison.
  *
+ * If compress_statsp is not NULL, what compression did for this write is
+ * added to it.
+ *
  * The calling routine must hold a reference on the share
  *
  */
 int 
 smbfs_dowrite(struct smb_share *share, off_t endOfFile, uio_t uiop, 
               SMBFID fid, int ioflag,
-              uint32_t *allow_compressionp, vfs_context_t context)
+              uint32_t *allow_compressionp,
+              struct smb_compress_stats *compress_statsp,
+              vfs_context_t context)
 {
 	int error = 0;
 
@@ -615,7 +716,7 @@ smbfs_dowrite(struct smb_share *share, off_t endOfFile, uio_t uiop,
 
 	if (!error) {
 		error = smb_smb_write(share, fid, uiop, ioflag,
-                              allow_compressionp, context);
+                              allow_compressionp, compress_statsp, context);
 	}
 
 	return error;
@@ -73,10 +73,11 @@
 #include <smbclient/smbclient_internal.h>
 
 #define	SMBFS_NOHASH(smp, hval)	(&(smp)->sm_hash[(hval) & (smp)->sm_hashlen])
-#define	smbfs_hash_lock(smp)	(lck_mtx_lock((smp)->sm_hashlock))
-#define	smbfs_hash_unlock(smp)	(lck_mtx_unlock((smp)->sm_hashlock))
+#define	SMBFS_HASHLOCK(smp, hval) \
+	(&(smp)->sm_hashlock[(hval) & (SMBFS_HASH_LOCK_STRIPES - 1)])
 
 extern vnop_t **smbfs_vnodeop_p;
+extern int smbfs_def_close_timeout;
 
 
 #define	FNV_32_PRIME ((uint32_t) 0x01000193UL)
@@ -487,6 +488,36 @@ smbnode_lockpair(struct smbnode *np1, struct smbnode *np2, enum smbfslocktype lo
 	return (0);
 }
 
+/*
+ * Upgrade a shared lock on a node to an exclusive lock. If another thread is
+ * also upgrading, the shared lock gets dropped before the exclusive lock is
+ * taken, so the caller has to recheck anything it looked at while shared.
+ */
+void
+smbnode_lock_upgrade(struct smbnode *np)
+{
+	if (!lck_rw_lock_shared_to_exclusive(&np->n_rwlock)) {
+		lck_rw_lock_exclusive(&np->n_rwlock);
+	}
+
+	np->n_lockState = SMBFS_EXCLUSIVE_LOCK;
+	
+#if 1
+	/* For Debugging... */
+	np->n_activation = (void *) current_thread();
+#endif
+}
+
+/*
+ * Downgrade an exclusive lock on a node back to a shared lock
+ */
+void
+smbnode_lock_downgrade(struct smbnode *np)
+{
+	np->n_lockState = SMBFS_SHARED_LOCK;
+	lck_rw_lock_exclusive_to_shared(&np->n_rwlock);
+}
+
 /*
  * Unlock a cnode
  */
@@ -562,31 +593,297 @@ smbfs_hash(struct smb_share *share, uint64_t ino,
 	return v;
 }
 
+/*
+ * Lock the part of the hash table that holds hashval. Counts the times we
+ * had to wait for it, so we can tell how much lookups fight over the table.
+ */
+static void
+smbfs_hash_lock(struct smbmount *smp, uint64_t hashval)
+{
+	lck_mtx_t *lockp = SMBFS_HASHLOCK(smp, hashval);
+
+	if (!lck_mtx_try_lock(lockp)) {
+		OSAddAtomic64(1, &smp->sm_hashlock_contended);
+		lck_mtx_lock(lockp);
+	}
+}
+
+static void
+smbfs_hash_unlock(struct smbmount *smp, uint64_t hashval)
+{
+	lck_mtx_unlock(SMBFS_HASHLOCK(smp, hashval));
+}
+
+/*
+ * Move every node of one lock stripe from sm_oldhash into sm_hash. The last
+ * stripe to move frees sm_oldhash. Called with the hash lock for the stripe
+ * held.
+ */
+static void
+smbfs_hash_migrate(struct smbmount *smp, uint32_t stripe)
+{
+	struct smbnode *np;
+	u_long ii;
+
+	for (ii = stripe; ii <= smp->sm_oldhashlen; ii += SMBFS_HASH_LOCK_STRIPES) {
+		while ((np = LIST_FIRST(&smp->sm_oldhash[ii])) != NULL) {
+			LIST_REMOVE(np, n_hash);
+			LIST_INSERT_HEAD(SMBFS_NOHASH(smp, np->n_hashval), np, n_hash);
+		}
+	}
+	smp->sm_hash_migrated[stripe] = 1;
+
+	/* OSAddAtomic returns the old value */
+	if (OSAddAtomic(-1, &smp->sm_hash_migrate_left) == 1) {
+		hashdestroy(smp->sm_oldhash, M_SMBFSHASH, smp->sm_oldhashlen);
+		smp->sm_oldhash = NULL;
+		smp->sm_oldhashlen = 0;
+	}
+}
+
+/*
+ * Return the bucket for hashval, first finishing the move of its stripe
+ * if the table is being resized. Called with the hash lock for hashval held.
+ */
+static struct smbnode_hashhead *
+smbfs_hash_bucket(struct smbmount *smp, uint64_t hashval)
+{
+	uint32_t stripe = hashval & (SMBFS_HASH_LOCK_STRIPES - 1);
+
+	if (!smp->sm_hash_migrated[stripe]) {
+		smbfs_hash_migrate(smp, stripe);
+	}
+	return (SMBFS_NOHASH(smp, hashval));
+}
+
+/*
+ * Lock the whole hash table, used by code that walks every bucket. Always
+ * take the locks in the same order. Any resize in progress is finished so
+ * the caller only has to walk sm_hash.
+ */
+static void
+smbfs_hash_lock_all(struct smbmount *smp)
+{
+	uint32_t ii;
+
+	for (ii = 0; ii < SMBFS_HASH_LOCK_STRIPES; ii++) {
+		lck_mtx_lock(&smp->sm_hashlock[ii]);
+	}
+
+	for (ii = 0; ii < SMBFS_HASH_LOCK_STRIPES; ii++) {
+		if (!smp->sm_hash_migrated[ii]) {
+			smbfs_hash_migrate(smp, ii);
+		}
+	}
+}
+
+static void
+smbfs_hash_unlock_all(struct smbmount *smp)
+{
+	uint32_t ii;
+
+	for (ii = SMBFS_HASH_LOCK_STRIPES; ii > 0; ii--) {
+		lck_mtx_unlock(&smp->sm_hashlock[ii - 1]);
+	}
+}
+
+/*
+ * Grow or shrink the hash table if the node count has left the range the
+ * current size is good for. Only swaps in the new table, the nodes are moved
+ * a stripe at a time by whoever next uses that stripe, so no one waits for
+ * the whole table to be rehashed. Called without any hash locks held.
+ */
+static void
+smbfs_hash_resize(struct smbmount *smp)
+{
+	struct smbnode_hashhead *new_hash;
+	u_long new_hashlen = 0;
+	uint64_t node_cnt = 0, buckets;
+	int elements;
+	uint32_t ii;
+
+	if (!lck_mtx_try_lock(&smp->sm_hash_resize_lock)) {
+		/* Someone else is already on it */
+		return;
+	}
+
+	if (smp->sm_oldhash != NULL) {
+		/* Still moving nodes from the last resize */
+		goto done;
+	}
+
+	for (ii = 0; ii < SMBFS_HASH_LOCK_STRIPES; ii++) {
+		node_cnt += smp->sm_hash_cnt[ii];
+	}
+
+	/* Only changed while holding sm_hash_resize_lock */
+	buckets = smp->sm_hashlen + 1;
+
+	if (node_cnt > (buckets * kSmbfsHashMaxLoad)) {
+		elements = (int) MIN(node_cnt, INT_MAX);
+	}
+	else if ((buckets > kSmbfsHashMinLen) &&
+			 (node_cnt < (buckets / kSmbfsHashMinLoadDiv))) {
+		elements = (int) MAX(node_cnt, kSmbfsHashMinLen);
+	}
+	else {
+		goto done;
+	}
+
+	/* hashinit() rounds down to a power of 2 */
+	new_hash = hashinit(elements, M_SMBFSHASH, &new_hashlen);
+	if (new_hash == NULL) {
+		SMBERROR("hashinit failed for %d elements \n", elements);
+		goto done;
+	}
+
+	if (new_hashlen == smp->sm_hashlen) {
+		hashdestroy(new_hash, M_SMBFSHASH, new_hashlen);
+		goto done;
+	}
+
+	SMBDEBUG("node hash %llu -> %lu buckets for %llu nodes \n",
+			 buckets, new_hashlen + 1, node_cnt);
+
+	/* Nothing to migrate as sm_oldhash is NULL */
+	smbfs_hash_lock_all(smp);
+
+	if (new_hashlen > smp->sm_hashlen) {
+		smp->sm_hash_grow_cnt++;
+	}
+	else {
+		smp->sm_hash_shrink_cnt++;
+	}
+
+	smp->sm_oldhash = smp->sm_hash;
+	smp->sm_oldhashlen = smp->sm_hashlen;
+	smp->sm_hash = new_hash;
+	smp->sm_hashlen = new_hashlen;
+	for (ii = 0; ii < SMBFS_HASH_LOCK_STRIPES; ii++) {
+		smp->sm_hash_migrated[ii] = 0;
+	}
+	smp->sm_hash_migrate_left = SMBFS_HASH_LOCK_STRIPES;
+
+	smbfs_hash_unlock_all(smp);
+
+done:
+	lck_mtx_unlock(&smp->sm_hash_resize_lock);
+}
+
 void
 smb_vhashrem(struct smbnode *np)
 {
-	smbfs_hash_lock(np->n_mount);
+	uint64_t hashval;
+
+	for (;;) {
+		hashval = np->n_hashval;
+		smbfs_hash_lock(np->n_mount, hashval);
+		if (hashval == np->n_hashval) {
+			break;
+		}
+		/* Hash value changed while we waited, try again */
+		smbfs_hash_unlock(np->n_mount, hashval);
+	}
+
 	if (np->n_hash.le_prev) {
 		LIST_REMOVE(np, n_hash);
 		np->n_hash.le_prev = NULL;
+		np->n_mount->sm_hash_cnt[hashval & (SMBFS_HASH_LOCK_STRIPES - 1)]--;
 	}
-	smbfs_hash_unlock(np->n_mount);
+	smbfs_hash_unlock(np->n_mount, hashval);
 	return;
 }
 
 void 
 smb_vhashadd(struct smbnode *np, uint64_t hashval)
 {
+	struct smbmount *smp = np->n_mount;
 	struct smbnode_hashhead	*nhpp;
+	uint32_t stripe = hashval & (SMBFS_HASH_LOCK_STRIPES - 1);
+	uint64_t stripe_buckets;
+	int need_resize = 0;
 	
-	smbfs_hash_lock(np->n_mount);
-	nhpp = SMBFS_NOHASH(np->n_mount, hashval);
+	smbfs_hash_lock(smp, hashval);
+	np->n_hashval = hashval;
+	nhpp = smbfs_hash_bucket(smp, hashval);
 	LIST_INSERT_HEAD(nhpp, np, n_hash);
-	smbfs_hash_unlock(np->n_mount);
+
+	/*
+	 * Hash values spread evenly over the stripes, so if this stripe is
+	 * over or under loaded, the whole table probably is too. Only check
+	 * here and not in smb_vhashrem() as that can be called from reclaim
+	 * where we do not want to be allocating memory.
+	 */
+	smp->sm_hash_cnt[stripe]++;
+	stripe_buckets = (smp->sm_hashlen + 1) / SMBFS_HASH_LOCK_STRIPES;
+	if ((smp->sm_hash_cnt[stripe] > (stripe_buckets * kSmbfsHashMaxLoad)) ||
+		(((smp->sm_hashlen + 1) > kSmbfsHashMinLen) &&
+		 (smp->sm_hash_cnt[stripe] < (stripe_buckets / kSmbfsHashMinLoadDiv)))) {
+		need_resize = 1;
+	}
+	smbfs_hash_unlock(smp, hashval);
+
+	if (need_resize) {
+		smbfs_hash_resize(smp);
+	}
 	return;
 	
 }
 
+/*
+ * Fill in the hash table info for smbfsStatFSCTL. The node count comes from
+ * the per stripe counters. Bucket use and the longest chain are sampled from
+ * one lock stripe per call, rotating through the stripes, so stats never
+ * hold more than one hash lock or walk the whole table.
+ */
+void
+smbfs_hash_stats(struct smbmount *smp, struct smb_node_hash_stats *statsp)
+{
+	struct smbnode *np;
+	uint64_t chain_len, used_buckets = 0;
+	uint32_t stripe, ii;
+	u_long jj;
+
+	statsp->lock_contended = smp->sm_hashlock_contended;
+	statsp->grow_cnt = smp->sm_hash_grow_cnt;
+	statsp->shrink_cnt = smp->sm_hash_shrink_cnt;
+
+	for (ii = 0; ii < SMBFS_HASH_LOCK_STRIPES; ii++) {
+		statsp->nodes += smp->sm_hash_cnt[ii];
+	}
+
+	stripe = (uint32_t) OSAddAtomic(1, &smp->sm_hash_stats_stripe) & (SMBFS_HASH_LOCK_STRIPES - 1);
+
+	/* The stripe number works as a hash value for its own lock */
+	smbfs_hash_lock(smp, stripe);
+
+	/* Finish moving the stripe if the table is being resized */
+	(void) smbfs_hash_bucket(smp, stripe);
+
+	statsp->buckets = smp->sm_hashlen + 1;
+	for (jj = stripe; jj <= smp->sm_hashlen; jj += SMBFS_HASH_LOCK_STRIPES) {
+		chain_len = 0;
+		LIST_FOREACH(np, &smp->sm_hash[jj], n_hash) {
+			chain_len++;
+		}
+
+		if (chain_len == 0) {
+			continue;
+		}
+
+		used_buckets++;
+		if (chain_len > statsp->max_chain) {
+			statsp->max_chain = chain_len;
+		}
+	}
+
+	smbfs_hash_unlock(smp, stripe);
+
+	/* Hash values spread evenly over the stripes */
+	statsp->used_buckets = MIN(used_buckets * SMBFS_HASH_LOCK_STRIPES,
+							   statsp->buckets);
+}
+
 /* Returns 0 if the names match, non zero if they do not match */
 static int
 smbfs_check_name(struct smb_share *share,
@@ -633,8 +930,8 @@ smb_hashget(struct smbmount *smp, struct smbnode *dnp, uint64_t hashval,
     sessionp = SS_TO_SESSION(smp->sm_share);
     
 loop:
-	smbfs_hash_lock(smp);
-	nhpp = SMBFS_NOHASH(smp, hashval);
+	smbfs_hash_lock(smp, hashval);
+	nhpp = smbfs_hash_bucket(smp, hashval);
 	LIST_FOREACH(np, nhpp, n_hash) {
 		/* 
 		 * If we are only looking for a stream node then skip any other nodes. 
@@ -726,7 +1023,7 @@ loop:
                 lck_mtx_unlock(&np->n_flag_alloc_lock);
                 ts.tv_sec = 1;
                 ts.tv_nsec = 0;
-                (void)msleep((caddr_t)np, smp->sm_hashlock, PINOD|PDROP, "smb_ngetalloc", &ts);
+                (void)msleep((caddr_t)np, SMBFS_HASHLOCK(smp, hashval), PINOD|PDROP, "smb_ngetalloc", &ts);
                 goto loop;
             } else {
                 lck_mtx_unlock(&np->n_flag_alloc_lock);
@@ -739,14 +1036,14 @@ loop:
             lck_mtx_unlock(&np->n_flag_alloc_lock);
             ts.tv_sec = 1;
             ts.tv_nsec = 0;
-			(void)msleep((caddr_t)np, smp->sm_hashlock, PINOD|PDROP, "smb_ngettransit", &ts);
+			(void)msleep((caddr_t)np, SMBFS_HASHLOCK(smp, hashval), PINOD|PDROP, "smb_ngettransit", &ts);
 			goto loop;
 		}
 
 		vp = SMBTOV(np);
 		vid = vnode_vid(vp);
         
-		smbfs_hash_unlock(smp);
+		smbfs_hash_unlock(smp, hashval);
         
 		if (vnode_getwithvid(vp, vid)) {
 			return (NULL);
@@ -762,7 +1059,7 @@ loop:
 		return (vp);
 	}
     
-	smbfs_hash_unlock(smp);
+	smbfs_hash_unlock(smp, hashval);
 	return (NULL);
 }
 
@@ -1078,6 +1375,8 @@ smbfs_nget(struct smb_share *share, struct mount *mp,
 	lck_rw_init(&np->n_name_rwlock, smbfs_rwlock_group, smbfs_lock_attr);
 	lck_rw_init(&np->n_parent_rwlock, smbfs_rwlock_group, smbfs_lock_attr);
     lck_mtx_init(&np->n_flag_alloc_lock, smbfs_mutex_group, smbfs_lock_attr);
+    lck_mtx_init(&np->n_attr_lock, smbfs_mutex_group, smbfs_lock_attr);
+    lck_mtx_init(&np->n_alloc_range_lock, smbfs_mutex_group, smbfs_lock_attr);
 
 	(void) smbnode_lock(np, SMBFS_EXCLUSIVE_LOCK);
 	/* if we error out, don't forget to unlock this */
@@ -1366,12 +1665,15 @@ errout:
     if (np->n_name != NULL) {
         SMB_FREE_DATA(np->n_name, np->n_name_allocsize);
     }
+    smbfs_path_cache_free(np);
     lck_rw_unlock_exclusive(&np->n_name_rwlock);
     
 	lck_rw_destroy(&np->n_rwlock, smbfs_rwlock_group);
 	lck_rw_destroy(&np->n_name_rwlock, smbfs_rwlock_group);
 	lck_rw_destroy(&np->n_parent_rwlock, smbfs_rwlock_group);
     lck_mtx_destroy(&np->n_flag_alloc_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&np->n_attr_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&np->n_alloc_range_lock, smbfs_mutex_group);
 
     SMB_FREE_TYPE(struct smbnode, np);
     
@@ -1485,6 +1787,8 @@ smbfs_vgetstrm(struct smb_share *share, struct smbmount *smp, vnode_t vp,
 	lck_rw_init(&snp->n_name_rwlock, smbfs_rwlock_group, smbfs_lock_attr);
 	lck_rw_init(&snp->n_parent_rwlock, smbfs_rwlock_group, smbfs_lock_attr);
     lck_mtx_init(&snp->n_flag_alloc_lock, smbfs_mutex_group, smbfs_lock_attr);
+    lck_mtx_init(&snp->n_attr_lock, smbfs_mutex_group, smbfs_lock_attr);
+    lck_mtx_init(&snp->n_alloc_range_lock, smbfs_mutex_group, smbfs_lock_attr);
 
 	(void) smbnode_lock(snp, SMBFS_EXCLUSIVE_LOCK);
 	locked = 1;
@@ -1674,7 +1978,9 @@ errout:
     lck_rw_destroy(&snp->n_rwlock, smbfs_rwlock_group);
 	lck_rw_destroy(&snp->n_name_rwlock, smbfs_rwlock_group);
 	lck_rw_destroy(&snp->n_parent_rwlock, smbfs_rwlock_group);
-    lck_mtx_destroy(&np->n_flag_alloc_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&snp->n_flag_alloc_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&snp->n_attr_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&snp->n_alloc_range_lock, smbfs_mutex_group);
 
     SMB_FREE_TYPE(struct smbnode, snp);
 
@@ -2179,7 +2485,7 @@ smbfs_attr_cacheenter(struct smb_share *share, vnode_t vp, struct smbfattr *fap,
             SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> due to vnode vtype changed \n",
                              np->n_name);
             
-            np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+            OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
             ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_INVALIDATE);
         }
 
@@ -2211,7 +2517,7 @@ smbfs_attr_cacheenter(struct smb_share *share, vnode_t vp, struct smbfattr *fap,
                     SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY, UBC_INVALIDATE on <%s> due to dataless file changed \n",
                                      np->n_name);
                     
-                    np->n_flag &= ~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY);
+                    OSBitAndAtomic(~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY), &np->n_flag);
                     ubc_msync (vp, 0, ubc_getsize(vp), NULL,
                                UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
                 }
@@ -2219,7 +2525,7 @@ smbfs_attr_cacheenter(struct smb_share *share, vnode_t vp, struct smbfattr *fap,
                     SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> due to dataless file (not open) changed \n",
                                      np->n_name);
                     
-                    np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+                    OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
                     ubc_msync (vp, 0, ubc_getsize(vp), NULL,
                                UBC_INVALIDATE);
                 }
@@ -2933,7 +3239,7 @@ smbfs_update_size(struct smbnode *np, struct timespec *reqtime,
              */
             if ((np->f_lockFID_refcnt > 0) || (np->f_sharedFID_refcnt > 0)) {
                 /* File has to be open for the msync to make sense */
-                if (np->n_write_unsafe == false) {
+                if (np->n_write_unsafe == 0) {
                     /* Did the vnop call that got us here allows us to write data? */
                     SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY, UBC_INVALIDATE on <%s> due to vnode mod time changed (%ld:%ld vs %ld:%ld) \n",
                                      np->n_name,
@@ -2942,7 +3248,7 @@ smbfs_update_size(struct smbnode *np, struct timespec *reqtime,
                                      np->n_mtime.tv_sec,
                                      np->n_mtime.tv_nsec);
 
-                    np->n_flag &= ~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY);
+                    OSBitAndAtomic(~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY), &np->n_flag);
                     ubc_msync (np->n_vnode, 0, ubc_getsize(np->n_vnode), NULL,
                                UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
                 }
@@ -2958,7 +3264,7 @@ smbfs_update_size(struct smbnode *np, struct timespec *reqtime,
                                      np->n_mtime.tv_sec,
                                      np->n_mtime.tv_nsec);
                     
-                    np->n_flag |= NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY;
+                    OSBitOrAtomic(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
                 }
             }
         }
@@ -2987,12 +3293,12 @@ smbfs_update_size(struct smbnode *np, struct timespec *reqtime,
 	 */
     if ((np->f_lockFID_refcnt > 0) || (np->f_sharedFID_refcnt > 0)) {
         /* File has to be open for the msync to make sense */
-        if (np->n_write_unsafe == false) {
+        if (np->n_write_unsafe == 0) {
             /* Did the vnop call that got us here allows us to write data? */
             SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY, UBC_INVALIDATE on <%s> due to file size changed \n",
                              np->n_name);
 
-            np->n_flag &= ~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY);
+            OSBitAndAtomic(~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY), &np->n_flag);
             ubc_msync (np->n_vnode, 0, ubc_getsize(np->n_vnode), NULL,
                        UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
         }
@@ -3005,7 +3311,7 @@ smbfs_update_size(struct smbnode *np, struct timespec *reqtime,
             SMB_LOG_UBC_LOCK(np, "Postpone UBC_PUSHDIRTY, UBC_INVALIDATE on <%s> due to file size changed \n",
                              np->n_name);
             
-            np->n_flag |= NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY;
+            OSBitOrAtomic(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
         }
     }
 
@@ -3013,6 +3319,418 @@ smbfs_update_size(struct smbnode *np, struct timespec *reqtime,
 	return TRUE;
 }
 
+/*
+ * smbfs_sync used to lock every active vnode on the mount to look for work.
+ * Instead a node is put on sm_sync_list when it may need work from
+ * smbfs_sync: a file that gets opened (reopen or revoke, deferred closes,
+ * lease upgrades, dirty data and pending set eofs all need an open file),
+ * a dir that gets opened, monitored or gets an enumeration cache.
+ * smbfs_sync_callback takes the node off again once it has nothing left.
+ */
+void
+smbfs_sync_list_add(struct smbnode *np)
+{
+    struct smbmount *smp = np->n_mount;
+
+    if (smp == NULL) {
+        return;
+    }
+
+    lck_mtx_lock(&smp->sm_sync_lock);
+    if (!np->n_sync_queued) {
+        TAILQ_INSERT_TAIL(&smp->sm_sync_list, np, n_sync_link);
+        np->n_sync_queued = 1;
+        smp->sm_sync_cnt += 1;
+    }
+    lck_mtx_unlock(&smp->sm_sync_lock);
+}
+
+void
+smbfs_sync_list_remove(struct smbnode *np)
+{
+    struct smbmount *smp = np->n_mount;
+
+    if (smp == NULL) {
+        return;
+    }
+
+    lck_mtx_lock(&smp->sm_sync_lock);
+    if (np->n_sync_queued) {
+        TAILQ_REMOVE(&smp->sm_sync_list, np, n_sync_link);
+        np->n_sync_queued = 0;
+        smp->sm_sync_cnt -= 1;
+    }
+    lck_mtx_unlock(&smp->sm_sync_lock);
+}
+
+/*
+ * Every smbnode may cache its UTF-16 path from the share root in n_path_cache,
+ * built from its parent's cached path plus its own name. A rename changes the
+ * path of the node and of everything below it. Only a dir has anything below
+ * it, named streams use the path of their file, so renaming anything else
+ * just bumps the node's own n_path_gen. Build workloads rename temp files all
+ * the time and that leaves every other cached path alone. For a dir, rather
+ * than walking the children, bump the mount's path generation which makes
+ * every cached path built before now stale. Call this after n_name or
+ * n_parent_vnode has been changed.
+ */
+void
+smbfs_path_cache_invalidate(struct smbnode *np)
+{
+    vnode_t vp = np->n_vnode;
+
+    OSIncrementAtomic((SInt32 *) &np->n_path_gen);
+
+    if ((vp == NULL) || vnode_isdir(vp)) {
+        /* Not sure what it is or it has children */
+        OSIncrementAtomic((SInt32 *) &np->n_mount->sm_path_gen);
+    }
+}
+
+void
+smbfs_path_cache_free(struct smbnode *np)
+{
+    /* Caller must hold n_name_rwlock exclusive or own the node */
+    if (np->n_path_cache != NULL) {
+        SMB_FREE_DATA(np->n_path_cache, np->n_path_cache_allocsize);
+        np->n_path_cache = NULL;
+    }
+    np->n_path_cache_len = 0;
+    np->n_path_cache_allocsize = 0;
+}
+
+/*
+ * Only the data fork of a file the server calls sparse gets an allocated range
+ * cache. Tiered files (offline, reparse point or recall on access) say they
+ * are sparse too, but their "holes" are data that has not been recalled yet
+ * and must never be handed back as zeros.
+ */
+static int
+smbfs_alloc_range_eligible(struct smb_share *share, struct smbnode *np)
+{
+    vnode_t vp = np->n_vnode;
+
+    if (!(SS_TO_SESSION(share)->session_flags & SMBV_SMB2) ||
+        !(share->ss_attributes & FILE_SUPPORTS_SPARSE_FILES) ||
+        (share->ss_fsctl_refused & SMBS_FSCTL_NO_ALLOC_RANGES)) {
+        return (0);
+    }
+
+    if ((vp == NULL) || !vnode_isreg(vp) || vnode_isnamedstream(vp)) {
+        return (0);
+    }
+
+    if (!(np->n_dosattr & SMB_EFA_SPARSE) ||
+        (np->n_dosattr & (SMB_EFA_OFFLINE | SMB_EFA_REPARSE_POINT |
+                          SMB_EFA_RECALL_ON_DATA_OPEN |
+                          SMB_EFA_RECALL_ON_DATA_ACCESS))) {
+        return (0);
+    }
+
+    return (1);
+}
+
+void
+smbfs_alloc_range_free(struct smbnode *np)
+{
+    /* Caller must hold n_alloc_range_lock or own the node */
+    if (np->n_alloc_ranges != NULL) {
+        SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, np->n_alloc_range_cnt,
+                            np->n_alloc_ranges);
+        np->n_alloc_ranges = NULL;
+    }
+    np->n_alloc_range_cnt = 0;
+    np->n_alloc_range_start = 0;
+    np->n_alloc_range_end = 0;
+}
+
+void
+smbfs_alloc_range_list_free(struct smbfs_alloc_range_list *listp)
+{
+    if (listp->ranges != NULL) {
+        SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, listp->cnt,
+                            listp->ranges);
+        listp->ranges = NULL;
+    }
+    listp->cnt = 0;
+    listp->start = 0;
+    listp->end = 0;
+}
+
+/*
+ * Called whenever the file data may have changed under the cache, a write,
+ * a size change or losing the lease. The generation bump keeps a fetch that
+ * was in flight at the time from installing what it got back.
+ */
+void
+smbfs_alloc_range_invalidate(struct smbnode *np)
+{
+    lck_mtx_lock(&np->n_alloc_range_lock);
+    np->n_alloc_range_gen++;
+    smbfs_alloc_range_free(np);
+    lck_mtx_unlock(&np->n_alloc_range_lock);
+}
+
+/*
+ * Without a read caching lease another client can fill in a hole or punch a
+ * new one at any time, so the cached layout can not be trusted.
+ */
+static int
+smbfs_alloc_range_leased(struct smbnode *np)
+{
+    int leased;
+
+    smbnode_lease_lock(&np->n_lease, smbfs_alloc_range_leased);
+    leased = ((np->n_lease.flags & SMB2_LEASE_GRANTED) &&
+              (np->n_lease.lease_state & SMB2_LEASE_READ_CACHING));
+    smbnode_lease_unlock(&np->n_lease);
+
+    return (leased);
+}
+
+/* Caller must hold n_alloc_range_lock and have checked for a read lease */
+static int
+smbfs_alloc_range_valid(struct smbnode *np, uint64_t offset)
+{
+    struct timespec ts;
+
+    if ((np->n_alloc_range_end <= np->n_alloc_range_start) ||
+        (offset < np->n_alloc_range_start) ||
+        (offset >= np->n_alloc_range_end)) {
+        return (0);
+    }
+
+    /* Our idea of the file changed since the fetch, so has the layout */
+    if ((np->n_alloc_range_size != np->n_size) ||
+        (timespeccmp(&np->n_alloc_range_mtime, &np->n_mtime, !=))) {
+        return (0);
+    }
+
+    nanouptime(&ts);
+    if ((ts.tv_sec - np->n_alloc_range_timer.tv_sec) > SMB_MAXATTRTIMO) {
+        return (0);
+    }
+
+    return (1);
+}
+
+/*
+ * ranges are sorted and cover up to end. If they are the node's cache, caller
+ * must hold n_alloc_range_lock and have checked the offset is valid.
+ */
+static void
+smbfs_alloc_range_find(struct smbfs_alloc_range *ranges, uint32_t cnt,
+                       uint64_t end, uint64_t offset, int *is_hole,
+                       uint64_t *run_end)
+{
+    uint32_t lo = 0, hi = cnt, mid;
+
+    /* Find the first range that ends past offset */
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if ((ranges[mid].offset + ranges[mid].length) <= offset) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if ((lo < cnt) && (ranges[lo].offset <= offset)) {
+        *is_hole = 0;
+        *run_end = ranges[lo].offset + ranges[lo].length;
+    }
+    else {
+        *is_hole = 1;
+        *run_end = (lo < cnt) ? ranges[lo].offset : end;
+    }
+}
+
+/*
+ * Is offset in a hole or in data, and where does that run end? Fills the
+ * cache with FSCTL_QUERY_ALLOCATED_RANGES from offset to the eof if needed.
+ * Without a read caching lease the node cache is not used. What the server
+ * returns is kept in listp instead, which only lives for the caller's read or
+ * seek, so a call that crosses many runs still only asks the server once.
+ * Returns ENOTSUP if the file does not qualify or nothing is known about
+ * offset, callers then treat it as data and read it from the server.
+ *
+ * The calling routine must hold a reference on the share and the node lock
+ */
+int
+smbfs_alloc_range_lookup(struct smb_share *share, struct smbnode *np,
+                         SMBFID fid, uint64_t offset, int *is_hole,
+                         uint64_t *run_end,
+                         struct smbfs_alloc_range_list *listp,
+                         vfs_context_t context)
+{
+    struct smbfs_alloc_range *ranges = NULL;
+    struct timespec mtime;
+    uint64_t end;
+    u_quad_t size;
+    uint32_t cnt = 0, gen;
+    int truncated = 0, leased;
+    int error;
+
+    if (!smbfs_alloc_range_eligible(share, np)) {
+        return (ENOTSUP);
+    }
+
+    /* Past the eof its up to the server */
+    size = np->n_size;
+    mtime = np->n_mtime;
+    if (offset >= size) {
+        return (ENOTSUP);
+    }
+
+    leased = smbfs_alloc_range_leased(np);
+
+    if (!leased) {
+        if ((offset >= listp->start) && (offset < listp->end)) {
+            smbfs_alloc_range_find(listp->ranges, listp->cnt, listp->end,
+                                   offset, is_hole, run_end);
+            return (0);
+        }
+        goto fetch;
+    }
+
+    lck_mtx_lock(&np->n_alloc_range_lock);
+    if (leased && smbfs_alloc_range_valid(np, offset)) {
+        smbfs_alloc_range_find(np->n_alloc_ranges, np->n_alloc_range_cnt,
+                               np->n_alloc_range_end, offset,
+                               is_hole, run_end);
+        lck_mtx_unlock(&np->n_alloc_range_lock);
+        return (0);
+    }
+    gen = np->n_alloc_range_gen;
+    lck_mtx_unlock(&np->n_alloc_range_lock);
+
+fetch:
+    error = smbfs_smb_query_allocated_ranges(share, fid, offset, size - offset,
+                                             &ranges, &cnt, &truncated,
+                                             context);
+    if (error) {
+        SMBDEBUG_LOCK(np, "Query allocated ranges failed %d on <%s> \n",
+                      error, np->n_name);
+        return (error);
+    }
+
+    end = size;
+    if (truncated) {
+        /* Only know up to the end of the last range we got */
+        end = (cnt > 0) ? ranges[cnt - 1].offset + ranges[cnt - 1].length : offset;
+    }
+
+    if (end <= offset) {
+        /* Learned nothing, let the server answer */
+        error = ENOTSUP;
+        goto done;
+    }
+
+    if (!leased) {
+        /* Only keep it for the rest of the caller's read or seek */
+        smbfs_alloc_range_list_free(listp);
+        listp->ranges = ranges;
+        listp->cnt = cnt;
+        listp->start = offset;
+        listp->end = end;
+        ranges = NULL;
+
+        smbfs_alloc_range_find(listp->ranges, listp->cnt, listp->end,
+                               offset, is_hole, run_end);
+        goto done;
+    }
+
+    lck_mtx_lock(&np->n_alloc_range_lock);
+    if (gen == np->n_alloc_range_gen) {
+        smbfs_alloc_range_free(np);
+        np->n_alloc_ranges = ranges;
+        np->n_alloc_range_cnt = cnt;
+        np->n_alloc_range_start = offset;
+        np->n_alloc_range_end = end;
+        np->n_alloc_range_size = size;
+        np->n_alloc_range_mtime = mtime;
+        nanouptime(&np->n_alloc_range_timer);
+        ranges = NULL;
+
+        smbfs_alloc_range_find(np->n_alloc_ranges, np->n_alloc_range_cnt,
+                               np->n_alloc_range_end, offset,
+                               is_hole, run_end);
+    }
+    else {
+        /* Raced with a write, let the server answer */
+        error = ENOTSUP;
+    }
+    lck_mtx_unlock(&np->n_alloc_range_lock);
+
+done:
+    if (ranges != NULL) {
+        SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, cnt, ranges);
+    }
+
+    return (error);
+}
+
+/*
+ * SEEK_HOLE and SEEK_DATA. Files that are not sparse, or whose layout we can
+ * not get, are all data with the implicit hole at the eof.
+ *
+ * The calling routine must hold a reference on the share and the node lock
+ */
+int
+smbfs_seek_hole_data(struct smb_share *share, struct smbnode *np,
+                     int want_hole, off_t *offsetp, vfs_context_t context)
+{
+    uint64_t offset, run_end;
+    u_quad_t size = np->n_size;
+    SMBFID fid = 0;
+    int is_hole, found = 0;
+    struct smbfs_alloc_range_list list = {0};
+
+    if (*offsetp < 0) {
+        return (EINVAL);
+    }
+
+    offset = (uint64_t) *offsetp;
+    if (offset >= size) {
+        return (ENXIO);
+    }
+
+    if (smbfs_alloc_range_eligible(share, np) &&
+        (smbfs_tmpopen(share, np, SMB2_FILE_READ_DATA, &fid, context) == 0)) {
+        while (offset < size) {
+            if (smbfs_alloc_range_lookup(share, np, fid, offset, &is_hole,
+                                         &run_end, &list, context)) {
+                /* Nothing known past here, call it data */
+                break;
+            }
+
+            if (is_hole == want_hole) {
+                found = 1;
+                break;
+            }
+
+            offset = run_end;
+        }
+
+        (void) smbfs_tmpclose(share, np, fid, context);
+        smbfs_alloc_range_list_free(&list);
+    }
+
+    if (!found) {
+        if (want_hole) {
+            /* Everything left is data, so its the implicit hole at the eof */
+            offset = size;
+        }
+        else if (offset >= size) {
+            return (ENXIO);
+        }
+    }
+
+    *offsetp = (off_t) offset;
+    return (0);
+}
+
 int
 smbfs_update_name_par(struct smb_share *share, vnode_t dvp, vnode_t vp,
                       struct timespec *reqtime,
@@ -3158,6 +3876,7 @@ smbfs_update_name_par(struct smb_share *share, vnode_t dvp, vnode_t vp,
         /* Set the new parent */
         np->n_parent_vnode = dvp;
         np->n_parent_vid = vnode_vid(dvp);
+        smbfs_path_cache_invalidate(np);
         
         /* Mark that we need to update the vnodes parent */
         update_flags |= VNODE_UPDATE_PARENT;
@@ -3229,6 +3948,7 @@ error:
         np->n_name = new_name2;
         np->n_nmlen = name_len;
         np->n_name_allocsize = new_name2_allocsize;
+        smbfs_path_cache_invalidate(np);
         
         /* Now its safe to free the old name */
         SMB_FREE_DATA(old_name, old_name_allocsize);
@@ -3295,7 +4015,7 @@ smbfs_CloseChildren(struct smb_share *share,
     
     if (need_lock == 1) {
         /* lock hash table before we walk it */
-        smbfs_hash_lock(smp);
+        smbfs_hash_lock_all(smp);
     }
     
     /* We have a hash table for each mount point */
@@ -3390,7 +4110,7 @@ smbfs_CloseChildren(struct smb_share *share,
     }
     
     if (need_lock == 1) {
-        smbfs_hash_unlock(smp);
+        smbfs_hash_unlock_all(smp);
     }
 }
 
@@ -3408,7 +4128,7 @@ smbfs_IObusy(struct smbmount *smp)
     int is_dir = 0;
 
     /* lock hash table before we walk it */
-    smbfs_hash_lock(smp);
+    smbfs_hash_lock_all(smp);
     
     /* We have a hash table for each mount point */
     for (ii = 0; ii < (smp->sm_hashlen + 1); ii++) {
@@ -3437,13 +4157,13 @@ smbfs_IObusy(struct smbmount *smp)
             
             if ((np->f_openTotalWCnt > 0) || (vnode_hasdirtyblks(SMBTOV(np)))) {
                 /* Found one busy file so return EBUSY */
-                smbfs_hash_unlock(smp);
+                smbfs_hash_unlock_all(smp);
                 return EBUSY;
             }
         }
     }
     
-    smbfs_hash_unlock(smp);
+    smbfs_hash_unlock_all(smp);
     
     /* No files open for write and no files with dirty UBC data */
     return 0;
@@ -3460,7 +4180,7 @@ smb1fs_reconnect(struct smbmount *smp)
     int is_dir = 0;
 
     /* Get the hash lock */
-    smbfs_hash_lock(smp);
+    smbfs_hash_lock_all(smp);
     
     /* We have a hash table for each mount point */
     for (ii = 0; ii < (smp->sm_hashlen + 1); ii++) {
@@ -3541,10 +4261,13 @@ smb1fs_reconnect(struct smbmount *smp)
             }
             
             lck_mtx_unlock(&np->f_openStateLock);
+
+            /* smbfs_sync does the reopen or revoke */
+            smbfs_sync_list_add(np);
         }
     }
     
-    smbfs_hash_unlock(smp);
+    smbfs_hash_unlock_all(smp);
 }
 
 int
@@ -3890,7 +4613,7 @@ smb2fs_reconnect(struct smbmount *smp)
      */
     
     /* Get the hash lock */
-    smbfs_hash_lock(smp);
+    smbfs_hash_lock_all(smp);
     
     /* We have a hash table for each mount point */
     for (ii = 0; ii < (smp->sm_hashlen + 1); ii++) {
@@ -4031,6 +4754,7 @@ smb2fs_reconnect(struct smbmount *smp)
             else {
                 /* Will try to reopen the files */
                 np->f_openState |= kNeedReopen;
+                smbfs_sync_list_add(np);
                 
                 /* Mark that at least one file needs to be reopened */
                 need_reopen = 1;
@@ -4040,7 +4764,7 @@ smb2fs_reconnect(struct smbmount *smp)
     } /* for ii loop */
     
     /* Free the hash lock */
-    smbfs_hash_unlock(smp);
+    smbfs_hash_unlock_all(smp);
         
     if (need_reopen == 0) {
         /* No files need to be reopened, so leave */
@@ -4061,7 +4785,7 @@ smb2fs_reconnect(struct smbmount *smp)
         done = 1;
         
         /* Get the hash lock */
-        smbfs_hash_lock(smp);
+        smbfs_hash_lock_all(smp);
 
         /* We have a hash table for each mount point */
         for (ii = 0; ii < (smp->sm_hashlen + 1); ii++) {
@@ -4106,7 +4830,7 @@ smb2fs_reconnect(struct smbmount *smp)
                  * while loop as the hash table may now change.
                  */
                 done = 0;
-                smbfs_hash_unlock(smp);
+                smbfs_hash_unlock_all(smp);
 
                 /*
                  * For all network calls, use iod_context so we can tell this is
@@ -4338,6 +5062,7 @@ smb2fs_reconnect(struct smbmount *smp)
                     
                     /* Mark file to be revoked in smbfs_sync_callback() */
                     np->f_openState |= kNeedRevoke;
+                    smbfs_sync_list_add(np);
                 }
                 
                 lck_mtx_unlock(&np->f_openStateLock);
@@ -4354,7 +5079,7 @@ smb2fs_reconnect(struct smbmount *smp)
 loop_again:
         if (done == 1) {
             /* if we get here, then must not have found any files to reopen */
-            smbfs_hash_unlock(smp);
+            smbfs_hash_unlock_all(smp);
         }
     }
     
@@ -4465,6 +5190,167 @@ smbnode_lease_unlock(struct smb2_lease *leasep)
     return (0);
 }
 
+/*
+ * Files with a deferred close are kept on sm_def_close_lru in the order they
+ * were last closed, so when we run out of budget or the server runs out of
+ * handles, the handles least likely to be reopened are closed first.
+ */
+void
+smbfs_def_close_lru_add(struct smbnode *np)
+{
+    struct smbmount *smp = np->n_mount;
+
+    if (smp == NULL) {
+        return;
+    }
+
+    lck_mtx_lock(&smp->sm_def_close_lock);
+    if (np->n_def_close_queued) {
+        TAILQ_REMOVE(&smp->sm_def_close_lru, np, n_def_close_link);
+    }
+    TAILQ_INSERT_TAIL(&smp->sm_def_close_lru, np, n_def_close_link);
+    np->n_def_close_queued = 1;
+    lck_mtx_unlock(&smp->sm_def_close_lock);
+}
+
+void
+smbfs_def_close_lru_remove(struct smbnode *np)
+{
+    struct smbmount *smp = np->n_mount;
+
+    if (smp == NULL) {
+        return;
+    }
+
+    lck_mtx_lock(&smp->sm_def_close_lock);
+    if (np->n_def_close_queued) {
+        TAILQ_REMOVE(&smp->sm_def_close_lru, np, n_def_close_link);
+        np->n_def_close_queued = 0;
+    }
+    lck_mtx_unlock(&smp->sm_def_close_lock);
+}
+
+struct smbfs_def_close_node {
+    vnode_t     vp;
+    uint32_t    vid;
+};
+
+/*
+ * Close deferred closes from the least recently used end until no more than
+ * max_cnt are left on the share. If check_time is set, only the ones idle
+ * longer than smbfs_def_close_timeout are closed, so stop at the first one
+ * that is not. Callers already holding an smbnode lock must set try_lock and
+ * any node that is busy is just skipped. Returns the number of handles closed.
+ */
+uint32_t
+smbfs_def_close_lru_trim(struct smb_share *share, struct smbmount *smp,
+                         int32_t max_cnt, uint32_t check_time, int try_lock,
+                         const char *reason, vfs_context_t context)
+{
+    struct smbfs_def_close_node *nodes = NULL;
+    struct smbnode *np = NULL;
+    struct timespec ts;
+    int32_t over;
+    uint32_t cnt = 0, closed = 0, i;
+    uint64_t was_deferred;
+
+    if ((share == NULL) || (smp == NULL)) {
+        return (0);
+    }
+
+    over = OSAddAtomic(0, &share->ss_curr_def_close_cnt) - MAX(max_cnt, 0);
+    if (over <= 0) {
+        return (0);
+    }
+
+    SMB_MALLOC_TYPE_COUNT(nodes, struct smbfs_def_close_node, over, Z_WAITOK);
+    if (nodes == NULL) {
+        return (0);
+    }
+
+    nanouptime(&ts);
+
+    /* Can not hold sm_def_close_lock across vnode_getwithvid() */
+    lck_mtx_lock(&smp->sm_def_close_lock);
+    TAILQ_FOREACH(np, &smp->sm_def_close_lru, n_def_close_link) {
+        if (cnt >= (uint32_t) over) {
+            break;
+        }
+
+        if ((check_time == 1) &&
+            ((ts.tv_sec - np->n_lease.def_close_timer) <= smbfs_def_close_timeout)) {
+            /* The rest were closed more recently */
+            break;
+        }
+
+        nodes[cnt].vp = np->n_vnode;
+        nodes[cnt].vid = vnode_vid(np->n_vnode);
+        cnt++;
+    }
+    lck_mtx_unlock(&smp->sm_def_close_lock);
+
+    for (i = 0; i < cnt; i++) {
+        if (vnode_getwithvid(nodes[i].vp, nodes[i].vid) != 0) {
+            /* Got recycled, reclaim closed it */
+            continue;
+        }
+        np = VTOSMB(nodes[i].vp);
+
+        if (try_lock) {
+            if (smbnode_trylock(np, SMBFS_EXCLUSIVE_LOCK) != 0) {
+                vnode_put(nodes[i].vp);
+                continue;
+            }
+        }
+        else {
+            smbnode_lock(np, SMBFS_EXCLUSIVE_LOCK);
+        }
+        np->n_lastvop = smbfs_def_close_lru_trim;
+
+        was_deferred = np->n_lease.flags & SMB2_DEFERRED_CLOSE;
+        CloseDeferredFileRefs(nodes[i].vp, reason, check_time, context);
+
+        if (!(np->n_lease.flags & SMB2_DEFERRED_CLOSE)) {
+            if (was_deferred) {
+                closed++;
+            }
+            /* In case the deferred close went away some other way */
+            smbfs_def_close_lru_remove(np);
+        }
+
+        smbnode_unlock(np);
+        vnode_put(nodes[i].vp);
+    }
+
+    SMB_FREE_TYPE_COUNT(struct smbfs_def_close_node, over, nodes);
+
+    return (closed);
+}
+
+/*
+ * The server ran out of file handles. Use no more than half of the deferred
+ * closes we hold now from here on and close the rest, least recently used
+ * first, so the caller can retry its open. smbfs_sync slowly gives the
+ * budget back. Never drop it to 0, that means deferred closes are off.
+ */
+uint32_t
+smbfs_def_close_server_limit(struct smb_share *share, struct smbmount *smp,
+                             vfs_context_t context)
+{
+    int32_t curr = OSAddAtomic(0, &share->ss_curr_def_close_cnt);
+
+    if (curr <= 0) {
+        return (0);
+    }
+
+    share->ss_max_def_close_cnt = MAX(curr / 2, 1);
+    SMBWARNING("Server is out of file handles, deferred close limit now %d on %s\n",
+               share->ss_max_def_close_cnt, share->ss_name);
+
+    return (smbfs_def_close_lru_trim(share, smp, share->ss_max_def_close_cnt, 0, 1,
+                                     "server handle limit", context));
+}
+
 void
 CloseDeferredFileRefs(vnode_t vp, const char *reason, uint32_t check_time,
                       vfs_context_t context)
@@ -4473,7 +5359,7 @@ CloseDeferredFileRefs(vnode_t vp, const char *reason, uint32_t check_time,
     int error = 0, remove_fid = 0, warning = 0;
     struct smb_share *share = NULL;
     struct timespec ts;
-    time_t def_close_timeo = k_def_close_timeout;
+    time_t def_close_timeo = smbfs_def_close_timeout;
     struct smb2_close_rq close_parms = {0};
     SMBFID fid = 0;
 
@@ -4551,6 +5437,7 @@ CloseDeferredFileRefs(vnode_t vp, const char *reason, uint32_t check_time,
         np->n_lease.flags |= SMB2_LEASE_BROKEN;
         np->n_lease.flags &= ~(SMB2_LEASE_GRANTED | SMB2_DEFERRED_CLOSE);
         OSAddAtomic(-1, &share->ss_curr_def_close_cnt);
+        smbfs_def_close_lru_remove(np);
         
         /* Clear some lease fields */
         np->n_lease.handle_reuse_cnt = 0;
@@ -5268,6 +6155,11 @@ smbfs_add_update_lease(struct smb_share *share, vnode_t vp, struct smb2_lease *i
         
         /* Deal with file UBC now */
         if (!vnode_isdir(vp)) {
+            if (purge_cache) {
+                /* Someone else may be filling in our holes */
+                smbfs_alloc_range_invalidate(np);
+            }
+
             /* Its a file, see if its currently cacheable or not */
             if (vnode_isnocache(vp)) {
                 /* Currently not cacheable, thus nothing to purge */
@@ -5299,7 +6191,7 @@ smbfs_add_update_lease(struct smb_share *share, vnode_t vp, struct smb2_lease *i
                         SMB_LOG_UBC_LOCK(np, "Postpone UBC_INVALIDATE on <%s> because currently in reconnect \n",
                                          np->n_name);
 
-                        np->n_flag |= NNEEDS_UBC_INVALIDATE;
+                        OSBitOrAtomic(NNEEDS_UBC_INVALIDATE, &np->n_flag);
                     }
                     else {
                         SMB_LOG_LEASING_LOCK(np, "Purge UBC cache on <%s> \n",
@@ -5308,7 +6200,7 @@ smbfs_add_update_lease(struct smb_share *share, vnode_t vp, struct smb2_lease *i
                         SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> due to lease update \n",
                                          np->n_name);
                         
-                        np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+                        OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
                         ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_INVALIDATE);
                     }
                 }
@@ -5696,6 +6588,7 @@ smbfs_handle_lease_break(struct lease_rq *lease_rqp, vfs_context_t context)
              */
             np->n_lease.flags &= ~(SMB2_LEASE_GRANTED | SMB2_DEFERRED_CLOSE);
             OSAddAtomic(-1, &share->ss_curr_def_close_cnt);
+            smbfs_def_close_lru_remove(np);
             
             /* Clear deferred close time */
             np->n_lease.def_close_timer = 0;
@@ -5866,7 +6759,7 @@ smbfs_handle_lease_break(struct lease_rq *lease_rqp, vfs_context_t context)
                 SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY on <%s> due to lease break \n",
                                  np->n_name);
                 
-                np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
                 ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
                 
                 /* Invalidate the meta data cache too */
@@ -5879,7 +6772,7 @@ smbfs_handle_lease_break(struct lease_rq *lease_rqp, vfs_context_t context)
                 SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> due to lease break \n",
                                  np->n_name);
                 
-                np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+                OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
                 ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_INVALIDATE);
                 
                 /* Invalidate the meta data cache too */
@@ -35,6 +35,8 @@
 #ifndef _FS_SMBFS_NODE_H_
 #define _FS_SMBFS_NODE_H_
 
+#include <smbfs/smbfs.h>	/* struct smb_compress_stats */
+
 /*
  * OS X semantics expect that node id of 2 is the root of the share.
  * If File IDs are supported by the SMB 2/3 server, then we need to return 2
@@ -62,6 +64,7 @@
 #define N_POLLNOTIFY	0x00800 /* Change notify is not support, poll */
 #define NO_EXTENDEDOPEN 0x01000 /* The server doesn't support the extended open reply */
 #define NHAS_POSIXMODES 0x02000 /* This node has a Windows NFS ACE that contains posix modes */
+/* The two NNEEDS_UBC bits get set and cleared under a shared lock, use OSBit*Atomic */
 #define NNEEDS_UBC_INVALIDATE 0x04000 /* Need to do a UBC_INVALIDATE on this file */
 #define NNEEDS_UBC_PUSHDIRTY  0x08000 /* Need to do a UBC_PUSH_DIRTY | UBC_INVALIDATE on this file */
 #define N_DONT_COMPRESS      0x010000 /* This file is not allowed to be compressed */
@@ -170,6 +173,33 @@ enum {
     kDirCacheDirty = 0x04       /* Needs Meta Data and/or Finder Info */
 };
 
+/*
+ * Dir enum cache entries are kept in enumeration order in blocks of
+ * kDirCacheBlockEntries so an entry never moves once added and the Nth
+ * entry can be found without walking the ones before it.
+ */
+#define kDirCacheBlockShift     8
+#define kDirCacheBlockEntries   (1 << kDirCacheBlockShift)
+#define kDirCacheBlockMask      (kDirCacheBlockEntries - 1)
+
+/* Entries added since the last sort that are searched one at a time */
+#define kDirCacheIndexMaxTail   64
+
+/*
+ * Entry names are packed back to back into chunks instead of each getting
+ * its own allocation. Chunks are in the order the names were added, so
+ * trimming the front of the cache frees whole chunks.
+ */
+#define kDirCacheNameChunkSize  (16 * 1024)
+
+struct smb_dir_name_chunk {
+    struct smb_dir_name_chunk *next;
+    char            *data;
+    uint32_t        size;
+    uint32_t        used;
+    uint32_t        last_slot;       /* highest cache slot with a name in here */
+};
+
 struct smb_enum_cache {
     u_int64_t       flags;
     u_int32_t       chg_cnt;         /* copy of dirchangecnt when dir cached */
@@ -177,7 +207,16 @@ struct smb_enum_cache {
     off_t           offset;          /* last cache offset */
     off_t           start_offset;    /* first entry cache offset */
     time_t			timer;           /* dir enum cache timer */
-    struct cached_dir_entry	*list;   /* dir enum cache */
+    struct cached_dir_entry	**blocks; /* dir enum cache, see smb_dir_cache_entry_at() */
+    uint32_t        block_cnt;       /* number of slots in blocks */
+    uint32_t        first;           /* slot of first entry, earlier ones removed */
+    struct cached_dir_entry	**name_index; /* first index_cnt entries sorted by name */
+    struct cached_dir_entry	**ino_index;  /* same entries sorted by node id */
+    uint32_t        index_cnt;
+    uint32_t        index_alloc;     /* size of name_index and ino_index */
+    struct smb_dir_name_chunk *name_chunks; /* oldest first */
+    struct smb_dir_name_chunk *name_tail;   /* chunk new names go into */
+    uint64_t        bytes;           /* entry blocks and name chunks in use */
 };
 
 struct smb_dir_cookie {
@@ -212,6 +251,29 @@ struct smb_open_dir {
     struct smb_dir_cookie cookies[kSMBDirCookieMaxCnt];
 };
 
+/*
+ * One FILE_ALLOCATED_RANGE_BUFFER entry from FSCTL_QUERY_ALLOCATED_RANGES,
+ * everything between two entries in a sparse file is a hole.
+ */
+struct smbfs_alloc_range {
+    uint64_t        offset;
+    uint64_t        length;
+};
+
+#define kSMBAllocRangeMaxCnt 512    /* ranges fetched per FSCTL, 8K reply */
+
+/*
+ * Ranges fetched for a single read or seek call when there is no read lease
+ * to cache them under. They cover [start, end) and are freed with
+ * smbfs_alloc_range_list_free() when the call is done.
+ */
+struct smbfs_alloc_range_list {
+    struct smbfs_alloc_range *ranges;
+    uint32_t        cnt;
+    uint64_t        start;
+    uint64_t        end;
+};
+
 struct smb_open_file {
     int32_t         needClose;          /* we opened it in the read call */
     int32_t         openTotalWriteCnt;  /* nbr of w opens (shared and nonshared) */
@@ -229,7 +291,7 @@ struct smb_open_file {
 struct smbnode {
 	lck_rw_t			n_rwlock;	
 	void *				n_lastvop;	/* tracks last operation that locked the smbnode */
-    bool                n_write_unsafe; /* vop is a read operation, ie we cannot pushdirty the UBC */
+    SInt32              n_write_unsafe; /* nbr of read vops in progress, ie we cannot pushdirty the UBC */
 	void *				n_activation;
 	uint32_t			n_lockState;	/* current lock state */
     uint32_t            n_flag;
@@ -240,6 +302,8 @@ struct smbnode {
 	vnode_t				n_vnode;
 	struct smbmount		*n_mount;
 	time_t				attribute_cache_timer;	/* attributes (MetaData) cache time */
+	lck_mtx_t			n_attr_lock;	/* Locks n_attr_refresh_thread */
+	void *				n_attr_refresh_thread;	/* thread getting attributes from the server */
 	struct timespec		n_last_meta_set_time; /* last time we set attributes (MetaData) */
 	struct timespec		n_crtime;	/* create time */
 	struct timespec		n_mtime;	/* modify time */
@@ -285,7 +349,18 @@ struct smbnode {
 	size_t				n_snmlen;	        /* if a stream then the legnth of the stream name */
 	char				*n_sname;	        /* if a stream then the the name of the stream */
     size_t              n_sname_allocsize;  /* n_sname alloc size, required when freeing n_sname */
+	char				*n_path_cache;		/* UTF-16 path from the share root, locked by n_name_rwlock */
+	size_t				n_path_cache_len;	/* each component has a leading '\' */
+	size_t				n_path_cache_allocsize;
+	uint32_t			n_path_cache_gen;	/* valid while it matches sm_path_gen */
+	uint32_t			n_path_cache_node_gen;	/* and this matches n_path_gen */
+	uint32_t			n_path_gen;			/* bumped when this node is renamed */
 	LIST_ENTRY(smbnode)	n_hash;
+	TAILQ_ENTRY(smbnode) n_sync_link;		/* on sm_sync_list, locked by sm_sync_lock */
+	uint32_t			n_sync_queued;		/* on sm_sync_list */
+	TAILQ_ENTRY(smbnode) n_def_close_link;	/* on sm_def_close_lru, locked by sm_def_close_lock */
+	uint32_t			n_def_close_queued;	/* on sm_def_close_lru */
+	uint64_t			n_hashval;          /* picks hash bucket and lock */
 	uint32_t			maxAccessRights;
 	struct timespec		maxAccessRightChTime;	/* change time */
 	uint32_t			n_reparse_tag;
@@ -295,6 +370,8 @@ struct smbnode {
     size_t              n_symlink_target_allocsize; /* n_symlink_target alloc size, required when freeing n_symlink_target */
 	time_t				n_symlink_cache_timer;
 	struct timespec		n_last_write_time;
+	struct smb_compress_stats n_compress;		/* protected by sm_compress_lock */
+	uint32_t			n_compress_ext;			/* sm_compress_ext index + 1, 0 if none */
 	uint64_t			n_lease_key_hi;			/* Used for Dir Lease or shared FID */
 	uint64_t			n_lease_key_low;
 	uint16_t			n_epoch;				/* lease epoch */
@@ -302,6 +379,22 @@ struct smbnode {
     struct timespec     n_last_close_mtime;     /* modify time on last close */
     u_quad_t            n_last_close_size;      /* data size on last close */
 
+    /*
+     * Allocated range cache of a sparse file, only used by the data fork.
+     * The ranges cover [n_alloc_range_start, n_alloc_range_end) and are only
+     * good while we hold a read caching lease and n_size and n_mtime match
+     * what they were when fetched.
+     */
+    lck_mtx_t           n_alloc_range_lock;     /* Locks the allocated range cache */
+    struct smbfs_alloc_range *n_alloc_ranges;
+    uint32_t            n_alloc_range_cnt;
+    uint32_t            n_alloc_range_gen;      /* bumped by every invalidate */
+    uint64_t            n_alloc_range_start;
+    uint64_t            n_alloc_range_end;
+    u_quad_t            n_alloc_range_size;     /* n_size when fetched */
+    struct timespec     n_alloc_range_mtime;    /* n_mtime when fetched */
+    struct timespec     n_alloc_range_timer;    /* uptime when fetched */
+
     struct smb_vnode_attr *n_hifi_attrs;        /* Cached hifi attributes from server */
     struct smb2_lease   n_lease;                /* lease for both dirs/files */
 };
@@ -459,11 +552,14 @@ int smbnode_lock(struct smbnode *np, enum smbfslocktype);
 int smbnode_trylock(struct smbnode *np, enum smbfslocktype locktype);
 int smbnode_lockpair(struct smbnode *np1, struct smbnode *np2, enum smbfslocktype);
 void smbnode_unlock(struct smbnode *np);
+void smbnode_lock_upgrade(struct smbnode *np);
+void smbnode_lock_downgrade(struct smbnode *np);
 void smbnode_unlockpair(struct smbnode *np1, struct smbnode *np2);
 uint64_t smbfs_hash(struct smb_share *share, uint64_t ino,
                     const char *name, size_t nmlen);
 void smb_vhashrem (struct smbnode *np);
 void smb_vhashadd(struct smbnode *np, uint64_t hashval);
+void smbfs_hash_stats(struct smbmount *smp, struct smb_node_hash_stats *statsp);
 int smbfs_is_ancestor(vnode_t potential_ancestor, struct smbnode *np);
 int smbfs_nget(struct smb_share *share, struct mount *mp,
                vnode_t dvp, const char *name, size_t nmlen,
@@ -489,6 +585,20 @@ int smbfsIsCacheable(vnode_t vp);
 void smbfs_setsize(vnode_t vp, off_t size);
 int smbfs_update_size(struct smbnode *np, struct timespec * reqtime,
                       u_quad_t new_size, struct smbfattr *fap);
+void smbfs_sync_list_add(struct smbnode *np);
+void smbfs_sync_list_remove(struct smbnode *np);
+void smbfs_path_cache_invalidate(struct smbnode *np);
+void smbfs_path_cache_free(struct smbnode *np);
+void smbfs_alloc_range_invalidate(struct smbnode *np);
+void smbfs_alloc_range_free(struct smbnode *np);
+void smbfs_alloc_range_list_free(struct smbfs_alloc_range_list *listp);
+int smbfs_alloc_range_lookup(struct smb_share *share, struct smbnode *np,
+                             SMBFID fid, uint64_t offset, int *is_hole,
+                             uint64_t *run_end,
+                             struct smbfs_alloc_range_list *listp,
+                             vfs_context_t context);
+int smbfs_seek_hole_data(struct smb_share *share, struct smbnode *np,
+                         int want_hole, off_t *offsetp, vfs_context_t context);
 int smbfs_update_name_par(struct smb_share *share, vnode_t dvp, vnode_t vp,
                           struct timespec *reqtime,
                           const char *new_name, size_t name_len);
@@ -504,12 +614,15 @@ int smbfs_readvdir(vnode_t vp, uio_t uio, int flags, int32_t *numdirent,
 int smbfs_0extend(struct smb_share *share, SMBFID fid, u_quad_t from,
                   u_quad_t to, int ioflag,
                   uint32_t *allow_compressionp, vfs_context_t context);
-int smbfs_doread(struct smb_share *share, off_t endOfFile, uio_t uiop,
+int smbfs_doread(struct smb_share *share, struct smbnode *np,
+                 off_t endOfFile, uio_t uiop,
                  SMBFID fid, uint32_t allow_compression,
                  vfs_context_t context);
 int smbfs_dowrite(struct smb_share *share, off_t endOfFile, uio_t uiop,
 				  SMBFID fid, int ioflag,
-                  uint32_t *allow_compressionp, vfs_context_t context);
+                  uint32_t *allow_compressionp,
+                  struct smb_compress_stats *compress_statsp,
+                  vfs_context_t context);
 void smbfs_uio_update(uio_t uio, user_size_t length);
 int32_t smbfs_IObusy(struct smbmount *smp);
 void smbfs_CloseChildren(struct smb_share *share,
@@ -533,6 +646,15 @@ int smbnode_lease_lock(struct smb2_lease *leasep, void *last_op);
 int smbnode_lease_unlock(struct smb2_lease *leasep);
 
 void CloseDeferredFileRefs(vnode_t vp, const char *reason, uint32_t check_time, vfs_context_t context);
+void smbfs_def_close_lru_add(struct smbnode *np);
+void smbfs_def_close_lru_remove(struct smbnode *np);
+uint32_t smbfs_def_close_lru_trim(struct smb_share *share, struct smbmount *smp,
+                                  int32_t max_cnt, uint32_t check_time,
+                                  int try_lock, const char *reason,
+                                  vfs_context_t context);
+uint32_t smbfs_def_close_server_limit(struct smb_share *share,
+                                      struct smbmount *smp,
+                                      vfs_context_t context);
 
 int smb2_dur_handle_init(struct smb_share *share, uint64_t flags,
                          struct smb2_durable_handle *dur_handlep,
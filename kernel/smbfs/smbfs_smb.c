@@ -1079,7 +1079,7 @@ smbfs_smb_create_windows_symlink(struct smb_share *share, struct smbnode *dnp,
         }
         
         error = smb_smb_write(share, fid, uio, 0,
-                              &allow_compression, context);
+                              &allow_compression, NULL, context);
         
         (void) smbfs_smb_close(share, fid, context);
     }
@@ -2763,6 +2763,7 @@ out:
             np->n_name = new_name;
             np->n_nmlen = s_namlen;
             np->n_name_allocsize = new_name_allocsize;
+            smbfs_path_cache_invalidate(np);
             
             /* Mark smb node so Meta data cache never expires */
             np->n_flag |= NMARKEDFORDLETE;
@@ -2918,6 +2919,8 @@ smbfs_seteof(struct smb_share *share, struct smbnode *np, SMBFID fid,
 	int error;
 	
 	error = smbfs_smb_seteof(share, fid, newsize, context);
+	/* Growing or shrinking moves holes around */
+	smbfs_alloc_range_invalidate(np);
 	if (error && (error != EBADF)) {
 		/* Not a reconnect error then report it */
 		SMBWARNING("smbfs_node_seteof failed error = %d\n", error);
@@ -5882,6 +5885,7 @@ smbfs_smb_findopen(struct smb_share *share, struct smbnode *dnp,
 	ctx->f_share = share;
 	smb_share_ref(ctx->f_share);
 
+    STAILQ_INIT(&ctx->f_queries);
     ctx->f_is_readdir = is_readdir;
 	ctx->f_dnp = dnp;
 	ctx->f_flags |= SMBFS_RDD_FINDFIRST;
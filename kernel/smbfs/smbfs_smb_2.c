@@ -23,6 +23,7 @@
 
 #include <sys/smb_apple.h>
 #include <sys/syslog.h>
+#include <libkern/OSAtomic.h>
 
 #include <sys/msfscc.h>
 #include <netsmb/smb.h>
@@ -3224,6 +3225,136 @@ bad:
 	return error;
 }
 
+/*
+ * Next entry at or after currp that still needs its Meta Data or Finder Info
+ * fetched. Entries that are already fresh in the dir cache are skipped.
+ */
+static struct cached_dir_entry *
+smb2fs_smb_cmpd_query_async_next(struct smb_enum_cache *cachep,
+                                 struct cached_dir_entry *currp,
+                                 int32_t flags, int32_t *fetch_flagsp)
+{
+    for (; currp != NULL; currp = smb_dir_cache_next(cachep, currp)) {
+        if ((flags & kDirCacheGetStreamInfo) &&
+            (currp->flags & kCacheEntryNeedsMetaData)) {
+            *fetch_flagsp = kDirCacheGetStreamInfo;
+            return (currp);
+        }
+        
+        if ((flags & kDirCacheGetFinderInfo) &&
+            (currp->flags & kCacheEntryNeedsFinderInfo)) {
+            *fetch_flagsp = kDirCacheGetFinderInfo;
+            return (currp);
+        }
+    }
+    
+    return (NULL);
+}
+
+/*
+ * No point in sending more requests once the thread doing the enumeration has
+ * been interrupted or its process is exiting.
+ */
+static int
+smb2fs_smb_cmpd_query_async_cancelled(vfs_context_t context)
+{
+    proc_t p;
+    
+    if (context == NULL) {
+        return (0);
+    }
+    
+    if (vfs_context_issignal(context, SMB_SIGMASK)) {
+        return (1);
+    }
+    
+    p = vfs_context_proc(context);
+    if ((p != NULL) && proc_exiting(p)) {
+        return (1);
+    }
+    
+    return (0);
+}
+
+/*
+ * Adjust the number of compounds to keep in flight from the round trip time
+ * of this reply. Every window worth of replies, grow the window by one while
+ * replies come back within twice the fastest round trip seen, else shrink it
+ * by a quarter as the requests are just queueing up on the server.
+ */
+static void
+smb2fs_smb_cmpd_query_async_adapt(struct smbmount *smp, struct smb_rq *rqp,
+                                  uint32_t max_cnt, uint32_t *windowp,
+                                  uint32_t *repliesp)
+{
+    struct timespec rtt, now, elapsed;
+    uint64_t rtt_usecs;
+    uint32_t window = *windowp;
+    
+    if ((rqp->sr_timereplied.tv_sec == 0) && (rqp->sr_timereplied.tv_nsec == 0)) {
+        /* Never got a reply, nothing to learn */
+        return;
+    }
+    
+    rtt = rqp->sr_timereplied;
+    timespecsub(&rtt, &rqp->sr_timesent);
+    rtt_usecs = ((uint64_t) rtt.tv_sec * 1000000) + (rtt.tv_nsec / 1000);
+    if (rtt_usecs == 0) {
+        rtt_usecs = 1;
+    }
+    
+    /*
+     * Min filter on round trip time, restarted every kQuantumRecheckTimeOut
+     * so that we notice if the path got slower.
+     */
+    nanouptime(&now);
+    elapsed = now;
+    timespecsub(&elapsed, &smp->sm_dir_async_rtt_window);
+    if ((smp->sm_dir_async_min_rtt_usecs == 0) ||
+        (rtt_usecs < smp->sm_dir_async_min_rtt_usecs) ||
+        (elapsed.tv_sec > kQuantumRecheckTimeOut)) {
+        smp->sm_dir_async_min_rtt_usecs = rtt_usecs;
+        smp->sm_dir_async_rtt_window = now;
+    }
+    
+    if (smp->sm_dir_async_srtt_usecs == 0) {
+        smp->sm_dir_async_srtt_usecs = rtt_usecs;
+    }
+    else {
+        smp->sm_dir_async_srtt_usecs = ((smp->sm_dir_async_srtt_usecs * 7) + rtt_usecs) / 8;
+    }
+    
+    *repliesp += 1;
+    if (*repliesp < window) {
+        return;
+    }
+    *repliesp = 0;
+    
+    if (smp->sm_dir_async_srtt_usecs <= (2 * smp->sm_dir_async_min_rtt_usecs)) {
+        if (window < max_cnt) {
+            window += 1;
+        }
+    }
+    else {
+        window = (window * 3) / 4;
+        if (window < kDirCacheAsyncMinCnt) {
+            window = kDirCacheAsyncMinCnt;
+        }
+        if (window > max_cnt) {
+            window = max_cnt;
+        }
+    }
+    
+    if (window != *windowp) {
+        SMB_LOG_DIR_CACHE("window %u -> %u, srtt %llu min rtt %llu usecs \n",
+                          *windowp, window,
+                          smp->sm_dir_async_srtt_usecs,
+                          smp->sm_dir_async_min_rtt_usecs);
+        *windowp = window;
+        smp->sm_dir_async_window = window;
+    }
+}
+
 /*
  * smb2fs_smb_cmpd_query_async() does a Create/QueryInfo(stream info)/Close or a
  * Create/Read(FinderInfo)/Close.
@@ -3232,7 +3363,14 @@ bad:
  * support the AAPL Create Context extension for readdirattr. For those servers
  * we end up doing a QueryDir, then for each entry returned, we call this
  * function to do a Create/QueryInfo/Close and then for those items that have
- * FinderInfo, we call this again to do Create/Read/Close.
+ * FinderInfo, a Create/Read/Close. If both kDirCacheGetStreamInfo and
+ * kDirCacheGetFinderInfo are set, the Finder Info read for an entry is sent
+ * as soon as its stream info shows that it has Finder Info.
+ *
+ * The number of compounds in flight adapts to the round trip times and the
+ * credits available. Returns EINTR if the enumerating thread gets a signal,
+ * or EAGAIN if it runs out of credits with nothing in flight to bring more
+ * back, in which case the entries not fetched yet are left as needing it.
  *
  * All this is in support of the directory enumeration caches.
  *
@@ -3245,23 +3383,18 @@ smb2fs_smb_cmpd_query_async(struct smb_share *share, vnode_t dvp,
     struct smb_enum_cache *cachep = in_cachep;
     struct smbnode *dnp = NULL;
     int error = 0, tmp_error;
-    int32_t nbr_to_update = 0;
     int i, j;
     struct cached_dir_entry *currp = NULL;
     struct cached_dir_entry *entryp = NULL;
-    int32_t count = 0;
+    int32_t curr_flags = 0, fetch_flags = 0;
     struct mdchain *mdp;
     struct compound_pb *pb = NULL;
     int done = 0;
     uint32_t ret_ntstatus = 0;
     struct smbmount *smp = NULL;
-    int32_t dir_cache_async_cnt = 10;
-    
-    if ((flags & kDirCacheGetStreamInfo) && (flags & kDirCacheGetFinderInfo)) {
-        /* Both can not be set at same time */
-        SMBERROR("Illegal flags 0x%x \n", flags);
-        return (EINVAL);
-    }
+    int32_t dir_cache_async_cnt = kDirCacheAsyncDefaultCnt;
+    uint32_t window, new_window, in_flight = 0, replies = 0, nbr_sent = 0;
+    int cancelled = 0;
     
     if (dvp == NULL) {
         SMBERROR("dvp is null \n");
@@ -3270,26 +3403,35 @@ smb2fs_smb_cmpd_query_async(struct smb_share *share, vnode_t dvp,
     dnp = VTOSMB(dvp);
     
     smp = VFSTOSMBFS(vnode_mount(dvp));
-    if (smp != NULL) {
-        if ((smp->sm_args.dir_cache_async_cnt != 0) &&
-            (smp->sm_args.dir_cache_async_cnt <= 100)){
-            dir_cache_async_cnt = smp->sm_args.dir_cache_async_cnt;
-        }
+    if (smp == NULL) {
+        SMBERROR("smp is null \n");
+        return (EINVAL);
+    }
+    
+    if ((smp->sm_args.dir_cache_async_cnt != 0) &&
+        (smp->sm_args.dir_cache_async_cnt <= 100)){
+        dir_cache_async_cnt = smp->sm_args.dir_cache_async_cnt;
+    }
+    
+    /* Start where the last enumeration on this mount left off */
+    window = smp->sm_dir_async_window;
+    if (window == 0) {
+        window = kDirCacheAsyncInitialCnt;
+    }
+    if (window > (uint32_t) dir_cache_async_cnt) {
+        window = dir_cache_async_cnt;
     }
-    SMB_LOG_DIR_CACHE("async cnt %d flags 0x%x\n", dir_cache_async_cnt, flags);
+    SMB_LOG_DIR_CACHE("async cnt %d window %u flags 0x%x\n",
+                      dir_cache_async_cnt, window, flags);
     
     /*
      * Find first entry that needs Meta Data or Finder Info.
      * A linear search is not that efficient, but its simple and should be
      * reliable. Plus I do not expect the dir cache to get too big.
      */
-    for (currp = cachep->list; currp; currp = currp->next) {
-        if (((flags & kDirCacheGetStreamInfo) && (currp->flags & kCacheEntryNeedsMetaData)) ||
-            ((flags & kDirCacheGetFinderInfo) && (currp->flags & kCacheEntryNeedsFinderInfo))) {
-            break;
-        }
-    }
-    
+    currp = smb2fs_smb_cmpd_query_async_next(cachep,
+                                             smb_dir_cache_entry_at(cachep, 0),
+                                             flags, &curr_flags);
     if (currp == NULL) {
         error = 0;
         goto bad;
@@ -3299,99 +3441,23 @@ smb2fs_smb_cmpd_query_async(struct smb_share *share, vnode_t dvp,
     /* Zero out param blocks */
     bzero(pb, dir_cache_async_cnt * sizeof(struct compound_pb));
 
-    /*
-     * Count how many entries need Meta Data or Finder Info.
-     * All entries will need their Meta Data fetched, but only those items that
-     * have Finder Info will need the Finder Info to be read.
-     */
     SMB_LOG_DIR_CACHE("Starting fetch data at <%s> \n", currp->name);
-    for (entryp = currp; entryp; entryp = entryp->next) {
-        if ((flags & kDirCacheGetStreamInfo) ||
-            ((flags & kDirCacheGetFinderInfo) && (entryp->flags & kCacheEntryNeedsFinderInfo))) {
-            SMB_LOG_DIR_CACHE2("counting <%s> \n", entryp->name);
-            nbr_to_update += 1;
-        }
-    }
-    SMB_LOG_DIR_CACHE("nbr_to_update %d \n", nbr_to_update);
-    
-    /* Dont exceed max async request count */
-    count = nbr_to_update;
-    if (nbr_to_update > dir_cache_async_cnt) {
-        count = dir_cache_async_cnt;
-    }
-    
-    /* Fill in initial requests */
-    for (i = 0; i < count; i++) {
-        if (currp == NULL) {
-            SMBERROR("curr is NULL? \n");
-            error = EINVAL;
-            goto bad;
-        }
-        
-        SMB_MALLOC_TYPE(pb[i].queryp, struct smb2_query_info_rq, Z_WAITOK_ZERO);
-        SMB_MALLOC_TYPE(pb[i].readp, struct smb2_rw_rq, Z_WAITOK_ZERO);
-        SMB_MALLOC_TYPE(pb[i].stream_infop, struct FILE_STREAM_INFORMATION, Z_WAITOK_ZERO);
-        SMB_MALLOC_TYPE(pb[i].closep, struct smb2_close_rq, Z_WAITOK_ZERO);
-        /*
-         * Fill in the Create/GetInfo/Close requests
-         */
-        error = smb2fs_smb_cmpd_query_async_fill(share, dnp, currp, &pb[i],
-                                                 flags, context);
-        
-        if (error) {
-            if (error == ENOBUFS) {
-                /* Running out of credits, clear error and send what we have */
-                SMBWARNING("low on credits %d\n", error);
-                error = 0;
-                
-                /* In this case, if the fill failed, dont increment i */
-                break;
-            }
-            else {
-                SMBWARNING("smb2fs_smb_cmpd_query_async_fill failed %d\n", error);
-                goto bad;
-            }
-        }
-        
-        /* On to next dir cache entry */
-        if (flags & kDirCacheGetStreamInfo) {
-            currp = currp->next;
-        }
-        else {
-            do {
-                currp = currp->next;
-            } while ((currp != NULL) &&
-                     !(currp->flags & kCacheEntryNeedsFinderInfo));
-        }
-    }
-    SMB_LOG_DIR_CACHE("Inital requests %d \n", i);
-    
-    nbr_to_update -= i;
     
     /*
-     * Send initial requests
+     * Wait for replies in slot order and refill each slot as soon as its reply
+     * has been parsed, as long as there is room left in the window. The first
+     * pass has nothing to wait on and just sends the initial requests.
      */
-    for (j = 0; j < i; j++) {
-        error = smb_iod_rq_enqueue(pb[j].create_rqp);
-        if (error) {
-			if (error != ETIMEDOUT) {
-				SMBWARNING("smb_iod_rq_enqueue failed %d\n", error);
-			}
-            goto bad;
-        }
-        pb[j].pending = 1;
-    }
-    
-    /* Wait for replies and refill requests as needed */
     while (!done) {
         /* Assume we are done */
         done = 1;
         
-        for (j = 0; j < i; j++) {
+        for (j = 0; j < dir_cache_async_cnt; j++) {
             if (pb[j].pending == 1) {
                 error = smb_rq_reply(pb[j].create_rqp);
                 
                 pb[j].pending = 0;
+                in_flight -= 1;
                 if (error) {
                     /*
                      * If its due to reconnect, then exit as we will have
@@ -3416,68 +3482,154 @@ smb2fs_smb_cmpd_query_async(struct smb_share *share, vnode_t dvp,
                     ret_ntstatus = pb[j].create_rqp->sr_ntstatus;
                 }
                 
+                smb2fs_smb_cmpd_query_async_adapt(smp, pb[j].create_rqp,
+                                                  dir_cache_async_cnt,
+                                                  &window, &replies);
+                
                 /* Now get pointer to response data */
                 smb_rq_getreply(pb[j].create_rqp, &mdp);
                 
                 error = smb2fs_smb_cmpd_query_async_parse(share, mdp, &pb[j],
-                                                          flags, context);
+                                                          pb[j].fetch_flags,
+                                                          context);
                 if (error) {
                     SMBWARNING("smb2fs_smb_cmpd_query_async_parse failed %d on <%s>\n",
 							   error, pb[j].createp->namep);
                     goto bad;
                 }
                 
-                if (nbr_to_update > 0) {
-                    /* More meta data to retrieve */
-                    error = smb2fs_smb_cmpd_query_async_fill(share, dnp, currp, &pb[j],
-                                                             flags, context);
-                    
-                    if (error) {
-                        if (error == ENOBUFS) {
-                            done = 0;   /* Not done yet */
-                            continue;   /* Wait for more credits to arrive */
-                        }
-                        
-                        SMBWARNING("smb2fs_smb_cmpd_query_async_fill2 failed %d on <%s> \n",
-								   error, pb[j].createp->namep);
+                /* Read its Finder Info next while the entry is still hot */
+                if ((pb[j].fetch_flags & kDirCacheGetStreamInfo) &&
+                    (flags & kDirCacheGetFinderInfo) &&
+                    (pb[j].entryp->flags & kCacheEntryNeedsFinderInfo)) {
+                    pb[j].finfo_entryp = pb[j].entryp;
+                }
+            }
+            
+            if ((pb[j].finfo_entryp == NULL) && (currp == NULL)) {
+                /* Nothing left to send */
+                continue;
+            }
+            
+            if (!cancelled && smb2fs_smb_cmpd_query_async_cancelled(context)) {
+                SMB_LOG_DIR_CACHE("Interrupted, draining %u requests for <%s> \n",
+                                  in_flight, dnp->n_name);
+                cancelled = 1;
+            }
+            
+            if (cancelled) {
+                /* Just wait for whatever is still in flight */
+                continue;
+            }
+            
+            /* Not done yet */
+            done = 0;
+            
+            if (in_flight >= window) {
+                /* Window is full, refill this slot on a later pass */
+                continue;
+            }
+            
+            if (pb[j].queryp == NULL) {
+                /* First use of this slot */
+                SMB_MALLOC_TYPE(pb[j].queryp, struct smb2_query_info_rq, Z_WAITOK_ZERO);
+                SMB_MALLOC_TYPE(pb[j].readp, struct smb2_rw_rq, Z_WAITOK_ZERO);
+                SMB_MALLOC_TYPE(pb[j].stream_infop, struct FILE_STREAM_INFORMATION, Z_WAITOK_ZERO);
+                SMB_MALLOC_TYPE(pb[j].closep, struct smb2_close_rq, Z_WAITOK_ZERO);
+            }
+            
+            if (pb[j].finfo_entryp != NULL) {
+                entryp = pb[j].finfo_entryp;
+                fetch_flags = kDirCacheGetFinderInfo;
+            }
+            else {
+                entryp = currp;
+                fetch_flags = curr_flags;
+            }
+            
+            /*
+             * Fill in the Create/GetInfo/Close or Create/Read/Close requests
+             */
+            error = smb2fs_smb_cmpd_query_async_fill(share, dnp, entryp, &pb[j],
+                                                     fetch_flags, context);
+            if (error) {
+                if (error == ENOBUFS) {
+                    if (in_flight == 0) {
+                        /*
+                         * Out of credits and no replies of ours to wait on,
+                         * so looping here would just spin. Stop and let a
+                         * later call fetch the rest.
+                         */
+                        SMB_LOG_DIR_CACHE("out of credits, stopping for <%s> \n",
+                                          dnp->n_name);
+                        error = EAGAIN;
                         goto bad;
                     }
                     
-                    /* On to next dir cache entry */
-                    if (flags & kDirCacheGetStreamInfo) {
-                        currp = currp->next;
-                    }
-                    else {
-                        do {
-                            currp = currp->next;
-                        } while ((currp != NULL) &&
-                                 !(currp->flags & kCacheEntryNeedsFinderInfo));
-                    }
-                    
-                    nbr_to_update -= 1;
+                    /*
+                     * Running out of credits, so the window can not be any
+                     * bigger than what is in flight right now. Wait for more
+                     * credits to arrive.
+                     */
+                    error = 0;
                     
-                    error = smb_iod_rq_enqueue(pb[j].create_rqp);
-                    if (error) {
-                        SMBWARNING("smb_iod_rq_enqueue failed %d on <%s> \n",
-								   error, pb[j].createp->namep);
-                        goto bad;
+                    new_window = MAX(in_flight, kDirCacheAsyncMinCnt);
+                    if (new_window < window) {
+                        SMB_LOG_DIR_CACHE("low on credits, window %u -> %u \n",
+                                          window, new_window);
+                        window = new_window;
+                        smp->sm_dir_async_window = window;
                     }
-                    pb[j].pending = 1;
-                    
-                    /* Not done yet */
-                    done = 0;
+                    continue;
                 }
+                
+                SMBWARNING("smb2fs_smb_cmpd_query_async_fill failed %d on <%s> \n",
+                           error, entryp->name);
+                goto bad;
+            }
+            
+            /* On to next dir cache entry */
+            if (pb[j].finfo_entryp != NULL) {
+                pb[j].finfo_entryp = NULL;
+            }
+            else {
+                currp = smb2fs_smb_cmpd_query_async_next(cachep,
+                                                         smb_dir_cache_next(cachep, currp),
+                                                         flags, &curr_flags);
             }
+            
+            error = smb_iod_rq_enqueue(pb[j].create_rqp);
+            if (error) {
+                if (error != ETIMEDOUT) {
+                    SMBWARNING("smb_iod_rq_enqueue failed %d on <%s> \n",
+                               error, pb[j].createp->namep);
+                }
+                goto bad;
+            }
+            pb[j].pending = 1;
+            in_flight += 1;
+            nbr_sent += 1;
+        }
+        
+        if (in_flight > 0) {
+            /* Still have replies to wait for */
+            done = 0;
         }
     }
     
+    SMB_LOG_DIR_CACHE("Sent %u requests, window %u \n", nbr_sent, window);
+    
+    if (cancelled && (error == 0)) {
+        error = EINTR;
+    }
+    
 bad:
     if (pb != NULL) {
         /* Cleanup time */
         for (i = 0; i < dir_cache_async_cnt; i++) {
             /* If it has not finished, then wait for it to finish */
             if (pb[i].pending == 1) {
-                error = smb_rq_reply(pb[i].create_rqp);
+                tmp_error = smb_rq_reply(pb[i].create_rqp);
                 pb[i].pending = 0;
             }
             
@@ -3522,6 +3674,10 @@ bad:
                 SMB_FREE_TYPE(struct smb2_query_info_rq, pb[i].queryp);
             }
             
+            if (pb[i].readp != NULL) {
+                SMB_FREE_TYPE(struct smb2_rw_rq, pb[i].readp);
+            }
+            
             if (pb[i].closep != NULL) {
                 SMB_FREE_TYPE(struct smb2_close_rq, pb[i].closep);
             }
@@ -3529,6 +3685,11 @@ bad:
             if (pb[i].stream_infop != NULL) {
                 SMB_FREE_TYPE(struct FILE_STREAM_INFORMATION, pb[i].stream_infop);
             }
+            
+            if (pb[i].finfo_uio != NULL) {
+                uio_free(pb[i].finfo_uio);
+                pb[i].finfo_uio = NULL;
+            }
         }
         
         SMB_FREE_TYPE_COUNT(struct compound_pb, dir_cache_async_cnt, pb);
@@ -3617,6 +3778,7 @@ smb2fs_smb_cmpd_query_async_fill(struct smb_share *share, struct smbnode *dnp,
     /* Start filling pb in */
     pb->dnp = dnp;
     pb->entryp = currp;
+    pb->fetch_flags = flags;
     
     /* Fill in Finder Info pb if needed */
     if (flags & kDirCacheGetFinderInfo) {
@@ -4202,33 +4364,189 @@ smb2fs_smb_add_fctx_query(struct smbfs_fctx *ctx)
         SMBERROR("out of memory");
         return NULL;
     }
-    SLIST_INSERT_HEAD(&ctx->f_queries, queryp, next);
+    STAILQ_INSERT_TAIL(&ctx->f_queries, queryp, next);
     return queryp;
 }
 
+/*
+ * Remove a saved query and free it. If its a read ahead still in flight, wait
+ * for its reply first since the iod may still be using it.
+ */
+static void
+smb2fs_smb_free_fctx_query(struct smbfs_fctx *ctx,
+                           struct smbfs_fctx_query_t *saved_query)
+{
+    if (saved_query->ra_queryp != NULL) {
+        (void) smb2_smb_query_dir_reply(saved_query->ra_queryp);
+        SMB_FREE_TYPE(struct smb2_query_dir_rq, saved_query->ra_queryp);
+        ctx->f_ra_inflight--;
+    }
+    if (saved_query->create_rqp != NULL) {
+        smb_rq_done(saved_query->create_rqp);
+    }
+    if (saved_query->query_rqp != NULL) {
+        smb_rq_done(saved_query->query_rqp);
+    }
+
+    STAILQ_REMOVE(&ctx->f_queries, saved_query, smbfs_fctx_query_t, next);
+    SMB_FREE_TYPE(struct smbfs_fctx_query_t, saved_query);
+}
+
 int
 smb2fs_smb_free_fctx_query_head(struct smbfs_fctx *ctx) {
-    struct smbfs_fctx_query_t *query_first = NULL;
-
     if (ctx == NULL) {
         return EINVAL;
     }
 
-    if (!SLIST_EMPTY(&ctx->f_queries)) {
+    if (!STAILQ_EMPTY(&ctx->f_queries)) {
         /* Free the saved query if there is one */
-        query_first = SLIST_FIRST(&ctx->f_queries);
-        if (query_first->create_rqp != NULL) {
-            smb_rq_done(query_first->create_rqp);
-        }
-        if (query_first->query_rqp != NULL) {
-            smb_rq_done(query_first->query_rqp);
+        smb2fs_smb_free_fctx_query(ctx, STAILQ_FIRST(&ctx->f_queries));
+    }
+    return 0;
+}
+
+/*
+ * Send the next Query Dir without waiting for its reply, so the reply arrives
+ * while the entries of the current reply are handed out.
+ *
+ * Only one Query Dir is ever in flight on the enumeration handle. The server
+ * may complete Query Dirs on the same handle in any order, so a second one
+ * could get the STATUS_NO_MORE_FILES meant for the last one and its entries
+ * would be lost. The next read ahead is only sent once the reply of this one
+ * has been collected. Different dirs each have their own handle, so their
+ * enumerations still overlap.
+ *
+ * queryp is the Query Dir whose reply just arrived. A reply that is less than
+ * half full usually means the enumeration is about done, so stop there.
+ */
+static void
+smb2fs_smb_findnext_read_ahead(struct smbfs_fctx *ctx,
+                               struct smb2_query_dir_rq *queryp)
+{
+    struct smb2_query_dir_rq *ra_queryp = NULL;
+    struct smbfs_fctx_query_t *saved_query = NULL;
+    struct smbiod *iod = NULL;
+    int error;
+
+    if ((ctx->f_need_close == FALSE) ||
+        (ctx->f_flags & (SMBFS_RDD_EOF | SMBFS_RDD_FINDSINGLE | SMBFS_RDD_FINDFIRST)) ||
+        (queryp->ret_buffer_len < (queryp->output_buffer_len / 2))) {
+        return;
+    }
+
+    if (ctx->f_ra_inflight != 0) {
+        return;
+    }
+
+    error = smb_iod_get_any_iod(SS_TO_SESSION(ctx->f_share), &iod, __FUNCTION__);
+    if (error) {
+        return;
+    }
+
+    /* Dont use up the credits that other requests need */
+    if (OSAddAtomic(0, &iod->iod_credits_granted) <= kCREDIT_LOW_WATER) {
+        goto done;
+    }
+
+    SMB_MALLOC_TYPE(ra_queryp, struct smb2_query_dir_rq, Z_WAITOK_ZERO);
+    if (ra_queryp == NULL) {
+        goto done;
+    }
+
+    ra_queryp->file_info_class = queryp->file_info_class;
+    ra_queryp->flags = 0;
+    ra_queryp->file_index = 0;
+    ra_queryp->output_buffer_len = queryp->output_buffer_len;
+    ra_queryp->fid = ctx->f_create_fid;
+    ra_queryp->name_flags = queryp->name_flags;
+    ra_queryp->dnp = queryp->dnp;
+    ra_queryp->namep = queryp->namep;
+    ra_queryp->name_len = queryp->name_len;
+    ra_queryp->name_allocsize = queryp->name_allocsize;
+
+    saved_query = smb2fs_smb_add_fctx_query(ctx);
+    if (saved_query == NULL) {
+        SMB_FREE_TYPE(struct smb2_query_dir_rq, ra_queryp);
+        goto done;
+    }
+
+    /*
+     * No context, the reply may be collected by a later call and the
+     * dir was already opened by this enumeration.
+     */
+    error = smb2_smb_query_dir_send(ctx->f_share, ra_queryp, iod, NULL);
+    saved_query->query_rqp = ra_queryp->ret_rqp;
+    if (error) {
+        /* Never sent, so just free it */
+        smb2fs_smb_free_fctx_query(ctx, saved_query);
+        SMB_FREE_TYPE(struct smb2_query_dir_rq, ra_queryp);
+        goto done;
+    }
+
+    saved_query->ra_queryp = ra_queryp;
+    ctx->f_ra_inflight++;
+
+done:
+    smb_iod_rel(iod, NULL, __FUNCTION__);
+}
+
+/*
+ * Collect the reply of a read ahead Query Dir, waiting for it if it has not
+ * arrived yet. If refill is set, the next read ahead Query Dir is sent.
+ */
+static int
+smb2fs_smb_findnext_ra_reply(struct smbfs_fctx *ctx,
+                             struct smbfs_fctx_query_t *saved_query,
+                             int refill)
+{
+    struct smb2_query_dir_rq *ra_queryp = saved_query->ra_queryp;
+    int error;
+
+    error = smb2_smb_query_dir_reply(ra_queryp);
+    saved_query->ra_queryp = NULL;
+    ctx->f_ra_inflight--;
+
+    if (!error) {
+        saved_query->output_buf_len = ra_queryp->ret_buffer_len;
+        ctx->f_queries_total_memory += saved_query->output_buf_len;
+
+        if (refill) {
+            smb2fs_smb_findnext_read_ahead(ctx, ra_queryp);
         }
     }
-    SLIST_REMOVE_HEAD(&ctx->f_queries, next);
-    if (query_first != NULL) {
-        SMB_FREE_TYPE(struct smbfs_fctx_query_t, query_first);
+
+    SMB_FREE_TYPE(struct smb2_query_dir_rq, ra_queryp);
+    return error;
+}
+
+/*
+ * Collect the reply of the read ahead Query Dir, if there is one. Must be
+ * done before the enumeration dir is closed.
+ */
+void
+smb2fs_smb_findnext_read_ahead_wait(struct smbfs_fctx *ctx)
+{
+    struct smbfs_fctx_query_t *saved_query, *next_query;
+    int error = 0;
+
+    STAILQ_FOREACH_SAFE(saved_query, &ctx->f_queries, next, next_query) {
+        if (error) {
+            smb2fs_smb_free_fctx_query(ctx, saved_query);
+            continue;
+        }
+
+        if (saved_query->ra_queryp == NULL) {
+            continue;
+        }
+
+        error = smb2fs_smb_findnext_ra_reply(ctx, saved_query, 0);
+        if (error) {
+            if (error == ENOENT) {
+                ctx->f_flags |= SMBFS_RDD_EOF;
+            }
+            smb2fs_smb_free_fctx_query(ctx, saved_query);
+        }
     }
-    return 0;
 }
 
 /*
@@ -4560,7 +4878,7 @@ parse_query:
     }
 
 bad:
-    query_first = SLIST_FIRST(&ctx->f_queries);
+    query_first = STAILQ_LAST(&ctx->f_queries, smbfs_fctx_query_t, next);
     query_first->create_rqp = create_rqp; /* save rqp so it can be freed later */
     query_first->query_rqp = query_rqp; /* save rqp so it can be freed later */
 	
@@ -7240,10 +7558,14 @@ smbfs_smb_close_attr(vnode_t vp, struct smb_share *share,
  * a chunk count of zero, because the server uses copyfile(3) and doesn't need
  * a list of chunks from the client.  To specify Mac-to-Mac semantics, the
  * mac_to_mac parameter should be set to TRUE.
+ *
+ * If ranges is not NULL, only those ranges of a sparse source are copied and
+ * the holes between them are skipped, range_cnt must be at least one.
  */
 static int
 smb2fs_smb_copychunks(struct smb_share *share, SMBFID src_fid,
                       SMBFID targ_fid, uint64_t src_file_len,
+                      struct smbfs_alloc_range *ranges, uint32_t range_cnt,
                       int mac_to_mac, vfs_context_t context)
 {
     struct smb2_ioctl_rq            *ioctlp = NULL;
@@ -7255,7 +7577,17 @@ smb2fs_smb_copychunks(struct smb_share *share, SMBFID src_fid,
     uint32_t                        max_chunk_len, retry;
     uint64_t                        remaining_len, this_len, src_offset;
     u_char                          resume_key[SMB2_RESUME_KEY_LEN];
+    struct smbfs_alloc_range        whole_file;
+    uint32_t                        range_idx;
     int error = 0;
+
+    if (ranges == NULL) {
+        /* Not sparse, copy it all as one range */
+        whole_file.offset = 0;
+        whole_file.length = src_file_len;
+        ranges = &whole_file;
+        range_cnt = 1;
+    }
 	
     /* Allocate a copychunk header with an array of chunk elements */
     sendbuf_len = sizeof(struct smb2_copychunk) +
@@ -7341,8 +7673,9 @@ smb2fs_smb_copychunks(struct smb_share *share, SMBFID src_fid,
         max_chunk_len = SMB2_COPYCHUNK_MAX_CHUNK_LEN;
 
 again:
-        remaining_len = src_file_len;
-        src_offset = 0;
+        range_idx = 0;
+        remaining_len = ranges[0].length;
+        src_offset = ranges[0].offset;
         while (remaining_len) {
             
             /* Fillup the chunk array */
@@ -7427,6 +7760,12 @@ again:
             }
         
             SMB_FREE_DATA(ioctlp->rcv_output_buffer,  ioctlp->rcv_output_allocsize);
+
+            /* Done with this range, skip the hole to the next one */
+            while ((remaining_len == 0) && (++range_idx < range_cnt)) {
+                remaining_len = ranges[range_idx].length;
+                src_offset = ranges[range_idx].offset;
+            }
         }
     }
 out:
@@ -7446,6 +7785,93 @@ out:
     return (error);
 }
 
+/*
+ * Get every allocated range of a sparse source file for copyfile. This is a
+ * fresh query and not the node cache, a stale hole here would lose data in
+ * the copy. Returns ENOTSUP if the file is not sparse, *cntp of zero means
+ * the file is one big hole.
+ */
+static int
+smb2fs_smb_copyfile_ranges(struct smb_share *share, SMBFID src_fid,
+                           uint32_t src_attrs, uint64_t src_file_len,
+                           struct smbfs_alloc_range **rangesp,
+                           uint32_t *cntp, vfs_context_t context)
+{
+    struct smbfs_alloc_range *ranges = NULL, *more = NULL, *merged;
+    uint32_t cnt = 0, more_cnt;
+    uint64_t offset = 0;
+    int truncated, error;
+
+    *rangesp = NULL;
+    *cntp = 0;
+
+    /* Tiered files say they are sparse, but their holes are not zeros */
+    if (!(share->ss_attributes & FILE_SUPPORTS_SPARSE_FILES) ||
+        !(src_attrs & SMB_EFA_SPARSE) ||
+        (src_attrs & (SMB_EFA_OFFLINE | SMB_EFA_REPARSE_POINT |
+                      SMB_EFA_RECALL_ON_DATA_OPEN |
+                      SMB_EFA_RECALL_ON_DATA_ACCESS)) ||
+        (src_file_len == 0)) {
+        return (ENOTSUP);
+    }
+
+    do {
+        error = smbfs_smb_query_allocated_ranges(share, src_fid,
+                                                 offset, src_file_len - offset,
+                                                 &more, &more_cnt, &truncated,
+                                                 context);
+        if (error) {
+            goto bad;
+        }
+
+        if (more_cnt == 0) {
+            /* Nothing more allocated, or a truncated reply with no ranges */
+            if (truncated) {
+                error = EBADRPC;
+                goto bad;
+            }
+            break;
+        }
+
+        if (ranges == NULL) {
+            ranges = more;
+            cnt = more_cnt;
+        }
+        else {
+            SMB_MALLOC_TYPE_COUNT(merged, struct smbfs_alloc_range,
+                                  cnt + more_cnt, Z_WAITOK_ZERO);
+            if (merged == NULL) {
+                SMBERROR("SMB_MALLOC_TYPE_COUNT failed for %u ranges \n",
+                         cnt + more_cnt);
+                SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, more_cnt, more);
+                error = ENOMEM;
+                goto bad;
+            }
+
+            memcpy(merged, ranges, cnt * sizeof(*ranges));
+            memcpy(&merged[cnt], more, more_cnt * sizeof(*more));
+            SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, cnt, ranges);
+            SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, more_cnt, more);
+            ranges = merged;
+            cnt += more_cnt;
+        }
+        more = NULL;
+
+        /* Pick up where the truncated reply left off */
+        offset = ranges[cnt - 1].offset + ranges[cnt - 1].length;
+    } while (truncated && (offset < src_file_len));
+
+    *rangesp = ranges;
+    *cntp = cnt;
+    return (0);
+
+bad:
+    if (ranges != NULL) {
+        SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, cnt, ranges);
+    }
+    return (error);
+}
+
 int
 smb2fs_smb_copyfile(struct smb_share *share, struct smbnode *src_np,
                     struct smbnode *tdnp, const char *tnamep,
@@ -7465,6 +7891,9 @@ smb2fs_smb_copyfile(struct smb_share *share, struct smbnode *src_np,
     uint32_t        target_created = 0;
     uint32_t create_options = 0;
     enum vtype vnode_type = VREG;
+    struct smbfs_alloc_range *ranges = NULL;
+    uint32_t range_cnt = 0;
+    int src_is_sparse = 0;
     
     if ((SS_TO_SESSION(share)->session_misc_flags & SMBV_OSX_SERVER) &&
         (SS_TO_SESSION(share)->session_server_caps & kAAPL_SUPPORTS_OSX_COPYFILE)) {
@@ -7558,16 +7987,31 @@ smb2fs_smb_copyfile(struct smb_share *share, struct smbnode *src_np,
     targ_is_open = TRUE;
     target_created = 1;
     
+    /*
+     * If the source is sparse, only copy its allocated ranges. The target is
+     * made sparse too so the skipped holes stay holes when we set its eof.
+     * If the ranges can not be had, just copy the whole thing.
+     */
+    if (smb2fs_smb_copyfile_ranges(share, src_fid, sfap->fa_attr,
+                                   src_file_len, &ranges, &range_cnt,
+                                   context) == 0) {
+        src_is_sparse = 1;
+        (void) smbfs_smb_set_sparse(share, targ_fid, context);
+    }
+
     /*************************************/
     /* Now initiate the server-side copy */
     /*************************************/
-    error = smb2fs_smb_copychunks(share, src_fid,
-                                  targ_fid, src_file_len,
-                                  FALSE, context);
-    
-    if (error) {
-        SMBDEBUG("smb2fs_smb_copychunks failed (file data) %d\n", error);
-        goto out;
+    if (!src_is_sparse || (range_cnt > 0)) {
+        error = smb2fs_smb_copychunks(share, src_fid,
+                                      targ_fid, src_file_len,
+                                      ranges, range_cnt,
+                                      FALSE, context);
+        
+        if (error) {
+            SMBDEBUG("smb2fs_smb_copychunks failed (file data) %d\n", error);
+            goto out;
+        }
     }
     
     /********************************/
@@ -7668,6 +8112,7 @@ smb2fs_smb_copyfile(struct smb_share *share, struct smbnode *src_np,
         /*************************************/
         error = smb2fs_smb_copychunks(share, src_xattr_fid,
                                       targ_xattr_fid, src_file_len,
+                                      NULL, 0,
                                       FALSE, context);
         
         if (error) {
@@ -7744,6 +8189,10 @@ out:
     if (tfap != NULL) {
         SMB_FREE_TYPE(struct smbfattr, tfap);
     }
+
+    if (ranges != NULL) {
+        SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, range_cnt, ranges);
+    }
     
     if ((error) && (target_created == 1)) {
         /* Try to delete the target file we created */
@@ -7847,6 +8296,7 @@ smb2fs_smb_copyfile_mac(struct smb_share *share, struct smbnode *src_np,
     /*************************************/
     error = smb2fs_smb_copychunks(share, src_fid,
                                   targ_fid, 0,
+                                  NULL, 0,
                                   TRUE, context);
     
     if (error) {
@@ -8027,7 +8477,7 @@ smbfs_smb_findclose(struct smbfs_fctx *ctx, vfs_context_t context)
     int error;
     
     if (SS_TO_SESSION(ctx->f_share)->session_flags & SMBV_SMB2) {
-        while(!SLIST_EMPTY(&ctx->f_queries)) {
+        while(!STAILQ_EMPTY(&ctx->f_queries)) {
             /* free all saved queries */
             smb2fs_smb_free_fctx_query_head(ctx);
         }
@@ -8079,12 +8529,12 @@ smb2fs_smb_findnext(struct smbfs_fctx *ctx, vfs_context_t context)
     uint8_t info_class, flags;
     uint32_t file_index;
     int attempts = 0;
-    off_t total_entries;
 
-    if (!SLIST_EMPTY(&ctx->f_queries)) {
+    if (!STAILQ_EMPTY(&ctx->f_queries)) {
         /* We have at least one query saved */
-        current_query = SLIST_FIRST(&ctx->f_queries);
-        if (current_query->output_buf_len == 0) {
+        current_query = STAILQ_FIRST(&ctx->f_queries);
+        if ((current_query->ra_queryp == NULL) &&
+            (current_query->output_buf_len == 0)) {
              /*
               * The current query is finished, free it
               * Shouldn't happen:
@@ -8093,7 +8543,7 @@ smb2fs_smb_findnext(struct smbfs_fctx *ctx, vfs_context_t context)
               */
             smb2fs_smb_free_fctx_query_head(ctx);
             current_query = NULL;
-            if (SLIST_EMPTY(&ctx->f_queries)) {
+            if (STAILQ_EMPTY(&ctx->f_queries)) {
                 /* We had one query only, and we finished parsing it, send query dir */
                 goto fetch_entries;
             }
@@ -8110,7 +8560,6 @@ smb2fs_smb_findnext(struct smbfs_fctx *ctx, vfs_context_t context)
             error = ENOMEM;
             goto bad;
         }
-    do_query:
         if (ctx->f_flags & SMBFS_RDD_EOF) {
             error = ENOENT;
             goto bad;
@@ -8218,7 +8667,7 @@ again:
             smb2fs_smb_free_fctx_query_head(ctx);
             if (error == ENOENT) {
                 ctx->f_flags |= SMBFS_RDD_EOF;
-                if (SLIST_EMPTY(&ctx->f_queries)) {
+                if (STAILQ_EMPTY(&ctx->f_queries)) {
                     /*
                      * ENOENT received and we parsed all saved queries
                      */
@@ -8255,16 +8704,12 @@ again:
         ctx->f_eofs = 0;
         ctx->f_attr.fa_reqtime = ts;
 
-        /* Limit saved queries to the size of the cache
-         * When we parse entries they will be removed from the saved query
-         * and stored in the cache
+        /*
+         * Hand out the entries of this reply right away instead of waiting
+         * for more replies to be saved first. The next Query Dir goes out
+         * now so its reply arrives while these entries are returned.
          */
-        total_entries = ctx->f_dnp->d_overflow_cache.count + ctx->f_queries_total_memory/k_entry_struct_size;
-        if ((total_entries < g_max_dir_entries_cached) &&
-            ((flags & SMB2_RETURN_SINGLE_ENTRY) == 0)) {
-            /* we can store more queries*/
-            goto do_query;
-        }
+        smb2fs_smb_findnext_read_ahead(ctx, queryp);
     }
 
 parse_query:
@@ -8272,7 +8717,31 @@ parse_query:
      * Either we did a new search and we are parsing the first entry out or
      * we are just parsing more names out of a previous search.
      */
-    current_query = SLIST_FIRST(&ctx->f_queries);
+    current_query = STAILQ_FIRST(&ctx->f_queries);
+
+    if (current_query->ra_queryp != NULL) {
+        /* Next reply is from the read ahead, collect it */
+        error = smb2fs_smb_findnext_ra_reply(ctx, current_query, 1);
+        if (error) {
+            if (error == ENOENT) {
+                ctx->f_flags |= SMBFS_RDD_EOF;
+            }
+
+            /* Toss the failed read ahead */
+            while (!STAILQ_EMPTY(&ctx->f_queries)) {
+                smb2fs_smb_free_fctx_query_head(ctx);
+            }
+
+            if ((error != ENOENT) && (ctx->f_need_close == FALSE)) {
+                /* Dir was closed on us by a reconnect, reopen it */
+                SMBDEBUG("Query Dir read ahead failed %d, reopening dir\n", error);
+                goto fetch_entries;
+            }
+            goto bad;
+        }
+
+        ctx->f_eofs = 0;
+    }
 
     ctx->f_NetworkNameLen = 0;
     
@@ -8317,6 +8786,7 @@ parse_query:
             SMBERROR("Unexpected info level %d\n", ctx->f_infolevel);
             goto bad;
 	}
+
     if (current_query->output_buf_len == 0) {
         /* The current query is finished, free it */
         smb2fs_smb_free_fctx_query_head(ctx);
@@ -10351,6 +10821,255 @@ smbfs_smb_seteof(struct smb_share *share, SMBFID fid, uint64_t newsize,
     return error;
 }
 
+static int
+smb2fs_smb_set_zero_data(struct smb_share *share, SMBFID fid, uint64_t from,
+                         uint64_t to, vfs_context_t context)
+{
+    struct smb2_ioctl_rq *ioctlp = NULL;
+    uint64_t zero_data[2];
+    int error = 0;
+
+    /*
+     * Build the IOCTL request, input is FILE_ZERO_DATA_INFORMATION which is
+     * the FileOffset and the BeyondFinalZero offset.
+     */
+    SMB_MALLOC_TYPE(ioctlp, struct smb2_ioctl_rq, Z_WAITOK_ZERO);
+    if (ioctlp == NULL) {
+		SMBERROR("SMB_MALLOC_TYPE failed\n");
+        error = ENOMEM;
+        goto bad;
+    }
+
+    zero_data[0] = htoleq(from);
+    zero_data[1] = htoleq(to);
+
+    ioctlp->share = share;
+    ioctlp->ctl_code = FSCTL_SET_ZERO_DATA;
+    ioctlp->fid = fid;
+    ioctlp->mc_flags = 0;
+
+	ioctlp->snd_input_buffer = (uint8_t *) zero_data;
+	ioctlp->snd_input_len = sizeof(zero_data);
+	ioctlp->snd_output_len = 0;
+	ioctlp->rcv_input_len = 0;
+	ioctlp->rcv_output_len = 0;
+
+    error = smb2_smb_ioctl(share, NULL, ioctlp, NULL, context);
+    if (error) {
+        SMBDEBUG("smb2_smb_ioctl failed %d ntstatus 0x%x\n",
+                 error, ioctlp->ret_ntstatus);
+
+        if ((ioctlp->ret_ntstatus == STATUS_NOT_SUPPORTED) ||
+            (ioctlp->ret_ntstatus == STATUS_NOT_IMPLEMENTED) ||
+            (ioctlp->ret_ntstatus == STATUS_INVALID_DEVICE_REQUEST)) {
+            /* Remember for this tree so we go straight to writing zeros */
+            OSBitOrAtomic(SMBS_FSCTL_NO_ZERO_DATA, &share->ss_fsctl_refused);
+            error = ENOTSUP;
+        }
+    }
+
+    if (ioctlp->rcv_output_buffer != NULL) {
+        SMB_FREE_DATA(ioctlp->rcv_output_buffer, ioctlp->rcv_output_allocsize);
+    }
+
+bad:
+    if (ioctlp != NULL) {
+        SMB_FREE_TYPE(struct smb2_ioctl_rq, ioctlp);
+    }
+
+    return (error);
+}
+
+/*
+ * Fetch the allocated ranges of [offset, offset + length) of an open file. If
+ * the server had more ranges than fit in the reply, *truncatedp gets set and
+ * only the ranges up to the end of the last one returned are known. The
+ * caller frees *rangesp with SMB_FREE_TYPE_COUNT(..., *cntp, ...).
+ *
+ * The calling routine must hold a reference on the share
+ */
+int
+smbfs_smb_query_allocated_ranges(struct smb_share *share, SMBFID fid,
+                                 uint64_t offset, uint64_t length,
+                                 struct smbfs_alloc_range **rangesp,
+                                 uint32_t *cntp, int *truncatedp,
+                                 vfs_context_t context)
+{
+    struct smb2_ioctl_rq *ioctlp = NULL;
+    struct smbfs_alloc_range *ranges = NULL;
+    uint64_t query[2];
+    uint64_t *entryp;
+    uint32_t i, cnt = 0;
+    int error = 0;
+
+    *rangesp = NULL;
+    *cntp = 0;
+    *truncatedp = 0;
+
+    if (!(SS_TO_SESSION(share)->session_flags & SMBV_SMB2) ||
+        (share->ss_fsctl_refused & SMBS_FSCTL_NO_ALLOC_RANGES)) {
+        return (ENOTSUP);
+    }
+
+    SMB_MALLOC_TYPE(ioctlp, struct smb2_ioctl_rq, Z_WAITOK_ZERO);
+    if (ioctlp == NULL) {
+		SMBERROR("SMB_MALLOC_TYPE failed\n");
+        error = ENOMEM;
+        goto bad;
+    }
+
+    query[0] = htoleq(offset);
+    query[1] = htoleq(length);
+
+    ioctlp->share = share;
+    ioctlp->ctl_code = FSCTL_QUERY_ALLOCATED_RANGES;
+    ioctlp->fid = fid;
+    ioctlp->mc_flags = 0;
+
+	ioctlp->snd_input_buffer = (uint8_t *) query;
+	ioctlp->snd_input_len = sizeof(query);
+	ioctlp->snd_output_len = 0;
+	ioctlp->rcv_input_len = 0;
+	ioctlp->rcv_output_len = kSMBAllocRangeMaxCnt * sizeof(query);
+
+    error = smb2_smb_ioctl(share, NULL, ioctlp, NULL, context);
+    if (error) {
+        SMBDEBUG("smb2_smb_ioctl failed %d ntstatus 0x%x\n",
+                 error, ioctlp->ret_ntstatus);
+
+        if ((ioctlp->ret_ntstatus == STATUS_NOT_SUPPORTED) ||
+            (ioctlp->ret_ntstatus == STATUS_NOT_IMPLEMENTED) ||
+            (ioctlp->ret_ntstatus == STATUS_INVALID_DEVICE_REQUEST)) {
+            OSBitOrAtomic(SMBS_FSCTL_NO_ALLOC_RANGES, &share->ss_fsctl_refused);
+            error = ENOTSUP;
+        }
+        goto bad;
+    }
+
+    /* STATUS_BUFFER_OVERFLOW is only a warning, we got the first ranges */
+    if (ioctlp->ret_ntstatus == STATUS_BUFFER_OVERFLOW) {
+        *truncatedp = 1;
+    }
+
+    if (ioctlp->rcv_output_buffer != NULL) {
+        cnt = ioctlp->rcv_output_len / (uint32_t) sizeof(query);
+    }
+
+    if (cnt == 0) {
+        /* Its all one big hole */
+        goto bad;
+    }
+
+    SMB_MALLOC_TYPE_COUNT(ranges, struct smbfs_alloc_range, cnt, Z_WAITOK_ZERO);
+    if (ranges == NULL) {
+        SMBERROR("SMB_MALLOC_TYPE_COUNT failed for %u ranges \n", cnt);
+        error = ENOMEM;
+        goto bad;
+    }
+
+    entryp = (uint64_t *) ioctlp->rcv_output_buffer;
+    for (i = 0; i < cnt; i++) {
+        ranges[i].offset = letohq(entryp[i * 2]);
+        ranges[i].length = letohq(entryp[(i * 2) + 1]);
+
+        /* Server has to return them sorted and not overlapping */
+        if ((ranges[i].offset + ranges[i].length < ranges[i].offset) ||
+            ((i > 0) &&
+             (ranges[i].offset < ranges[i - 1].offset + ranges[i - 1].length))) {
+            SMBERROR("Bad allocated range %u, offset %llu, length %llu \n",
+                     i, ranges[i].offset, ranges[i].length);
+            SMB_FREE_TYPE_COUNT(struct smbfs_alloc_range, cnt, ranges);
+            error = EBADRPC;
+            goto bad;
+        }
+    }
+
+    *rangesp = ranges;
+    *cntp = cnt;
+
+bad:
+    if (ioctlp != NULL) {
+        if (ioctlp->rcv_output_buffer != NULL) {
+            SMB_FREE_DATA(ioctlp->rcv_output_buffer, ioctlp->rcv_output_allocsize);
+        }
+
+        SMB_FREE_TYPE(struct smb2_ioctl_rq, ioctlp);
+    }
+
+    return (error);
+}
+
+/*
+ * Mark an open file as sparse so the ranges we never write stay holes.
+ *
+ * The calling routine must hold a reference on the share
+ */
+int
+smbfs_smb_set_sparse(struct smb_share *share, SMBFID fid,
+                     vfs_context_t context)
+{
+    struct smb2_ioctl_rq *ioctlp = NULL;
+    int error = 0;
+
+    if (!(SS_TO_SESSION(share)->session_flags & SMBV_SMB2)) {
+        return (ENOTSUP);
+    }
+
+    SMB_MALLOC_TYPE(ioctlp, struct smb2_ioctl_rq, Z_WAITOK_ZERO);
+    if (ioctlp == NULL) {
+		SMBERROR("SMB_MALLOC_TYPE failed\n");
+        return (ENOMEM);
+    }
+
+    /* No input buffer means SetSparse is TRUE */
+    ioctlp->share = share;
+    ioctlp->ctl_code = FSCTL_SET_SPARSE;
+    ioctlp->fid = fid;
+    ioctlp->mc_flags = 0;
+
+	ioctlp->snd_input_len = 0;
+	ioctlp->snd_output_len = 0;
+	ioctlp->rcv_input_len = 0;
+	ioctlp->rcv_output_len = 0;
+
+    error = smb2_smb_ioctl(share, NULL, ioctlp, NULL, context);
+    if (error) {
+        SMBDEBUG("smb2_smb_ioctl failed %d ntstatus 0x%x\n",
+                 error, ioctlp->ret_ntstatus);
+    }
+
+    if (ioctlp->rcv_output_buffer != NULL) {
+        SMB_FREE_DATA(ioctlp->rcv_output_buffer, ioctlp->rcv_output_allocsize);
+    }
+
+    SMB_FREE_TYPE(struct smb2_ioctl_rq, ioctlp);
+
+    return (error);
+}
+
+/*
+ * Ask the server to zero the byte range [from, to) of an open file. This does
+ * not change the end of file. Returns ENOTSUP if the server or file system
+ * can not do it, in which case the caller has to write the zeros itself.
+ *
+ * The calling routine must hold a reference on the share
+ */
+int
+smbfs_smb_set_zero_data(struct smb_share *share, SMBFID fid, uint64_t from,
+                        uint64_t to, vfs_context_t context)
+{
+    if (!(SS_TO_SESSION(share)->session_flags & SMBV_SMB2) ||
+        (share->ss_fsctl_refused & SMBS_FSCTL_NO_ZERO_DATA)) {
+        return (ENOTSUP);
+    }
+
+    if (from >= to) {
+        return (0);
+    }
+
+    return (smb2fs_smb_set_zero_data(share, fid, from, to, context));
+}
+
 static int
 smb2fs_smb_set_file_basic_info(struct smb_share *share,
                                struct smb2_set_info_file_basic_info **infopp,
@@ -107,6 +107,160 @@ smb_time_local2NT(struct timespec *tsp, uint64_t *nsec, int fat_fstype)
     }
 }
 
+/*
+ * Make sure the path being built for n_path_cache has room for need more bytes
+ */
+static int
+smb_fphelp_reserve(char **bufp, size_t len, size_t *allocsizep, size_t need)
+{
+	char *new_buf = NULL;
+	size_t new_allocsize;
+
+	if ((len + need) <= *allocsizep) {
+		return 0;
+	}
+
+	new_allocsize = MAX(*allocsizep * 2, roundup(len + need, 64));
+	SMB_MALLOC_DATA(new_buf, new_allocsize, Z_WAITOK);
+	if (new_buf == NULL) {
+		return ENOMEM;
+	}
+
+	if (*bufp != NULL) {
+		memcpy(new_buf, *bufp, len);
+		SMB_FREE_DATA(*bufp, *allocsizep);
+	}
+	*bufp = new_buf;
+	*allocsizep = new_allocsize;
+
+	return 0;
+}
+
+/*
+ * Add '\' and the UTF-16 name to the path being built for n_path_cache
+ */
+static int
+smb_fphelp_add_name(char **bufp, size_t *lenp, size_t *allocsizep,
+					const char *name, size_t name_len)
+{
+	char *dst;
+	size_t need, outleft;
+	int error;
+
+	/* Same worst case as smb_put_dmem plus the '\' */
+	need = 2 + (name_len * 2) + 2;
+	error = smb_fphelp_reserve(bufp, *lenp, allocsizep, need);
+	if (error) {
+		return error;
+	}
+
+	dst = *bufp + *lenp;
+	*dst++ = '\\';
+	*dst++ = 0;
+	outleft = need - 2;
+
+	error = smb_convert_to_network(&name, &name_len, &dst, &outleft,
+								   UTF_SFM_CONVERSIONS, TRUE);
+	if (error) {
+		return error;
+	}
+
+	*lenp += need - outleft;
+	return 0;
+}
+
+/*
+ * Put a UTF-16 path built for n_path_cache into the mbchain
+ */
+static int
+smb_fphelp_put_path(struct mbchain *mbp, const char *path, size_t path_len,
+					int add_slash, size_t *lenp)
+{
+	int error;
+
+	if (add_slash == 0) {
+		/* SMB 2/3 without a starting path does not want the first '\' */
+		path += 2;
+		path_len -= 2;
+		mb_put_padbyte(mbp);
+	}
+
+	error = mb_put_mem(mbp, path, path_len, MB_MSYSTEM);
+	if (!error && lenp) {
+		*lenp += path_len;
+	}
+
+	return error;
+}
+
+/*
+ * Is the path cached on np still good? Caller must hold np's n_name_rwlock.
+ */
+static int
+smb_fphelp_cache_valid(struct smbnode *np, uint32_t gen)
+{
+	return ((np->n_path_cache != NULL) &&
+			(np->n_path_cache_gen == gen) &&
+			(np->n_path_cache_node_gen == np->n_path_gen));
+}
+
+/*
+ * If np has a path cached for this path generation, put it into the mbchain.
+ * Returns TRUE if the cache was used, with any mbchain error in *errorp.
+ */
+static int
+smb_fphelp_put_cache(struct mbchain *mbp, struct smbnode *np, uint32_t gen,
+					 int add_slash, size_t *lenp, int *errorp)
+{
+	int found = FALSE;
+
+	lck_rw_lock_shared(&np->n_name_rwlock);
+	if (smb_fphelp_cache_valid(np, gen)) {
+		found = TRUE;
+		*errorp = smb_fphelp_put_path(mbp, np->n_path_cache,
+									  np->n_path_cache_len, add_slash, lenp);
+	}
+	lck_rw_unlock_shared(&np->n_name_rwlock);
+
+	return found;
+}
+
+/*
+ * If np has a path cached for this path generation, copy it to the start of
+ * the path being built. Returns TRUE if the cache was used, with any
+ * allocation error in *errorp.
+ */
+static int
+smb_fphelp_copy_cache(struct smbnode *np, uint32_t gen, char **bufp,
+					  size_t *lenp, size_t *allocsizep, int *errorp)
+{
+	int found = FALSE;
+
+	lck_rw_lock_shared(&np->n_name_rwlock);
+	if (smb_fphelp_cache_valid(np, gen)) {
+		found = TRUE;
+		*errorp = smb_fphelp_reserve(bufp, *lenp, allocsizep,
+									 np->n_path_cache_len);
+		if (*errorp == 0) {
+			memcpy(*bufp + *lenp, np->n_path_cache, np->n_path_cache_len);
+			*lenp += np->n_path_cache_len;
+		}
+	}
+	lck_rw_unlock_shared(&np->n_name_rwlock);
+
+	return found;
+}
+
+/*
+ * Put the path of np, relative to the share, into the mbchain.
+ *
+ * For SMB 2/3 the UTF-16 path is cached on the node in n_path_cache so most
+ * requests just copy it in. When the cache is missing or stale, we only walk
+ * up until we find a parent with a valid cache, use that as the prefix, then
+ * convert the remaining names and cache the result on np. smbfs_update_name_par
+ * and rename age the renamed node's cached path by bumping its n_path_gen, and
+ * for a dir all the cached paths by bumping sm_path_gen.
+ */
 int 
 smb_fphelp(struct smbmount *smp, struct mbchain *mbp, struct smbnode *np,
 		   int usingUnicode, size_t *lenp)
@@ -118,6 +272,14 @@ smb_fphelp(struct smbmount *smp, struct mbchain *mbp, struct smbnode *np,
     int lock_count = 0;
 	struct smbnode **lock_stack;
 	struct smbnode **locked_npp;
+    struct smbnode *cache_np = NULL;
+    uint32_t node_gen = 0;
+    char *path = NULL;
+    size_t path_len = 0, path_allocsize = 0;
+    /* Read the generation before any names so a racing rename ages our copy */
+    uint32_t gen = smp->sm_path_gen;
+    int use_cache = (usingUnicode &&
+                     (SS_TO_SESSION(smp->sm_share)->session_flags & SMBV_SMB2));
     SMB_MALLOC_TYPE_COUNT(npstack, struct smbnode *, SMBFS_MAXPATHCOMP, Z_WAITOK);
     npp = &npstack[0];
     SMB_MALLOC_TYPE_COUNT(lock_stack, struct smbnode *, SMBFS_MAXPATHCOMP+1, Z_WAITOK); /* stream file adds one */
@@ -171,6 +333,15 @@ smb_fphelp(struct smbmount *smp, struct mbchain *mbp, struct smbnode *np,
         }
     }
 
+    if (use_cache) {
+        cache_np = np;
+        /* Same as gen, read it before the names */
+        node_gen = np->n_path_gen;
+        if (smb_fphelp_put_cache(mbp, np, gen, add_slash, lenp, &error)) {
+            goto done;
+        }
+    }
+
 	i = 0;
     par_vp = smbfs_smb_get_parent(np, 0);   /* do our own locking */
     if ((par_vp == NULL) &&
@@ -195,6 +366,16 @@ smb_fphelp(struct smbmount *smp, struct mbchain *mbp, struct smbnode *np,
         *locked_npp++ = np;     /* Save node to be unlocked later */
         lock_count += 1;
         
+        if (use_cache &&
+            smb_fphelp_copy_cache(np, gen, &path, &path_len, &path_allocsize,
+                                  &error)) {
+            /* The parent's cached path is our prefix, no need to go higher */
+            if (error) {
+                goto done;
+            }
+            break;
+        }
+
         par_vp = smbfs_smb_get_parent(np, 0);   /* do our own locking */
         if ((par_vp == NULL) &&
             (np->n_parent_vid != 0)) {
@@ -207,6 +388,17 @@ smb_fphelp(struct smbmount *smp, struct mbchain *mbp, struct smbnode *np,
 
 	while (i--) {
 		np = *--npp;
+        if (use_cache) {
+            lck_rw_lock_shared(&np->n_name_rwlock);
+            error = smb_fphelp_add_name(&path, &path_len, &path_allocsize,
+                                        np->n_name, np->n_nmlen);
+            lck_rw_unlock_shared(&np->n_name_rwlock);
+
+            if (error)
+                break;
+            continue;
+        }
+
         if (add_slash == 1) {
             if (usingUnicode)
                 error = mb_put_uint16le(mbp, '\\');
@@ -233,6 +425,22 @@ smb_fphelp(struct smbmount *smp, struct mbchain *mbp, struct smbnode *np,
 			break;
 	}
 
+    if (use_cache && !error && (path_len > 0)) {
+        error = smb_fphelp_put_path(mbp, path, path_len, add_slash, lenp);
+        if (!error) {
+            /* Save it for the next request, the old one is stale anyways */
+            lck_rw_lock_exclusive(&cache_np->n_name_rwlock);
+            smbfs_path_cache_free(cache_np);
+            cache_np->n_path_cache = path;
+            cache_np->n_path_cache_len = path_len;
+            cache_np->n_path_cache_allocsize = path_allocsize;
+            cache_np->n_path_cache_gen = gen;
+            cache_np->n_path_cache_node_gen = node_gen;
+            lck_rw_unlock_exclusive(&cache_np->n_name_rwlock);
+            path = NULL;
+        }
+    }
+
 done:
     /* Unlock all the nodes */
     for (i = 0; i < lock_count; i++) {
@@ -250,6 +458,9 @@ done:
     if (lock_stack) {
         SMB_FREE_TYPE_COUNT(struct smbnode *, SMBFS_MAXPATHCOMP+1, lock_stack);
     }
+    if (path != NULL) {
+        SMB_FREE_DATA(path, path_allocsize);
+    }
 
 	return error;
 }
@@ -97,6 +97,15 @@ enum {
     kDirCacheGetFinderInfo = 0x02
 };
 
+/*
+ * Number of Create/Query/Close compounds smb2fs_smb_cmpd_query_async() keeps
+ * in flight. The window starts at kDirCacheAsyncInitialCnt and then follows
+ * the round trip times and credits, up to dir_cache_async_cnt.
+ */
+#define kDirCacheAsyncDefaultCnt 32     /* keep in sync with preference.c */
+#define kDirCacheAsyncInitialCnt 10
+#define kDirCacheAsyncMinCnt 2
+
 /* enum cache flags */
 enum {
     kCacheEntryNeedsMetaData = 0x01,    /* Need to fetch Meta data */
@@ -112,7 +121,7 @@ struct cached_dir_entry {
     uint32_t query_ntstatus;
     uint32_t read_ntstatus;
     int error;
-    struct cached_dir_entry *next;
+    uint32_t cache_index;   /* slot in its smb_enum_cache */
 };
 
 struct compound_pb {
@@ -141,6 +150,8 @@ struct compound_pb {
     uio_t finfo_uio;
     uint8_t finfo[60];
 
+    int32_t fetch_flags;    /* kDirCacheGetStreamInfo or kDirCacheGetFinderInfo */
+    struct cached_dir_entry *finfo_entryp; /* Finder Info read to send next */
     int pending;
 };
 
@@ -159,11 +170,14 @@ struct compound_pb {
 #define	SMB_SKEYLEN		21			/* search context */
 #define SMB_DENTRYLEN		(SMB_SKEYLEN + 22)	/* entire entry */
 
+struct smb2_query_dir_rq;
+
 struct smbfs_fctx_query_t{
     struct smb_rq   *create_rqp;
     struct smb_rq   *query_rqp;
     uint32_t        output_buf_len;   /* bytes left in current response */
-    SLIST_ENTRY(smbfs_fctx_query_t) next;
+    struct smb2_query_dir_rq *ra_queryp; /* read ahead, reply not collected yet */
+    STAILQ_ENTRY(smbfs_fctx_query_t) next;
 };
 
 struct smbfs_fctx {
@@ -197,8 +211,9 @@ struct smbfs_fctx {
 	uint32_t	f_rnameofs;
 	int			f_rkey;		/* resume key */
     /* SMB 2/3 fields */
-    SLIST_HEAD(f_queries_head, smbfs_fctx_query_t) f_queries;
+    STAILQ_HEAD(f_queries_head, smbfs_fctx_query_t) f_queries; /* in send order */
     uint32_t    f_queries_total_memory;
+    uint32_t    f_ra_inflight;      /* read ahead Query Dir not collected yet, 0 or 1 */
     int         f_need_close;
     int         f_fid_closed;
     SMBFID      f_create_fid;
@@ -40,10 +40,22 @@
 extern int32_t gSMBSleeping;
 
 lck_mtx_t global_dir_cache_lock;
-struct global_dir_cache_entry *global_dir_cache_head;
+TAILQ_HEAD(global_dir_cache_lru_head, global_dir_cache_entry) global_dir_cache_lru;
+LIST_HEAD(global_dir_cache_hash_head, global_dir_cache_entry) *global_dir_cache_hash;
+u_long global_dir_cache_hash_len = 0;
+#define	GLOBAL_DIR_CACHE_HASH(dvp, vid) \
+	(&global_dir_cache_hash[((((uintptr_t) (dvp)) >> 8) ^ (vid)) & global_dir_cache_hash_len])
 uint64_t g_hardware_memory_size = 0;
-uint32_t g_max_dirs_cached = k_2GB_max_dirs_cached;
+uint32_t g_max_dirs_cached = k_max_dirs_cached;
 uint32_t g_max_dir_entries_cached = k_2GB_max_dir_entries_cached;
+uint64_t g_max_dir_cache_bytes = k_min_dir_cache_bytes;
+
+/* Protected by global_dir_cache_lock */
+static uint64_t g_dir_cache_bytes = 0;	/* used by dirs on the LRU list */
+static uint32_t g_dir_cache_dirs = 0;	/* dirs on the LRU list */
+static uint64_t g_dir_cache_lookups = 0;
+static uint64_t g_dir_cache_hits = 0;
+static uint64_t g_dir_cache_evictions = 0;
 
 
 #pragma mark - SMB Data Compression
@@ -233,6 +245,192 @@ smb_compression_excluded(const char* extension, size_t extension_len)
 }
 
 
+/*
+ * Compression is only worth it if it saves at least kSmbCompressMinSavings
+ * percent. After kSmbCompressBadLimit write calls in a row that do not, a
+ * file or an extension is not compressed for kSmbCompressReprobeSecs, then
+ * one write call is tried again. Each time it gets turned off again in a row
+ * the wait doubles, up to kSmbCompressReprobeMaxSecs.
+ */
+#define kSmbCompressMinSavings      10
+#define kSmbCompressBadLimit        4
+#define kSmbCompressReprobeSecs     60
+#define kSmbCompressReprobeMaxSecs  3600
+
+/*
+ * Return the index + 1 of the extension in sm_compress_ext, adding it if
+ * there is room, or 0 if it is not tracked.
+ * Called with sm_compress_lock held.
+ */
+static uint32_t
+smb_compress_ext_get(struct smbmount *smp, const char *extension)
+{
+    uint32_t i;
+
+    if (strnlen(extension, SMB_COMPRESS_EXT_LEN) >= SMB_COMPRESS_EXT_LEN) {
+        return(0);
+    }
+
+    for (i = 0; i < smp->sm_compress_ext_cnt; i++) {
+        if (strncasecmp(smp->sm_compress_ext[i].ce_name, extension,
+                        SMB_COMPRESS_EXT_LEN) == 0) {
+            return(i + 1);
+        }
+    }
+
+    if (smp->sm_compress_ext_cnt >= kSmbCompressExtMax) {
+        return(0);
+    }
+
+    i = smp->sm_compress_ext_cnt++;
+    strlcpy(smp->sm_compress_ext[i].ce_name, extension,
+            sizeof(smp->sm_compress_ext[i].ce_name));
+
+    return(i + 1);
+}
+
+/*
+ * Called with sm_compress_lock held
+ */
+static int
+smb_compress_stats_allowed(struct smb_compress_stats *statsp, time_t now)
+{
+    if (statsp->reprobe_time == 0) {
+        return(1);
+    }
+
+    if (now < statsp->reprobe_time) {
+        return(0);
+    }
+
+    /* Try again, one more bad write call turns it back off */
+    statsp->reprobe_time = 0;
+    statsp->bad_cnt = kSmbCompressBadLimit - 1;
+
+    return(1);
+}
+
+/*
+ * Add the results of one write call. Returns 1 if that turned compression
+ * off. Called with sm_compress_lock held.
+ */
+static int
+smb_compress_stats_add(struct smb_compress_stats *totalp,
+                       struct smb_compress_stats *statsp,
+                       int bad, int force_off, time_t now)
+{
+    time_t wait = kSmbCompressReprobeSecs;
+
+    totalp->in_bytes += statsp->in_bytes;
+    totalp->out_bytes += statsp->out_bytes;
+    totalp->usecs += statsp->usecs;
+    totalp->writes += statsp->writes;
+    totalp->fails += statsp->fails;
+
+    if (!bad) {
+        totalp->bad_cnt = 0;
+        totalp->disabled_cnt = 0;
+        return(0);
+    }
+
+    totalp->bad_cnt += 1;
+    if ((totalp->bad_cnt < kSmbCompressBadLimit) && !force_off) {
+        return(0);
+    }
+
+    wait <<= MIN(totalp->disabled_cnt, 6);
+    if (wait > kSmbCompressReprobeMaxSecs) {
+        wait = kSmbCompressReprobeMaxSecs;
+    }
+
+    totalp->bad_cnt = 0;
+    totalp->disabled_cnt += 1;
+    totalp->reprobe_time = now + wait;
+
+    return(1);
+}
+
+/*
+ * Has compression been turned off for this file or its extension because
+ * it was not compressing? Files excluded by name have N_DONT_COMPRESS set
+ * instead.
+ */
+int
+smbfs_compress_allowed_now(struct smbnode *np)
+{
+    struct smbmount *smp = np->n_mount;
+    struct smb_compress_stats *ext_statsp = NULL;
+    struct timespec ts;
+    int allowed = 1;
+
+    nanouptime(&ts);
+
+    lck_mtx_lock(&smp->sm_compress_lock);
+
+    if (np->n_compress_ext != 0) {
+        ext_statsp = &smp->sm_compress_ext[np->n_compress_ext - 1].ce_stats;
+    }
+
+    if (!smb_compress_stats_allowed(&np->n_compress, ts.tv_sec)) {
+        allowed = 0;
+    }
+    else if ((ext_statsp != NULL) &&
+             !smb_compress_stats_allowed(ext_statsp, ts.tv_sec)) {
+        allowed = 0;
+    }
+
+    lck_mtx_unlock(&smp->sm_compress_lock);
+
+    return(allowed);
+}
+
+/*
+ * Learn from what compression did on one write call to this file. gave_up is
+ * set if the write call stopped compressing because of too many failures,
+ * which turns compression off for the file right away.
+ */
+void
+smbfs_compress_update(struct smbnode *np, struct smb_compress_stats *statsp,
+                      int gave_up)
+{
+    struct smbmount *smp = np->n_mount;
+    struct smb_compress_stats *ext_statsp = NULL;
+    struct timespec ts;
+    int bad, node_off, ext_off = 0;
+
+    if (statsp->writes == 0) {
+        /* Nothing was tried */
+        return;
+    }
+
+    bad = gave_up ||
+          ((statsp->out_bytes * 100) > (statsp->in_bytes * (100 - kSmbCompressMinSavings)));
+
+    nanouptime(&ts);
+
+    lck_mtx_lock(&smp->sm_compress_lock);
+
+    node_off = smb_compress_stats_add(&np->n_compress, statsp, bad, gave_up,
+                                      ts.tv_sec);
+
+    if (np->n_compress_ext != 0) {
+        ext_statsp = &smp->sm_compress_ext[np->n_compress_ext - 1].ce_stats;
+        ext_off = smb_compress_stats_add(ext_statsp, statsp, bad, 0, ts.tv_sec);
+    }
+
+    lck_mtx_unlock(&smp->sm_compress_lock);
+
+    if (node_off) {
+        SMB_LOG_COMPRESS_LOCK(np, "Compression turned off on <%s> for a while, not compressing \n",
+                              np->n_name);
+    }
+
+    if (ext_off) {
+        SMB_LOG_COMPRESS_LOCK(np, "Compression turned off for extension of <%s> for a while, not compressing \n",
+                              np->n_name);
+    }
+}
+
 int
 smb_compression_allowed(struct mount *mp, vnode_t vp)
 {
@@ -309,13 +507,18 @@ smb_compression_allowed(struct mount *mp, vnode_t vp)
     }
 
     /* if there is no "." extension, it can't match. Assume its compressible */
-    if ((name_ext == NULL) || (name_ext++ == NULL)) {
+    if (name_ext == NULL) {
         return(compression_allowed);
     }
 
     /* advance over the "." */
     name_ext++;
 
+    /* Track what compression does for this extension */
+    lck_mtx_lock(&smp->sm_compress_lock);
+    np->n_compress_ext = smb_compress_ext_get(smp, name_ext);
+    lck_mtx_unlock(&smp->sm_compress_lock);
+
     /* Check the default exclusion list */
     if (smb_compression_excluded(name_ext, strlen(name_ext))) {
         /* Compression not allowed, but does user list allow this file? */
@@ -355,7 +558,360 @@ smb_compression_allowed(struct mount *mp, vnode_t vp)
 
 #pragma mark - Dir Enumeration Caching
 
-void
+/*
+ * Dir enum cache entries live in fixed size blocks. Slot N of the cache is
+ * entry (N & kDirCacheBlockMask) of block (N >> kDirCacheBlockShift). Slots
+ * before cachep->first have been removed, so the live entries are slots
+ * first through first + count - 1.
+ *
+ * All of these expect d_enum_cache_list_lock to be held.
+ */
+static inline struct cached_dir_entry *
+smb_dir_cache_slot(struct smb_enum_cache *cachep, uint32_t slot)
+{
+    return (&cachep->blocks[slot >> kDirCacheBlockShift][slot & kDirCacheBlockMask]);
+}
+
+struct cached_dir_entry *
+smb_dir_cache_entry_at(void *in_cachep, off_t index)
+{
+    struct smb_enum_cache *cachep = in_cachep;
+
+    if ((index < 0) || (index >= cachep->count)) {
+        return (NULL);
+    }
+
+    return (smb_dir_cache_slot(cachep, cachep->first + (uint32_t) index));
+}
+
+struct cached_dir_entry *
+smb_dir_cache_next(void *in_cachep, struct cached_dir_entry *entryp)
+{
+    struct smb_enum_cache *cachep = in_cachep;
+
+    if (entryp == NULL) {
+        return (NULL);
+    }
+
+    return (smb_dir_cache_entry_at(cachep,
+                                   (off_t) entryp->cache_index + 1 - cachep->first));
+}
+
+off_t
+smb_dir_cache_entry_index(void *in_cachep, struct cached_dir_entry *entryp)
+{
+    struct smb_enum_cache *cachep = in_cachep;
+
+    return ((off_t) entryp->cache_index - cachep->first);
+}
+
+static void
+smb_dir_cache_index_free(struct smb_enum_cache *cachep)
+{
+    if (cachep->name_index != NULL) {
+        SMB_FREE_TYPE_COUNT(struct cached_dir_entry *, cachep->index_alloc,
+                            cachep->name_index);
+        cachep->name_index = NULL;
+    }
+
+    if (cachep->ino_index != NULL) {
+        SMB_FREE_TYPE_COUNT(struct cached_dir_entry *, cachep->index_alloc,
+                            cachep->ino_index);
+        cachep->ino_index = NULL;
+    }
+
+    cachep->index_alloc = 0;
+    cachep->index_cnt = 0;
+}
+
+/* Ties are broken on cache_index so the earliest of equal entries sorts first */
+static int
+smb_dir_cache_name_cmp(const void *a, const void *b)
+{
+    const struct cached_dir_entry *ap = *(struct cached_dir_entry * const *) a;
+    const struct cached_dir_entry *bp = *(struct cached_dir_entry * const *) b;
+    int cmp;
+
+    if (ap->name_len != bp->name_len) {
+        return ((ap->name_len < bp->name_len) ? -1 : 1);
+    }
+
+    cmp = memcmp(ap->name, bp->name, ap->name_len);
+    if (cmp != 0) {
+        return (cmp);
+    }
+
+    if (ap->cache_index != bp->cache_index) {
+        return ((ap->cache_index < bp->cache_index) ? -1 : 1);
+    }
+
+    return (0);
+}
+
+static int
+smb_dir_cache_ino_cmp(const void *a, const void *b)
+{
+    const struct cached_dir_entry *ap = *(struct cached_dir_entry * const *) a;
+    const struct cached_dir_entry *bp = *(struct cached_dir_entry * const *) b;
+
+    if (ap->fattr.fa_ino != bp->fattr.fa_ino) {
+        return ((ap->fattr.fa_ino < bp->fattr.fa_ino) ? -1 : 1);
+    }
+
+    if (ap->cache_index != bp->cache_index) {
+        return ((ap->cache_index < bp->cache_index) ? -1 : 1);
+    }
+
+    return (0);
+}
+
+/*
+ * The name and node id indexes cover the first index_cnt live entries.
+ * Entries added after that are searched linearly, until there are enough of
+ * them that it is cheaper to sort everything again. Since entries never move
+ * while being added, the indexes only need to be thrown away on a remove.
+ */
+static void
+smb_dir_cache_index_update(struct smb_enum_cache *cachep)
+{
+    uint32_t count = (uint32_t) cachep->count;
+    uint32_t alloc_cnt;
+    uint32_t i;
+
+    if ((count - cachep->index_cnt) <= kDirCacheIndexMaxTail) {
+        return;
+    }
+
+    if (cachep->index_alloc < count) {
+        smb_dir_cache_index_free(cachep);
+
+        /* Leave room to grow so a cache being filled is not resized each time */
+        alloc_cnt = count + (count >> 1);
+        SMB_MALLOC_TYPE_COUNT(cachep->name_index, struct cached_dir_entry *,
+                              alloc_cnt, Z_WAITOK);
+        SMB_MALLOC_TYPE_COUNT(cachep->ino_index, struct cached_dir_entry *,
+                              alloc_cnt, Z_WAITOK);
+        if ((cachep->name_index == NULL) || (cachep->ino_index == NULL)) {
+            cachep->index_alloc = alloc_cnt;
+            smb_dir_cache_index_free(cachep);
+            return;
+        }
+        cachep->index_alloc = alloc_cnt;
+    }
+
+    for (i = 0; i < count; i++) {
+        cachep->name_index[i] = smb_dir_cache_slot(cachep, cachep->first + i);
+        cachep->ino_index[i] = cachep->name_index[i];
+    }
+
+    qsort(cachep->name_index, count, sizeof(cachep->name_index[0]),
+          smb_dir_cache_name_cmp);
+    qsort(cachep->ino_index, count, sizeof(cachep->ino_index[0]),
+          smb_dir_cache_ino_cmp);
+    cachep->index_cnt = count;
+}
+
+struct cached_dir_entry *
+smb_dir_cache_find_name(void *in_cachep, const char *name, size_t name_len)
+{
+    struct smb_enum_cache *cachep = in_cachep;
+    struct cached_dir_entry *entryp = NULL;
+    uint32_t lo = 0, hi, mid;
+    uint32_t i;
+
+    smb_dir_cache_index_update(cachep);
+
+    /* Find the first indexed entry that is not less than name */
+    hi = cachep->index_cnt;
+    while (lo < hi) {
+        mid = lo + ((hi - lo) >> 1);
+        entryp = cachep->name_index[mid];
+
+        if ((entryp->name_len < name_len) ||
+            ((entryp->name_len == name_len) &&
+             (memcmp(entryp->name, name, name_len) < 0))) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo < cachep->index_cnt) {
+        entryp = cachep->name_index[lo];
+        if ((entryp->name_len == name_len) &&
+            (bcmp(entryp->name, name, name_len) == 0)) {
+            return (entryp);
+        }
+    }
+
+    /* Not indexed yet? */
+    for (i = cachep->index_cnt; i < cachep->count; i++) {
+        entryp = smb_dir_cache_slot(cachep, cachep->first + i);
+        if ((entryp->name_len == name_len) &&
+            (bcmp(entryp->name, name, name_len) == 0)) {
+            return (entryp);
+        }
+    }
+
+    return (NULL);
+}
+
+struct cached_dir_entry *
+smb_dir_cache_find_ino(void *in_cachep, uint64_t ino)
+{
+    struct smb_enum_cache *cachep = in_cachep;
+    struct cached_dir_entry *entryp = NULL;
+    uint32_t lo = 0, hi, mid;
+    uint32_t i;
+
+    smb_dir_cache_index_update(cachep);
+
+    hi = cachep->index_cnt;
+    while (lo < hi) {
+        mid = lo + ((hi - lo) >> 1);
+        if (cachep->ino_index[mid]->fattr.fa_ino < ino) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if ((lo < cachep->index_cnt) &&
+        (cachep->ino_index[lo]->fattr.fa_ino == ino)) {
+        return (cachep->ino_index[lo]);
+    }
+
+    for (i = cachep->index_cnt; i < cachep->count; i++) {
+        entryp = smb_dir_cache_slot(cachep, cachep->first + i);
+        if (entryp->fattr.fa_ino == ino) {
+            return (entryp);
+        }
+    }
+
+    return (NULL);
+}
+
+/*
+ * Copy name into the cache's name arena. The name stays put until the chunk
+ * holding it is freed, which only happens once every entry in slot or
+ * earlier is gone. Returns NULL if a new chunk can not be allocated.
+ */
+static const char *
+smb_dir_cache_name_add(struct smbmount *smp, struct smb_enum_cache *cachep,
+                       const char *name, size_t name_len, uint32_t slot)
+{
+    struct smb_dir_name_chunk *chunkp = cachep->name_tail;
+    char *namep = NULL;
+
+    if ((chunkp == NULL) || ((chunkp->size - chunkp->used) < (name_len + 1))) {
+        SMB_MALLOC_TYPE(chunkp, struct smb_dir_name_chunk, Z_WAITOK_ZERO);
+        if (chunkp == NULL) {
+            SMBERROR("SMB_MALLOC_TYPE failed \n");
+            return (NULL);
+        }
+
+        chunkp->size = (uint32_t) MAX(kDirCacheNameChunkSize, name_len + 1);
+        SMB_MALLOC_DATA(chunkp->data, chunkp->size, Z_WAITOK);
+        if (chunkp->data == NULL) {
+            SMBERROR("SMB_MALLOC_DATA failed \n");
+            SMB_FREE_TYPE(struct smb_dir_name_chunk, chunkp);
+            return (NULL);
+        }
+
+        if (cachep->name_tail != NULL) {
+            cachep->name_tail->next = chunkp;
+        }
+        else {
+            cachep->name_chunks = chunkp;
+        }
+        cachep->name_tail = chunkp;
+
+        OSAddAtomic64(1, &smp->sm_dir_arena.name_chunk_allocs);
+        OSAddAtomic64(chunkp->size, &smp->sm_dir_arena.bytes_in_use);
+        cachep->bytes += chunkp->size;
+    }
+
+    namep = chunkp->data + chunkp->used;
+    memcpy(namep, name, name_len);
+    namep[name_len] = 0;
+    chunkp->used += (uint32_t) name_len + 1;
+    chunkp->last_slot = slot;
+
+    return (namep);
+}
+
+/*
+ * Free the first remove_cnt live entries along with any blocks and name
+ * chunks that no longer hold a live entry. Emptying the cache releases
+ * everything in a handful of frees no matter how many entries it held.
+ * The indexes point at the removed entries so they go too.
+ */
+static void
+smb_dir_cache_free_entries(struct smbmount *smp, struct smb_enum_cache *cachep,
+                           uint32_t remove_cnt)
+{
+    struct smb_dir_name_chunk *chunkp = NULL;
+    uint32_t first_block;
+    uint32_t i;
+
+    smb_dir_cache_index_free(cachep);
+
+    if (remove_cnt > cachep->count) {
+        remove_cnt = (uint32_t) cachep->count;
+    }
+
+    cachep->first += remove_cnt;
+    cachep->count -= remove_cnt;
+
+    while ((chunkp = cachep->name_chunks) != NULL) {
+        if ((cachep->count != 0) && (chunkp->last_slot >= cachep->first)) {
+            break;
+        }
+
+        cachep->name_chunks = chunkp->next;
+        if (cachep->name_tail == chunkp) {
+            cachep->name_tail = NULL;
+        }
+
+        OSAddAtomic64(1, &smp->sm_dir_arena.name_chunk_frees);
+        OSAddAtomic64(-(int64_t) chunkp->size, &smp->sm_dir_arena.bytes_in_use);
+        cachep->bytes -= chunkp->size;
+        SMB_FREE_DATA(chunkp->data, chunkp->size);
+        SMB_FREE_TYPE(struct smb_dir_name_chunk, chunkp);
+    }
+
+    if (cachep->count == 0) {
+        first_block = cachep->block_cnt;
+    }
+    else {
+        first_block = cachep->first >> kDirCacheBlockShift;
+    }
+
+    for (i = 0; i < first_block; i++) {
+        if (cachep->blocks[i] != NULL) {
+            SMB_FREE_TYPE_COUNT(struct cached_dir_entry, kDirCacheBlockEntries,
+                                cachep->blocks[i]);
+            cachep->blocks[i] = NULL;
+
+            OSAddAtomic64(1, &smp->sm_dir_arena.entry_block_frees);
+            OSAddAtomic64(-(int64_t) (kDirCacheBlockEntries * sizeof(struct cached_dir_entry)),
+                          &smp->sm_dir_arena.bytes_in_use);
+            cachep->bytes -= kDirCacheBlockEntries * sizeof(struct cached_dir_entry);
+        }
+    }
+
+    if ((cachep->count == 0) && (cachep->blocks != NULL)) {
+        SMB_FREE_TYPE_COUNT(struct cached_dir_entry *, cachep->block_cnt,
+                            cachep->blocks);
+        cachep->blocks = NULL;
+        cachep->block_cnt = 0;
+        cachep->first = 0;
+    }
+}
+
+int
 smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
                         const char *name, size_t name_len,
                         struct smbfattr *fap,
@@ -363,11 +919,14 @@ smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
 {
     struct smb_enum_cache *cachep = in_cachep;
     struct smbnode *dnp = NULL;
+    struct smbmount *smp = NULL;
     struct cached_dir_entry *entry = NULL;
-    struct cached_dir_entry *current = NULL;
+    struct cached_dir_entry **new_blocks = NULL;
     uint32_t dir_cache_max_cnt = g_max_dir_entries_cached;
+    uint32_t slot, block, block_cnt;
     struct timespec ts;
     const char *cache_namep;
+    int error = 0;
 
     if (is_overflow) {
         cache_namep = "overflow";
@@ -378,18 +937,19 @@ smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
 	
 	if (fap == NULL) {
         SMBERROR("fap is null \n");
-        return;
+        return (EINVAL);
     }
     
     if (dvp == NULL) {
         SMBERROR("dvp is null \n");
-        return;
+        return (EINVAL);
     }
     dnp = VTOSMB(dvp);
+    smp = VFSTOSMBFS(vnode_mount(dvp));
 
     if (!vnode_isdir(dvp)) {
         SMBERROR("dvp is not a dir \n");
-        return;
+        return (EINVAL);
     }
     
     if (cachep->count >= dir_cache_max_cnt) {
@@ -404,18 +964,67 @@ smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
              * when the last entry was added.
              */
         }
-        return;
+        return (0);
     }
 
     //SMB_LOG_DIR_CACHE2("Caching <%s> <%s>\n", name, cache_namep);
 
-    /* Create a new cached_dir_entry and insert it into the list */
-    SMB_MALLOC_TYPE(entry, struct cached_dir_entry, Z_WAITOK_ZERO);
-    
-	entry->name = vfs_addname(name, (uint32_t) name_len, 0, 0);
+    if (!is_locked) {
+        lck_mtx_lock(&dnp->d_enum_cache_list_lock);
+    }
+
+    /* Find the next free slot, adding a block for it if needed */
+    slot = cachep->first + (uint32_t) cachep->count;
+    block = slot >> kDirCacheBlockShift;
+
+    if (block >= cachep->block_cnt) {
+        block_cnt = (cachep->block_cnt == 0) ? 4 : cachep->block_cnt * 2;
+        SMB_MALLOC_TYPE_COUNT(new_blocks, struct cached_dir_entry *,
+                              block_cnt, Z_WAITOK_ZERO);
+        if (new_blocks == NULL) {
+            SMBERROR("SMB_MALLOC_TYPE_COUNT failed for <%s> <%s> \n",
+                     dnp->n_name, cache_namep);
+            error = ENOMEM;
+            goto done;
+        }
+
+        if (cachep->blocks != NULL) {
+            memcpy(new_blocks, cachep->blocks,
+                   cachep->block_cnt * sizeof(cachep->blocks[0]));
+            SMB_FREE_TYPE_COUNT(struct cached_dir_entry *, cachep->block_cnt,
+                                cachep->blocks);
+        }
+        cachep->blocks = new_blocks;
+        cachep->block_cnt = block_cnt;
+    }
+
+    if (cachep->blocks[block] == NULL) {
+        SMB_MALLOC_TYPE_COUNT(cachep->blocks[block], struct cached_dir_entry,
+                              kDirCacheBlockEntries, Z_WAITOK_ZERO);
+        if (cachep->blocks[block] == NULL) {
+            SMBERROR("SMB_MALLOC_TYPE_COUNT failed for <%s> <%s> \n",
+                     dnp->n_name, cache_namep);
+            error = ENOMEM;
+            goto done;
+        }
+
+        OSAddAtomic64(1, &smp->sm_dir_arena.entry_block_allocs);
+        OSAddAtomic64(kDirCacheBlockEntries * sizeof(struct cached_dir_entry),
+                      &smp->sm_dir_arena.bytes_in_use);
+        cachep->bytes += kDirCacheBlockEntries * sizeof(struct cached_dir_entry);
+    }
+
+    entry = smb_dir_cache_slot(cachep, slot);
+    bzero(entry, sizeof(*entry));
+
+    entry->name = smb_dir_cache_name_add(smp, cachep, name, name_len, slot);
+    if (entry->name == NULL) {
+        error = ENOMEM;
+        goto done;
+    }
     entry->name_len = name_len;
     memcpy(&entry->fattr, fap, sizeof(entry->fattr));
-    entry->next = NULL;
+    entry->cache_index = slot;
     
     /*
      * For non OS X servers, we are missing
@@ -433,11 +1042,7 @@ smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
             entry->flags |= kCacheEntryNeedsMetaData;
         }
     
-    if (!is_locked) {
-        lck_mtx_lock(&dnp->d_enum_cache_list_lock);
-    }
-    
-    if (cachep->list == NULL) {
+    if (cachep->count == 0) {
         /* No other entries, so we are the first */
         if (is_overflow == 0) {
             cachep->offset = 0;
@@ -446,7 +1051,6 @@ smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
             /* Save the starting offset for overflow cache */
             cachep->start_offset = cachep->offset;
         }
-        cachep->list = entry;
         
         /* Set cache time */
         nanouptime(&ts);
@@ -460,19 +1064,10 @@ smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
 		SMB_LOG_DIR_CACHE_LOCK(dnp, "Set chg cnt to %d for <%s> <%s> \n",
                                cachep->chg_cnt, dnp->n_name, cache_namep);
     }
-    else {
-        /* look for last entry in the list */
-        current = cachep->list;
-        while (current->next != NULL) {
-            current = current->next;
-        }
-        
-        /* put it at the end of the list */
-        current->next = entry;
-    }
     
     cachep->offset += 1;
     cachep->count += 1;
+    OSAddAtomic64(1, &smp->sm_dir_arena.entries_added);
     
     /* Mark that the dir cache needs to get Meta Data and/or Finder Info */
     cachep->flags |= kDirCacheDirty;
@@ -488,10 +1083,18 @@ smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
         nanouptime(&ts);
         cachep->timer = ts.tv_sec;
     }
-    
+
+done:
+    if (error) {
+        /* Out of memory, so the cache can not hold the whole dir */
+        cachep->flags |= kDirCachePartial;
+    }
+
     if (!is_locked) {
         lck_mtx_unlock(&dnp->d_enum_cache_list_lock);
     }
+
+    return (error);
 }
 
 void
@@ -651,26 +1254,24 @@ smb_dir_cache_find_entry(vnode_t dvp, void *in_cachep,
     /* Setup the dir cache */
     smb_dir_cache_check(dvp, &dnp->d_main_cache, 1, context);
 
-    /* Now search the list until we find a match */
-    for (entry = cachep->list; entry; entry = entry->next) {
-        if ((entry->name_len == name_len) &&
-            (bcmp(entry->name, name, name_len) == 0)) {
-            /* found a match, but did we manage to get the attrs they want? */
-            if ((req_attrs != 0) &&
-                !(req_attrs & entry->fattr.fa_valid_mask)) {
-                SMB_LOG_DIR_CACHE("Asking for 0x%llx but only have 0x%llx for %s \n",
-                                  req_attrs, entry->fattr.fa_valid_mask,
-                                  entry->name);
-                error = ENOENT;
-            }
-            
-            if (error == 0) {
-                *fap = entry->fattr;
-            }
-            
-            lck_mtx_unlock(&dnp->d_enum_cache_list_lock);
-            return(error);
+    /* Now search the cache for a match */
+    entry = smb_dir_cache_find_name(cachep, name, name_len);
+    if (entry != NULL) {
+        /* found a match, but did we manage to get the attrs they want? */
+        if ((req_attrs != 0) &&
+            !(req_attrs & entry->fattr.fa_valid_mask)) {
+            SMB_LOG_DIR_CACHE("Asking for 0x%llx but only have 0x%llx for %s \n",
+                              req_attrs, entry->fattr.fa_valid_mask,
+                              entry->name);
+            error = ENOENT;
+        }
+        
+        if (error == 0) {
+            *fap = entry->fattr;
         }
+        
+        lck_mtx_unlock(&dnp->d_enum_cache_list_lock);
+        return(error);
     }
     
     lck_mtx_unlock(&dnp->d_enum_cache_list_lock);
@@ -702,32 +1303,18 @@ smb_dir_cache_get_attrs(struct smb_share *share, vnode_t dvp,
     
 again:
 	nanotime(&start);
+    /* Finder Info reads are sent as soon as the stream info says they exist */
     error = smb2fs_smb_cmpd_query_async(share, dvp, cachep,
-                                        kDirCacheGetStreamInfo, context);
+                                        kDirCacheGetStreamInfo | kDirCacheGetFinderInfo,
+                                        context);
     nanotime(&stop);
-    SMB_LOG_DIR_CACHE_LOCK(VTOSMB(dvp), "stream elapsed time %ld for <%s>\n",
+    SMB_LOG_DIR_CACHE_LOCK(VTOSMB(dvp), "elapsed time %ld for <%s>\n",
                            stop.tv_sec - start.tv_sec, VTOSMB(dvp)->n_name);
     if (error) {
-		if (error != ETIMEDOUT) {
-			SMBERROR("smb2fs_smb_cmpd_query_async failed for stream info %d \n",
-					error);
+		if ((error != ETIMEDOUT) && (error != EINTR) && (error != EAGAIN)) {
+			SMBERROR("smb2fs_smb_cmpd_query_async failed %d \n", error);
 		}
     }
-    else {
-        nanotime(&start);
-        error = smb2fs_smb_cmpd_query_async(share, dvp, cachep,
-                                            kDirCacheGetFinderInfo,
-                                            context);
-        nanotime(&stop);
-        SMB_LOG_DIR_CACHE_LOCK(VTOSMB(dvp), "FInfo elapsed time %ld for <%s>\n",
-                               stop.tv_sec - start.tv_sec, VTOSMB(dvp)->n_name);
-        if (error) {
-			if (error != ETIMEDOUT) {
-				SMBERROR("smb2fs_smb_cmpd_query_async failed for Finder Info %d \n",
-						error);
-			}
-        }
-    }
 	
 	if (error == ETIMEDOUT) {
         if (share->ss_going_away(share)) {
@@ -809,8 +1396,6 @@ smb_dir_cache_remove(vnode_t dvp, void *in_cachep,
 {
     struct smb_enum_cache *cachep = in_cachep;
     struct smbnode *dnp = NULL;
-    struct cached_dir_entry *entryp = NULL;
-    struct cached_dir_entry *currp = NULL;
     off_t remove_count = 0;
     uint8_t partial_remove = 0;
     
@@ -831,8 +1416,7 @@ smb_dir_cache_remove(vnode_t dvp, void *in_cachep,
         lck_mtx_lock(&dnp->d_enum_cache_list_lock);
     }
     
-    entryp = cachep->list;
-    if (entryp != NULL) {
+    if (cachep->count != 0) {
         SMB_LOG_DIR_CACHE_LOCK(dnp, "Removing <%s> dir cache for <%s> due to <%s> \n",
                                cache, dnp->n_name, reason);
     }
@@ -842,29 +1426,18 @@ smb_dir_cache_remove(vnode_t dvp, void *in_cachep,
     if (partial_remove) {
         remove_count = offset - cachep->start_offset;
     }
-
-    while (entryp != NULL) {
-        /* wipe out the enum cache entries */
-        currp = entryp;
-        entryp = entryp->next;
-		
-		vfs_removename(currp->name);
-        SMB_FREE_TYPE(struct cached_dir_entry, currp);
-
-        remove_count--;
-        if (partial_remove && (remove_count == 0)) {
-            break;
-        }
+    else {
+        remove_count = cachep->count;
     }
+
+    /* wipe out the enum cache entries */
+    smb_dir_cache_free_entries(VFSTOSMBFS(vnode_mount(dvp)), cachep,
+                               (uint32_t) remove_count);
     
     if (partial_remove) {
         cachep->start_offset = offset;
-        cachep->count = cachep->offset - offset;
-        cachep->list = entryp;
     } else {
         cachep->offset = 0;
-        cachep->count = 0;
-        cachep->list = NULL;
     }
     cachep->flags &= ~(kDirCacheComplete | kDirCachePartial);
     
@@ -883,62 +1456,63 @@ smb_dir_cache_remove(vnode_t dvp, void *in_cachep,
     SMB_LOG_KTRACE(SMB_DBG_DIR_CACHE_REMOVE | DBG_FUNC_END, 0, 0, 0, 0, 0);
 }
 
-void
-smb_dir_cache_remove_one(vnode_t dvp, void *in_cachep,
-                         void *in_one_entryp, int is_locked)
+/*
+ * The global dir cache tracks every dir that has entries in its enum cache.
+ * Entries are hashed by dvp and vid for lookups, and the ones that still
+ * have entries cached are also on an LRU list so pruning always starts at
+ * the least recently used dir without having to search for it. Everything
+ * below expects global_dir_cache_lock to be held.
+ */
+static struct global_dir_cache_entry *
+smb_global_dir_cache_lookup(vnode_t dvp, uint32_t dir_vid)
 {
-    struct smb_enum_cache *cachep = in_cachep;
-    struct smbnode *dnp = NULL;
-    struct cached_dir_entry *one_entryp = in_one_entryp;
-    struct cached_dir_entry *entryp = NULL;
-    struct cached_dir_entry *prevp = NULL;
-    
-    if (dvp == NULL) {
-        SMBERROR("dvp is null \n");
-        return;
-    }
-    dnp = VTOSMB(dvp);
-    
-    if (!vnode_isdir(dvp)) {
-        SMBERROR("dvp is not a dir \n");
-        return;
-    }
+	struct global_dir_cache_entry *entryp = NULL;
 
-    if (!is_locked) {
-        lck_mtx_lock(&dnp->d_enum_cache_list_lock);
-    }
-    
-    entryp = cachep->list;
-    
-    /* Search for the matching entry and remove it */
-    while (entryp != NULL) {
-        if (entryp == one_entryp) {
-            if (entryp == cachep->list) {
-                cachep->list = entryp->next;
-            }
-            else {
-                if (prevp != NULL) {
-                    prevp->next = entryp->next;
-                }
-                else {
-                    SMBERROR("prevp is NULL \n");
-                }
-            }
-            
-			vfs_removename(entryp->name);
-            SMB_FREE_TYPE(struct cached_dir_entry, entryp);
-            break;
-        }
-        
-        prevp = entryp;
-        entryp = entryp->next;
-    }
-    
-    cachep->count -= 1;
-    
-    if (!is_locked) {
-        lck_mtx_unlock(&dnp->d_enum_cache_list_lock);
-    }
+	LIST_FOREACH(entryp, GLOBAL_DIR_CACHE_HASH(dvp, dir_vid), hash_link) {
+		if ((entryp->dvp == dvp) && (entryp->dir_vid == dir_vid)) {
+			return (entryp);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Update how much a dir has cached. A dir with entries moves to the most
+ * recently used end of the LRU list, one without comes off the list.
+ */
+static void
+smb_global_dir_cache_set_cached(struct global_dir_cache_entry *entryp,
+								uint64_t cached_cnt, uint64_t cached_bytes)
+{
+	if (entryp->in_lru) {
+		TAILQ_REMOVE(&global_dir_cache_lru, entryp, lru_link);
+		entryp->in_lru = 0;
+		g_dir_cache_dirs -= 1;
+	}
+
+	g_dir_cache_bytes -= entryp->cached_bytes;
+
+	entryp->cached_cnt = cached_cnt;
+	entryp->cached_bytes = (cached_cnt > 0) ? cached_bytes : 0;
+
+	g_dir_cache_bytes += entryp->cached_bytes;
+
+	if (cached_cnt > 0) {
+		TAILQ_INSERT_TAIL(&global_dir_cache_lru, entryp, lru_link);
+		entryp->in_lru = 1;
+		g_dir_cache_dirs += 1;
+	}
+}
+
+static void
+smb_global_dir_cache_free_entry(struct global_dir_cache_entry *entryp)
+{
+	smb_global_dir_cache_set_cached(entryp, 0, 0);
+	LIST_REMOVE(entryp, hash_link);
+
+	vfs_removename(entryp->name);
+	SMB_FREE_TYPE(struct global_dir_cache_entry, entryp);
 }
 
 void
@@ -946,9 +1520,6 @@ smb_global_dir_cache_add_entry(vnode_t dvp, int is_locked)
 {
 	struct smbnode *dnp = NULL;
 	struct global_dir_cache_entry *entryp = NULL;
-	struct global_dir_cache_entry *currentp = NULL;
-	uint64_t current_dir_cnt = 0;
-	struct timespec	ts;
 	
 	if (dvp == NULL) {
 		SMBERROR("dvp is null \n");
@@ -961,6 +1532,9 @@ smb_global_dir_cache_add_entry(vnode_t dvp, int is_locked)
 		return;
 	}
 	
+	/* smbfs_sync checks if the cache has expired */
+	smbfs_sync_list_add(dnp);
+
 	SMB_LOG_LEASING_LOCK(dnp, "Adding dir <%s> entry count <%lld> \n",
 						   dnp->n_name, dnp->d_main_cache.count);
 	
@@ -974,46 +1548,25 @@ smb_global_dir_cache_add_entry(vnode_t dvp, int is_locked)
 	
 	/* Set last accessed time */
 	nanouptime(&entryp->last_access_time);
-	
-	entryp->cached_cnt = dnp->d_main_cache.count;
-	entryp->next = NULL;
 
 	if (!is_locked) {
 		lck_mtx_lock(&global_dir_cache_lock);
 	}
-	
-	if (global_dir_cache_head == NULL) {
-		/* No other entries, so we are the first */
-		global_dir_cache_head = entryp;
-	}
-	else {
-		/* look for last entry in the list */
-		currentp = global_dir_cache_head;
-		
-		/* also look for least recently accessed */
-		ts = currentp->last_access_time;
-		
-		while (currentp->next != NULL) {
-			/* Ignore dirs that have no entries cached */
-			if (currentp->cached_cnt > 0) {
-				/* Count up number of dirs */
-				current_dir_cnt += 1;
 
-				/*
-				 * Is this entry the least recently accessed and does it have any
-				 * entries that can be removed?
-				 */
-				if (timespeccmp(&ts, &currentp->last_access_time, >)) {
-					ts = currentp->last_access_time;
-				}
-			}
-			
-			currentp = currentp->next;
+	if (smb_global_dir_cache_lookup(dvp, entryp->dir_vid) != NULL) {
+		/* Someone else added it while we were not holding the lock */
+		if (!is_locked) {
+			lck_mtx_unlock(&global_dir_cache_lock);
 		}
-		
-		/* put it at the end of the list */
-		currentp->next = entryp;
+
+		vfs_removename(entryp->name);
+		SMB_FREE_TYPE(struct global_dir_cache_entry, entryp);
+		return;
 	}
+
+	LIST_INSERT_HEAD(GLOBAL_DIR_CACHE_HASH(dvp, entryp->dir_vid), entryp, hash_link);
+	smb_global_dir_cache_set_cached(entryp, dnp->d_main_cache.count,
+									dnp->d_main_cache.bytes + dnp->d_overflow_cache.bytes);
 	
 	if (!is_locked) {
 		lck_mtx_unlock(&global_dir_cache_lock);
@@ -1027,6 +1580,7 @@ smb_global_dir_cache_low_memory(int free_all, void *context_ptr)
 #pragma unused(context_ptr)
 	
 	struct global_dir_cache_entry *currentp = NULL;
+	struct global_dir_cache_entry *nextp = NULL;
 	vnode_t	dvp = NULL;
     int error;
 
@@ -1039,70 +1593,65 @@ smb_global_dir_cache_low_memory(int free_all, void *context_ptr)
 
 		lck_mtx_lock(&global_dir_cache_lock);
 		
-		currentp = global_dir_cache_head;
-		
-		while (currentp != NULL) {
-			/* Ignore dirs that have no entries cached */
-			if (currentp->cached_cnt > 0) {
-				/* Try to retrieve the vnode */
-				dvp = currentp->dvp;
-				if (vnode_getwithvid(currentp->dvp, currentp->dir_vid)) {
-                    /*
-                     * Must have gotten reclaimed, set its cached_cnt to 0 so
-                     * we will ignore it until it gets removed.
-                     */
-                    currentp->cached_cnt = 0;
-					dvp = NULL;
+		/* Only dirs with entries cached are on the LRU list */
+		TAILQ_FOREACH_SAFE(currentp, &global_dir_cache_lru, lru_link, nextp) {
+			/* Try to retrieve the vnode */
+			dvp = currentp->dvp;
+			if (vnode_getwithvid(currentp->dvp, currentp->dir_vid)) {
+				/*
+				 * Must have gotten reclaimed, set its cached_cnt to 0 so
+				 * we will ignore it until it gets removed.
+				 */
+				smb_global_dir_cache_set_cached(currentp, 0, 0);
+				dvp = NULL;
+			}
+			else {
+				if (vnode_tag(dvp) != VT_CIFS) {
+					SMBERROR("vnode_getwithvid found non SMB vnode???\n");
 				}
 				else {
-					if (vnode_tag(dvp) != VT_CIFS) {
-						SMBERROR("vnode_getwithvid found non SMB vnode???\n");
+					/*
+					 * Try to get the lock and if fail, then it must be busy
+					 * so skip this dir
+					 */
+					error = smbnode_trylock(VTOSMB(dvp), SMBFS_EXCLUSIVE_LOCK);
+					if (error == 0) {
+						/* Got the lock */
+						SMB_LOG_LEASING("Removing dir cache entries for <%s> \n",
+										currentp->name);
+
+						/*
+						 * SMBFS_EXCLUSIVE_LOCK should be enough to
+						 * keep others from accessing the dir while we close
+						 * it.
+						 */
+
+						/*
+						 * 41800260/47501728 Be careful here. We can get
+						 * called while machine is asleep so we cant send
+						 * any request. Also can be called from mbuf
+						 * allocator so another reason to not try sending
+						 * any SMB requests. Just empty the dir cache and
+						 * that should be enough.
+						 */
+						smb_dir_cache_remove(dvp, &VTOSMB(dvp)->d_main_cache, "main", "low memory", 0, 0);
+						smb_dir_cache_remove(dvp, &VTOSMB(dvp)->d_overflow_cache, "overflow", "low memory", 0, 0);
+
+						/*
+						 * Assume its cached count is now 0. Its actual count will
+						 * get updated after its refilled.
+						 */
+						smb_global_dir_cache_set_cached(currentp, 0, 0);
+						g_dir_cache_evictions += 1;
+
+						smbnode_unlock(VTOSMB(dvp));
 					}
-                    else {
-                        /*
-                         * Try to get the lock and if fail, then it must be busy
-                         * so skip this dir
-                         */
-                        error = smbnode_trylock(VTOSMB(dvp), SMBFS_EXCLUSIVE_LOCK);
-                        if (error == 0) {
-                            /* Got the lock */
-                            SMB_LOG_LEASING("Removing dir cache entries for <%s> \n",
-                                            currentp->name);
-
-                            /*
-                             * SMBFS_EXCLUSIVE_LOCK should be enough to
-                             * keep others from accessing the dir while we close
-                             * it.
-                             */
-
-                            /*
-                             * 41800260/47501728 Be careful here. We can get
-                             * called while machine is asleep so we cant send
-                             * any request. Also can be called from mbuf
-                             * allocator so another reason to not try sending
-                             * any SMB requests. Just empty the dir cache and
-                             * that should be enough.
-                             */
-                            smb_dir_cache_remove(dvp, &VTOSMB(dvp)->d_main_cache, "main", "low memory", 0, 0);
-                            smb_dir_cache_remove(dvp, &VTOSMB(dvp)->d_overflow_cache, "overflow", "low memory", 0, 0);
-
-                            /*
-                             * Assume its cached count is now 0. Its actual count will
-                             * get updated after its refilled.
-                             */
-                            currentp->cached_cnt = 0;
-
-                            smbnode_unlock(VTOSMB(dvp));
-                        }
-                    }
-				}
-				
-				if (dvp != NULL) {
-					vnode_put(dvp);
 				}
 			}
 			
-			currentp = currentp->next;
+			if (dvp != NULL) {
+				vnode_put(dvp);
+			}
 		}
 		
 		lck_mtx_unlock(&global_dir_cache_lock);
@@ -1116,12 +1665,10 @@ void
 smb_global_dir_cache_prune(void *oldest_ptr, int is_locked,
                            vfs_context_t context)
 {
-	struct global_dir_cache_entry *currentp = NULL;
 	struct global_dir_cache_entry *oldestp = oldest_ptr;
 	vnode_t	dvp = NULL;
-	uint64_t current_dir_cnt = 0;
-	struct timespec	ts;
 	int32_t max_attempts = 50;	/* Safety to keep from looping forever */
+	int evicted;
     int error;
 
     SMB_LOG_KTRACE(SMB_DBG_GLOBAL_DIR_CACHE_PRUNE | DBG_FUNC_START, is_locked, 0, 0, 0, 0);
@@ -1138,7 +1685,9 @@ again:
 	}
 	
 	/* if oldestp is non NULL, then free that entry first */
-	if (oldestp != NULL) {
+	if ((oldestp != NULL) && (oldestp->in_lru)) {
+		evicted = 0;
+
 		if (oldestp->dvp == NULL) {
 			SMBERROR("dvp is null? \n");
 		}
@@ -1150,7 +1699,7 @@ again:
                  * Must have gotten reclaimed, set its cached_cnt to 0 so
                  * we will ignore it until it gets removed.
                  */
-                oldestp->cached_cnt = 0;
+                evicted = 1;
 				dvp = NULL;
 			}
 			else {
@@ -1178,11 +1727,8 @@ again:
 						smb_dir_cache_remove(dvp, &VTOSMB(dvp)->d_main_cache, "main", "prune", 1, 0);
 						smb_dir_cache_remove(dvp, &VTOSMB(dvp)->d_overflow_cache, "overflow", "prune", 1, 0);
 						
-						/*
-						 * Assume its cached count is now 0. Its actual count will
-						 * get updated after its refilled.
-						 */
-						oldestp->cached_cnt = 0;
+						evicted = 1;
+						g_dir_cache_evictions += 1;
 						
                         smbnode_unlock(VTOSMB(dvp));
 					}
@@ -1193,43 +1739,35 @@ again:
 				vnode_put(dvp);
 			}
 		}
-	}
-	
-	/* Count number of current entries and find least recently used */
-	currentp = global_dir_cache_head;
-	oldestp = NULL;
-	current_dir_cnt = 0;
-	
-	while (currentp != NULL) {
-		/* Ignore dirs that have no entries cached */
-		if (currentp->cached_cnt > 0) {
-			/* Find first dir with entries and set that as the oldest */
-			if (oldestp == NULL) {
-				oldestp = currentp;
-				ts = currentp->last_access_time;
-			}
 
-			/* Count up number of dirs */
-			current_dir_cnt += 1;
-			
+		if (evicted) {
 			/*
-			 * Is this entry the least recently accessed and does it have any
-			 * entries that can be removed?
+			 * Assume its cached count is now 0. Its actual count will
+			 * get updated after its refilled.
 			 */
-			if (timespeccmp(&ts, &currentp->last_access_time, >)) {
-				ts = currentp->last_access_time;
-				oldestp = currentp;
-			}
+			smb_global_dir_cache_set_cached(oldestp, 0, 0);
+		}
+		else {
+			/*
+			 * Its busy, so its being used. Treat it as recently used so the
+			 * next pass tries a different dir.
+			 */
+			smb_global_dir_cache_set_cached(oldestp, oldestp->cached_cnt,
+											oldestp->cached_bytes);
 		}
-
-		currentp = currentp->next;
 	}
 	
-    SMB_LOG_KTRACE(SMB_DBG_GLOBAL_DIR_CACHE_PRUNE | DBG_FUNC_NONE, 0xabc001, current_dir_cnt, 0, 0, 0);
-
-    /* Do we have too many cached dir or entries? */
-	if (current_dir_cnt > g_max_dirs_cached) {
-		goto again;
+    SMB_LOG_KTRACE(SMB_DBG_GLOBAL_DIR_CACHE_PRUNE | DBG_FUNC_NONE, 0xabc001,
+                   g_dir_cache_dirs, g_dir_cache_bytes, 0, 0);
+
+    /* Are we using too much memory or have too many dirs cached? */
+	if ((g_dir_cache_bytes > g_max_dir_cache_bytes) ||
+		(g_dir_cache_dirs > g_max_dirs_cached)) {
+		/* Least recently used dir is always first */
+		oldestp = TAILQ_FIRST(&global_dir_cache_lru);
+		if (oldestp != NULL) {
+			goto again;
+		}
 	}
 	
 exit:
@@ -1244,71 +1782,41 @@ void
 smb_global_dir_cache_remove(int is_locked, int remove_all)
 {
 	struct global_dir_cache_entry *entryp = NULL;
-	struct global_dir_cache_entry *currentp = NULL;
-    struct global_dir_cache_entry *prevp = NULL;
+	struct global_dir_cache_entry *nextp = NULL;
+	u_long i;
 
 	if (!is_locked) {
 		lck_mtx_lock(&global_dir_cache_lock);
 	}
 
+	if (global_dir_cache_hash == NULL) {
+		goto exit;
+	}
+
     if (remove_all == 1) {
         SMB_LOG_LEASING("Removing all dirs \n");
-        entryp = global_dir_cache_head;
-        while (entryp != NULL) {
-            /* wipe out the enum cache entries */
-            currentp = entryp;
-            entryp = entryp->next;
-
-            vfs_removename(currentp->name);
-            SMB_FREE_TYPE(struct global_dir_cache_entry, currentp);
-        }
-
-        global_dir_cache_head = NULL;
     }
-    else {
-        /* Check for reclaimed dir vnodes and remove them from list */
-        entryp = global_dir_cache_head;
-        while (entryp != NULL) {
-            /* Check to see if this dir vnode has been reclaimed */
-            if (vnode_getwithvid(entryp->dvp, entryp->dir_vid)) {
-                currentp = entryp;
-                entryp = entryp->next;
-                /* Leave prevp unchanged since removing currentp */
-
-                if (currentp == global_dir_cache_head) {
-                    /* Its first in list */
-                    global_dir_cache_head = currentp->next;
-                }
-                else {
-                    /* Not first, so reset next pointers */
-                    if (prevp != NULL) {
-                        prevp->next = currentp->next;
-                    }
-                    else {
-                        /* Should never happen */
-                        SMBERROR("prevp is NULL \n");
-                    }
-                }
 
-                SMB_LOG_LEASING("Removing dir <%s> \n",
-                                currentp->name);
-
-                vfs_removename(currentp->name);
-                SMB_FREE_TYPE(struct global_dir_cache_entry, currentp);
-                currentp = NULL;
+	/* Every dir is in the hash table, even ones without entries cached */
+	for (i = 0; i <= global_dir_cache_hash_len; i++) {
+		LIST_FOREACH_SAFE(entryp, &global_dir_cache_hash[i], hash_link, nextp) {
+			if (remove_all == 0) {
+				/* Check to see if this dir vnode has been reclaimed */
+				if (vnode_getwithvid(entryp->dvp, entryp->dir_vid) == 0) {
+					vnode_put(entryp->dvp);
+					continue;
+				}
 
-                /* on to next entryp */
-                continue;
-            }
-            else {
-                vnode_put(entryp->dvp);
-            }
+				SMB_LOG_LEASING("Removing dir <%s> \n",
+								entryp->name);
+			}
 
-            prevp = entryp;
-            entryp = entryp->next;
-        }
-    }
+			/* wipe out the enum cache entries */
+			smb_global_dir_cache_free_entry(entryp);
+		}
+	}
 
+exit:
     if (!is_locked) {
 		lck_mtx_unlock(&global_dir_cache_lock);
 	}
@@ -1319,8 +1827,6 @@ smb_global_dir_cache_remove_one(vnode_t dvp, int is_locked)
 {
 	struct smbnode *dnp = NULL;
 	struct global_dir_cache_entry *entryp = NULL;
-	struct global_dir_cache_entry *prevp = NULL;
-	uint32_t dir_vid;
 	
 	if (dvp == NULL) {
 		SMBERROR("dvp is null \n");
@@ -1333,41 +1839,16 @@ smb_global_dir_cache_remove_one(vnode_t dvp, int is_locked)
 		return;
 	}
 	
-	/* We search by the vnode vid which should be unique */
-	dir_vid = vnode_vid(dvp);
-	
 	if (!is_locked) {
 		lck_mtx_lock(&global_dir_cache_lock);
 	}
 	
 	/* Search for the matching entry and remove it */
-	entryp = global_dir_cache_head;
-	
-	while (entryp != NULL) {
-		if (dir_vid == entryp->dir_vid) {
-			if (entryp == global_dir_cache_head) {
-				/* Its first in list */
-				global_dir_cache_head = entryp->next;
-			}
-			else {
-				/* Not first, so reset next pointers */
-				if (prevp != NULL) {
-					prevp->next = entryp->next;
-				}
-				else {
-					SMBERROR("prevp is NULL \n");
-				}
-			}
-			
-			SMB_LOG_LEASING_LOCK(dnp, "Removing dir <%s> \n", dnp->n_name);
+	entryp = smb_global_dir_cache_lookup(dvp, vnode_vid(dvp));
+	if (entryp != NULL) {
+		SMB_LOG_LEASING_LOCK(dnp, "Removing dir <%s> \n", dnp->n_name);
 
-			vfs_removename(entryp->name);
-            SMB_FREE_TYPE(struct global_dir_cache_entry, entryp);
-			break;
-		}
-		
-		prevp = entryp;
-		entryp = entryp->next;
+		smb_global_dir_cache_free_entry(entryp);
 	}
 	
 	if (!is_locked) {
@@ -1375,12 +1856,15 @@ smb_global_dir_cache_remove_one(vnode_t dvp, int is_locked)
 	}
 }
 
+/*
+ * Called at the end of each enumeration. is_hit is set if the enumeration
+ * was answered from the dir's enum cache without going to the server.
+ */
 int32_t
-smb_global_dir_cache_update_entry(vnode_t dvp)
+smb_global_dir_cache_update_entry(vnode_t dvp, int is_hit)
 {
 	struct smbnode *dnp = NULL;
 	struct global_dir_cache_entry *entryp = NULL;
-	uint32_t dir_vid;
 	
 	if (dvp == NULL) {
 		SMBERROR("dvp is null \n");
@@ -1393,43 +1877,62 @@ smb_global_dir_cache_update_entry(vnode_t dvp)
 		return (EINVAL);
 	}
 	
-	/* We search by the vnode vid which should be unique */
-	dir_vid = vnode_vid(dvp);
-	
 	lck_mtx_lock(&global_dir_cache_lock);
+
+	g_dir_cache_lookups += 1;
+	if (is_hit) {
+		g_dir_cache_hits += 1;
+	}
 	
-	/* Now search the list until we find a match */
-	for (entryp = global_dir_cache_head; entryp; entryp = entryp->next) {
-		if (dir_vid == entryp->dir_vid) {
-			/* found it, now update it */
-			if (entryp->cached_cnt != (uint64_t) dnp->d_main_cache.count) {
-				SMB_LOG_LEASING_LOCK(dnp, "Updating dir <%s> old entry count <%lld> new entry cnt <%lld> \n",
-									   dnp->n_name, entryp->cached_cnt, dnp->d_main_cache.count);
-			}
-			
-			if ((entryp->name_len == dnp->n_nmlen) &&
-				(bcmp(entryp->name, dnp->n_name, entryp->name_len) == 0)) {
-				/* Name did not change, so do not need to update name */
-			}
-			else {
-				/* Name changed, so update it */
-				vfs_removename(entryp->name);
-				entryp->name = vfs_addname(dnp->n_name, (uint32_t) dnp->n_nmlen, 0, 0);
-				entryp->name_len = dnp->n_nmlen;
-			}
-			
-			/* Set last accessed time */
-			nanouptime(&entryp->last_access_time);
-			
-			entryp->cached_cnt = dnp->d_main_cache.count;
-			
-			lck_mtx_unlock(&global_dir_cache_lock);
-			return(0);
-		}
+	/* Now search for a match */
+	entryp = smb_global_dir_cache_lookup(dvp, vnode_vid(dvp));
+	if (entryp == NULL) {
+		lck_mtx_unlock(&global_dir_cache_lock);
+		return(ENOENT);	/* No match found */
+	}
+
+	/* found it, now update it */
+	if (entryp->cached_cnt != (uint64_t) dnp->d_main_cache.count) {
+		SMB_LOG_LEASING_LOCK(dnp, "Updating dir <%s> old entry count <%lld> new entry cnt <%lld> \n",
+							   dnp->n_name, entryp->cached_cnt, dnp->d_main_cache.count);
+	}
+	
+	if ((entryp->name_len == dnp->n_nmlen) &&
+		(bcmp(entryp->name, dnp->n_name, entryp->name_len) == 0)) {
+		/* Name did not change, so do not need to update name */
+	}
+	else {
+		/* Name changed, so update it */
+		vfs_removename(entryp->name);
+		entryp->name = vfs_addname(dnp->n_name, (uint32_t) dnp->n_nmlen, 0, 0);
+		entryp->name_len = dnp->n_nmlen;
 	}
 	
+	/* Set last accessed time */
+	nanouptime(&entryp->last_access_time);
+	
+	/* Also makes it the most recently used */
+	smb_global_dir_cache_set_cached(entryp, dnp->d_main_cache.count,
+									dnp->d_main_cache.bytes + dnp->d_overflow_cache.bytes);
+	
+	lck_mtx_unlock(&global_dir_cache_lock);
+	return(0);
+}
+
+void
+smb_global_dir_cache_get_stats(struct smb_global_dir_cache_stats *statsp)
+{
+	lck_mtx_lock(&global_dir_cache_lock);
+
+	statsp->lookups = g_dir_cache_lookups;
+	statsp->hits = g_dir_cache_hits;
+	statsp->evictions = g_dir_cache_evictions;
+	statsp->dirs = g_dir_cache_dirs;
+	statsp->bytes = g_dir_cache_bytes;
+	statsp->max_bytes = g_max_dir_cache_bytes;
+	statsp->max_dirs = g_max_dirs_cached;
+
 	lck_mtx_unlock(&global_dir_cache_lock);
-	return(ENOENT);	/* No match found */
 }
 
 #pragma mark - buf_map_range helper functions
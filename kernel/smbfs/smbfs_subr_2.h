@@ -24,19 +24,27 @@
 #ifndef _SMBFS_SMBFS_SUBR_2_H_
 #define _SMBFS_SMBFS_SUBR_2_H_
 
+struct cached_dir_entry;
 struct compound_pb;
+struct smbnode;
+struct smb_compress_stats;
+struct smbfs_alloc_range;
+struct smb_global_dir_cache_stats;
 
 /* SMB Data compression */
 int smb_check_user_list(const char* extension, size_t extension_len,
                              char *list[], uint32_t list_cnt);
 int smb_compression_allowed(struct mount *mp, vnode_t vp);
+int smbfs_compress_allowed_now(struct smbnode *np);
+void smbfs_compress_update(struct smbnode *np, struct smb_compress_stats *statsp,
+                           int gave_up);
 bool smb_compression_excluded(const char* extension, size_t extension_len);
 
 /* Directory Enumeration Caching functions */
-void smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
-                             const char *name, size_t name_len,
-                             struct smbfattr *fap,
-                             uint32_t is_overflow, int is_locked);
+int smb_dir_cache_add_entry(vnode_t dvp, void *in_cachep,
+                            const char *name, size_t name_len,
+                            struct smbfattr *fap,
+                            uint32_t is_overflow, int is_locked);
 void smb_dir_cache_check(vnode_t dvp, void *in_cachep, int is_locked,
                          vfs_context_t context);
 int32_t smb_dir_cache_find_entry(vnode_t dvp, void *in_cachep,
@@ -50,8 +58,13 @@ void smb_dir_cache_invalidate(vnode_t vp, uint32_t forceInvalidate);
 void smb_dir_cache_remove(vnode_t dvp, void *in_cachep,
 						  const char *cache, const char *reason,
 						  int is_locked, off_t offset);
-void smb_dir_cache_remove_one(vnode_t dvp, void *in_cachep,
-                              void *in_one_entryp, int is_locked);
+struct cached_dir_entry *smb_dir_cache_entry_at(void *in_cachep, off_t index);
+struct cached_dir_entry *smb_dir_cache_next(void *in_cachep,
+                                            struct cached_dir_entry *entryp);
+struct cached_dir_entry *smb_dir_cache_find_name(void *in_cachep,
+                                                 const char *name, size_t name_len);
+struct cached_dir_entry *smb_dir_cache_find_ino(void *in_cachep, uint64_t ino);
+off_t smb_dir_cache_entry_index(void *in_cachep, struct cached_dir_entry *entryp);
 
 
 /* Global Directory Enumeration Caching functions */
@@ -61,7 +74,8 @@ void smb_global_dir_cache_prune(void *oldest_ptr, int is_locked,
                                 vfs_context_t context);
 void smb_global_dir_cache_remove(int is_locked, int remove_all);
 void smb_global_dir_cache_remove_one(vnode_t dvp, int is_locked);
-int32_t smb_global_dir_cache_update_entry(vnode_t dvp);
+int32_t smb_global_dir_cache_update_entry(vnode_t dvp, int is_hit);
+void smb_global_dir_cache_get_stats(struct smb_global_dir_cache_stats *statsp);
 
 
 /* buf_map_range helper functions */
@@ -232,6 +246,15 @@ int smbfs_smb_set_allocation(struct smb_share *share, SMBFID fid,
                              uint64_t new_size, vfs_context_t context);
 int smbfs_smb_seteof(struct smb_share *share, SMBFID fid, uint64_t newsize, 
                      vfs_context_t context);
+int smbfs_smb_query_allocated_ranges(struct smb_share *share, SMBFID fid,
+                                     uint64_t offset, uint64_t length,
+                                     struct smbfs_alloc_range **rangesp,
+                                     uint32_t *cntp, int *truncatedp,
+                                     vfs_context_t context);
+int smbfs_smb_set_sparse(struct smb_share *share, SMBFID fid,
+                         vfs_context_t context);
+int smbfs_smb_set_zero_data(struct smb_share *share, SMBFID fid, uint64_t from,
+                            uint64_t to, vfs_context_t context);
 int smbfs_smb_setfattrNT(struct smb_share *share, uint32_t attr, SMBFID fid, 
                          struct timespec *crtime, struct timespec *mtime, 
                          struct timespec *atime, vfs_context_t context);
@@ -262,6 +285,7 @@ int smbfs_smb_undollardata(const char *fname, char *name, size_t *nmlen,
                            uint32_t *is_data);
 struct smbfs_fctx_query_t* smb2fs_smb_add_fctx_query(struct smbfs_fctx *ctx);
 int smb2fs_smb_free_fctx_query_head(struct smbfs_fctx *ctx) ;
+void smb2fs_smb_findnext_read_ahead_wait(struct smbfs_fctx *ctx);
 int smbfs_add_dir_entry(vnode_t dvp, uio_t uio, int flags, const char *name, size_t name_len,
                         struct smbfattr *fap, int is_attrlist);
 int smbfs_enum_dir(struct vnode *dvp, uio_t uio, int is_attrlist, void* vnop_argsp);
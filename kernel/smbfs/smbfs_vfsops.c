@@ -91,6 +91,9 @@ __attribute__((visibility("hidden"))) int smbfs_loglevel = SMB_NO_LOG_LEVEL;
 __attribute__((visibility("hidden"))) uint32_t smbfs_deadtimer = DEAD_TIMEOUT;
 __attribute__((visibility("hidden"))) uint32_t smbfs_hard_deadtimer = HARD_DEAD_TIMER;
 __attribute__((visibility("hidden"))) uint32_t smbfs_trigger_deadtimer = TRIGGER_DEAD_TIMEOUT;
+__attribute__((visibility("hidden"))) int smbfs_def_close_timeout = k_def_close_timeout;
+__attribute__((visibility("hidden"))) int smbfs_def_close_lo_water = k_def_close_lo_water;
+__attribute__((visibility("hidden"))) int smbfs_def_close_hi_water = k_def_close_hi_water;
 
 static int smbfs_version = SMBFS_VERSION;
 static int mount_cnt = 0;
@@ -178,6 +181,9 @@ SYSCTL_INT(_net_smb_fs, OID_AUTO, kern_hard_deadtimer, CTLFLAG_RW, &smbfs_hard_d
 SYSCTL_INT(_net_smb_fs, OID_AUTO, kern_soft_deadtimer, CTLFLAG_RW, &smbfs_trigger_deadtimer, TRIGGER_DEAD_TIMEOUT, "");
 SYSCTL_INT(_net_smb_fs, OID_AUTO, maxsegreadsize, CTLFLAG_RW, &smb_maxsegreadsize, 0, "");
 SYSCTL_INT(_net_smb_fs, OID_AUTO, maxsegwritesize, CTLFLAG_RW, &smb_maxsegwritesize, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, def_close_timeout, CTLFLAG_RW, &smbfs_def_close_timeout, k_def_close_timeout, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, def_close_lo_water, CTLFLAG_RW, &smbfs_def_close_lo_water, k_def_close_lo_water, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, def_close_hi_water, CTLFLAG_RW, &smbfs_def_close_hi_water, k_def_close_hi_water, "");
 
 
 extern struct sysctl_oid sysctl__net_smb;
@@ -202,10 +208,13 @@ MALLOC_DEFINE(M_SMBFSHASH, "SMBFS hash", "SMBFS hash table");
 
 /* Global dir enumeration caching */
 extern lck_mtx_t global_dir_cache_lock; /* global_dir_cache_entry lock */
-extern struct global_dir_cache_entry *global_dir_cache_head;
+extern TAILQ_HEAD(global_dir_cache_lru_head, global_dir_cache_entry) global_dir_cache_lru;
+extern struct global_dir_cache_hash_head *global_dir_cache_hash;
+extern u_long global_dir_cache_hash_len;
 extern uint64_t g_hardware_memory_size;
 extern uint32_t g_max_dirs_cached;
 extern uint32_t g_max_dir_entries_cached;
+extern uint64_t g_max_dir_cache_bytes;
 
 int g_registered_for_low_memory = 0;
 
@@ -231,7 +240,12 @@ smbfs_lock_init(void)
 	
 	/* Init global dir enum cache mutex */
 	lck_mtx_init(&global_dir_cache_lock, smbfs_mutex_group, smbfs_lock_attr);
-	global_dir_cache_head = NULL;
+	TAILQ_INIT(&global_dir_cache_lru);
+	global_dir_cache_hash = hashinit(k_max_dirs_cached, M_SMBFSHASH, &global_dir_cache_hash_len);
+	if (global_dir_cache_hash == NULL) {
+		/* Should never fail */
+		SMBERROR("dir cache table hashinit failed \n");
+	}
 
 	/* Register for low memory callback */
 	error = fs_buffer_cache_gc_register(smb_global_dir_cache_low_memory, NULL);
@@ -270,7 +284,10 @@ smbfs_lock_uninit(void)
 
 	/* Free global dir enum cache mutex */
 	lck_mtx_destroy(&global_dir_cache_lock, smbfs_mutex_group);
-	global_dir_cache_head = NULL;
+	if (global_dir_cache_hash) {
+		hashdestroy(global_dir_cache_hash, M_SMBFSHASH, global_dir_cache_hash_len);
+		global_dir_cache_hash = NULL;
+	}
 
 	/* Free global lease hash table */
 	if (g_lease_hash) {
@@ -857,14 +874,25 @@ smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t con
 	vfs_setfsprivate(mp, (void *)smp);	
     
     /* alloc hash stuff */
-	smp->sm_hash = hashinit(desiredvnodes, M_SMBFSHASH, &smp->sm_hashlen);
+	for (i = 0; i < SMBFS_HASH_LOCK_STRIPES; i++) {
+		lck_mtx_init(&smp->sm_hashlock[i], hash_lck_grp, hash_lck_attr);
+		/* No resize in progress */
+		smp->sm_hash_migrated[i] = 1;
+	}
+	lck_mtx_init(&smp->sm_hash_resize_lock, hash_lck_grp, hash_lck_attr);
+	/* Starts small and grows with the number of nodes */
+	smp->sm_hash = hashinit(kSmbfsHashMinLen, M_SMBFSHASH, &smp->sm_hashlen);
 	if (smp->sm_hash == NULL)
 		goto bad;
-	smp->sm_hashlock = lck_mtx_alloc_init(hash_lck_grp, hash_lck_attr);
 
 	lck_rw_init(&smp->sm_rw_sharelock, smbfs_rwlock_group, smbfs_lock_attr);
 	lck_mtx_init(&smp->sm_statfslock, smbfs_mutex_group, smbfs_lock_attr);		
     lck_mtx_init(&smp->sm_svrmsg_lock, smbfs_mutex_group, smbfs_lock_attr);
+    lck_mtx_init(&smp->sm_compress_lock, smbfs_mutex_group, smbfs_lock_attr);
+    lck_mtx_init(&smp->sm_sync_lock, smbfs_mutex_group, smbfs_lock_attr);
+    TAILQ_INIT(&smp->sm_sync_list);
+    lck_mtx_init(&smp->sm_def_close_lock, smbfs_mutex_group, smbfs_lock_attr);
+    TAILQ_INIT(&smp->sm_def_close_lru);
 
 	lck_rw_lock_exclusive(&smp->sm_rw_sharelock);
 	smp->sm_share = share;
@@ -931,7 +959,7 @@ smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t con
                       smp->sm_args.dir_cache_min);
 
     if ((smp->sm_args.max_dirs_cached != 0) &&
-        (smp->sm_args.max_dirs_cached < 5000)) {
+        (smp->sm_args.max_dirs_cached < k_max_dirs_cached)) {
         /* Keep max in sync with preferences.c value */
         SMBWARNING("%s using custom max dirs cached of %d \n",
                    vfs_statfs(mp)->f_mntfromname, smp->sm_args.max_dirs_cached);
@@ -946,9 +974,10 @@ smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t con
         g_max_dir_entries_cached = smp->sm_args.max_dir_entries_cached;
     }
 
-    SMB_LOG_DIR_CACHE("max_dirs_cached %d, max_dir_entries_cached %d \n",
+    SMB_LOG_DIR_CACHE("max_dirs_cached %d, max_dir_entries_cached %d, max_dir_cache_bytes %lld \n",
                       g_max_dirs_cached,
-                      g_max_dir_entries_cached);
+                      g_max_dir_entries_cached,
+                      g_max_dir_cache_bytes);
 
     
     /*
@@ -1255,7 +1284,7 @@ smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t con
             SS_TO_SESSION(share)->session_misc_flags |= SMBV_OTHER_SERVER;
         }
 
-		share->ss_max_def_close_cnt = k_def_close_hi_water;
+		share->ss_max_def_close_cnt = smbfs_def_close_hi_water;
 		if (smp->sm_args.altflags & SMBFS_MNT_FILE_DEF_CLOSE_OFF) {
 			/* 
 			 * Turn off File Handle Leasing. We will still ask for Read/Handle
@@ -1817,10 +1846,16 @@ bad:
             hashdestroy(smp->sm_hash, M_SMBFSHASH, smp->sm_hashlen);
 		}
 		
-		lck_mtx_free(smp->sm_hashlock, hash_lck_grp);
+		for (i = 0; i < SMBFS_HASH_LOCK_STRIPES; i++) {
+			lck_mtx_destroy(&smp->sm_hashlock[i], hash_lck_grp);
+		}
+		lck_mtx_destroy(&smp->sm_hash_resize_lock, hash_lck_grp);
 		lck_mtx_destroy(&smp->sm_statfslock, smbfs_mutex_group);
 		lck_rw_destroy(&smp->sm_rw_sharelock, smbfs_rwlock_group);
         lck_mtx_destroy(&smp->sm_svrmsg_lock, smbfs_mutex_group);
+        lck_mtx_destroy(&smp->sm_compress_lock, smbfs_mutex_group);
+        lck_mtx_destroy(&smp->sm_sync_lock, smbfs_mutex_group);
+        lck_mtx_destroy(&smp->sm_def_close_lock, smbfs_mutex_group);
 		
 		if (smp->sm_args.volume_name) {
             SMB_FREE_DATA(smp->sm_args.volume_name, smp->sm_args.volume_name_allocsize);
@@ -1992,10 +2027,21 @@ smbfs_unmount(struct mount *mp, int mntflags, vfs_context_t context)
         hashdestroy(smp->sm_hash, M_SMBFSHASH, smp->sm_hashlen);
 		smp->sm_hash = (void *)0xDEAD5AB0;
 	}
-	lck_mtx_free(smp->sm_hashlock, hash_lck_grp);
+	if (smp->sm_oldhash) {
+		/* Resize never finished moving the nodes, but they are all gone */
+        hashdestroy(smp->sm_oldhash, M_SMBFSHASH, smp->sm_oldhashlen);
+		smp->sm_oldhash = NULL;
+	}
+	for (i = 0; i < SMBFS_HASH_LOCK_STRIPES; i++) {
+		lck_mtx_destroy(&smp->sm_hashlock[i], hash_lck_grp);
+	}
+	lck_mtx_destroy(&smp->sm_hash_resize_lock, hash_lck_grp);
 
 	lck_mtx_destroy(&smp->sm_statfslock, smbfs_mutex_group);
     lck_mtx_destroy(&smp->sm_svrmsg_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&smp->sm_compress_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&smp->sm_sync_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&smp->sm_def_close_lock, smbfs_mutex_group);
 	lck_rw_destroy(&smp->sm_rw_sharelock, smbfs_rwlock_group);
     
     if (smp->sm_args.volume_name) {
@@ -2189,27 +2235,28 @@ smbfs_init(struct vfsconf *vfsp)
 		g_hardware_memory_size = ((uint64_t) 2) * 1024 * 1024 * 1024;
 	}
 	
+	/* Dir enum caches are pruned by how much memory they use */
+	g_max_dir_cache_bytes = g_hardware_memory_size / k_dir_cache_mem_divisor;
+	if (g_max_dir_cache_bytes < k_min_dir_cache_bytes) {
+		g_max_dir_cache_bytes = k_min_dir_cache_bytes;
+	}
+
 	if (g_hardware_memory_size <= ((uint64_t) 2) * 1024 * 1024 * 1024) {
-		g_max_dirs_cached = k_2GB_max_dirs_cached;
 		g_max_dir_entries_cached = k_2GB_max_dir_entries_cached;
 	}
 	else {
 		if (g_hardware_memory_size <= ((uint64_t) 4) * 1024 * 1024 * 1024) {
-			g_max_dirs_cached = k_4GB_max_dirs_cached;
 			g_max_dir_entries_cached = k_4GB_max_dir_entries_cached;
 		}
 		else {
 			if (g_hardware_memory_size <= ((uint64_t) 8) * 1024 * 1024 * 1024) {
-				g_max_dirs_cached = k_8GB_max_dirs_cached;
 				g_max_dir_entries_cached = k_8GB_max_dir_entries_cached;
 			}
 			else {
 				if (g_hardware_memory_size <= ((uint64_t) 16) * 1024 * 1024 * 1024) {
-					g_max_dirs_cached = k_16GB_max_dirs_cached;
 					g_max_dir_entries_cached = k_16GB_max_dir_entries_cached;
 				}
 				else {
-					g_max_dirs_cached = k_LotsOfGB_max_dirs_cached;
 					g_max_dir_entries_cached = k_LotsOfGB_max_dir_entries_cached;
 				}
 			}
@@ -2793,6 +2840,56 @@ struct smbfs_sync_cargs {
 	int	error;
 };
 
+struct smbfs_sync_node {
+	vnode_t		vp;
+	uint32_t	vid;
+};
+
+/*
+ * Does smbfs_sync still have work for this node? Called with the node locked.
+ * A file stays on sm_sync_list while it has any open or deferred close
+ * handle, dirty data or a pending set eof or flush. A dir stays while it is
+ * open, monitored, has a lease or has entries in its enumeration cache.
+ */
+static int
+smbfs_sync_node_busy(vnode_t vp, struct smbnode *np)
+{
+	uint32_t i;
+
+	if (vnode_ismonitored(vp)) {
+		return (TRUE);
+	}
+
+	if (vnode_isdir(vp)) {
+		if ((np->d_refcnt != 0) || (np->d_kqrefcnt != 0) ||
+			(np->d_fid != 0) || (np->d_main_cache.count != 0) ||
+			(np->n_lease.flags & SMB2_LEASE_GRANTED)) {
+			return (TRUE);
+		}
+		return (FALSE);
+	}
+
+	if (!vnode_isreg(vp)) {
+		return (FALSE);
+	}
+
+	if ((np->f_sharedFID_refcnt != 0) || (np->f_lockFID_refcnt != 0) ||
+		(np->f_sharedFID_fid != 0) || (np->f_lockFID_fid != 0) ||
+		(np->f_openState != 0) ||
+		(np->n_flag & (NNEEDS_EOF_SET | NNEEDS_FLUSH)) ||
+		vnode_hasdirtyblks(vp)) {
+		return (TRUE);
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (np->f_sharedFID_lockEntries[i].fid != 0) {
+			return (TRUE);
+		}
+	}
+
+	return (FALSE);
+}
+
 
 static int
 smbfs_sync_callback(vnode_t vp, void *args)
@@ -2848,13 +2945,10 @@ smbfs_sync_callback(vnode_t vp, void *args)
 		}
 		lck_mtx_unlock(&np->f_openStateLock);
 		
-		/* 
-		 * See if this file can close any deferred closes now.
-         * Especially since all files now have leases and potentially
-         * have pending deferred closes and we dont want to keep too many
-         * open files on the server.
+		/*
+		 * Idle deferred closes are closed least recently used first by
+		 * smbfs_sync, see smbfs_def_close_lru_trim()
 		 */
-        CloseDeferredFileRefs(vp, "smbfs_sync_callback", 1, cargs->context);
         
         /* Can we upgrade the lease? */
         smb2fs_smb_lease_upgrade(share, vp, "SyncLeaseUpgrade", cargs->context);
@@ -2930,6 +3024,10 @@ smbfs_sync_callback(vnode_t vp, void *args)
     
 done:
 	if (np) {
+		/* Nothing left for smbfs_sync to do until it gets added again */
+		if (!smbfs_sync_node_busy(vp, np)) {
+			smbfs_sync_list_remove(np);
+		}
 		smbnode_unlock(np);
 	}
     
@@ -2941,6 +3039,64 @@ done:
 	return (VNODE_RETURNED);
 }
 
+/*
+ * Call smbfs_sync_callback on the nodes on sm_sync_list instead of every
+ * active vnode on the mount. sm_sync_lock can not be held across the
+ * callback, so save each vnode with its vid and let vnode_getwithvid() skip
+ * any that got recycled in the meantime. Visited nodes go to the end of the
+ * list so if it grew while we allocated, the rest get done next time.
+ * Returns the number of nodes visited.
+ */
+static uint32_t
+smbfs_sync_list_iterate(struct smbmount *smp, struct smbfs_sync_cargs *args)
+{
+	struct smbfs_sync_node *nodes = NULL;
+	struct smbnode *np = NULL;
+	uint32_t alloc_cnt, cnt = 0, visited = 0, i;
+
+	lck_mtx_lock(&smp->sm_sync_lock);
+	alloc_cnt = smp->sm_sync_cnt;
+	lck_mtx_unlock(&smp->sm_sync_lock);
+
+	if (alloc_cnt == 0) {
+		return (0);
+	}
+
+	alloc_cnt += kSmbSyncListSlack;
+	SMB_MALLOC_TYPE_COUNT(nodes, struct smbfs_sync_node, alloc_cnt, Z_WAITOK);
+	if (nodes == NULL) {
+		SMBERROR("SMB_MALLOC_TYPE_COUNT failed for %u nodes \n", alloc_cnt);
+		return (0);
+	}
+
+	lck_mtx_lock(&smp->sm_sync_lock);
+	while ((cnt < alloc_cnt) && (cnt < smp->sm_sync_cnt)) {
+		np = TAILQ_FIRST(&smp->sm_sync_list);
+		TAILQ_REMOVE(&smp->sm_sync_list, np, n_sync_link);
+		TAILQ_INSERT_TAIL(&smp->sm_sync_list, np, n_sync_link);
+
+		nodes[cnt].vp = np->n_vnode;
+		nodes[cnt].vid = vnode_vid(np->n_vnode);
+		cnt++;
+	}
+	lck_mtx_unlock(&smp->sm_sync_lock);
+
+	for (i = 0; i < cnt; i++) {
+		if (vnode_getwithvid(nodes[i].vp, nodes[i].vid) != 0) {
+			/* Got recycled, reclaim took it off the list */
+			continue;
+		}
+
+		(void)smbfs_sync_callback(nodes[i].vp, args);
+		vnode_put(nodes[i].vp);
+		visited++;
+	}
+
+	SMB_FREE_TYPE_COUNT(struct smbfs_sync_node, alloc_cnt, nodes);
+
+	return (visited);
+}
+
 /*
  * Flush out the buffer cache
  */
@@ -2952,6 +3108,9 @@ smbfs_sync(struct mount *mp, int waitfor, vfs_context_t context)
     struct smbmount *smp = VFSTOSMBFS(mp);
     struct smb_share *share = NULL;
     struct smb_session *sessionp = NULL;
+    struct timespec start, elapsed;
+    uint32_t visited = 0;
+    uint64_t usecs = 0;
 
     SMB_LOG_KTRACE(SMB_DBG_SYNC | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
@@ -2962,15 +3121,6 @@ smbfs_sync(struct mount *mp, int waitfor, vfs_context_t context)
 	args.waitfor = waitfor;
 	args.error = 0;
 
-	/*
-	 * Force stale buffer cache information to be flushed.
-	 *
-	 * sbmfs_sync_callback will be called for each vnode
-	 * hung off of this mount point... the vnode will be
-	 * properly referenced and unreferenced around the callback
-	 */
-	vnode_iterate(mp, VNODE_ITERATE_ACTIVE, smbfs_sync_callback, (void *)&args);
-
     /* See if its time to requery the server interfaces */
     if (smp == NULL) {
         SMBERROR("smp == NULL? \n");
@@ -2978,6 +3128,29 @@ smbfs_sync(struct mount *mp, int waitfor, vfs_context_t context)
         goto done;
     }
 
+	/*
+	 * Force stale buffer cache information to be flushed.
+	 *
+	 * sbmfs_sync_callback will be called for each vnode on sm_sync_list,
+	 * the vnode will be properly referenced and unreferenced around the
+	 * callback
+	 */
+    nanouptime(&start);
+    visited = smbfs_sync_list_iterate(smp, &args);
+    nanouptime(&elapsed);
+    timespecsub(&elapsed, &start);
+
+    usecs = (elapsed.tv_sec * USEC_PER_SEC) + (elapsed.tv_nsec / NSEC_PER_USEC);
+    smp->sm_sync_last_nodes = visited;
+    smp->sm_sync_last_usecs = usecs;
+    if (usecs > smp->sm_sync_max_usecs) {
+        smp->sm_sync_max_usecs = usecs;
+    }
+    if (usecs > kSmbSyncSlowUsecs) {
+        SMBWARNING("sync pass took %llu usecs for %u nodes, %u on list \n",
+                   usecs, visited, smp->sm_sync_cnt);
+    }
+
     share = smb_get_share_with_reference(smp);
     if (share == NULL) {
         SMBERROR("share == NULL? \n");
@@ -2992,6 +3165,19 @@ smbfs_sync(struct mount *mp, int waitfor, vfs_context_t context)
         goto done;
     }
 
+    /* Give back deferred close budget taken by smbfs_def_close_server_limit */
+    if ((share->ss_max_def_close_cnt > 0) &&
+        (share->ss_max_def_close_cnt < smbfs_def_close_hi_water)) {
+        share->ss_max_def_close_cnt += 1;
+    }
+
+    /*
+     * Close the deferred closes that have been idle too long, oldest first,
+     * but keep up to smbfs_def_close_lo_water of them around for reuse.
+     */
+    smbfs_def_close_lru_trim(share, smp, smbfs_def_close_lo_water, 1, 0,
+                             "smbfs_sync", context);
+
     /* For multichannel, see if its time to query the server interfaces */
     if (sessionp->session_flags & SMBV_MULTICHANNEL_ON) {
         error = smb_session_query_net_if(sessionp);
@@ -3006,7 +3192,7 @@ done:
         smb_share_rele(share, context);
     }
 
-    SMB_LOG_KTRACE(SMB_DBG_SYNC | DBG_FUNC_END, args.error, 0, 0, 0, 0);
+    SMB_LOG_KTRACE(SMB_DBG_SYNC | DBG_FUNC_END, args.error, visited, usecs, 0, 0);
 	return (args.error);
 }
 
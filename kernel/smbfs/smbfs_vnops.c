@@ -51,6 +51,7 @@
 #include <sys/kauth.h>
 #include <sys/syslog.h>
 #include <sys/priv.h>
+#include <sys/fsctl.h>
 
 #include <sys/smb_apple.h>
 #include <sys/smb_byte_order.h>
@@ -406,7 +407,7 @@ smbfs_check_for_ubc_invalidate(vnode_t vp, const char *reason)
     /* Need a push dirty and invalidate? */
     if ((np->n_flag & NNEEDS_UBC_INVALIDATE) &&
         (np->n_flag & NNEEDS_UBC_PUSHDIRTY)) {
-        np->n_flag &= ~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY);
+        OSBitAndAtomic(~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY), &np->n_flag);
 
         SMB_LOG_LEASING_LOCK(np, "Delayed push/purge of UBC cache on <%s> during <%s> \n",
                              np->n_name, reason);
@@ -418,7 +419,7 @@ smbfs_check_for_ubc_invalidate(vnode_t vp, const char *reason)
     else {
         /* Need just an invalidate? */
         if (np->n_flag & NNEEDS_UBC_INVALIDATE) {
-            np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+            OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
             
             SMB_LOG_LEASING_LOCK(np, "Delayed purge of UBC cache on <%s> during <%s> \n",
                                  np->n_name, reason);
@@ -429,7 +430,7 @@ smbfs_check_for_ubc_invalidate(vnode_t vp, const char *reason)
         else {
             /* Need just an push dirty? */
             if (np->n_flag & NNEEDS_UBC_PUSHDIRTY) {
-                np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
                 
                 SMB_LOG_LEASING_LOCK(np, "Delayed push of UBC cache on <%s> during <%s> \n",
                                      np->n_name, reason);
@@ -597,6 +598,10 @@ smbfs_io_reopen(struct smb_share *share, vnode_t vp, uio_t uio,
  *
  * The calling routine must hold a reference on the share
  *
+ * Callers holding only a shared node lock can get here at the same time once
+ * the attributes expire. Only one of them goes to the server, the others wait
+ * for it and then use the attributes it entered.
+ *
  */
 int 
 smbfs_update_cache(struct smb_share *share, vnode_t vp, 
@@ -606,6 +611,8 @@ smbfs_update_cache(struct smb_share *share, vnode_t vp,
 	 int use_cached_data = 0;
 	 struct smbfattr fattr;
 	 int error = 0;
+	 struct smbnode *np = VTOSMB(vp);
+	 int refreshing = 0;
  
      /* If we are in reconnect, use cached data if we have it */
      if (VTOSMB(vp)->attribute_cache_timer != 0) {
@@ -638,6 +645,27 @@ smbfs_update_cache(struct smb_share *share, vnode_t vp,
 		 goto done;
      }
 
+     lck_mtx_lock(&np->n_attr_lock);
+     while ((np->n_attr_refresh_thread != NULL) &&
+            (np->n_attr_refresh_thread != current_thread())) {
+         /* Someone else is already getting them, wait for them */
+         msleep(&np->n_attr_refresh_thread, &np->n_attr_lock, PWAIT | PDROP,
+                "smbfs_update_cache", NULL);
+
+         error = smbfs_attr_cachelookup(share, vp, vap, context, use_cached_data);
+         if (error != ENOENT) {
+             goto done;
+         }
+
+         /* Their lookup must have failed, try it ourself */
+         lck_mtx_lock(&np->n_attr_lock);
+     }
+     if (np->n_attr_refresh_thread == NULL) {
+         np->n_attr_refresh_thread = current_thread();
+         refreshing = 1;
+     }
+     lck_mtx_unlock(&np->n_attr_lock);
+
 	 error = smbfs_lookup(share, VTOSMB(vp), NULL, NULL, NULL, &fattr, context);
      SMB_LOG_KTRACE(SMB_DBG_SMBFS_UPDATE_CACHE | DBG_FUNC_NONE,
                     0xabc001, error, 0, 0, 0);
@@ -665,6 +693,13 @@ use_cache:
      error = smbfs_attr_cachelookup(share, vp, vap, context, use_cached_data);
 
 done:
+     if (refreshing) {
+         lck_mtx_lock(&np->n_attr_lock);
+         np->n_attr_refresh_thread = NULL;
+         lck_mtx_unlock(&np->n_attr_lock);
+         wakeup(&np->n_attr_refresh_thread);
+     }
+
      SMB_LOG_KTRACE(SMB_DBG_SMBFS_UPDATE_CACHE | DBG_FUNC_END, error, 0, 0, 0, 0);
 	 return (error);
  }
@@ -1390,6 +1425,20 @@ smbfs_close(struct smb_share *share, vnode_t vp, int openMode,
 
     /* If last close of entire file, can we defer the close? */
     if (last_close) {
+        /*
+         * If we are out of budget, close the least recently used deferred
+         * close instead of this one, as this file is more likely to be
+         * opened again.
+         */
+        if (!(openMode & FNOCACHE) &&
+            !(np->n_flag & (NDELETEONCLOSE | N_ISSTREAM)) &&
+            (share->ss_max_def_close_cnt > 0) &&
+            (OSAddAtomic(0, &share->ss_curr_def_close_cnt) >= share->ss_max_def_close_cnt)) {
+            smbfs_def_close_lru_trim(share, np->n_mount,
+                                     share->ss_max_def_close_cnt - 1, 0, 1,
+                                     "LRU evict", context);
+        }
+
         /*
          * If we have a handle lease, try to defer the close
          * But only if its not marked for delete on close and not a
@@ -1409,6 +1458,7 @@ smbfs_close(struct smb_share *share, vnode_t vp, int openMode,
             /* Mark it as a deferred close */
             np->n_lease.flags |= SMB2_DEFERRED_CLOSE;
             OSAddAtomic(1, &share->ss_curr_def_close_cnt);
+            smbfs_def_close_lru_add(np);
 
             /* Update cumulative count */
             OSAddAtomic64(1, &share->ss_total_def_close_cnt);
@@ -1693,7 +1743,7 @@ smbfs_vnop_close(struct vnop_close_args *ap)
                  */
                 SMB_LOG_UBC_LOCK(np, "cluster_push(IO_CLOSE) and UBC_PUSHDIRTY on <%s> due to closing file \n",
                                  np->n_name);
-                np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
                                 
                 cluster_push(vp, IO_CLOSE);
                 ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
@@ -2173,6 +2223,8 @@ smbfs_create_open(struct smb_share *share, vnode_t dvp, struct componentname *cn
 			/* if opened with just write, then turn off cluster code */
 			vnode_setnocache(vp);
 		}
+
+		smbfs_sync_list_add(np);
 	}
     
 	/* If it was allocated then free, since we are done with it now */ 
@@ -2469,6 +2521,7 @@ smbfs_open(struct smb_share *share, vnode_t vp, int mode,
                     np->n_lease.def_close_timer = 0;
 
                     OSAddAtomic(-1, &share->ss_curr_def_close_cnt);
+                    smbfs_def_close_lru_remove(np);
 
                     SMB_LOG_LEASING_LOCK(np, "Reusing lockFID on <%s> accessMode <0x%x> cnt <%d> \n",
                                            np->n_name,
@@ -2596,19 +2649,20 @@ smbfs_open(struct smb_share *share, vnode_t vp, int mode,
                 (np->n_lease.lease_state & SMB2_LEASE_HANDLE_CACHING) &&
                 (np->n_lease.flags & SMB2_DEFERRED_CLOSE)) {
                 /*
-                 * There is a pending deferred close, but we will only reuse
-                 * it if its an exact match. Could be lockFID or sharedFID
-                 * with the deferred close.
+                 * There is a pending deferred close, the sharedFID has no
+                 * deny modes so like an open sharedFID, we can reuse it if
+                 * it has all the access we need. Could be lockFID or
+                 * sharedFID with the deferred close.
                  */
                 if ((np->f_sharedFID_fid != 0) &&
-                    ((np->f_sharedFID_accessMode == accessMode) ||
-                     ((np->f_sharedFID_accessMode & ~kAccessRead) == accessMode))) {
+                    ((accessMode & np->f_sharedFID_accessMode) == accessMode)) {
                     /* Its a match that we can reuse */
                     np->n_lease.flags &= ~SMB2_DEFERRED_CLOSE;
                     np->n_lease.handle_reuse_cnt += 1;
                     np->n_lease.def_close_timer = 0;
 
                     OSAddAtomic(-1, &share->ss_curr_def_close_cnt);
+                    smbfs_def_close_lru_remove(np);
 
                     SMB_LOG_LEASING_LOCK(np, "Reusing sharedFID on <%s> accessMode <0x%x> cnt <%d> \n",
                                            np->n_name,
@@ -2713,6 +2767,16 @@ smbfs_open(struct smb_share *share, vnode_t vp, int mode,
                                         context);
         }
 
+        if ((error == EMFILE) &&
+            (smbfs_def_close_server_limit(share, np->n_mount, context) != 0)) {
+            /* Server ran out of handles, we gave some back so try again */
+            error = smbfs_smb_open_file(share, np,
+                                        rights | addedReadRights, shareMode, &fid,
+                                        NULL, 0, FALSE,
+                                        fap, &dur_hndl_lease,
+                                        context);
+        }
+
         if (error) {
             /* Failed to open the file, so exit */
             goto exit;
@@ -2931,6 +2995,11 @@ exit:
 		vnode_setnocache(vp);
 	}
 
+    if (error == 0) {
+        /* Reopen, deferred close and lease upgrade are done by smbfs_sync */
+        smbfs_sync_list_add(np);
+    }
+
     /* Free the temp lease */
     if (lease_need_free) {
         smb2_lease_free(&temp_lease);
@@ -2986,6 +3055,7 @@ smbfs_vnop_open_common(vnode_t vp, int mode, vfs_context_t context, void *n_last
 	/* Just mark that the directory was opened */
 	if (vnode_isdir(vp)) {
 		np->d_refcnt++;
+		smbfs_sync_list_add(np);
 		error = 0;
 	}
     else {
@@ -3073,7 +3143,7 @@ smbfs_vnop_open_common(vnode_t vp, int mode, vfs_context_t context, void *n_last
                         SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> due to file modified while closed \n",
                                          np->n_name);
                         
-                        np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+                        OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
                         ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_INVALIDATE);
                     }
                 }
@@ -4032,7 +4102,7 @@ smbfs_vnop_mnomap(struct vnop_mnomap_args *ap)
         SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY, UBC_INVALIDATE on <%s> due to mnomap \n",
                          np->n_name);
         
-        np->n_flag &= ~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY);
+        OSBitAndAtomic(~(NNEEDS_UBC_INVALIDATE | NNEEDS_UBC_PUSHDIRTY), &np->n_flag);
         ubc_msync(vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
     }
 
@@ -4134,6 +4204,10 @@ static int smbfs_vnop_reclaim(struct vnop_reclaim_args *ap)
 	np->n_lastvop = smbfs_vnop_reclaim;
 	smp = VTOSMBFS(vp);
 
+	/* smbfs_sync must not find this node any more */
+	smbfs_sync_list_remove(np);
+	smbfs_def_close_lru_remove(np);
+
 #ifdef SMB_DEBUG
 	if (vnode_isdir(vp)) {
 		DBG_ASSERT((np->d_kqrefcnt == 0));	
@@ -4325,6 +4399,9 @@ static int smbfs_vnop_reclaim(struct vnop_reclaim_args *ap)
     }
 	np->n_symlink_target_len = 0;
 	np->n_symlink_cache_timer = 0;
+
+    /* Clear any allocated range cache, always safe to do */
+    smbfs_alloc_range_free(np);
 	
 	/* We are done with the node clear the acl cache and destroy the acl cache lock  */
 	if (!vnode_isnamedstream(vp)) {
@@ -4342,6 +4419,7 @@ static int smbfs_vnop_reclaim(struct vnop_reclaim_args *ap)
     if (np->n_sname != NULL) {
         SMB_FREE_DATA(np->n_sname, np->n_sname_allocsize);
     }
+    smbfs_path_cache_free(np);
 
     if (np->n_hifi_attrs != NULL) {
         SMB_FREE_TYPE(struct smb_vnode_attr, np->n_hifi_attrs);
@@ -4370,6 +4448,8 @@ static int smbfs_vnop_reclaim(struct vnop_reclaim_args *ap)
 	lck_rw_destroy(&np->n_name_rwlock, smbfs_rwlock_group);
 	lck_rw_destroy(&np->n_parent_rwlock, smbfs_rwlock_group);
     lck_mtx_destroy(&np->n_flag_alloc_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&np->n_attr_lock, smbfs_mutex_group);
+    lck_mtx_destroy(&np->n_alloc_range_lock, smbfs_mutex_group);
 
     SMB_FREE_TYPE(struct smbnode, np);
 
@@ -5071,7 +5151,7 @@ smbfs_vnop_getattr(struct vnop_getattr_args *ap)
 	SMB_LOG_KTRACE(SMB_DBG_GET_ATTR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     np = VTOSMB(vp);
-    np->n_write_unsafe = true;
+    OSAddAtomic(1, &np->n_write_unsafe);
 	np->n_lastvop = smbfs_vnop_getattr;
 	share = smb_get_share_with_reference(VTOSMBFS(vp));
 
@@ -5094,7 +5174,7 @@ smbfs_vnop_getattr(struct vnop_getattr_args *ap)
 
         /* Get an exclusive lock */
         if ((error = smbnode_lock(VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK))) {
-            np->n_write_unsafe = false;
+            OSAddAtomic(-1, &np->n_write_unsafe);
             return (error);
         }
 
@@ -5114,7 +5194,7 @@ smbfs_vnop_getattr(struct vnop_getattr_args *ap)
 
         /* And get the shared lock again */
         if ((error = smbnode_lock(VTOSMB(vp), SMBFS_SHARED_LOCK))) {
-            np->n_write_unsafe = false;
+            OSAddAtomic(-1, &np->n_write_unsafe);
             return (error);
         }
     }
@@ -5133,7 +5213,7 @@ smbfs_vnop_getattr(struct vnop_getattr_args *ap)
 
 	error = smbfs_getattr(share, vp, ap->a_vap, ap->a_context);
 	smb_share_rele(share, ap->a_context);
-    np->n_write_unsafe = false;
+    OSAddAtomic(-1, &np->n_write_unsafe);
 	smbnode_unlock(np);
     
     SMB_LOG_KTRACE(SMB_DBG_GET_ATTR | DBG_FUNC_END, error, 0, 0, 0, 0);
@@ -5607,7 +5687,7 @@ smbfs_set_data_size(struct smb_share *share, vnode_t vp, struct vnode_attr *vap,
         SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY on <%s> due to set file data size \n",
                          np->n_name);
 
-        np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+        OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
         ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
     }
     else {
@@ -5727,6 +5807,9 @@ smbfs_set_data_size(struct smb_share *share, vnode_t vp, struct vnode_attr *vap,
     SMB_LOG_IO_LOCK(np, "%s: Calling smbfs_setsize, old eof = %lld  new eof = %lld\n",
                     np->n_name, curr_size, new_size);
 
+    /* The eof moved, so did the holes */
+    smbfs_alloc_range_invalidate(np);
+
     if (error) {
         /* If we failed, try to restore previous size in UBC and leave */
         smbfs_setsize(vp, (off_t) curr_size);
@@ -6242,7 +6325,7 @@ smbfs_setattr(struct smb_share *share, vnode_t vp, struct vnode_attr *vap,
         SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY on <%s> due to setting mod date \n",
                          np->n_name);
         
-        np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+        OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
 		ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
 	}
 	
@@ -6538,7 +6621,8 @@ smbfs_do_strategy(struct buf *bp)
     struct smb_share *share = NULL;
     uint32_t trycnt = 0;
     struct smbfattr *fap = NULL;
-    uint32_t allow_compression = 1, need_unmap = 0;
+    uint32_t allow_compression = 1, need_unmap = 0, tried_compression = 0;
+    struct smb_compress_stats compress_stats = {0};
     vm_prot_t prot = PROT_READ;
     
     SMB_LOG_KTRACE(SMB_DBG_DO_STRATEGY | DBG_FUNC_START, 0, 0, 0, 0, 0);
@@ -6572,7 +6656,7 @@ smbfs_do_strategy(struct buf *bp)
     }
 
     /* Not safe to call UBC during this operation */
-    np->n_write_unsafe = true;
+    OSAddAtomic(1, &np->n_write_unsafe);
 
     /*
      * Can't use the physical addresses passed in the vector list, so map it
@@ -6649,21 +6733,29 @@ smbfs_do_strategy(struct buf *bp)
     smb_ktrace_io_start(np->n_mount->sm_mp, uio, uio_offset(uio), VTOSMBFS(vp)->sm_statfsbuf.f_bsize, bflags, uio_resid(uio));
     
     if (bflags & B_READ) {
-        error = smbfs_doread(share, (off_t)np->n_size, uio, fid, allow_compression, NULL);
+        error = smbfs_doread(share, np, (off_t)np->n_size, uio, fid, allow_compression, NULL);
     }
     else {
-        error = smbfs_dowrite(share, (off_t)np->n_size, uio, fid, 0, &allow_compression, NULL);
+        /* Has compression been paying off for this file? */
+        if (allow_compression && !smbfs_compress_allowed_now(np)) {
+            allow_compression = 0;
+        }
+        tried_compression = allow_compression;
+
+        error = smbfs_dowrite(share, (off_t)np->n_size, uio, fid, 0,
+                              &allow_compression, &compress_stats, NULL);
+
+        /* Even a failed write may have filled in a hole */
+        smbfs_alloc_range_invalidate(np);
         
         if (!error) {
             /* Save last time we wrote data */
             nanouptime(&np->n_last_write_time);
         }
         
-        /* Check for too many write compression failures */
-        if (!(np->n_flag & N_DONT_COMPRESS) && (allow_compression == 0)) {
-            SMBWARNING_LOCK(np, "%s: Compression disabled because of too many compression failures \n",
-                            np->n_name);
-            np->n_flag |= N_DONT_COMPRESS;
+        /* Learn from the results, too many failures turns it off for a while */
+        if (tried_compression) {
+            smbfs_compress_update(np, &compress_stats, (allow_compression == 0));
         }
     }
     
@@ -6737,11 +6829,11 @@ smbfs_do_strategy(struct buf *bp)
                 break;
             }
             if (bflags & B_READ) {
-                error = smbfs_doread(share, (off_t)np->n_size, uio, fid, allow_compression, NULL);
+                error = smbfs_doread(share, np, (off_t)np->n_size, uio, fid, allow_compression, NULL);
             }
             else {
                 /* SMBv1 so no need to check for write compress fails */
-                error = smbfs_dowrite(share, (off_t)np->n_size, uio, fid, 0, &allow_compression, NULL);
+                error = smbfs_dowrite(share, (off_t)np->n_size, uio, fid, 0, &allow_compression, NULL, NULL);
                 
                 if (!error) {
                     /* Save last time we wrote data */
@@ -6811,7 +6903,7 @@ exit:
         }
     }
 
-    np->n_write_unsafe = false;
+    OSAddAtomic(-1, &np->n_write_unsafe);
 
     if (error) {
         SMB_LOG_IO_LOCK(np, "%s: buf_resid(bp) %d, error = %d \n",
@@ -6955,7 +7047,7 @@ smbfs_vnop_read(struct vnop_read_args *ap)
                    uio_resid(uio), 0, 0, 0);
 
 	np = VTOSMB(vp);
-    np->n_write_unsafe = true;
+    OSAddAtomic(1, &np->n_write_unsafe);
 	np->n_lastvop = smbfs_vnop_read;
 	share = smb_get_share_with_reference(VTOSMBFS(vp));
     
@@ -6976,10 +7068,22 @@ smbfs_vnop_read(struct vnop_read_args *ap)
 	 * issues. So only if we have a f_refcnt do we call smbfs_smb_reopen_file.
  	 */
  	if ((np->f_lockFID_refcnt == 0) && (np->f_sharedFID_refcnt == 0)) {
- 		error = smbfs_open(share, vp, FREAD, ap->a_context);
+        /*
+         * Opening the file changes its open state which needs the exclusive
+         * lock. The upgrade can drop the lock, so check again once we have it.
+         * Reads of a file that is already open stay on the shared lock.
+         */
+        smbnode_lock_upgrade(np);
+        if ((np->f_lockFID_refcnt == 0) && (np->f_sharedFID_refcnt == 0)) {
+            error = smbfs_open(share, vp, FREAD, ap->a_context);
+            if (error == 0) {
+                np->f_needClose = 1;
+            }
+        }
+        smbnode_lock_downgrade(np);
+        
  		if (error)
  			goto exit;
-		else np->f_needClose = 1;
  	}
     else {
         /* See if file needs to be reopened or revoked */
@@ -7056,20 +7160,20 @@ smbfs_vnop_read(struct vnop_read_args *ap)
                 SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY on <%s> due to EACCESS error on mmapped file \n",
                                  np->n_name);
                 
-                np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
 				ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
 			} else {
 				/* Less expensive, but does not handle mmapped files */
                 SMB_LOG_UBC_LOCK(np, "IO_SYNC cluster_push on <%s> due to EACCESS error \n",
                                  np->n_name);
-                np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
 				cluster_push(vp, IO_SYNC);
 			}
             
             SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> due to EACCESS error \n",
                              np->n_name);
             
-            np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+            OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
 			ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_INVALIDATE);
 			vnode_setnocache(vp);
 			/* Fall through and try a non cached read */
@@ -7101,13 +7205,13 @@ smbfs_vnop_read(struct vnop_read_args *ap)
         SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY on <%s> due to non cacheable read on mmapped file \n",
                          np->n_name);
         
-        np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+        OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
 		ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
 	} else {
 		/* Less expensive, but does not handle mmapped files */
         SMB_LOG_UBC_LOCK(np, "IO_SYNC cluster_push on <%s> due to non cacheable read \n",
                          np->n_name);
-        np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+        OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
 		cluster_push(vp, IO_SYNC);
 	}
     
@@ -7118,7 +7222,7 @@ smbfs_vnop_read(struct vnop_read_args *ap)
     SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> on offset/len due to non cacheable read \n",
                      np->n_name);
     
-    np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+    OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
 	ubc_msync (vp, uio_offset(uio), uio_offset(uio)+ uio_resid(uio), NULL,
 			   UBC_INVALIDATE);
 	
@@ -7134,7 +7238,7 @@ smbfs_vnop_read(struct vnop_read_args *ap)
     
     smb_ktrace_io_start(np->n_mount->sm_mp, uio, uio_offset(uio), VTOSMBFS(vp)->sm_statfsbuf.f_bsize, bflags, uio_resid(uio));
 
-    error = smbfs_doread(share, (off_t)np->n_size, uio, fid,
+    error = smbfs_doread(share, np, (off_t)np->n_size, uio, fid,
                          allow_compression, ap->a_context);
 
     smb_ktrace_io_end(vp, uio, uio_resid(uio), error);
@@ -7156,7 +7260,7 @@ smbfs_vnop_read(struct vnop_read_args *ap)
             
             smb_ktrace_io_start(np->n_mount->sm_mp, uio, uio_offset(uio), VTOSMBFS(vp)->sm_statfsbuf.f_bsize, bflags, uio_resid(uio));
             
-			error = smbfs_doread(share, (off_t)np->n_size, uio, fid, 
+			error = smbfs_doread(share, np, (off_t)np->n_size, uio, fid, 
                                  allow_compression, ap->a_context);
             
             smb_ktrace_io_end(vp, uio, uio_resid(uio), error);
@@ -7176,7 +7280,7 @@ smbfs_vnop_read(struct vnop_read_args *ap)
 	
 exit:
 	smb_share_rele(share, ap->a_context);
-    np->n_write_unsafe = false;
+    OSAddAtomic(-1, &np->n_write_unsafe);
 	smbnode_unlock(np);
 
 	SMB_LOG_KTRACE(SMB_DBG_READ | DBG_FUNC_END, error, 0, 0, 0, 0);
@@ -7204,6 +7308,8 @@ smbfs_vnop_write(struct vnop_write_args *ap)
 	u_quad_t originalEOF = 0;	
 	user_size_t writeCount = 0;
     uint32_t allow_compression = 1, do_cluster = 1, bflags = 0;
+    uint32_t tried_compression = 0;
+    struct smb_compress_stats compress_stats = {0};
 
 	/* Preflight checks */
 	if (!vnode_isreg(vp)) {
@@ -7390,21 +7496,21 @@ smbfs_vnop_write(struct vnop_write_args *ap)
                 SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY on <%s> due to EACCESS on mmapped file \n",
                                  np->n_name);
                 
-                np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
 				ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
 			} else {
 				/* Less expensive, but does not handle mmapped files */
                 SMB_LOG_UBC_LOCK(np, "IO_SYNC cluster_push on <%s> due to EACCESS \n",
                                  np->n_name);
 
-                np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
                 cluster_push(vp, IO_SYNC);
 			}
             
             SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> due to EACCESS error \n",
                              np->n_name);
             
-            np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+            OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
 			ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_INVALIDATE);
 			vnode_setnocache(vp);
 			/* Fall through and try a non cached write */
@@ -7429,14 +7535,14 @@ smbfs_vnop_write(struct vnop_write_args *ap)
     SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY on <%s> on offset/len due to non cacheable write \n",
                      np->n_name);
     
-    np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+    OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
 	ubc_msync(vp, uio_offset(uio), uio_offset(uio)+ uio_resid(uio), NULL,
 			   UBC_PUSHDIRTY | UBC_SYNC);
 
     SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> on offset/len due to non cacheable write \n",
                      np->n_name);
 
-    np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+    OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
 	ubc_msync(vp, uio_offset(uio), uio_offset(uio)+ uio_resid(uio), NULL,
 			   UBC_INVALIDATE);
 	
@@ -7468,21 +7574,29 @@ smbfs_vnop_write(struct vnop_write_args *ap)
         
         smb_ktrace_io_start(np->n_mount->sm_mp, uio,uio_offset(uio), VTOSMBFS(vp)->sm_statfsbuf.f_bsize, bflags, uio_resid(uio));
 
+        /* Has compression been paying off for this file? */
+        if (allow_compression && !smbfs_compress_allowed_now(np)) {
+            allow_compression = 0;
+        }
+        tried_compression = allow_compression;
+        bzero(&compress_stats, sizeof(compress_stats));
+
 		error = smbfs_dowrite(share, (off_t)np->n_size, uio, fid, ap->a_ioflag,
-                              &allow_compression, ap->a_context);
+                              &allow_compression, &compress_stats, ap->a_context);
         
         smb_ktrace_io_end(vp, uio, uio_resid(uio), error);
+
+        /* Even a failed write may have filled in a hole */
+        smbfs_alloc_range_invalidate(np);
         
         if (!error) {
             /* Save last time we wrote data */
             nanouptime(&np->n_last_write_time);
         }
         
-        /* Check for too many write compression failures */
-        if (!(np->n_flag & N_DONT_COMPRESS) && (allow_compression == 0)) {
-            SMBWARNING_LOCK(np, "Compression disabled on <%s> because of too many compression failures \n",
-                            np->n_name);
-            np->n_flag |= N_DONT_COMPRESS;
+        /* Learn from the results, too many failures turns it off for a while */
+        if (tried_compression) {
+            smbfs_compress_update(np, &compress_stats, (allow_compression == 0));
         }
 
         if (error == EBADF) {
@@ -7542,6 +7656,7 @@ exit:
              * to the server can wait until system sync or vnop_sync time.
              */
             np->n_flag |= NNEEDS_EOF_SET;
+            smbfs_sync_list_add(np);
             
             /*
              * Windows FAT file systems require a flush, after a seteof. Until the
@@ -8941,6 +9056,7 @@ smbfs_vnop_rename(struct vnop_rename_args *ap)
             
             fnp->n_parent_vnode = tdvp;
             fnp->n_parent_vid = vnode_vid(tdvp);
+            smbfs_path_cache_invalidate(fnp);
 
             lck_rw_unlock_exclusive(&fnp->n_parent_rwlock);
 		}
@@ -8960,6 +9076,7 @@ smbfs_vnop_rename(struct vnop_rename_args *ap)
 			fnp->n_name = new_name;
 			fnp->n_nmlen = tcnp->cn_namelen;
             fnp->n_name_allocsize = new_name_allocsize;
+            smbfs_path_cache_invalidate(fnp);
 
             if (!(SS_TO_SESSION(share)->session_misc_flags & SMBV_HAS_FILEIDS)) {
                 /* Server does not support File IDs */
@@ -9439,7 +9556,7 @@ smbfs_vnop_readdir(struct vnop_readdir_args *ap)
 	SMB_LOG_KTRACE(SMB_DBG_READ_DIR | DBG_FUNC_START, VTOSMB(vp)->d_fid, 0, 0, 0, 0);
 
 	np->n_lastvop = smbfs_vnop_readdir;
-    np->n_write_unsafe = true;
+    OSAddAtomic(1, &np->n_write_unsafe);
 
     share = smb_get_share_with_reference(VFSTOSMBFS(vnode_mount(vp)));
 
@@ -9517,7 +9634,7 @@ smbfs_vnop_readdir(struct vnop_readdir_args *ap)
     }
     ap->a_numdirent += dot_and_dotdot;
 done:
-    np->n_write_unsafe = false;
+    OSAddAtomic(-1, &np->n_write_unsafe);
 
     if (share != NULL) {
         smb_share_rele(share, ap->a_context);
@@ -9551,7 +9668,7 @@ smbfs_fsync(struct smb_share *share, vnode_t vp, int waitfor, int ubc_flags,
             SMB_LOG_UBC_LOCK(VTOSMB(vp), "UBC_PUSHDIRTY on <%s> due to fsync on mmapped file. waitfor 0x%x \n",
                              VTOSMB(vp)->n_name, waitfor);
             
-            VTOSMB(vp)->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+            OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &VTOSMB(vp)->n_flag);
             
             flags = UBC_PUSHDIRTY;
             if (waitfor & (MNT_WAIT | MNT_DWAIT)) {
@@ -9564,7 +9681,7 @@ smbfs_fsync(struct smb_share *share, vnode_t vp, int waitfor, int ubc_flags,
             SMB_LOG_UBC_LOCK(VTOSMB(vp), "IO_SYNC cluster_push on <%s> due to fsync. waitfor 0x%x \n",
                              VTOSMB(vp)->n_name, waitfor);
 
-            VTOSMB(vp)->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+            OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &VTOSMB(vp)->n_flag);
             
             if (waitfor & (MNT_WAIT | MNT_DWAIT)) {
                 flags |= IO_SYNC;
@@ -9575,7 +9692,7 @@ smbfs_fsync(struct smb_share *share, vnode_t vp, int waitfor, int ubc_flags,
         if (error) {
             SMBERROR_LOCK(VTOSMB(vp), "ubc_msync or cluster_push failed %d on <%s> \n",
                           error, VTOSMB(vp)->n_name);
-            VTOSMB(vp)->n_flag |= NNEEDS_UBC_PUSHDIRTY;
+            OSBitOrAtomic(NNEEDS_UBC_PUSHDIRTY, &VTOSMB(vp)->n_flag);
             goto exit;
         }
 	}
@@ -9779,6 +9896,8 @@ static int smbfs_is_vnop_ioctl_command_supported(u_long command) {
         case F_FULLFSYNC:
         case smbfsStatFSCTL:
         case smbfsUpdateLeaseFSCTL:
+        case FSIOC_FIOSEEKHOLE:
+        case FSIOC_FIOSEEKDATA:
             return true;
         default:
             return false;
@@ -9878,20 +9997,20 @@ static int32_t smbfs_vnop_ioctl(struct vnop_ioctl_args *ap)
                     SMB_LOG_UBC_LOCK(np, "UBC_PUSHDIRTY on <%s> on offset/len due to byte range lock on mmapped file \n",
                                      np->n_name);
                     
-                    np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                    OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
                     ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_PUSHDIRTY | UBC_SYNC);
                 } else {
                     /* Less expensive, but does not handle mmapped files */
                     SMB_LOG_UBC_LOCK(np, "IO_SYNC cluster_push on <%s> due to byte range lock \n",
                                      np->n_name);
 
-                    np->n_flag &= ~NNEEDS_UBC_PUSHDIRTY;
+                    OSBitAndAtomic(~NNEEDS_UBC_PUSHDIRTY, &np->n_flag);
                     cluster_push(vp, IO_SYNC);
                 }
                 
                 SMB_LOG_UBC_LOCK(np, "UBC_INVALIDATE on <%s> on offset/len due to byte range lock \n",
                                  np->n_name);
-                np->n_flag &= ~NNEEDS_UBC_INVALIDATE;
+                OSBitAndAtomic(~NNEEDS_UBC_INVALIDATE, &np->n_flag);
                 ubc_msync (vp, 0, ubc_getsize(vp), NULL, UBC_INVALIDATE);
                 vnode_setnocache(vp);
             }
@@ -10691,6 +10810,17 @@ static int32_t smbfs_vnop_ioctl(struct vnop_ioctl_args *ap)
                 
                 pb->file.rsrc_fork_timer = np->rfrk_cache_timer;
                 pb->file.symlink_timer = np->n_symlink_cache_timer;
+
+                /* Fill in write compression results */
+                lck_mtx_lock(&np->n_mount->sm_compress_lock);
+                pb->file.compress = np->n_compress;
+                if (np->n_compress_ext != 0) {
+                    pb->file.compress_ext = np->n_mount->sm_compress_ext[np->n_compress_ext - 1].ce_stats;
+                    strlcpy(pb->file.compress_ext_name,
+                            np->n_mount->sm_compress_ext[np->n_compress_ext - 1].ce_name,
+                            sizeof(pb->file.compress_ext_name));
+                }
+                lck_mtx_unlock(&np->n_mount->sm_compress_lock);
             }
             
             nanouptime(&ts);
@@ -10710,6 +10840,15 @@ static int32_t smbfs_vnop_ioctl(struct vnop_ioctl_args *ap)
             pb->lease_def_close_reuse_cnt = np->n_lease.handle_reuse_cnt;
             pb->lease_def_close_timer = np->n_lease.def_close_timer;
 
+            smbfs_hash_stats(np->n_mount, &pb->node_hash);
+            pb->dir_arena = np->n_mount->sm_dir_arena;
+            smb_global_dir_cache_get_stats(&pb->dir_cache);
+
+            pb->sync.list_nodes = np->n_mount->sm_sync_cnt;
+            pb->sync.last_nodes = np->n_mount->sm_sync_last_nodes;
+            pb->sync.last_usecs = np->n_mount->sm_sync_last_usecs;
+            pb->sync.max_usecs = np->n_mount->sm_sync_max_usecs;
+
             error = 0;
         }
             break;
@@ -10722,6 +10861,19 @@ static int32_t smbfs_vnop_ioctl(struct vnop_ioctl_args *ap)
             break;
         }
 
+        case FSIOC_FIOSEEKHOLE:
+        case FSIOC_FIOSEEKDATA:
+            /* lseek(SEEK_HOLE/SEEK_DATA), a_data is the offset in and out */
+            if (!vnode_isreg(vp)) {
+                error = ENOTSUP;
+                break;
+            }
+
+            error = smbfs_seek_hole_data(share, np,
+                                         (ap->a_command == FSIOC_FIOSEEKHOLE),
+                                         (off_t *) ap->a_data, ap->a_context);
+            break;
+
 		default:
             /*
              * Should never happen as command is checked in
@@ -11577,7 +11729,7 @@ smbfs_vnop_pagein(struct vnop_pagein_args *ap)
         goto done;
 	}
 
-    np->n_write_unsafe = true;
+    OSAddAtomic(1, &np->n_write_unsafe);
 
     share = smb_get_share_with_reference(VTOSMBFS(vp));
 	/* Before trying the read see if the file needs to be reopened or revoked */
@@ -11586,7 +11738,7 @@ smbfs_vnop_pagein(struct vnop_pagein_args *ap)
 		SMBDEBUG_LOCK(np, " %s waiting to be revoked\n", np->n_name);
 
 		/* Release the share reference before returning */
-        np->n_write_unsafe = false;
+        OSAddAtomic(-1, &np->n_write_unsafe);
 		smb_share_rele(share, ap->a_context);
 		error = err_pagein(ap);	/* behave like the deadfs does */
 		goto done;
@@ -11610,7 +11762,7 @@ smbfs_vnop_pagein(struct vnop_pagein_args *ap)
 		SMB_LOG_IO_LOCK(np, "%s failed cluster_pagein with an error of %d\n",
                         np->n_name, error);
 	}
-    np->n_write_unsafe = false;
+    OSAddAtomic(-1, &np->n_write_unsafe);
 	smb_share_rele(share, ap->a_context);
 
 done:
@@ -12121,7 +12273,7 @@ smbfs_vnop_setxattr(struct vnop_setxattr_args *ap)
             /* Now we can write the afp info back out with the new finder information */
             if (!error) {
                 error = smb_smb_write(share, fid, afp_uio, 0,
-                                      &allow_compression, ap->a_context);
+                                      &allow_compression, NULL, ap->a_context);
                 SMB_LOG_KTRACE(SMB_DBG_SET_XATTR | DBG_FUNC_NONE,
                                0xabc002, error, stype, 0, 0);
             }
@@ -12200,7 +12352,7 @@ smbfs_vnop_setxattr(struct vnop_setxattr_args *ap)
         
         /* Now write out the stream data */
         error = smb_smb_write(share, fid, ap->a_uio, 0,
-                              &allow_compression, ap->a_context);
+                              &allow_compression, NULL, ap->a_context);
         SMB_LOG_KTRACE(SMB_DBG_SET_XATTR | DBG_FUNC_NONE,
                        0xabc004, error, stype, 0, 0);
         
@@ -12502,7 +12654,7 @@ smbfs_vnop_removexattr(struct vnop_removexattr_args *ap)
             
 			if (!error) {
 				error = smb_smb_write(share, fid, afp_uio, 0,
-                                      &allow_compression, ap->a_context);
+                                      &allow_compression, NULL, ap->a_context);
                 SMB_LOG_KTRACE(SMB_DBG_RM_XATTR | DBG_FUNC_NONE,
                                0xabc003, error, stype, 0, 0);
             }
@@ -12608,7 +12760,7 @@ smbfs_vnop_getxattr(struct vnop_getxattr_args *ap)
     SMB_LOG_KTRACE(SMB_DBG_GET_XATTR | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
     np = VTOSMB(vp);
-    np->n_write_unsafe = true;
+    OSAddAtomic(1, &np->n_write_unsafe);
 	np->n_lastvop = smbfs_vnop_getxattr;
 	share = smb_get_share_with_reference(VTOSMBFS(vp));
 
@@ -12955,7 +13107,7 @@ exit:
 			error = ENOATTR;		
 	}
 
-    np->n_write_unsafe = false;
+    OSAddAtomic(-1, &np->n_write_unsafe);
     smb_share_rele(share, ap->a_context);
 	smbnode_unlock(np);
 
@@ -13361,6 +13513,8 @@ smbfs_vnop_monitor(struct vnop_monitor_args *ap)
 
 	switch (ap->a_flags) {
 		case VNODE_MONITOR_BEGIN:
+			/* smbfs_sync restarts the notify and updates the cache */
+			smbfs_sync_list_add(np);
 			error = smbfs_start_change_notify(share, ap->a_vp, ap->a_context,
 											  &releaseLock);
 			break;
@@ -14620,7 +14774,7 @@ smbfs_fetch_new_entries(struct smb_share *share, vnode_t dvp,
 
     if ((ctx = dnp->d_fctx) &&
         ctx->f_fid_closed &&
-        SLIST_EMPTY(&ctx->f_queries) &&
+        STAILQ_EMPTY(&ctx->f_queries) &&
         ((ctx->f_flags & SMBFS_RDD_EOF) == SMBFS_RDD_EOF)) {
         smbfs_fetch_new_entries_eof(dvp, cachep, context);
         error = ENOENT;
@@ -14789,7 +14943,7 @@ smbfs_fetch_new_entries(struct smb_share *share, vnode_t dvp,
                    fetch_count, 0, 0, 0, 0);
 
     while (fetch_count > 0) {
-        if (ctx->f_fid_closed && SLIST_EMPTY(&ctx->f_queries)) {
+        if (ctx->f_fid_closed && STAILQ_EMPTY(&ctx->f_queries)) {
             /* dir was closed after sending the last query dir
              * because the directory needs to be closed whenever possible
              * we have no more saved entries
@@ -14854,17 +15008,33 @@ smbfs_fetch_new_entries(struct smb_share *share, vnode_t dvp,
 				}
 			}
 
-			smb_dir_cache_add_entry(dvp, cachep,
-                                    name, name_len, fap,
-                                    is_overflow, 1);
+			tmp_error = smb_dir_cache_add_entry(dvp, cachep,
+                                                name, name_len, fap,
+                                                is_overflow, 1);
 
-			/* Did we hit the max number of entries? */
-            if (cachep->flags & kDirCachePartial) {
+			/* Did we hit the max number of entries or run out of memory? */
+            if (tmp_error || (cachep->flags & kDirCachePartial)) {
                 break; /* yep, return what we have */
             }
 
             cache_entries_added += 1;
         }
+
+        /*
+         * When filling the main cache, return each Query Dir reply as soon
+         * as its entries are parsed out so the caller can start handing them
+         * back. The next reply is already being read ahead by
+         * smb2fs_smb_findnext. Overflow fills and refills keep going since
+         * they close or restart the enumeration afterwards.
+         */
+        if ((is_overflow == 0) &&
+            (need_refill == 0) &&
+            (cache_entries_added > 0) &&
+            (SS_TO_SESSION(share)->session_flags & SMBV_SMB2) &&
+            (STAILQ_EMPTY(&ctx->f_queries) ||
+             (STAILQ_FIRST(&ctx->f_queries)->ra_queryp != NULL))) {
+            break;
+        }
     }
 
     /*
@@ -14875,8 +15045,14 @@ smbfs_fetch_new_entries(struct smb_share *share, vnode_t dvp,
         (share->ss_attributes & FILE_NAMED_STREAMS)) {
         /* Get the meta data for this set of entries */
         if (cachep->flags & kDirCacheDirty) {
-            smb_dir_cache_get_attrs(share, dvp, cachep, 1, context);
-            cachep->flags &= ~kDirCacheDirty;
+            /*
+             * If interrupted or out of credits, leave it dirty so the next
+             * caller finishes it
+             */
+            tmp_error = smb_dir_cache_get_attrs(share, dvp, cachep, 1, context);
+            if ((tmp_error != EINTR) && (tmp_error != EAGAIN)) {
+                cachep->flags &= ~kDirCacheDirty;
+            }
         }
     }
     
@@ -14886,6 +15062,9 @@ smbfs_fetch_new_entries(struct smb_share *share, vnode_t dvp,
      */
     if ((ctx = dnp->d_fctx) &&
         ctx->f_need_close && is_overflow) {
+        /* Collect the read ahead reply before the dir goes away */
+        smb2fs_smb_findnext_read_ahead_wait(ctx);
+
         error = smb2_smb_close_fid(ctx->f_share, ctx->f_create_fid,
                                    NULL, NULL, NULL, context);
         smbfs_remove_dir_lease(dnp, "smbfs_fetch_new_entries done");
@@ -15237,8 +15416,7 @@ smbfs_search_main_cache(struct smb_session *sessionp, struct vnode *dvp,
 {
     struct smbnode *dnp = NULL;
     struct cached_dir_entry *enum_cache_currp = NULL;
-    int error = ENOENT, is_match;
-    off_t curr_offset = 0;
+    int error = ENOENT;
 
     /* d_enum_cache_list_lock MUST be already held */
 
@@ -15252,20 +15430,22 @@ smbfs_search_main_cache(struct smb_session *sessionp, struct vnode *dvp,
 
     dnp = VTOSMB(dvp);
     
-    enum_cache_currp = dnp->d_main_cache.list;
-
-    while (enum_cache_currp != NULL) {
-        is_match = smbfs_entries_match(sessionp, dvp,
-                                       enum_cache_currp,
-                                       resume_cookiep);
+    /* Same matching rules as smbfs_entries_match, but using the cache indexes */
+    if (sessionp->session_misc_flags & SMBV_HAS_FILEIDS) {
+        enum_cache_currp = smb_dir_cache_find_ino(&dnp->d_main_cache,
+                                                  resume_cookiep->resume_node_id);
+    }
+    else if (resume_cookiep->resume_name_p != NULL) {
+        enum_cache_currp = smb_dir_cache_find_name(&dnp->d_main_cache,
+                                                   resume_cookiep->resume_name_p,
+                                                   strnlen(resume_cookiep->resume_name_p,
+                                                           PATH_MAX));
+    }
 
-        if (is_match == 1) {
-            *return_offsetp = curr_offset;
-            return(0);
-        }
-        
-        curr_offset += 1;
-        enum_cache_currp = enum_cache_currp->next;
+    if (enum_cache_currp != NULL) {
+        *return_offsetp = smb_dir_cache_entry_index(&dnp->d_main_cache,
+                                                    enum_cache_currp);
+        error = 0;
     }
     
     return(error);
@@ -15338,10 +15518,10 @@ smbfs_enum_dir(struct vnode *dvp, uio_t uio, int is_attrlist, void* vnop_argsp)
     int error = 0, overflow_error, tmp_error;
     struct smb_share *share = NULL;
    	struct smb_session *sessionp = NULL;
-    int i;
     struct cached_dir_entry *enum_cache_currp = NULL;
     off_t skip_count = 0;
     int32_t add_remaining = 0;
+    int from_server = 0;
     struct timespec    start, stop;
     int first = 0;
     char *last_entry_namep = NULL;
@@ -15445,32 +15625,18 @@ smbfs_enum_dir(struct vnode *dvp, uio_t uio, int is_attrlist, void* vnop_argsp)
             /*
              * Find starting cached entry
              */
-            enum_cache_currp = dnp->d_main_cache.list;
-            skip_count = offset;
-            
-            for (i = 0; i < skip_count; i++) {
-                if (i == 0) {
-                    SMB_LOG_DIR_CACHE2_LOCK(dnp, "First skip <%s> for <%s> \n",
-                                            enum_cache_currp->name,
-                                            dnp->n_name);
-                }
-                if (i == (skip_count - 1)) {
-                    SMB_LOG_DIR_CACHE2_LOCK(dnp, "Last skip <%s> for <%s> \n",
-                                            enum_cache_currp->name,
-                                            dnp->n_name);
-                }
-
-                if (enum_cache_currp == NULL) {
-                    /* Should never happen */
-                    SMBERROR_LOCK(dnp, "Out of cached entries i = %d offset = %lld/%lld for <%s> \n",
-                                  i, offset, dnp->d_main_cache.offset, dnp->n_name);
-                    smb_dir_cache_remove(dvp, &dnp->d_main_cache, "main", "Out of cached entries", 1, 0);
-                    smb_dir_cache_remove(dvp, &dnp->d_overflow_cache, "overflow", "Out of cached entries", 1, 0);
-                    goto fetch_new_entries;
-                }
-                
-                enum_cache_currp = enum_cache_currp->next;
-            }
+            if (offset > dnp->d_main_cache.count) {
+                /* Should never happen */
+                SMBERROR_LOCK(dnp, "Out of cached entries count = %lld offset = %lld/%lld for <%s> \n",
+                              dnp->d_main_cache.count, offset,
+                              dnp->d_main_cache.offset, dnp->n_name);
+                smb_dir_cache_remove(dvp, &dnp->d_main_cache, "main", "Out of cached entries", 1, 0);
+                smb_dir_cache_remove(dvp, &dnp->d_overflow_cache, "overflow", "Out of cached entries", 1, 0);
+                goto fetch_new_entries;
+            }
+
+            /* NULL if offset is just past the last cached entry */
+            enum_cache_currp = smb_dir_cache_entry_at(&dnp->d_main_cache, offset);
             
             /* Do we need to verify the resume entry? */
             if (check_resume) {
@@ -15562,7 +15728,7 @@ smbfs_enum_dir(struct vnode *dvp, uio_t uio, int is_attrlist, void* vnop_argsp)
                 }
                 
                 /* on to next cached dir entry */
-                enum_cache_currp = enum_cache_currp->next;
+                enum_cache_currp = smb_dir_cache_next(&dnp->d_main_cache, enum_cache_currp);
             }
 
             if (strnlen(last_entry_namep, PATH_MAX)) {
@@ -15623,8 +15789,8 @@ fetch_new_entries:
          * dnp->d_overflow_cache, then we can start filling from the overflow
          * cache.
          */
-        if ((dnp->d_main_cache.list != NULL) &&
-            (dnp->d_overflow_cache.list != NULL) &&
+        if ((dnp->d_main_cache.count != 0) &&
+            (dnp->d_overflow_cache.count != 0) &&
             (offset >= dnp->d_overflow_cache.start_offset) &&
             (offset < dnp->d_overflow_cache.offset)) {
             /*
@@ -15639,32 +15805,23 @@ fetch_new_entries:
             /*
              * Find starting cached entry
              */
-            enum_cache_currp = dnp->d_overflow_cache.list;
             skip_count = offset - dnp->d_overflow_cache.start_offset;
             SMB_LOG_DIR_CACHE2_LOCK(dnp, "saved skip %lld offset %lld start %lld offset %lld for <%s> \n",
                                     skip_count, offset, dnp->d_overflow_cache.start_offset,
                                     dnp->d_overflow_cache.offset, dnp->n_name);
 
-            for (i = 0; i < skip_count; i++) {
-                if (i == 0) {
-                    SMB_LOG_DIR_CACHE2("First saved skip <%s> \n", enum_cache_currp->name);
-                }
-                if (i == (skip_count - 1)) {
-                    SMB_LOG_DIR_CACHE2("Last saved skip <%s> \n", enum_cache_currp->name);
-                }
-
-                if (enum_cache_currp == NULL) {
-                    /* Can happen for overflow cache */
-                    SMB_LOG_DIR_CACHE2_LOCK(dnp, "Ran out of saved i %d skip %lld offset %lld start %lld offset %lld for <%s> \n",
-                                            i, skip_count, offset, dnp->d_overflow_cache.start_offset,
-                                            dnp->d_overflow_cache.offset, dnp->n_name);
-                    smb_dir_cache_remove(dvp, &dnp->d_overflow_cache, "overflow", "Out of cached entries", 1, 0);
-                    goto done_with_saved;
-                }
-
-                enum_cache_currp = enum_cache_currp->next;
+            if (skip_count > dnp->d_overflow_cache.count) {
+                /* Can happen for overflow cache */
+                SMB_LOG_DIR_CACHE2_LOCK(dnp, "Ran out of saved count %lld skip %lld offset %lld start %lld offset %lld for <%s> \n",
+                                        dnp->d_overflow_cache.count, skip_count, offset,
+                                        dnp->d_overflow_cache.start_offset,
+                                        dnp->d_overflow_cache.offset, dnp->n_name);
+                smb_dir_cache_remove(dvp, &dnp->d_overflow_cache, "overflow", "Out of cached entries", 1, 0);
+                goto done_with_saved;
             }
 
+            enum_cache_currp = smb_dir_cache_entry_at(&dnp->d_overflow_cache, skip_count);
+
             /* Do we need to verify the resume entry? */
             if (check_resume) {
                 check_resume = 0;   /* Only need to check once on resume */
@@ -15755,7 +15912,7 @@ fetch_new_entries:
                 }
 
                 /* on to next cached dir entry */
-                enum_cache_currp = enum_cache_currp->next;
+                enum_cache_currp = smb_dir_cache_next(&dnp->d_overflow_cache, enum_cache_currp);
             }
 
             if (strnlen(last_entry_namep, PATH_MAX)) {
@@ -15770,6 +15927,7 @@ done_with_saved:
          */
         if (!(dnp->d_main_cache.flags & kDirCachePartial)) {
             /* Add more entries into main cache */
+            from_server = 1;
             error = smbfs_fetch_new_entries(share, dvp,
                                             &dnp->d_main_cache, offset,
                                             0, context);
@@ -15812,6 +15970,7 @@ done_with_saved:
              */
             smb_dir_cache_remove(dvp, &dnp->d_overflow_cache, "overflow", "done with saved", 1, min_offset);
 
+            from_server = 1;
             overflow_error = smbfs_fetch_new_entries(share, dvp,
                                                      &dnp->d_overflow_cache, offset,
                                                      1, context);
@@ -15824,13 +15983,9 @@ done_with_saved:
         first = 0;
         bzero(last_entry_namep, PATH_MAX);
 
-        off_t overflow_offset = dnp->d_overflow_cache.start_offset;
-        enum_cache_currp = dnp->d_overflow_cache.list;
-
-        while (overflow_offset < offset && enum_cache_currp != NULL) {
-            overflow_offset++;
-            enum_cache_currp = enum_cache_currp->next;
-        }
+        off_t overflow_index = offset - dnp->d_overflow_cache.start_offset;
+        enum_cache_currp = smb_dir_cache_entry_at(&dnp->d_overflow_cache,
+                                                  MAX(overflow_index, 0));
 
         /* Do we need to verify the resume entry? */
         if (check_resume) {
@@ -15853,7 +16008,7 @@ done_with_saved:
         while (enum_cache_currp != NULL) {
             /* Is this the last entry and not finished enumerating? */
             if ((overflow_error != ENOENT) &&
-                (enum_cache_currp->next == NULL)) {
+                (smb_dir_cache_next(&dnp->d_overflow_cache, enum_cache_currp) == NULL)) {
                 /* If so, need to save this entry for the next resume */
                 if (strnlen(last_entry_namep, PATH_MAX)) {
                     SMB_LOG_DIR_CACHE2_LOCK(dnp, "Last overflow return <%s>. Save one entry for resume for <%s> \n",
@@ -15918,7 +16073,7 @@ done_with_saved:
             }
             
             /* on to next cached dir entry */
-            enum_cache_currp = enum_cache_currp->next;
+            enum_cache_currp = smb_dir_cache_next(&dnp->d_overflow_cache, enum_cache_currp);
         }
 
         if (strnlen(last_entry_namep, PATH_MAX)) {
@@ -15964,7 +16119,7 @@ done:
     }
 
     /* Update the global dir enum cache list */
-    tmp_error = smb_global_dir_cache_update_entry(dvp);
+    tmp_error = smb_global_dir_cache_update_entry(dvp, !from_server);
     if (tmp_error == ENOENT) {
         /*
          * Not yet in list, so add it in. Since we added a dir to the global
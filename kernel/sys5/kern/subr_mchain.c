@@ -966,6 +966,8 @@ int md_get_uio(mdchain_t mdp, uio_t uiop, int32_t size)
 		}
 		if (count > size)
 			count = size;
+		if (count > uio_resid(uiop))
+			count = (int32_t)uio_resid(uiop);
 		size -= count;
 		mdp->md_pos += count;
 		error = uiomove((void *)src, count, uiop);
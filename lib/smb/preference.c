@@ -881,7 +881,7 @@ void getDefaultPreferences(struct smb_prefs *prefs)
     prefs->minAuthAllowed = SMB_MINAUTH_NTLMV2;
 	prefs->NetBIOSResolverTimeout = DefaultNetBIOSResolverTimeout;
     
-    prefs->dir_cache_async_cnt = 10; /* keep in sync with smb2fs_smb_cmpd_query_async */
+    prefs->dir_cache_async_cnt = 32; /* keep in sync with kDirCacheAsyncDefaultCnt */
     prefs->dir_cache_max = 60; /* Same as NFS */
     prefs->dir_cache_min = 30; /* Same as NFS */
     prefs->max_dirs_cached = 0; /* Use defaults */
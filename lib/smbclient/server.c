@@ -907,6 +907,34 @@ SMBGetMultichannelProperties(SMBHANDLE inConnection, void *outAttrs)
     return status;
 }
 
+NTSTATUS
+SMBGetRWControllerProperties(SMBHANDLE inConnection, void *outAttrs)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    struct smb_ctx *ctx = NULL;
+
+    if (!inConnection || !outAttrs)
+        return STATUS_INVALID_PARAMETER;
+
+    status = SMBServerContext(inConnection, (void **)&ctx);
+    if (!NT_SUCCESS(status)) {
+        os_log_error(OS_LOG_DEFAULT, "%s: failed to get smb_ctx, syserr = %s",
+                     __FUNCTION__, strerror(errno));
+        return status;
+    }
+
+    struct smbioc_rw_ctl_properties *rw_props = outAttrs;
+    memset(rw_props, 0, sizeof(struct smbioc_rw_ctl_properties));
+    rw_props->ioc_version = SMB_IOC_STRUCT_VERSION;
+    if (smb_ioctl_call(ctx->ct_fd, SMBIOC_RW_CTL_PROPERTIES, rw_props) == -1) {
+        os_log_error(OS_LOG_DEFAULT, "%s: Getting the read/write controller properties failed, syserr = %s",
+                     __FUNCTION__, strerror(errno));
+        return errno;
+    }
+
+    return status;
+}
+
 NTSTATUS
 SMBGetNicInfoProperties(SMBHANDLE inConnection, void *outAttrs, uint8_t inClientOrServer)
 {
@@ -1027,6 +1055,9 @@ SMBGetShareAttributes(SMBHANDLE inConnection, void *outAttrs)
         sattrs->read_cnt_fwd_pattern = session_prop.read_cnt_fwd_pattern;
         sattrs->read_cnt_bwd_pattern = session_prop.read_cnt_bwd_pattern;
 
+        sattrs->compress_scratch_hits = session_prop.compress_scratch_hits;
+        sattrs->compress_scratch_misses = session_prop.compress_scratch_misses;
+
        if (sattrs->session_misc_flags & SMBV_MNT_SNAPSHOT) {
             strlcpy(sattrs->snapshot_time, session_prop.snapshot_time,
                     sizeof(sattrs->snapshot_time));
@@ -340,6 +340,9 @@ typedef struct SMBShareAttributes
     uint32_t    reserved;
     struct timespec session_reconnect_time;
 
+    uint64_t    compress_scratch_hits;
+    uint64_t    compress_scratch_misses;
+
 } SMBShareAttributes;
 
 /*!
@@ -357,6 +357,21 @@ SMBConvertGMT(
 API_AVAILABLE(macos(11.3))
 ;
 
+/*!
+ * @function SMBGetRWControllerProperties
+ * @abstract Private routine for smbutil to get the adaptive read/write
+ * sizing state of each channel.
+ * @param inConnection A SMBHANDLE created by SMBOpenServerEx.
+ * @param outAttrs is of the type smbioc_rw_ctl_properties
+ * @result Returns an NTSTATUS error code.
+ */
+SMBCLIENT_EXPORT
+NTSTATUS
+SMBGetRWControllerProperties(
+              SMBHANDLE    inConnection,
+              void *outAttrs)
+;
+
 #endif // KERNEL
 
 	
@@ -389,6 +389,7 @@ void print_nic_info(int server_nic, struct nic_properties *props) {
 #define S_NIC_INFO   0x2
 #define C_NIC_INFO   0x4
 #define SESSION_INFO 0x8
+#define RW_CTL_INFO  0x10
 
 static NTSTATUS
 stat_multichannel(char *share_mp, enum OutputFormat output_format, uint8_t flags)
@@ -660,6 +661,108 @@ stat_multichannel(char *share_mp, enum OutputFormat output_format, uint8_t flags
 
     }
 
+    if (flags & RW_CTL_INFO) {
+
+        struct smbioc_rw_ctl_properties rw_props;
+        CFMutableDictionaryRef rw_dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (output_format == Json && rw_dict == NULL) {
+            fprintf(stderr, "CFDictionaryCreateMutable failed\n");
+            status = EINVAL;
+            goto exit;
+        }
+
+        status = SMBGetRWControllerProperties(inConnection, &rw_props);
+        if (!NT_SUCCESS(status)) {
+            /* Skip just this section, the rest can still be printed */
+            fprintf(stderr, "%s : SMBGetRWControllerProperties() failed\n",
+                    __FUNCTION__);
+            goto rw_ctl_done;
+        }
+
+        if (rw_props.num_of_iods > MAX_NUM_OF_IODS_IN_QUERY) {
+            fprintf(stderr, "%s : incorrect num_of_iods (%u))\n",
+                    __FUNCTION__, rw_props.num_of_iods);
+            status = EINVAL;
+            goto rw_ctl_done;
+        }
+
+        if (output_format == None) {
+            fprintf(stdout, "\n       id   dir     req size  reqs    MB/sec   srtt(us)  min rtt(us)  max credits");
+            fprintf(stdout, "\n====================================================================================\n");
+        }
+
+        for (uint32_t u = 0; u < rw_props.num_of_iods; u++) {
+            struct smbioc_iod_rw_ctl *p = &rw_props.iod_rw_ctl[u];
+            struct smbioc_rw_ctl *ctls[2] = {&p->read_ctl, &p->write_ctl};
+            const char *names[2] = {"read", "write"};
+
+            if (output_format == Json) {
+                char buf[40];
+                CFMutableDictionaryRef iod_dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+                if (iod_dict == NULL) {
+                    fprintf(stderr, "CFDictionaryCreateMutable failed\n");
+                    status = EINVAL;
+                    goto exit;
+                }
+
+                sprintf(buf, "%u", p->iod_credits_max);
+                json_add_str(iod_dict, "max_credits", buf);
+
+                for (int k = 0; k < 2; k++) {
+                    CFMutableDictionaryRef ctl_dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+                    if (ctl_dict == NULL) {
+                        fprintf(stderr, "CFDictionaryCreateMutable failed\n");
+                        status = EINVAL;
+                        goto exit;
+                    }
+
+                    sprintf(buf, "%u", ctls[k]->quantum_size);
+                    json_add_str(ctl_dict, "request_size", buf);
+                    sprintf(buf, "%u", ctls[k]->quantum_nbr);
+                    json_add_str(ctl_dict, "outstanding_requests", buf);
+                    sprintf(buf, "%llu", ctls[k]->bytes_per_sec);
+                    json_add_str(ctl_dict, "bytes_per_sec", buf);
+                    sprintf(buf, "%u", ctls[k]->srtt_usecs);
+                    json_add_str(ctl_dict, "srtt_usecs", buf);
+                    sprintf(buf, "%u", ctls[k]->min_rtt_usecs);
+                    json_add_str(ctl_dict, "min_rtt_usecs", buf);
+
+                    json_add_dict(iod_dict, names[k], ctl_dict);
+                }
+
+                sprintf(buf, "%u", p->iod_id);
+                json_add_dict(rw_dict, buf, iod_dict);
+            } else {
+                for (int k = 0; k < 2; k++) {
+                    if (ctls[k]->quantum_size == 0) {
+                        /* Not sampled yet */
+                        fprintf(stdout, "   %6u   %-5s   %8s  %4s  %8s  %9s  %11s  %11u\n",
+                                p->iod_id, names[k], "N/A", "N/A", "N/A", "N/A", "N/A",
+                                p->iod_credits_max);
+                        continue;
+                    }
+
+                    fprintf(stdout, "   %6u   %-5s   %8u  %4u  %8.1f  %9u  %11u  %11u\n",
+                            p->iod_id, names[k],
+                            ctls[k]->quantum_size, ctls[k]->quantum_nbr,
+                            (double)ctls[k]->bytes_per_sec / (1024 * 1024),
+                            ctls[k]->srtt_usecs, ctls[k]->min_rtt_usecs,
+                            p->iod_credits_max);
+                }
+            }
+        }
+
+        if (output_format == Json) {
+            json_add_dict(status_dict, "rw_controller", rw_dict);
+            json_add_dict(smbMCShares, share_mp, status_dict);
+        }
+
+rw_ctl_done:
+        if (rw_dict != NULL) {
+            CFRelease(rw_dict);
+        }
+    }
+
     if (flags & S_NIC_INFO) {
 
         struct smbioc_nic_info server_nics;
@@ -768,6 +871,10 @@ stat_multichannel(char *share_mp, enum OutputFormat output_format, uint8_t flags
 exit:
     SMBReleaseServer(inConnection);
 
+    if (status_dict != NULL) {
+        CFRelease(status_dict);
+    }
+
     return status;
 }
 
@@ -813,7 +920,7 @@ cmd_multichannel(int argc, char *argv[])
     char *mountPath = NULL;
     uint8_t flags = 0;
 
-    while ((opt = getopt(argc, argv, "aicsxm:f:")) != EOF) {
+    while ((opt = getopt(argc, argv, "aicsxrm:f:")) != EOF) {
         switch(opt) {
             case 'f':
                 if (strcasecmp(optarg, "json") == 0) {
@@ -852,6 +959,9 @@ cmd_multichannel(int argc, char *argv[])
             case 'x':
                 flags |= MC_STATUS;
                 break;
+            case 'r':
+                flags |= RW_CTL_INFO;
+                break;
             case 'i':
                 flags |= SESSION_INFO;
                 break;
@@ -862,7 +972,7 @@ cmd_multichannel(int argc, char *argv[])
 
     if (!flags) {
         // default is to print all
-        flags = C_NIC_INFO | S_NIC_INFO | MC_STATUS | SESSION_INFO;
+        flags = C_NIC_INFO | S_NIC_INFO | MC_STATUS | SESSION_INFO | RW_CTL_INFO;
     }
 
     if (!printShare && !printAll) {
@@ -901,6 +1011,7 @@ multichannel_usage(void)
              -c : show information about client interfaces\n \
              -s : show information about server interfaces\n \
              -x : show information about the established connections\n \
+             -r : show read/write sizing of the established connections\n \
              -f <format> : print info in the provided format. Supported formats: JSON\n \
           ]\n");
     exit(1);
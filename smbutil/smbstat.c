@@ -188,9 +188,222 @@ get_lease_flags_str(uint64_t lease_flags, char *out_str, size_t str_buf_size) {
     return(error);
 }
 
+static void
+json_add_compress_stats(CFMutableDictionaryRef dict, const char *key,
+                        struct smb_compress_stats *statsp, time_t curr_time)
+{
+    CFMutableDictionaryRef compress = NULL;
+    time_t reprobe = 0;
+
+    compress = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                         0,
+                                         &kCFTypeDictionaryKeyCallBacks,
+                                         &kCFTypeDictionaryValueCallBacks);
+
+    if (statsp->reprobe_time > curr_time) {
+        reprobe = statsp->reprobe_time - curr_time;
+    }
+
+    json_add_num(compress, "in_bytes",
+                 &statsp->in_bytes, sizeof(statsp->in_bytes));
+    json_add_num(compress, "out_bytes",
+                 &statsp->out_bytes, sizeof(statsp->out_bytes));
+    json_add_num(compress, "usecs",
+                 &statsp->usecs, sizeof(statsp->usecs));
+    json_add_num(compress, "writes",
+                 &statsp->writes, sizeof(statsp->writes));
+    json_add_num(compress, "fails",
+                 &statsp->fails, sizeof(statsp->fails));
+    json_add_num(compress, "disabled_cnt",
+                 &statsp->disabled_cnt, sizeof(statsp->disabled_cnt));
+    json_add_num(compress, "reprobe_secs",
+                 &reprobe, sizeof(reprobe));
+
+    json_add_dict(dict, key, compress);
+}
+
+static void
+print_compress_stats(const char *label, struct smb_compress_stats *statsp,
+                     time_t curr_time)
+{
+    printf("   %s: writes %u, fails %u, %llu -> %llu bytes",
+           label, statsp->writes, statsp->fails,
+           statsp->in_bytes, statsp->out_bytes);
+    if (statsp->in_bytes != 0) {
+        printf(" (%llu%%)", (statsp->out_bytes * 100) / statsp->in_bytes);
+    }
+    printf(", %llu usecs \n", statsp->usecs);
+
+    if (statsp->reprobe_time > curr_time) {
+        printf("   %s: off for %ld more secs (turned off %u times in a row) \n",
+               label, statsp->reprobe_time - curr_time, statsp->disabled_cnt);
+    }
+}
 
+static void
+json_add_node_hash_stats(CFMutableDictionaryRef dict, const char *key,
+                         struct smb_node_hash_stats *statsp)
+{
+    CFMutableDictionaryRef node_hash = NULL;
+
+    node_hash = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                          0,
+                                          &kCFTypeDictionaryKeyCallBacks,
+                                          &kCFTypeDictionaryValueCallBacks);
+
+    json_add_num(node_hash, "lock_contended",
+                 &statsp->lock_contended, sizeof(statsp->lock_contended));
+    json_add_num(node_hash, "buckets",
+                 &statsp->buckets, sizeof(statsp->buckets));
+    json_add_num(node_hash, "used_buckets",
+                 &statsp->used_buckets, sizeof(statsp->used_buckets));
+    json_add_num(node_hash, "nodes",
+                 &statsp->nodes, sizeof(statsp->nodes));
+    json_add_num(node_hash, "max_chain",
+                 &statsp->max_chain, sizeof(statsp->max_chain));
+    json_add_num(node_hash, "grow_cnt",
+                 &statsp->grow_cnt, sizeof(statsp->grow_cnt));
+    json_add_num(node_hash, "shrink_cnt",
+                 &statsp->shrink_cnt, sizeof(statsp->shrink_cnt));
+
+    json_add_dict(dict, key, node_hash);
+}
 
+static void
+print_node_hash_stats(struct smb_node_hash_stats *statsp)
+{
+    printf("node hash buckets: %llu (about %llu in use", statsp->buckets, statsp->used_buckets);
+    if (statsp->buckets != 0) {
+        printf(", %llu%%", (statsp->used_buckets * 100) / statsp->buckets);
+    }
+    printf(") \n");
+    printf("node hash nodes: %llu \n", statsp->nodes);
+    if (statsp->used_buckets != 0) {
+        /* Only count buckets a lookup would actually have to walk */
+        printf("node hash avg chain length: %.2f \n",
+               (double) statsp->nodes / statsp->used_buckets);
+    }
+    printf("node hash max chain length (sampled): %llu \n", statsp->max_chain);
+    printf("node hash grown: %u, shrunk: %u \n", statsp->grow_cnt, statsp->shrink_cnt);
+    printf("node hash lock contended: %lld \n", statsp->lock_contended);
+}
 
+static void
+json_add_dir_arena_stats(CFMutableDictionaryRef dict, const char *key,
+                         struct smb_dir_arena_stats *statsp)
+{
+    CFMutableDictionaryRef dir_arena = NULL;
+
+    dir_arena = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                          0,
+                                          &kCFTypeDictionaryKeyCallBacks,
+                                          &kCFTypeDictionaryValueCallBacks);
+
+    json_add_num(dir_arena, "entries_added",
+                 &statsp->entries_added, sizeof(statsp->entries_added));
+    json_add_num(dir_arena, "entry_block_allocs",
+                 &statsp->entry_block_allocs, sizeof(statsp->entry_block_allocs));
+    json_add_num(dir_arena, "entry_block_frees",
+                 &statsp->entry_block_frees, sizeof(statsp->entry_block_frees));
+    json_add_num(dir_arena, "name_chunk_allocs",
+                 &statsp->name_chunk_allocs, sizeof(statsp->name_chunk_allocs));
+    json_add_num(dir_arena, "name_chunk_frees",
+                 &statsp->name_chunk_frees, sizeof(statsp->name_chunk_frees));
+    json_add_num(dir_arena, "bytes_in_use",
+                 &statsp->bytes_in_use, sizeof(statsp->bytes_in_use));
+
+    json_add_dict(dict, key, dir_arena);
+}
+
+static void
+print_dir_arena_stats(struct smb_dir_arena_stats *statsp)
+{
+    printf("dir cache entries added: %lld 
+", statsp->entries_added);
+    printf("dir cache entry blocks allocated: %lld, freed: %lld 
+",
+           statsp->entry_block_allocs, statsp->entry_block_frees);
+    printf("dir cache name chunks allocated: %lld, freed: %lld 
+",
+           statsp->name_chunk_allocs, statsp->name_chunk_frees);
+    printf("dir cache bytes in use: %lld 
+", statsp->bytes_in_use);
+}
+
+static void
+json_add_global_dir_cache_stats(CFMutableDictionaryRef dict, const char *key,
+                                struct smb_global_dir_cache_stats *statsp)
+{
+    CFMutableDictionaryRef dir_cache = NULL;
+
+    dir_cache = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                          0,
+                                          &kCFTypeDictionaryKeyCallBacks,
+                                          &kCFTypeDictionaryValueCallBacks);
+
+    json_add_num(dir_cache, "lookups",
+                 &statsp->lookups, sizeof(statsp->lookups));
+    json_add_num(dir_cache, "hits",
+                 &statsp->hits, sizeof(statsp->hits));
+    json_add_num(dir_cache, "evictions",
+                 &statsp->evictions, sizeof(statsp->evictions));
+    json_add_num(dir_cache, "dirs",
+                 &statsp->dirs, sizeof(statsp->dirs));
+    json_add_num(dir_cache, "bytes",
+                 &statsp->bytes, sizeof(statsp->bytes));
+    json_add_num(dir_cache, "max_bytes",
+                 &statsp->max_bytes, sizeof(statsp->max_bytes));
+    json_add_num(dir_cache, "max_dirs",
+                 &statsp->max_dirs, sizeof(statsp->max_dirs));
+
+    json_add_dict(dict, key, dir_cache);
+}
+
+static void
+print_global_dir_cache_stats(struct smb_global_dir_cache_stats *statsp)
+{
+    printf("global dir cache: %llu dirs, %llu of %llu bytes (max dirs %u) \n",
+           statsp->dirs, statsp->bytes, statsp->max_bytes, statsp->max_dirs);
+    printf("global dir cache enumerations: %llu, from cache: %llu",
+           statsp->lookups, statsp->hits);
+    if (statsp->lookups != 0) {
+        printf(" (%llu%% hit rate)", (statsp->hits * 100) / statsp->lookups);
+    }
+    printf(" \n");
+    printf("global dir cache evictions: %llu \n", statsp->evictions);
+}
+
+static void
+json_add_sync_stats(CFMutableDictionaryRef dict, const char *key,
+                    struct smb_sync_stats *statsp)
+{
+    CFMutableDictionaryRef sync = NULL;
+
+    sync = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                     0,
+                                     &kCFTypeDictionaryKeyCallBacks,
+                                     &kCFTypeDictionaryValueCallBacks);
+
+    json_add_num(sync, "list_nodes",
+                 &statsp->list_nodes, sizeof(statsp->list_nodes));
+    json_add_num(sync, "last_nodes",
+                 &statsp->last_nodes, sizeof(statsp->last_nodes));
+    json_add_num(sync, "last_usecs",
+                 &statsp->last_usecs, sizeof(statsp->last_usecs));
+    json_add_num(sync, "max_usecs",
+                 &statsp->max_usecs, sizeof(statsp->max_usecs));
+
+    json_add_dict(dict, key, sync);
+}
+
+static void
+print_sync_stats(struct smb_sync_stats *statsp)
+{
+    printf("sync list nodes: %u \n", statsp->list_nodes);
+    printf("sync last pass: %u nodes in %llu usecs \n",
+           statsp->last_nodes, statsp->last_usecs);
+    printf("sync slowest pass: %llu usecs \n", statsp->max_usecs);
+}
 
 static int
 do_smbstat(char *path, enum OutputFormat output_format)
@@ -445,6 +658,15 @@ do_smbstat(char *path, enum OutputFormat output_format)
                          &pb.file.rsrc_fork_timer, sizeof(pb.file.rsrc_fork_timer));
             json_add_num(smbStats, "symlink_timer",
                          &pb.file.symlink_timer, sizeof(pb.file.symlink_timer));
+
+            json_add_compress_stats(smbStats, "compress",
+                                    &pb.file.compress, pb.curr_time);
+            if (pb.file.compress_ext_name[0] != 0) {
+                json_add_str(smbStats, "compress_ext_name",
+                             pb.file.compress_ext_name);
+                json_add_compress_stats(smbStats, "compress_ext",
+                                        &pb.file.compress_ext, pb.curr_time);
+            }
         }
 
         json_add_num(smbStats, "curr_time",
@@ -475,6 +697,11 @@ do_smbstat(char *path, enum OutputFormat output_format)
                      &pb.lease_def_close_reuse_cnt, sizeof(pb.lease_def_close_reuse_cnt));
         json_add_num(smbStats, "lease_def_close_timer",
                      &pb.lease_def_close_timer, sizeof(pb.lease_def_close_timer));
+
+        json_add_node_hash_stats(smbStats, "node_hash", &pb.node_hash);
+        json_add_dir_arena_stats(smbStats, "dir_arena", &pb.dir_arena);
+        json_add_global_dir_cache_stats(smbStats, "global_dir_cache", &pb.dir_cache);
+        json_add_sync_stats(smbStats, "sync", &pb.sync);
     }
     else {
         printf("Object Type: %s \n", objType[pb.vnode_type]);
@@ -503,6 +730,15 @@ do_smbstat(char *path, enum OutputFormat output_format)
             else {
                 printf("   SMB Compression: Allowed \n");
             }
+
+            print_compress_stats("Compression", &pb.file.compress,
+                                 pb.curr_time);
+            if (pb.file.compress_ext_name[0] != 0) {
+                snprintf(buf, sizeof(buf), "Compression .%s",
+                         pb.file.compress_ext_name);
+                print_compress_stats(buf, &pb.file.compress_ext,
+                                     pb.curr_time);
+            }
             
             printf("   sharedFID_refcnt: %d \n", pb.file.sharedFID_refcnt);
             printf("   sharedFID_mmapped: %d \n", pb.file.sharedFID_mmapped);
@@ -652,6 +888,14 @@ do_smbstat(char *path, enum OutputFormat output_format)
         printf("lease def close reuse count: %d \n", pb.lease_def_close_reuse_cnt);
         printf("lease def close timer: %ld \n", pb.lease_def_close_timer);
         printf("\n");
+        print_node_hash_stats(&pb.node_hash);
+        printf("\n");
+        print_dir_arena_stats(&pb.dir_arena);
+        printf("\n");
+        print_global_dir_cache_stats(&pb.dir_cache);
+        printf("\n");
+        print_sync_stats(&pb.sync);
+        printf("\n");
     }
 
 	return(error);
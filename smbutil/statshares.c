@@ -365,6 +365,11 @@ interpret_and_display(char *share, SMBShareAttributes *sattrs)
             sattrs->read_cnt_fwd_pattern);
     fprintf(stdout, "%-30s%-30s%llu\n", "", "READ_CNT_BWD_PATTERN",
             sattrs->read_cnt_bwd_pattern);
+
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "COMPRESS_SCRATCH_HITS",
+            sattrs->compress_scratch_hits);
+    fprintf(stdout, "%-30s%-30s%llu\n", "", "COMPRESS_SCRATCH_MISSES",
+            sattrs->compress_scratch_misses);
     
    /*
      * Note: No way to get file system type since the type is determined at
@@ -755,6 +760,11 @@ display_json(char *share, SMBShareAttributes *sattrs)
     json_add_num(dict, "READ_CNT_BWD_PATTERN", &sattrs->read_cnt_bwd_pattern,
                  sizeof(sattrs->read_cnt_bwd_pattern));
 
+    json_add_num(dict, "COMPRESS_SCRATCH_HITS", &sattrs->compress_scratch_hits,
+                 sizeof(sattrs->compress_scratch_hits));
+    json_add_num(dict, "COMPRESS_SCRATCH_MISSES", &sattrs->compress_scratch_misses,
+                 sizeof(sattrs->compress_scratch_misses));
+
     /*
      * Note: No way to get file system type since the type is determined at
      * mount time and not just by a Tree Connect.  If we ever wanted to display